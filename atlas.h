@@ -46,9 +46,22 @@
 #include <sstream>
 #include <array>
 #include <memory>
-#include <unordered_map>
 #include <utility>
 #include <thread>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "stb_image.h"
 
@@ -61,30 +74,65 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "core.h"
+#include "bits.h"
+#include "hash.h"
+#include "image_map.h"
+#include "bcn.h"
+#include "etc.h"
+#include "mip.h"
+#include "downscale.h"
+#include "resample.h"
+#include "pixel.h"
 
 //------------------------------------------------------------------------------------
 // logging and GL error handling
 //------------------------------------------------------------------------------------
 
+// Layer alignment which rounds each layer up to a power of two
+#define GLK_ATLAS_LAYER_ALIGN_POW2 0
+
+// ES2 only guarantees NPOT textures with clamped wrapping and no
+// mipmaps, so it keeps power of two layers by default.
 #if defined(GLK_INCLUDE_GLEW)
     #define GLK_ATLAS_INTERNAL_TEX_FORMAT GL_RGBA8
+    #define GLK_ATLAS_DEFAULT_LAYER_ALIGN 1
 #elif defined(GLK_INCLUDE_EGL)
     #define GLK_ATLAS_INTERNAL_TEX_FORMAT GL_RGBA
+    #define GLK_ATLAS_DEFAULT_LAYER_ALIGN GLK_ATLAS_LAYER_ALIGN_POW2
 #endif
 
-namespace glk {
+// From EXT_texture_compression_s3tc, in case the headers predate it
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+    #define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+    #define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
 
-    GLK_FUNC uint32_t pack_rgba(const uint8_t* rgba);
+// From OES_compressed_ETC1_RGB8_texture and ES 3.0
+#ifndef GL_ETC1_RGB8_OES
+    #define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
+#ifndef GL_COMPRESSED_RGB8_ETC2
+    #define GL_COMPRESSED_RGB8_ETC2 0x9274
+#endif
+
+#ifndef GL_COMPRESSED_RGBA8_ETC2_EAC
+    #define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#endif
 
-    GLK_FUNC void unpack_rgba(uint8_t* dest, uint32_t src);
+// What a new atlas_t compresses its layers with. Every ES2 device has
+// ETC1, and on those an atlas at a quarter of RGBA8's size is usually
+// what decides whether it fits at all.
+#if defined(GLK_INCLUDE_GLEW)
+    #define GLK_ATLAS_DEFAULT_COMPRESSION atlas_compression_none
+#elif defined(GLK_INCLUDE_EGL)
+    #define GLK_ATLAS_DEFAULT_COMPRESSION atlas_compression_etc1
+#endif
 
-    GLK_FUNC uint8_t average_pix_channel4(
-        size_t index,
-        const uint8_t* x1,
-        const uint8_t* x2,
-        const uint8_t* y1,
-        const uint8_t* y2
-    );
+namespace glk {
 
 //-------------------------------------------------------------------------
 // atlas generation-specific classes/functions.
@@ -103,819 +151,3969 @@ namespace glk {
 		return x;
 	}
 
+	// Rounds a layer's used extent up to the size it's allocated at:
+	// the next power of two for GLK_ATLAS_LAYER_ALIGN_POW2, otherwise
+	// the next multiple of align.
+	template <class numType>
+	numType layer_extent(numType used, uint16_t align)
+	{
+		if (align == GLK_ATLAS_LAYER_ALIGN_POW2)
+			return next_power2(used);
+
+		return ((used + align - 1) / align) * align;
+	}
+
+	// layer_extent for a layer which can't be larger than max_dims: if
+	// aligning would take it past max_dims, it's max_dims instead.
+	// Returns 0 if used itself doesn't fit.
+	template <class numType>
+	numType layer_extent(numType used, uint16_t align, int32_t max_dims)
+	{
+		if ((int64_t) used > (int64_t) max_dims)
+			return 0;
+
+		return (numType) glm::min((int64_t) layer_extent(used, align),
+			(int64_t) max_dims);
+	}
+
 	// When we have multiple atlasses for a single set of images, we use layers.
 
     static void glk_inline alloc_blank_texture(
 		size_t width,
 		size_t height,
-		uint32_t clear_val);
+		uint32_t clear_val,
+		GLint level = 0);
 
-	using image_fill_map_t = std::unordered_map<uint16_t, uint8_t>;
+	// How gen_layer sizes the root region it packs each layer into.
+	enum atlas_root_size_t {
+		// square, next_power2(sqrt(area_accum)), capped by GL_MAX_TEXTURE_SIZE
+		atlas_root_size_sqrt_area = 0,
 
-	struct atlas_image_info_t {
-		uint8_t 	layer;
-		glm::vec2 	coords;
-		glm::vec2 	inverse_layer_dims;
+		// smallest power of two w x h, square or not, which fits every
+		// remaining image; GL_MAX_TEXTURE_SIZE squared if none do
+		atlas_root_size_search
 	};
 
-	struct atlas_t {
-		static const uint16_t no_image_index = 0xFFFF;
+	// What happens to an atlas's CPU copy of its pixels once they've
+	// been uploaded.
+	enum atlas_residency_t {
+		// kept in memory, so the atlas can always be repacked
+		atlas_residency_keep = 0,
 
-        bool is_downscaled;
+		// freed; the layout is final from then on, since there's
+		// nothing left to upload a new one from (inserting still works)
+		atlas_residency_drop,
 
-		uint16_t default_image;
+		// written out to a temporary file and freed; read back in
+		// whenever a new layout has to be uploaded
+		atlas_residency_spill
+	};
 
-		uint32_t num_images;
+	// See atlas_t::memory_usage
+	struct atlas_memory_usage_t {
+		uint64_t cpu_reserved_bytes; // held by the pixel arena
+		uint64_t cpu_pixel_bytes; // of that, pixels of live images
+		uint64_t spilled_bytes; // in the spill file
+		uint64_t gpu_bytes; // layer textures
+		uint64_t cpu_block_bytes; // layer blocks kept for inserting (see atlas_t::layer_blocks)
+	};
 
-		uint32_t area_accum;
+	// How layer textures are stored on the GPU.
+	enum atlas_compression_t {
+		atlas_compression_none = 0, // RGBA8
 
-		std::vector<uint8_t> layers;
+		// BC1 for layers whose images are all opaque, BC3 for the rest;
+		// needs EXT_texture_compression_s3tc
+		atlas_compression_bcn,
 
-		std::vector<uint16_t> widths;
-		std::vector<uint16_t> heights;
+		// ETC1 for opaque layers; the rest get a second ETC1 texture
+		// holding their alpha (see atlas_t::bind_alpha), since ES2 has
+		// no compressed format with alpha. Needs OES_compressed_ETC1_RGB8_texture.
+		atlas_compression_etc1,
 
-		std::vector<uint16_t> dims_x;
-		std::vector<uint16_t> dims_y;
+		// ES 3.0's ETC2 RGB8 for opaque layers, ETC2 RGBA8 (EAC alpha)
+		// for the rest
+		atlas_compression_etc2
+	};
 
-		std::vector<uint16_t> coords_x;
-		std::vector<uint16_t> coords_y;
+	// What a single layer ended up stored as.
+	enum atlas_layer_format_t {
+		atlas_layer_rgba8 = 0,
+		atlas_layer_bc1,
+		atlas_layer_bc3,
+		atlas_layer_etc1,
+		atlas_layer_etc1_alpha, // ETC1 color, plus ETC1 alpha in a second texture
+		atlas_layer_etc2_rgb,
+		atlas_layer_etc2_rgba
+	};
 
-		std::vector<GLuint> layer_tex_handles;
+	// The size of a layer's texture, or of each of its two textures
+	// for atlas_layer_etc1_alpha.
+	GLK_FUNC uint64_t atlas_layer_plane_bytes(atlas_layer_format_t format,
+		size_t width, size_t height)
+	{
+		switch (format) {
+		case atlas_layer_bc1: return bcn_encoded_size(bcn_bc1, width, height);
+		case atlas_layer_bc3: return bcn_encoded_size(bcn_bc3, width, height);
+		case atlas_layer_etc1:
+		case atlas_layer_etc1_alpha:
+		case atlas_layer_etc2_rgb: return etc_encoded_size(etc_etc1, width, height);
+		case atlas_layer_etc2_rgba: return etc_encoded_size(etc_etc2_rgba, width, height);
+		default: return (uint64_t) width * height * GLK_ATLAS_DESIRED_BPP;
+		}
+	}
 
-		std::vector<std::vector<uint8_t>> buffer_table;
+	// Everything a layer stores; for atlas_layer_etc1_alpha that's the
+	// color blocks followed by the alpha blocks.
+	GLK_FUNC uint64_t atlas_layer_bytes(atlas_layer_format_t format,
+		size_t width, size_t height)
+	{
+		uint64_t bytes = atlas_layer_plane_bytes(format, width, height);
 
-		std::vector<std::string> filenames; // optional
+		return format == atlas_layer_etc1_alpha ? bytes * 2 : bytes;
+	}
 
-        std::unordered_map<size_t, uint16_t> key_map; // optional
+	// How many levels a layer stores: just the one without mipmaps,
+	// otherwise a full chain down to 1 x 1 (see atlas_t::set_mipmap_levels).
+	GLK_FUNC size_t atlas_layer_levels(uint8_t mip_levels, size_t width, size_t height)
+	{
+		return mip_levels > 1 ? mip_count(width, height) : 1;
+	}
 
-        bool downscaled(void) const { return is_downscaled; }
+	// The first levels levels of a layer, each atlas_layer_bytes in
+	// size and stored level 0 first; also where level levels starts.
+	GLK_FUNC uint64_t atlas_layer_chain_bytes(atlas_layer_format_t format,
+		size_t width, size_t height, size_t levels)
+	{
+		uint64_t bytes = 0;
 
-        void set_downscaled(bool d) { is_downscaled = d; }
+		for (size_t level = 0; level < levels; ++level)
+			bytes += atlas_layer_bytes(format, mip_extent(width, level), mip_extent(height, level));
 
-        size_t num_layers(void) const { return layer_tex_handles.size(); }
+		return bytes;
+	}
 
-		uint16_t check_index(uint16_t index) const
-		{
-			if (num_images <= index)
-			{
-				if (default_image == no_image_index)
-				{
-                    glk_logf(
-						"%s",
-						"FATAL: atlas_t default_image == no_image_index");
-                    exit_on_error();
-				}
+	GLK_FUNC GLenum atlas_layer_gl_format(atlas_layer_format_t format)
+	{
+		switch (format) {
+		case atlas_layer_bc1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case atlas_layer_bc3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case atlas_layer_etc1:
+		case atlas_layer_etc1_alpha: return GL_ETC1_RGB8_OES;
+		case atlas_layer_etc2_rgb: return GL_COMPRESSED_RGB8_ETC2;
+		case atlas_layer_etc2_rgba: return GL_COMPRESSED_RGBA8_ETC2_EAC;
+		default: return GLK_ATLAS_INTERNAL_TEX_FORMAT;
+		}
+	}
 
-				return default_image;
-			}
+	GLK_FUNC bool atlas_layer_has_alpha(atlas_layer_format_t format)
+	{
+		return format != atlas_layer_bc1
+			&& format != atlas_layer_etc1
+			&& format != atlas_layer_etc2_rgb;
+	}
 
-			return index;
+	// OES_compressed_ETC1_RGB8_texture rules out glCompressedTexSubImage2D,
+	// so an ETC1 layer can only be updated by uploading all of it again -
+	// unless the context decodes ETC2 (see atlas_t::etc1_as_etc2).
+	GLK_FUNC bool atlas_layer_updatable(atlas_layer_format_t format)
+	{
+		return format != atlas_layer_etc1 && format != atlas_layer_etc1_alpha;
+	}
+
+	// Whether the current context decodes ES 3.0's ETC2 formats: any
+	// ES 3 context, or desktop GL 4.3 (ARB_ES3_compatibility)
+	GLK_FUNC bool atlas_gl_has_etc2(void)
+	{
+		const char* version = (const char*) glGetString(GL_VERSION);
+		int major = 0, minor = 0;
+
+		if (!version)
+			return false;
+
+		if (sscanf(version, "OpenGL ES %d.%d", &major, &minor) == 2)
+			return major >= 3;
+
+		if (sscanf(version, "%d.%d", &major, &minor) == 2)
+			return major > 4 || (major == 4 && minor >= 3);
+
+		return false;
+	}
+
+	// The format compression stores a layer in, given whether every
+	// image on it is opaque.
+	GLK_FUNC atlas_layer_format_t atlas_layer_format(atlas_compression_t compression,
+		bool opaque)
+	{
+		switch (compression) {
+		case atlas_compression_bcn:
+			return opaque ? atlas_layer_bc1 : atlas_layer_bc3;
+		case atlas_compression_etc1:
+			return opaque ? atlas_layer_etc1 : atlas_layer_etc1_alpha;
+		case atlas_compression_etc2:
+			return opaque ? atlas_layer_etc2_rgb : atlas_layer_etc2_rgba;
+		default:
+			return atlas_layer_rgba8;
 		}
+	}
 
-		uint16_t origin_x(uint16_t image) const
+	// Encodes width x height RGBA texels (stride bytes per row) into the
+	// atlas_layer_bytes(format, width, height) bytes at out.
+	GLK_FUNC void atlas_encode_blocks(atlas_layer_format_t format, const uint8_t* rgba,
+		size_t width, size_t height, size_t stride, uint8_t* out, unsigned threads = 0)
+	{
+		switch (format) {
+		case atlas_layer_bc1:
+		case atlas_layer_bc3:
+			bcn_encode_image(rgba, width, height, stride,
+				format == atlas_layer_bc1 ? bcn_bc1 : bcn_bc3, out, threads);
+			break;
+		case atlas_layer_etc1_alpha:
+			etc_encode_image(rgba, width, height, stride, etc_etc1, out, threads);
+			etc_encode_image(rgba, width, height, stride, etc_etc1_alpha,
+				out + atlas_layer_plane_bytes(format, width, height), threads);
+			break;
+		case atlas_layer_etc1:
+		case atlas_layer_etc2_rgb:
+			etc_encode_image(rgba, width, height, stride, etc_etc1, out, threads);
+			break;
+		case atlas_layer_etc2_rgba:
+			etc_encode_image(rgba, width, height, stride, etc_etc2_rgba, out, threads);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// atlas_encode_blocks for each level of an RGBA chain (see mip.h),
+	// into atlas_layer_chain_bytes(format, width, height, levels) at out.
+	GLK_FUNC void atlas_encode_levels(atlas_layer_format_t format, const uint8_t* chain,
+		size_t width, size_t height, size_t levels, uint8_t* out, unsigned threads = 0)
+	{
+		for (size_t level = 0; level < levels; ++level) {
+			size_t w = mip_extent(width, level);
+			size_t h = mip_extent(height, level);
+
+			atlas_encode_blocks(format, chain, w, h, w * GLK_ATLAS_DESIRED_BPP, out, threads);
+
+			chain += w * h * GLK_ATLAS_DESIRED_BPP;
+			out += atlas_layer_bytes(format, w, h);
+		}
+	}
+
+	// Placement algorithm used by gen_atlas_layers for each layer.
+	enum atlas_packer_t {
+		atlas_packer_bsp = 0,
+		atlas_packer_maxrects_bssf, // best short side fit
+		atlas_packer_maxrects_baf // best area fit
+	};
+
+	// Settings gen_atlas_layers packs with; see the atlas_t setters.
+	struct atlas_pack_params_t {
+		atlas_packer_t packer;
+		bool sort_race;
+		atlas_root_size_t root_size;
+		uint16_t layer_align;
+		bool allow_rotation;
+
+		// Images take up their size rounded up to a multiple of this, so
+		// every one starts and ends on a block of a compressed layer
+		// (and on a texel or block of each level images keep to themselves)
+		uint16_t block_align;
+
+		// Texels of border around every image, on each side, before
+		// rounding up to block_align (see atlas_t::set_mipmap_levels)
+		uint16_t gutter;
+	};
+
+	// Everything the layer generators read: dimensions indexed by image,
+	// the total image area and the settings. Nothing here refers back to
+	// an atlas_t, so packing can run on a thread with a snapshot while
+	// the atlas itself keeps changing.
+	struct atlas_pack_source_t {
+		const uint16_t* dims_x;
+		const uint16_t* dims_y;
+		uint64_t area_accum;
+		atlas_pack_params_t params;
+
+		// Set when compressing: opaque images (1s) are packed onto layers
+		// of their own, so those layers can skip alpha
+		const uint8_t* opaque;
+
+		// The room image takes up in a layer, before any rotation
+		uint32_t width(uint16_t image) const
 		{
-			return coords_x[check_index(image)];
+			return layer_extent((uint32_t) dims_x[image] + params.gutter * 2,
+				params.block_align);
 		}
 
-		uint16_t origin_y(uint16_t image) const
+		uint32_t height(uint16_t image) const
 		{
-			return coords_y[check_index(image)];
+			return layer_extent((uint32_t) dims_y[image] + params.gutter * 2,
+				params.block_align);
 		}
+	};
 
-        uint16_t dim_x(uint16_t image) const
-        {
-            return dims_x[check_index(image)];
-        }
+	struct atlas_image_info_t {
+		uint8_t 	layer;
+		glm::vec2 	coords;
+		glm::vec2 	inverse_layer_dims;
 
-        uint16_t dim_y(uint16_t image) const
-        {
-            return dims_y[check_index(image)];
-        }
+		// Where the packed rectangle sits within the image as it was
+		// pushed, and that image's size. With transparent trimming off
+		// these are (0, 0) and the packed size.
+		glm::vec2 	trim_offset;
+		glm::vec2 	source_dims;
+
+		// Set if the image was packed turned a quarter turn: for a w x h
+		// image it covers h x w texels from coords, texel (x, y) of the
+		// image is at coords + (h - 1 - y, x) and UVs (s, t) map to
+		// coords + (1 - t, s) * (h, w).
+		bool 		rotated;
+	};
 
-		uint8_t layer(uint16_t image) const
+	// An image's placement, precomputed when the atlas is laid out so
+	// hot paths can read it in one go (see atlas_t::record). 32 bytes:
+	// two to a cache line.
+	struct atlas_image_record_t {
+		float u0, v0, u1, v1; // normalized packed rectangle
+
+		// packed rectangle in texels: h x w for a rotated w x h image
+		uint16_t x, y, w, h;
+
+		uint16_t trim_x, trim_y; // see atlas_image_info_t::trim_offset
+
+		uint8_t layer; // 0xFF if the image isn't placed
+		uint8_t rotated; // see atlas_image_info_t::rotated
+		uint16_t reserved;
+	};
+
+	static_assert(sizeof(atlas_image_record_t) == 32,
+		"atlas_image_record_t should fill half a cache line");
+
+	// Output of atlas_t::query_uvs, one array per field, each with room
+	// for as many images as were asked about. u0, v0 - u1, v1 is the
+	// normalized rectangle an image covers in its layer: for a rotated
+	// image that's the rectangle it was packed into, turned.
+	struct atlas_uv_batch_t {
+		uint8_t* layers;
+		float* u0;
+		float* v0;
+		float* u1;
+		float* v1;
+	};
+
+	//------------------
+	// maxrects_bin_t
+	//
+	// keeps the maximal free rectangles of a bin: every placement
+	// splits each free rectangle it overlaps into up to four maximal
+	// remainders, and any free rectangle contained within another
+	// is discarded afterward.
+	//
+	// Unlike the BSP, free rectangles may overlap, so leftover space
+	// isn't locked into whichever side of a partition line it
+	// landed on.
+	//
+	// idea and heuristics are from Jukka Jylänki's
+	// "A Thousand Ways to Pack the Bin":
+	// http://clb.demon.fi/files/RectangleBinPack.pdf
+	//------------------
+
+	struct atlas_rect_t {
+		int32_t x, y, w, h;
+	};
+
+	struct maxrects_bin_t {
+		std::vector<atlas_rect_t> free_rects;
+
+		void reset(int32_t width, int32_t height)
 		{
-			assert(image < layers.size());
+			free_rects.clear();
+			free_rects.push_back(atlas_rect_t { 0, 0, width, height });
+		}
 
-			image = check_index(image);
+		// Returns the index of the free rectangle which best fits
+		// a w x h image, or -1 if nothing fits. If rotated is given,
+		// an h x w fit is considered as well and *rotated says which
+		// one won.
+		int32_t find(int32_t w, int32_t h, atlas_packer_t heuristic,
+			bool* rotated = nullptr) const
+		{
+			int32_t best = -1;
+			int64_t best_primary = INT64_MAX;
+			int64_t best_secondary = INT64_MAX;
+
+			int32_t turns = (rotated && w != h) ? 2 : 1;
+
+			for (size_t i = 0; i < free_rects.size(); ++i) {
+				const atlas_rect_t& r = free_rects[i];
+
+				for (int32_t turn = 0; turn < turns; ++turn) {
+					int32_t fw = turn ? h : w;
+					int32_t fh = turn ? w : h;
+
+					if (r.w < fw || r.h < fh)
+						continue;
+
+					int64_t leftover_x = r.w - fw;
+					int64_t leftover_y = r.h - fh;
+					int64_t short_side = glm::min(leftover_x, leftover_y);
+					int64_t long_side = glm::max(leftover_x, leftover_y);
+
+					int64_t primary, secondary;
+
+					if (heuristic == atlas_packer_maxrects_baf) {
+						primary = (int64_t) r.w * r.h - (int64_t) w * h;
+						secondary = short_side;
+					} else {
+						primary = short_side;
+						secondary = long_side;
+					}
+
+					if (primary < best_primary
+						|| (primary == best_primary && secondary < best_secondary)) {
+						best = (int32_t) i;
+						best_primary = primary;
+						best_secondary = secondary;
+
+						if (rotated)
+							*rotated = turn != 0;
+					}
+				}
+			}
 
-			assert(layers[image] != 0xFF);
-			return layers[image];
+			return best;
 		}
 
-		atlas_image_info_t image_info(uint16_t image) const
+		// Hands a rectangle which was placed earlier back to the bin.
+		// Nothing is merged, so space freed this way stays fragmented
+		// until the layer is repacked.
+		void release(const atlas_rect_t& freed)
 		{
-			image = check_index(image);
+			free_rects.push_back(freed);
+			prune();
+		}
 
-			uint8_t L = layer(image);
+		void place(const atlas_rect_t& used)
+		{
+			size_t count = free_rects.size();
+
+			for (size_t i = 0; i < count;) {
+				if (split(free_rects[i], used)) {
+					free_rects[i] = free_rects[count - 1];
+					free_rects[count - 1] = free_rects.back();
+					free_rects.pop_back();
+					count--;
+				} else {
+					i++;
+				}
+			}
 
-			atlas_image_info_t img {
-				L,
-				glm::vec2(origin_x(image), origin_y(image)),
-				glm::vec2(
-					1.0f / static_cast<float>(widths[L]),
-					1.0f / static_cast<float>(heights[L])
-				)
-			};
+			prune();
+		}
 
-			return img;
+	private:
+		// Pushes the parts of free which don't overlap used
+		// and returns true if they overlap at all.
+		bool split(atlas_rect_t free, const atlas_rect_t& used)
+		{
+			if (used.x >= free.x + free.w || used.x + used.w <= free.x
+				|| used.y >= free.y + free.h || used.y + used.h <= free.y)
+				return false;
+
+			if (used.x > free.x) {
+				free_rects.push_back(atlas_rect_t {
+					free.x, free.y, used.x - free.x, free.h });
+			}
+
+			if (used.x + used.w < free.x + free.w) {
+				free_rects.push_back(atlas_rect_t {
+					used.x + used.w, free.y,
+					free.x + free.w - (used.x + used.w), free.h });
+			}
+
+			if (used.y > free.y) {
+				free_rects.push_back(atlas_rect_t {
+					free.x, free.y, free.w, used.y - free.y });
+			}
+
+			if (used.y + used.h < free.y + free.h) {
+				free_rects.push_back(atlas_rect_t {
+					free.x, used.y + used.h,
+					free.w, free.y + free.h - (used.y + used.h) });
+			}
+
+			return true;
 		}
 
-		void push_layer(uint16_t width, uint16_t height)
+		static bool contains(const atlas_rect_t& a, const atlas_rect_t& b)
 		{
-			size_t index = layer_tex_handles.size();
+			return b.x >= a.x && b.y >= a.y
+				&& b.x + b.w <= a.x + a.w
+				&& b.y + b.h <= a.y + a.h;
+		}
 
-			layer_tex_handles.push_back(0);
-			widths.push_back(width);
-			heights.push_back(height);
+		void prune(void)
+		{
+			for (size_t i = 0; i < free_rects.size(); ++i) {
+				for (size_t j = i + 1; j < free_rects.size();) {
+					if (contains(free_rects[j], free_rects[i])) {
+						free_rects.erase(free_rects.begin() + i);
+						i--;
+						break;
+					}
+
+					if (contains(free_rects[i], free_rects[j])) {
+						free_rects.erase(free_rects.begin() + j);
+					} else {
+						j++;
+					}
+				}
+			}
+		}
+	};
 
-            GLK_H( glGenTextures(1, &layer_tex_handles[index]) );
+	//------------------
+	// pixel_arena_t
+	//
+	// holds the pixels of every image in a few large slabs rather than
+	// one allocation per image. Images are allocated back to back, so
+	// filling layers walks memory in order; releasing an image only counts
+	// its bytes as a hole, and holes are given back by compact() or
+	// reset(). reset() keeps the slabs, so rebuilding an atlas reuses
+	// the memory the last build grew.
+	//------------------
 
-			bind(index);
+	struct pixel_span_t {
+		uint32_t slab;
+		uint32_t offset;
+		uint32_t length; // bytes
+		uint32_t stride; // bytes per row
+	};
 
-            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
-				GL_LINEAR) );
-            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-				GL_LINEAR) );
-            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-				GL_CLAMP_TO_EDGE) );
-            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
-				GL_CLAMP_TO_EDGE) );
+	struct pixel_arena_t {
+		static const size_t slab_size = 64 << 20;
+		static const size_t min_slab_size = 1 << 20;
+		static const size_t alignment = 16;
+
+		struct slab_t {
+			std::unique_ptr<uint8_t[]> data;
+			size_t capacity;
+			size_t used;
+		};
 
-			alloc_blank_texture(widths[index], heights[index], 0x00000000);
+		std::vector<slab_t> slabs;
+		size_t current; // slab allocations are coming out of
+		size_t freed; // bytes in holes
 
-			release();
+		pixel_arena_t(void)
+			:   current(0),
+				freed(0)
+		{}
+
+		pixel_span_t alloc(uint32_t length, uint32_t stride)
+		{
+			for (; current < slabs.size(); ++current) {
+				slab_t& slab = slabs[current];
+
+				size_t offset = (slab.used + alignment - 1) & ~(alignment - 1);
+
+				if (offset + length <= slab.capacity) {
+					slab.used = offset + length;
+
+					return pixel_span_t { (uint32_t) current, (uint32_t) offset,
+						length, stride };
+				}
+			}
+
+			// Slabs double from min_slab_size up to slab_size, so a
+			// handful of images doesn't cost a whole slab. Images larger
+			// than that get one to themselves.
+			size_t capacity = glm::min((size_t) slab_size,
+				(size_t) min_slab_size << glm::min(slabs.size(), (size_t) 6));
+
+			capacity = glm::max(capacity, (size_t) length);
+
+			slabs.push_back(slab_t {
+				std::unique_ptr<uint8_t[]>(new uint8_t[capacity]),
+				capacity,
+				(size_t) length
+			});
+
+			current = slabs.size() - 1;
+
+			return pixel_span_t { (uint32_t) current, 0, length, stride };
 		}
 
-		void set_layer(uint16_t image, uint8_t layer)
+		// Shrinks or gives back the most recent allocation
+		void truncate(pixel_span_t& span, uint32_t length)
 		{
-			if (layers.size() != num_images)
-				layers.resize(num_images, 0xFF);
+			slab_t& slab = slabs[span.slab];
 
-			layers[check_index(image)] = layer;
+			assert(slab.used == span.offset + span.length);
+
+			slab.used = span.offset + length;
+			span.length = length;
 		}
 
-		void bind(uint8_t layer) const
+		// Shrinks any allocation: the tail goes back to the slab if
+		// nothing was allocated after it, otherwise it's left as a hole
+		void shrink(pixel_span_t& span, uint32_t length)
 		{
-            GLK_H( glBindTexture(GL_TEXTURE_2D, layer_tex_handles[layer]) );
+			slab_t& slab = slabs[span.slab];
+
+			if (slab.used == span.offset + span.length)
+				slab.used = span.offset + length;
+			else
+				freed += span.length - length;
+
+			span.length = length;
 		}
 
-		void bind_to_active_slot(uint8_t layer, GLenum offset) const
+		void release(pixel_span_t& span)
 		{
-            GLK_H( glActiveTexture(GL_TEXTURE0 + offset) );
-			bind(layer);
+			freed += span.length;
+			span.length = 0;
 		}
 
-		void release(void) const
+		uint8_t* data(const pixel_span_t& span)
 		{
-            GLK_H( glBindTexture(GL_TEXTURE_2D, 0) );
+			return slabs[span.slab].data.get() + span.offset;
 		}
 
-		void release_from_active_slot(GLenum offset) const
+		const uint8_t* data(const pixel_span_t& span) const
 		{
-            GLK_H( glActiveTexture(GL_TEXTURE0 + offset) );
-			release();
+			return slabs[span.slab].data.get() + span.offset;
 		}
 
-		void write_origins(uint16_t image, uint16_t x, uint16_t y)
+		size_t bytes_reserved(void) const
 		{
-			image = check_index(image);
+			size_t bytes = 0;
 
-			if (coords_x.size() != num_images)
-				coords_x.resize(num_images, 0);
+			for (const slab_t& slab: slabs)
+				bytes += slab.capacity;
 
-			coords_x[image] = x;
+			return bytes;
+		}
 
-			if (coords_y.size() != num_images)
-				coords_y.resize(num_images, 0);
+		size_t bytes_used(void) const
+		{
+			size_t bytes = 0;
 
-			coords_y[image] = y;
+			for (const slab_t& slab: slabs)
+				bytes += slab.used;
+
+			return bytes - freed;
 		}
 
-        void downscale_image(size_t image)
+		// Forgets every allocation but keeps the slabs
+		void reset(void)
 		{
-            uint16_t old_width = dim_x(image);
-            uint16_t old_height = dim_y(image);
-            uint16_t new_width = old_width >> 1 + (old_width & 0x1);
-            uint16_t new_height = old_height >> 1 + (old_height & 0x1);
+			for (slab_t& slab: slabs)
+				slab.used = 0;
 
-            std::vector<uint8_t> old_pixels = buffer_table[image];
+			current = 0;
+			freed = 0;
+		}
 
-            buffer_table[image].clear();
-            buffer_table[image].resize(old_width * old_height * GLK_ATLAS_DESIRED_BPP, 0);
+		// Moves the live spans into fresh slabs so the holes are
+		// given back; spans is updated in place.
+		void compact(std::vector<pixel_span_t>& spans)
+		{
+			pixel_arena_t packed;
 
-            uint8_t* buffer = &buffer_table[image][0];
+			for (pixel_span_t& span: spans) {
+				if (!span.length)
+					continue;
 
-            for (uint16_t v = 0; v < new_height; ++v) {
-                uint16_t oy = v << 1;
+				pixel_span_t moved = packed.alloc(span.length, span.stride);
+				memcpy(packed.data(moved), data(span), span.length);
 
-                for (uint16_t u = 0; u < new_width; ++u) {
-                    uint16_t ox = u << 1;
+				span = moved;
+			}
 
-                    const uint8_t* x1 = &old_pixels[((oy + 0) * old_width + ox + 0) * GLK_ATLAS_DESIRED_BPP];
-                    const uint8_t* x2 = &old_pixels[((oy + 0) * old_width + ox + 1) * GLK_ATLAS_DESIRED_BPP];
+			*this = std::move(packed);
+		}
+	};
 
-                    const uint8_t* y1 = &old_pixels[((oy + 1) * old_width + ox + 0) * GLK_ATLAS_DESIRED_BPP];
-                    const uint8_t* y2 = &old_pixels[((oy + 1) * old_width + ox + 1) * GLK_ATLAS_DESIRED_BPP];
+	struct atlas_compaction_t;
 
-                    uint8_t* new_pixel = &buffer[(v * new_width + u) * GLK_ATLAS_DESIRED_BPP];
+	GLK_FUNC void destroy_atlas_compaction(atlas_compaction_t* c);
 
-                    new_pixel[0] = average_pix_channel4(0, x1, x2, y1, y2);
-                    new_pixel[1] = average_pix_channel4(1, x1, x2, y1, y2);
-                    new_pixel[2] = average_pix_channel4(2, x1, x2, y1, y2);
-                    new_pixel[3] = average_pix_channel4(3, x1, x2, y1, y2);
-                }
+	struct atlas_t {
+		static const uint16_t no_image_index = 0xFFFF;
 
-                dims_x[image] = new_width;
-                dims_y[image] = new_height;
-            }
-		}
+		using compaction_ptr_t = std::unique_ptr<atlas_compaction_t,
+			void (*)(atlas_compaction_t*)>;
 
-        void fill(size_t image, GLsizei offset_x, GLsizei offset_y, GLsizei dx, GLsizei dy) const
+        bool is_downscaled;
+
+		// Bytes of pixels gen_atlas_layers downscales images to fit in,
+		// 0 for no limit, and the filter it and is_downscaled use
+		uint64_t downscale_budget;
+		downscale_filter_t downscale_filter;
+
+		atlas_pack_params_t pack_params;
+
+		uint16_t default_image;
+
+		uint32_t num_images;
+
+		uint32_t area_accum;
+
+		std::vector<uint8_t> layers;
+
+		std::vector<uint16_t> widths;
+		std::vector<uint16_t> heights;
+
+		std::vector<uint16_t> dims_x;
+		std::vector<uint16_t> dims_y;
+
+		std::vector<uint16_t> coords_x;
+		std::vector<uint16_t> coords_y;
+
+		// Transparent trimming: dims_x/dims_y are what's left after the
+		// trim, and these are the offset of that within the pushed image
+		// (rows counted after flipping) and the pushed image's size.
+		bool trim;
+
+		std::vector<uint16_t> trim_x;
+		std::vector<uint16_t> trim_y;
+
+		std::vector<uint16_t> source_x;
+		std::vector<uint16_t> source_y;
+
+		std::vector<GLuint> layer_tex_handles;
+		std::vector<GLuint> alpha_tex_handles; // 0 unless the layer is atlas_layer_etc1_alpha
+
+		pixel_arena_t pixels;
+		std::vector<pixel_span_t> pixel_spans; // empty for duplicates and removed images
+
+		std::vector<std::string> filenames; // optional
+
+		image_map_t filename_map; // hash64 of each filename -> image; see build_filename_map
+		size_t filenames_mapped; // filenames.size() when filename_map was built
+
+        image_map_t key_map; // optional
+
+		// Free space left in each layer, kept so images can be inserted
+		// after gen_atlas_layers without repacking.
+		std::vector<maxrects_bin_t> layer_bins;
+
+		std::vector<uint8_t> removed; // 1 for images taken out by remove_image
+
+		std::vector<uint8_t> rotated; // 1 for images packed turned (see atlas_image_info_t)
+
+		// One atlas_image_record_t per image, kept up to date with the
+		// layout, plus an empty one past the last image which ids with
+		// nothing else to show read. Records are cache line aligned
+		// within record_storage, two to a line.
+		std::vector<uint8_t> record_storage;
+		atlas_image_record_t* records;
+		size_t num_records;
+
+		// Block compression: each image takes up its size rounded up to
+		// whole blocks (see reserved_rect), and a layer is stored without
+		// alpha only if every image on it is opaque.
+		atlas_compression_t compression;
+
+		// Levels, counting the base, which every image keeps to itself:
+		// see set_mipmap_levels. 1 for no mipmaps.
+		uint8_t mip_levels;
+
+		std::vector<uint8_t> opaque; // 1 for images with no alpha below 255
+		std::vector<uint8_t> layer_formats; // atlas_layer_format_t, per layer
+
+		// The blocks of each layer which can't be updated in place (see
+		// layer_updatable), empty for the rest: inserting into one
+		// patches these and uploads the whole layer again. Holds every
+		// level of a mipmapped layer.
+		std::vector<std::vector<uint8_t>> layer_blocks;
+
+		// ETC1 layers are made as GL_COMPRESSED_RGB8_ETC2 where the
+		// context decodes ETC2: the blocks decode the same (see etc.h),
+		// and ES 3.0 lets those be updated in place. Only ES2 devices
+		// keep layer_blocks. Set by push_layer.
+		bool etc1_as_etc2;
+
+		// While capture_layers is set, apply_atlas_plan keeps each layer's
+		// contents as it uploaded them (see encode_atlas_layer) in
+		// captured_layers, before the residency policy sees the pixels.
+		// make_atlas_from_dir_cached writes its cache from these, so the
+		// encoders don't run twice and dropped pixels aren't needed.
+		bool capture_layers;
+		std::vector<std::vector<uint8_t>> captured_layers;
+
+		// Content deduplication: an image whose pixels match one pushed
+		// earlier shares that image's slot - its pixels and its place in
+		// the layers - instead of taking up space of its own.
+		bool dedupe;
+
+		std::vector<uint16_t> slots; // image whose pixels each image shows
+		std::vector<uint16_t> slot_refs; // live images showing each slot
+		std::vector<uint64_t> content_hashes;
+
+		image_map_t content_map; // hash -> slot
+
+		uint32_t num_duplicates;
+		uint64_t duplicate_bytes; // pixel bytes never stored or uploaded
+
+		compaction_ptr_t compaction; // in flight, if any
+
+		using file_ptr_t = std::unique_ptr<FILE, int (*)(FILE*)>;
+
+		static const uint64_t not_spilled = UINT64_MAX;
+
+		atlas_residency_t residency;
+
+		bool pixels_dropped; // by atlas_residency_drop
+
+		file_ptr_t spill_file;
+		uint64_t spill_bytes; // written to spill_file so far
+
+		std::vector<uint64_t> spill_offsets; // not_spilled unless in spill_file
+		std::vector<pixel_span_t> spill_spans; // lengths and strides of those
+
+        bool downscaled(void) const { return is_downscaled; }
+
+		// Halves every image pushed afterward, rounding up, before it's
+		// deduplicated or packed
+        void set_downscaled(bool d) { is_downscaled = d; }
+
+		uint64_t downscale_budget_bytes(void) const { return downscale_budget; }
+
+		downscale_filter_t downscale_filter_mode(void) const { return downscale_filter; }
+
+		// Each time the atlas is laid out, images are downscaled until
+		// their pixels (4 bytes a texel, duplicates counted once) fit in
+		// bytes: the largest is halved, rounding up, over and over, and
+		// then each is scaled once by the factor it ended up with. That's
+		// for good - pixels given up to the budget don't come back if it's
+		// raised. 0 means no budget. The filter also applies to
+		// set_downscaled.
+		void set_downscale_budget(uint64_t bytes, downscale_filter_t filter = downscale_box)
+		{
+			downscale_budget = bytes;
+			downscale_filter = filter;
+		}
+
+		atlas_packer_t packer_type(void) const { return pack_params.packer; }
+
+		void set_packer_type(atlas_packer_t p) { pack_params.packer = p; }
+
+		bool sort_race(void) const { return pack_params.sort_race; }
+
+		// Packs each layer in every layer_sort_t order, on as many cores
+		// as there are, and keeps the best. Off by default: it's only
+		// worth the threads for large image sets on machines with cores
+		// to spare.
+		void set_sort_race(bool r) { pack_params.sort_race = r; }
+
+		atlas_root_size_t root_size_mode(void) const { return pack_params.root_size; }
+
+		void set_root_size_mode(atlas_root_size_t r) { pack_params.root_size = r; }
+
+		uint16_t layer_alignment(void) const { return pack_params.layer_align; }
+
+		// GLK_ATLAS_LAYER_ALIGN_POW2, or the multiple of texels each
+		// layer's width and height is rounded up to (1 for exact extents)
+		void set_layer_alignment(uint16_t align) { pack_params.layer_align = align; }
+
+		bool allow_rotation(void) const { return pack_params.allow_rotation; }
+
+		// Lets the packers turn images a quarter turn when that fits
+		// better; see atlas_image_info_t::rotated.
+		void set_allow_rotation(bool r) { pack_params.allow_rotation = r; }
+
+		bool trim_transparent(void) const { return trim; }
+
+		// Only affects images pushed afterward
+		void set_trim_transparent(bool t) { trim = t; }
+
+		atlas_residency_t residency_policy(void) const { return residency; }
+
+		// Takes effect the next time pixels are uploaded
+		void set_residency_policy(atlas_residency_t r) { residency = r; }
+
+		atlas_compression_t compression_mode(void) const { return compression; }
+
+		// Takes effect the next time the atlas is laid out. Defaults to
+		// GLK_ATLAS_DEFAULT_COMPRESSION.
+		void set_compression(atlas_compression_t c)
+		{
+			compression = c;
+			align_images();
+		}
+
+		uint8_t mipmap_levels(void) const { return mip_levels; }
+
+		// Mipmaps every layer, down to 1 x 1. Images keep the first levels
+		// levels (counting the base) to themselves: each is packed with a
+		// gutter of 2^(levels - 1) texels of its own edge on every side and
+		// aligned to 2^(levels - 1) texels (times the block size when
+		// compressed), so each texel of those levels, and each block, lies
+		// within one image. Levels past that average neighbouring images
+		// together, but by then an image covers a texel or so anyway.
+		// 1 turns mipmaps off; at most 8. Takes effect the next time the
+		// atlas is laid out. ES2 only mipmaps power of two layers.
+		void set_mipmap_levels(uint8_t levels)
+		{
+			mip_levels = glm::clamp(levels, (uint8_t) 1, (uint8_t) 8);
+			align_images();
+		}
+
+		// Sets the alignment and gutter the packers give each image from
+		// the compression and mipmap settings
+		void align_images(void)
+		{
+			uint16_t block = compression == atlas_compression_none ? 1 : 4;
+
+			pack_params.block_align = (uint16_t) (block << (mip_levels - 1));
+			pack_params.gutter = mip_levels > 1 ? (uint16_t) (1 << (mip_levels - 1)) : 0;
+		}
+
+		// How many levels layer stores
+		size_t layer_levels(size_t layer) const
+		{
+			return atlas_layer_levels(mip_levels, widths[layer], heights[layer]);
+		}
+
+		bool dedupe_images(void) const { return dedupe; }
+
+		// Only affects images pushed afterward
+		void set_dedupe_images(bool d) { dedupe = d; }
+
+        size_t num_layers(void) const { return layer_tex_handles.size(); }
+
+		atlas_pack_source_t pack_source(void) const
+		{
+			return atlas_pack_source_t {
+				dims_x.data(), dims_y.data(), area_accum, pack_params,
+				compression == atlas_compression_none ? nullptr : opaque.data() };
+		}
+
+		bool image_removed(uint16_t image) const
+		{
+			return image < removed.size() && removed[image];
+		}
+
+		bool image_duplicate(uint16_t image) const
+		{
+			return slots[image] != image;
+		}
+
+		uint8_t* image_pixels(uint16_t image)
+		{
+			return pixels.data(pixel_spans[image]);
+		}
+
+		const uint8_t* image_pixels(uint16_t image) const
+		{
+			return pixels.data(pixel_spans[image]);
+		}
+
+		bool pixels_resident(uint16_t image) const
+		{
+			return pixel_spans[image].length > 0;
+		}
+
+		// True if image's pixels are the length bytes at data, wherever
+		// they're kept. Dropped pixels never compare equal.
+		bool same_pixels(uint16_t image, const uint8_t* data, uint32_t length) const
+		{
+			if (pixels_resident(image)) {
+				return pixel_spans[image].length == length
+					&& memcmp(image_pixels(image), data, length) == 0;
+			}
+
+			if (image >= spill_offsets.size()
+				|| spill_offsets[image] == not_spilled
+				|| spill_spans[image].length != length)
+				return false;
+
+			uint8_t chunk[4096];
+
+			fseeko(spill_file.get(), (off_t) spill_offsets[image], SEEK_SET);
+
+			for (uint32_t at = 0; at < length; at += sizeof(chunk)) {
+				size_t n = glm::min((size_t) (length - at), sizeof(chunk));
+
+				if (fread(chunk, 1, n, spill_file.get()) != n
+					|| memcmp(chunk, data + at, n) != 0)
+					return false;
+			}
+
+			return true;
+		}
+
+		// Frees the pixels of every image that's been uploaded, as the
+		// residency policy asks. Called once they're all on the GPU.
+		void evict_pixels(void)
+		{
+			if (residency == atlas_residency_keep)
+				return;
+
+			if (residency == atlas_residency_spill) {
+				if (!spill_file)
+					spill_file.reset(tmpfile());
+
+				if (!spill_file) {
+					glk_logf("ERROR: couldn't open a spill file; keeping %lu bytes "
+						"of pixels in memory", pixels.bytes_used());
+					return;
+				}
+
+				spill_offsets.resize(num_images, (uint64_t) not_spilled);
+				spill_spans.resize(num_images, pixel_span_t { 0, 0, 0, 0 });
+
+				fseeko(spill_file.get(), (off_t) spill_bytes, SEEK_SET);
+
+				for (uint16_t image = 0; image < num_images; ++image) {
+					if (!pixels_resident(image))
+						continue;
+
+					const pixel_span_t& span = pixel_spans[image];
+
+					if (fwrite(image_pixels(image), 1, span.length,
+						spill_file.get()) != span.length) {
+						glk_logf("ERROR: spill file write failed; keeping the "
+							"pixels of image %i onward in memory", (int) image);
+						return;
+					}
+
+					spill_offsets[image] = spill_bytes;
+					spill_spans[image] = span;
+					spill_bytes += span.length;
+				}
+
+				fflush(spill_file.get());
+			} else {
+				pixels_dropped = true;
+			}
+
+			for (pixel_span_t& span: pixel_spans)
+				span.length = 0;
+
+			pixels = pixel_arena_t();
+		}
+
+		// Brings spilled pixels back into memory. Returns false if any
+		// live image's pixels were dropped, and are gone for good.
+		bool restore_pixels(void)
+		{
+			for (uint16_t image = 0; image < spill_offsets.size(); ++image) {
+				if (spill_offsets[image] == not_spilled)
+					continue;
+
+				if (slot_live(image)) {
+					const pixel_span_t& spilled = spill_spans[image];
+					pixel_span_t span = pixels.alloc(spilled.length, spilled.stride);
+
+					fseeko(spill_file.get(), (off_t) spill_offsets[image], SEEK_SET);
+
+					if (fread(pixels.data(span), 1, span.length,
+						spill_file.get()) != span.length) {
+						glk_logf("ERROR: spill file read failed for image %i",
+							(int) image);
+						return false;
+					}
+
+					pixel_spans[image] = span;
+				}
+
+				spill_offsets[image] = not_spilled;
+			}
+
+			// Everything's back in memory, so the file can be reused
+			spill_bytes = 0;
+
+			return !pixels_dropped;
+		}
+
+		atlas_memory_usage_t memory_usage(void) const
+		{
+			atlas_memory_usage_t usage {
+				pixels.bytes_reserved(),
+				pixels.bytes_used(),
+				0,
+				0,
+				0
+			};
+
+			for (uint16_t image = 0; image < spill_offsets.size(); ++image) {
+				if (spill_offsets[image] != not_spilled)
+					usage.spilled_bytes += spill_spans[image].length;
+			}
+
+			for (size_t i = 0; i < num_layers(); ++i)
+				usage.gpu_bytes += atlas_layer_chain_bytes(layer_format(i), widths[i],
+					heights[i], layer_levels(i));
+
+			for (const std::vector<uint8_t>& blocks: layer_blocks)
+				usage.cpu_block_bytes += blocks.size();
+
+			return usage;
+		}
+
+		// Gives the holes removed images left in the pixel arena back,
+		// once they make up at least half of it.
+		void compact_pixels(void)
+		{
+			if (pixels.freed && pixels.freed * 2 >= pixels.bytes_used() + pixels.freed)
+				pixels.compact(pixel_spans);
+		}
+
+		bool image_rotated(uint16_t image) const
+		{
+			return image < rotated.size() && rotated[image];
+		}
+
+		void set_rotated(uint16_t image, bool r)
+		{
+			if (rotated.size() != num_images)
+				rotated.resize(num_images, 0);
+
+			rotated[check_index(image)] = r;
+		}
+
+		// The rectangle image takes up in its layer
+		atlas_rect_t packed_rect(uint16_t image) const
+		{
+			if (image_rotated(image))
+				return atlas_rect_t { coords_x[image], coords_y[image],
+					dims_y[image], dims_x[image] };
+
+			return atlas_rect_t { coords_x[image], coords_y[image],
+				dims_x[image], dims_y[image] };
+		}
+
+		// packed_rect, grown by the gutter on every side and padded out
+		// to whole blocks: what image keeps other images out of. The same
+		// as packed_rect when uncompressed and not mipmapped.
+		atlas_rect_t reserved_rect(uint16_t image) const
+		{
+			atlas_rect_t r = packed_rect(image);
+
+			int32_t gutter = pack_params.gutter;
+
+			r.x -= gutter;
+			r.y -= gutter;
+			r.w = layer_extent(r.w + gutter * 2, pack_params.block_align);
+			r.h = layer_extent(r.h + gutter * 2, pack_params.block_align);
+
+			return r;
+		}
+
+		bool image_opaque(uint16_t image) const
+		{
+			return image < opaque.size() && opaque[image];
+		}
+
+		atlas_layer_format_t layer_format(size_t layer) const
+		{
+			return layer < layer_formats.size()
+				? (atlas_layer_format_t) layer_formats[layer] : atlas_layer_rgba8;
+		}
+
+		GLenum layer_gl_format(size_t layer) const
+		{
+			atlas_layer_format_t format = layer_format(layer);
+
+			if (etc1_as_etc2 && !atlas_layer_updatable(format))
+				return GL_COMPRESSED_RGB8_ETC2;
+
+			return atlas_layer_gl_format(format);
+		}
+
+		// Whether inserting into layer can upload just the image's blocks
+		bool layer_updatable(size_t layer) const
+		{
+			return etc1_as_etc2 || atlas_layer_updatable(layer_format(layer));
+		}
+
+		// The format a layer needs to hold image
+		atlas_layer_format_t layer_format_for(uint16_t image) const
+		{
+			return atlas_layer_format(compression, image_opaque(image));
+		}
+
+		// True if image owns pixels which something still shows, i.e.
+		// it's one of the images which actually gets packed.
+		bool slot_live(uint16_t image) const
+		{
+			return slots[image] == image && slot_refs[image] > 0;
+		}
+
+		std::vector<uint16_t> packed_images(void) const
+		{
+			std::vector<uint16_t> images;
+
+			for (uint16_t i = 0; i < num_images; ++i)
+				if (slot_live(i))
+					images.push_back(i);
+
+			return images;
+		}
+
+		// Gives every live duplicate its slot's placement.
+		void place_duplicates(void)
+		{
+			for (uint16_t image = 0; image < num_images; ++image) {
+				if (!image_duplicate(image) || image_removed(image))
+					continue;
+
+				uint16_t slot = slots[image];
+
+				if (slot < layers.size() && layers[slot] != 0xFF) {
+					set_layer(image, layers[slot]);
+					write_origins(image, coords_x[slot], coords_y[slot]);
+					set_rotated(image, image_rotated(slot));
+				}
+			}
+		}
+
+		uint16_t check_index(uint16_t index) const
+		{
+			if (num_images <= index)
+			{
+				if (default_image == no_image_index)
+				{
+                    glk_logf(
+						"%s",
+						"FATAL: atlas_t default_image == no_image_index");
+                    exit_on_error();
+				}
+
+				return default_image;
+			}
+
+			return index;
+		}
+
+		uint16_t origin_x(uint16_t image) const
+		{
+			return coords_x[check_index(image)];
+		}
+
+		uint16_t origin_y(uint16_t image) const
+		{
+			return coords_y[check_index(image)];
+		}
+
+        uint16_t dim_x(uint16_t image) const
         {
-            GLsizei dest_x = (GLsizei) origin_x(image) + offset_x;
-            GLsizei dest_y = (GLsizei) origin_y(image) + offset_y;
+            return dims_x[check_index(image)];
+        }
+
+        uint16_t dim_y(uint16_t image) const
+        {
+            return dims_y[check_index(image)];
+        }
+
+		uint8_t layer(uint16_t image) const
+		{
+			assert(image < layers.size());
+
+			image = check_index(image);
+
+			assert(layers[image] != 0xFF);
+			return layers[image];
+		}
+
+		atlas_image_info_t image_info(uint16_t image) const
+		{
+			image = check_index(image);
+
+			uint8_t L = layer(image);
+
+			atlas_image_info_t img {
+				L,
+				glm::vec2(origin_x(image), origin_y(image)),
+				glm::vec2(
+					1.0f / static_cast<float>(widths[L]),
+					1.0f / static_cast<float>(heights[L])
+				),
+				glm::vec2(trim_x[image], trim_y[image]),
+				glm::vec2(source_x[image], source_y[image]),
+				image_rotated(image)
+			};
+
+			return img;
+		}
+
+		// Unchecked, for hot paths: image must be below num_images.
+		// Images which aren't placed have layer 0xFF and zeros. The
+		// checked accessors above read the same placement, and are
+		// the ones to use while debugging.
+		const atlas_image_record_t& record(uint16_t image) const
+		{
+			return records[image];
+		}
+
+		// num_images + 1 records; the last one is the empty record
+		const atlas_image_record_t* record_table(void) const
+		{
+			return records;
+		}
+
+		// Grows the record table to rows records, new ones empty. The
+		// table lives cache line aligned in record_storage.
+		void resize_records(size_t rows)
+		{
+			size_t bytes = rows * sizeof(atlas_image_record_t) + 63;
+
+			if (record_storage.size() < bytes) {
+				std::vector<uint8_t> grown(glm::max(bytes, record_storage.size() * 2));
+
+				atlas_image_record_t* base = (atlas_image_record_t*)
+					(((uintptr_t) grown.data() + 63) & ~(uintptr_t) 63);
+
+				if (num_records)
+					memcpy(base, records, num_records * sizeof(atlas_image_record_t));
+
+				record_storage.swap(grown);
+				records = base;
+			}
+
+			atlas_image_record_t empty;
+
+			memset(&empty, 0, sizeof(empty));
+			empty.layer = 0xFF;
+
+			for (size_t i = num_records; i < rows; ++i)
+				records[i] = empty;
+
+			num_records = rows;
+		}
+
+		// Brings image's record up to date with its placement. Removed
+		// images read as empty, even a slot which stays placed for the
+		// duplicates still showing its pixels.
+		void refresh_record(uint16_t image)
+		{
+			if (num_records < (size_t) num_images + 1)
+				resize_records((size_t) num_images + 1);
+
+			atlas_image_record_t& rec = records[image];
+
+			memset(&rec, 0, sizeof(rec));
+			rec.layer = 0xFF;
+
+			if (image >= layers.size() || layers[image] == 0xFF || image_removed(image))
+				return;
+
+			uint8_t L = layers[image];
+			atlas_rect_t r = packed_rect(image);
+
+			float iw = 1.0f / static_cast<float>(widths[L]);
+			float ih = 1.0f / static_cast<float>(heights[L]);
+
+			rec.u0 = r.x * iw;
+			rec.v0 = r.y * ih;
+			rec.u1 = (r.x + r.w) * iw;
+			rec.v1 = (r.y + r.h) * ih;
+			rec.x = (uint16_t) r.x;
+			rec.y = (uint16_t) r.y;
+			rec.w = (uint16_t) r.w;
+			rec.h = (uint16_t) r.h;
+			rec.trim_x = trim_x[image];
+			rec.trim_y = trim_y[image];
+			rec.layer = L;
+			rec.rotated = image_rotated(image) ? 1 : 0;
+		}
+
+		// Rebuilds every record; apply_atlas_plan and load_atlas_cache
+		// finish with this
+		void build_records(void)
+		{
+			num_records = 0;
+			resize_records((size_t) num_images + 1);
+
+			for (uint16_t image = 0; image < num_images; ++image)
+				refresh_record(image);
+		}
+
+		// image_info's layer and UV rectangle for count images at once,
+		// read from the record table. Nothing's checked per image: ids
+		// the table doesn't cover read the default image, or the empty
+		// record if there isn't one, and images which aren't placed
+		// read as empty (layer 0xFF, zeros).
+		void query_uvs(const uint16_t* images, size_t count, atlas_uv_batch_t out) const
+		{
+			if (!num_records) {
+				memset(out.layers, 0xFF, count);
+
+				for (size_t i = 0; i < count; ++i)
+					out.u0[i] = out.v0[i] = out.u1[i] = out.v1[i] = 0.0f;
+
+				return;
+			}
+
+			const uint32_t rows = (uint32_t) num_records - 1;
+			const uint32_t fallback = default_image < rows ? default_image : rows;
+
+			const float* table = &records[0].u0;
+
+			// Records are 8 floats apart
+			const size_t stride = sizeof(atlas_image_record_t) / sizeof(float);
+
+			size_t i = 0;
+
+			// The vector loops stop at the last whole group and the tail
+			// counts up to count from there; bounding them by i + n <= count
+			// instead lets GCC assume i could wrap in the tail
+			// (-Waggressive-loop-optimizations).
+#if defined(__AVX2__)
+			const size_t grouped = count & ~(size_t) 7;
+
+			// Eight images at a time: widen the ids, swap out-of-range
+			// ones for the fallback and gather each field; the layer
+			// comes along in the low byte of a gathered word
+			const __m256i limit = _mm256_set1_epi32((int) rows);
+			const __m256i fallback8 = _mm256_set1_epi32((int) fallback);
+			const __m256i one = _mm256_set1_epi32(1);
+			const __m256i layer_word = _mm256_set1_epi32(
+				(int) (offsetof(atlas_image_record_t, layer) / sizeof(float)));
+
+			for (; i < grouped; i += 8) {
+				__m256i ids = _mm256_cvtepu16_epi32(
+					_mm_loadu_si128((const __m128i*) (images + i)));
+
+				__m256i rows8 = _mm256_blendv_epi8(fallback8, ids,
+					_mm256_cmpgt_epi32(limit, ids));
+
+				__m256i at = _mm256_slli_epi32(rows8, 3);
+
+				__m256i layer = _mm256_i32gather_epi32((const int*) table,
+					_mm256_add_epi32(at, layer_word), 4);
+
+				_mm256_storeu_ps(out.u0 + i, _mm256_i32gather_ps(table, at, 4));
+				at = _mm256_add_epi32(at, one);
+				_mm256_storeu_ps(out.v0 + i, _mm256_i32gather_ps(table, at, 4));
+				at = _mm256_add_epi32(at, one);
+				_mm256_storeu_ps(out.u1 + i, _mm256_i32gather_ps(table, at, 4));
+				at = _mm256_add_epi32(at, one);
+				_mm256_storeu_ps(out.v1 + i, _mm256_i32gather_ps(table, at, 4));
+
+				uint32_t words[8];
+				_mm256_storeu_si256((__m256i*) words, layer);
+
+				for (size_t k = 0; k < 8; ++k)
+					out.layers[i + k] = (uint8_t) words[k];
+			}
+#elif defined(__SSE2__)
+			const size_t grouped = count & ~(size_t) 3;
+
+			// Four images at a time: one load per record's UVs, then a
+			// transpose turns the rows into fields
+			for (; i < grouped; i += 4) {
+				uint32_t r[4];
+
+				for (size_t k = 0; k < 4; ++k) {
+					r[k] = images[i + k] < rows ? images[i + k] : fallback;
+					out.layers[i + k] = records[r[k]].layer;
+				}
+
+				__m128 a = _mm_load_ps(table + r[0] * stride);
+				__m128 b = _mm_load_ps(table + r[1] * stride);
+				__m128 c = _mm_load_ps(table + r[2] * stride);
+				__m128 d = _mm_load_ps(table + r[3] * stride);
+
+				_MM_TRANSPOSE4_PS(a, b, c, d);
+
+				_mm_storeu_ps(out.u0 + i, a);
+				_mm_storeu_ps(out.v0 + i, b);
+				_mm_storeu_ps(out.u1 + i, c);
+				_mm_storeu_ps(out.v1 + i, d);
+			}
+#endif
+
+			for (; i < count; ++i) {
+				const atlas_image_record_t& rec =
+					records[images[i] < rows ? images[i] : fallback];
+
+				out.layers[i] = rec.layer;
+				out.u0[i] = rec.u0;
+				out.v0[i] = rec.v0;
+				out.u1[i] = rec.u1;
+				out.v1[i] = rec.v1;
+			}
+
+			GLK_UNUSED(stride);
+		}
+
+		// pixels, if given, is the layer's initial contents in format
+		// (RGBA, or atlas_layer_bytes of blocks for the compressed
+		// formats), for each of its levels in turn; otherwise it starts
+		// out cleared.
+		void push_layer(uint16_t width, uint16_t height,
+			const uint8_t* pixels = nullptr,
+			atlas_layer_format_t format = atlas_layer_rgba8)
+		{
+			size_t index = layer_tex_handles.size();
+
+			layer_tex_handles.push_back(0);
+			alpha_tex_handles.resize(index, 0);
+			alpha_tex_handles.push_back(0);
+			widths.push_back(width);
+			heights.push_back(height);
+
+			layer_formats.resize(index, atlas_layer_rgba8);
+			layer_formats.push_back((uint8_t) format);
+			layer_blocks.resize(index + 1);
+
+			if (!atlas_layer_updatable(format))
+				etc1_as_etc2 = atlas_gl_has_etc2();
+
+			size_t levels = layer_levels(index);
+
+            GLK_H( glGenTextures(1, &layer_tex_handles[index]) );
+
+			bind(index);
+			init_layer_texture(levels);
+
+			if (format == atlas_layer_etc1_alpha) {
+                GLK_H( glGenTextures(1, &alpha_tex_handles[index]) );
+
+				bind_alpha(index);
+				init_layer_texture(levels);
+			}
+
+			if (pixels) {
+				upload_layer_levels(index, pixels);
+			} else if (format != atlas_layer_rgba8) {
+				std::vector<uint8_t> blank;
+
+				blank_layer_blocks(format, width, height, levels, blank);
+				upload_layer_levels(index, blank.data());
+			} else {
+				for (size_t level = 0; level < levels; ++level) {
+					alloc_blank_texture(mip_extent(width, level),
+						mip_extent(height, level), 0x00000000, (GLint) level);
+				}
+			}
+
+			release();
+		}
+
+		// Sets up the bound texture's sampling, trilinear if it has
+		// more than one level
+		static void init_layer_texture(size_t levels)
+		{
+            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_LINEAR) );
+            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR) );
+            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE) );
+            GLK_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE) );
+		}
+
+		// Blocks which decode to black, transparent where the format
+		// has alpha. All zeros does for BCn and EAC, but an all zero
+		// ETC1 block decodes to 2, so those pick the entry which subtracts.
+		static void blank_layer_blocks(atlas_layer_format_t format,
+			size_t width, size_t height, size_t levels, std::vector<uint8_t>& out)
+		{
+			out.assign(atlas_layer_chain_bytes(format, width, height, levels), 0);
+
+			if (format < atlas_layer_etc1)
+				return;
+
+			size_t block_bytes = format == atlas_layer_etc2_rgba ? 16 : 8;
+			size_t color = block_bytes - 8; // after EAC alpha, if any
+
+			for (size_t i = 0; i < out.size(); i += block_bytes) {
+				out[i + color + 4] = 0xFF; // index MSBs: every texel base - 2
+				out[i + color + 5] = 0xFF;
+			}
+		}
+
+		// Uploads every level of layer (atlas_layer_chain_bytes of texels
+		// or blocks), keeping a copy of them if the layer can't be updated
+		// in place. Leaves nothing bound.
+		void upload_layer_levels(size_t layer, const uint8_t* data)
+		{
+			atlas_layer_format_t format = layer_format(layer);
+			size_t levels = layer_levels(layer);
+
+			const uint8_t* level_data = data;
+
+			for (size_t level = 0; level < levels; ++level) {
+				size_t w = mip_extent(widths[layer], level);
+				size_t h = mip_extent(heights[layer], level);
+
+				bind(layer);
+
+				if (format == atlas_layer_rgba8) {
+					GLK_H( glTexImage2D(GL_TEXTURE_2D,
+										(GLint) level,
+										GLK_ATLAS_INTERNAL_TEX_FORMAT,
+										(GLsizei) w,
+										(GLsizei) h,
+										0,
+										GLK_ATLAS_TEX_FORMAT,
+										GL_UNSIGNED_BYTE,
+										level_data) );
+
+					level_data += atlas_layer_bytes(format, w, h);
+					continue;
+				}
+
+				uint64_t plane = atlas_layer_plane_bytes(format, w, h);
+
+				GLK_H( glCompressedTexImage2D(GL_TEXTURE_2D,
+									(GLint) level,
+									layer_gl_format(layer),
+									(GLsizei) w,
+									(GLsizei) h,
+									0,
+									(GLsizei) plane,
+									level_data) );
+
+				if (alpha_tex_handles[layer]) {
+					bind_alpha(layer);
+
+					GLK_H( glCompressedTexImage2D(GL_TEXTURE_2D,
+										(GLint) level,
+										layer_gl_format(layer),
+										(GLsizei) w,
+										(GLsizei) h,
+										0,
+										(GLsizei) plane,
+										level_data + plane) );
+				}
+
+				level_data += atlas_layer_bytes(format, w, h);
+			}
+
+			release();
+
+			std::vector<uint8_t>& copy = layer_blocks[layer];
+
+			if (!layer_updatable(layer) && data != copy.data())
+				copy.assign(data, data + atlas_layer_chain_bytes(format,
+					widths[layer], heights[layer], levels));
+		}
+
+		void set_layer(uint16_t image, uint8_t layer)
+		{
+			if (layers.size() != num_images)
+				layers.resize(num_images, 0xFF);
+
+			layers[check_index(image)] = layer;
+		}
+
+		void bind(uint8_t layer) const
+		{
+            GLK_H( glBindTexture(GL_TEXTURE_2D, layer_tex_handles[layer]) );
+		}
+
+		void bind_to_active_slot(uint8_t layer, GLenum offset) const
+		{
+            GLK_H( glActiveTexture(GL_TEXTURE0 + offset) );
+			bind(layer);
+		}
+
+		// An atlas_layer_etc1_alpha layer's alpha lives in a second
+		// texture, as grey: shaders take its red channel as the alpha
+		// of the texel from bind(layer). Binds 0 for any other layer.
+		void bind_alpha(uint8_t layer) const
+		{
+            GLK_H( glBindTexture(GL_TEXTURE_2D, alpha_tex_handles[layer]) );
+		}
+
+		void bind_alpha_to_active_slot(uint8_t layer, GLenum offset) const
+		{
+            GLK_H( glActiveTexture(GL_TEXTURE0 + offset) );
+			bind_alpha(layer);
+		}
+
+		void release(void) const
+		{
+            GLK_H( glBindTexture(GL_TEXTURE_2D, 0) );
+		}
+
+		void release_from_active_slot(GLenum offset) const
+		{
+            GLK_H( glActiveTexture(GL_TEXTURE0 + offset) );
+			release();
+		}
+
+		void write_origins(uint16_t image, uint16_t x, uint16_t y)
+		{
+			image = check_index(image);
+
+			if (coords_x.size() != num_images)
+				coords_x.resize(num_images, 0);
+
+			coords_x[image] = x;
+
+			if (coords_y.size() != num_images)
+				coords_y.resize(num_images, 0);
+
+			coords_y[image] = y;
+		}
+
+		// Scales a slot's pixels down to width x height where they are,
+		// giving the rest of its allocation back. Only the pixels: see
+		// rescale_image.
+		void downscale_slot_pixels(uint16_t slot, uint16_t width, uint16_t height,
+			downscale_filter_t filter)
+		{
+			pixel_span_t& span = pixel_spans[slot];
+			uint8_t* data = pixels.data(span);
+
+			downscale_rgba(data, dims_x[slot], dims_y[slot], span.stride,
+				data, width, height, (size_t) width * GLK_ATLAS_DESIRED_BPP, filter);
+
+			pixels.shrink(span, (uint32_t) width * height * GLK_ATLAS_DESIRED_BPP);
+			span.stride = (uint32_t) width * GLK_ATLAS_DESIRED_BPP;
+		}
+
+		// Gives image the size width x height, scaling its trim offset and
+		// source size along with it so they stay in its own texels
+		void rescale_image(uint16_t image, uint16_t width, uint16_t height)
+		{
+			uint32_t old_width = dims_x[image];
+			uint32_t old_height = dims_y[image];
+
+			if (slots[image] == image)
+				area_accum += (uint32_t) width * height - old_width * old_height;
+
+			trim_x[image] = (uint16_t) ((uint32_t) trim_x[image] * width / old_width);
+			trim_y[image] = (uint16_t) ((uint32_t) trim_y[image] * height / old_height);
+
+			source_x[image] = (uint16_t) glm::max((uint32_t) source_x[image] * width / old_width, 1u);
+			source_y[image] = (uint16_t) glm::max((uint32_t) source_y[image] * height / old_height, 1u);
+
+			dims_x[image] = width;
+			dims_y[image] = height;
+		}
+
+		// Scales image, and every duplicate of it, down to width x height
+		// (no larger than it is now) with filter. Its pixels have to be in
+		// memory. Takes effect the next time the atlas is laid out.
+		void downscale_image(uint16_t image, uint16_t width, uint16_t height,
+			downscale_filter_t filter = downscale_box)
+		{
+			uint16_t slot = slots[check_index(image)];
+
+			assert(width <= dims_x[slot] && height <= dims_y[slot]);
+
+			if (!pixels_resident(slot) || (width == dims_x[slot] && height == dims_y[slot]))
+				return;
+
+			downscale_slot_pixels(slot, width, height, filter);
+
+			for (uint16_t i = 0; i < num_images; ++i) {
+				if (slots[i] == slot && i != slot)
+					rescale_image(i, width, height);
+			}
+
+			rescale_image(slot, width, height);
+		}
+
+		// Downscales images until the live slots fit in downscale_budget
+		// (see set_downscale_budget). Returns false if they'd have to
+		// shrink but their pixels aren't there to shrink anymore.
+		bool fit_downscale_budget(void)
+		{
+			struct target_t {
+				uint64_t bytes;
+				uint16_t slot;
+				uint16_t factor;
+
+				bool operator < (const target_t& t) const { return bytes < t.bytes; }
+			};
+
+			if (!downscale_budget)
+				return true;
+
+			std::priority_queue<target_t> largest;
+			uint64_t total = 0;
+
+			for (uint16_t image = 0; image < num_images; ++image) {
+				if (!slot_live(image))
+					continue;
+
+				uint64_t bytes = (uint64_t) dims_x[image] * dims_y[image] * GLK_ATLAS_DESIRED_BPP;
+
+				largest.push(target_t { bytes, image, 1 });
+				total += bytes;
+			}
+
+			if (total <= downscale_budget)
+				return true;
+
+			if (!restore_pixels())
+				return false;
+
+			std::vector<target_t> scaled;
+
+			while (total > downscale_budget && !largest.empty()) {
+				target_t t = largest.top();
+				largest.pop();
+
+				// Factors past 2^15 leave every image at 1 x 1 anyway
+				if (t.bytes <= GLK_ATLAS_DESIRED_BPP || t.factor >= 0x8000) {
+					if (t.factor > 1)
+						scaled.push_back(t);
+
+					continue;
+				}
+
+				t.factor *= 2;
+
+				uint64_t bytes = (uint64_t) downscale_extent(dims_x[t.slot], t.factor)
+					* downscale_extent(dims_y[t.slot], t.factor) * GLK_ATLAS_DESIRED_BPP;
+
+				total -= t.bytes - bytes;
+				t.bytes = bytes;
+
+				largest.push(t);
+			}
+
+			for (; !largest.empty(); largest.pop()) {
+				if (largest.top().factor > 1)
+					scaled.push_back(largest.top());
+			}
+
+			std::vector<uint16_t> new_x(num_images), new_y(num_images);
+
+			for (const target_t& t: scaled) {
+				new_x[t.slot] = (uint16_t) downscale_extent(dims_x[t.slot], t.factor);
+				new_y[t.slot] = (uint16_t) downscale_extent(dims_y[t.slot], t.factor);
+			}
+
+			// Slots' pixels never overlap, so they're scaled on every core
+			parallel_rows(scaled.size(), 0, [&](size_t first, size_t end) {
+				for (size_t i = first; i < end; ++i) {
+					uint16_t slot = scaled[i].slot;
+					uint8_t* data = image_pixels(slot);
+
+					downscale_rgba(data, dims_x[slot], dims_y[slot], pixel_spans[slot].stride,
+						data, new_x[slot], new_y[slot],
+						(size_t) new_x[slot] * GLK_ATLAS_DESIRED_BPP, downscale_filter);
+				}
+			});
+
+			for (const target_t& t: scaled) {
+				pixel_span_t& span = pixel_spans[t.slot];
+
+				pixels.shrink(span, (uint32_t) new_x[t.slot] * new_y[t.slot] * GLK_ATLAS_DESIRED_BPP);
+				span.stride = (uint32_t) new_x[t.slot] * GLK_ATLAS_DESIRED_BPP;
+			}
+
+			for (uint16_t image = 0; image < num_images; ++image) {
+				uint16_t slot = slots[image];
+
+				if (new_x[slot])
+					rescale_image(image, new_x[slot], new_y[slot]);
+			}
+
+			glk_logf("Downscale Budget: %lu images downscaled to fit %llu bytes",
+				scaled.size(), (unsigned long long) downscale_budget);
+
+			compact_pixels();
+
+			return true;
+		}
+
+        void fill(size_t image, GLsizei offset_x, GLsizei offset_y, GLsizei dx, GLsizei dy) const
+        {
+            GLsizei dest_x = (GLsizei) origin_x(image) + offset_x;
+            GLsizei dest_y = (GLsizei) origin_y(image) + offset_y;
+
+            // NOTE: there is a problem due to how the array is being traversed.
+            // E.g., the buffer's stride isn't actually given, so the only "width"
+            // it can actually go off of is what's provided by dx. This is why starting
+            // after the image will still produce image texels on further iterations.
+
+            const pixel_span_t& span = pixel_spans[image];
+
+            // Whole rows of an unrotated image are already laid out
+            // the way GL wants them
+            if (!image_rotated(image) && offset_x == 0
+                && (uint32_t) dx * GLK_ATLAS_DESIRED_BPP == span.stride) {
+                GLK_H( glTexSubImage2D(GL_TEXTURE_2D,
+                                       0,
+                                       dest_x,
+                                       dest_y,
+                                       dx,
+                                       dy,
+                                       GLK_ATLAS_TEX_FORMAT,
+                                       GL_UNSIGNED_BYTE,
+                                       pixels.data(span) + offset_y * span.stride) );
+                return;
+            }
+
+            // Best bet is to instead copy.
+            std::vector<uint8_t> copy(dx * dy * GLK_ATLAS_DESIRED_BPP, 0);
+            const uint8_t* source = pixels.data(span);
+
+            for (GLsizei iy = 0; iy < dy; ++iy) {
+                for (GLsizei ix = 0; ix < dx; ++ix) {
+                    uint8_t* p_dest_copy = &copy[(iy * dx + ix) * GLK_ATLAS_DESIRED_BPP];
+                    size_t source_x = ix + offset_x;
+                    size_t source_y = iy + offset_y;
+
+                    // Layer texel (u, v) of a rotated image holds (v, h - 1 - u)
+                    if (image_rotated(image)) {
+                        source_x = iy + offset_y;
+                        source_y = dims_y[image] - 1 - (ix + offset_x);
+                    }
+
+                    const uint8_t* p_source = &source[source_y * span.stride + source_x * GLK_ATLAS_DESIRED_BPP];
+
+                    memcpy(&p_dest_copy[0], &p_source[0], sizeof(*p_dest_copy) * GLK_ATLAS_DESIRED_BPP);
+                }
+            }
+
+            GLK_H( glTexSubImage2D(GL_TEXTURE_2D,
+                                   0,
+                                   dest_x,
+                                   dest_y,
+                                   dx,
+                                   dy,
+                                   GLK_ATLAS_TEX_FORMAT,
+                                   GL_UNSIGNED_BYTE,
+                                   &copy[0]) );
+        }
+
+		// Writes image's reserved_rect, as its layer shows it, to out
+		// (stride bytes per row): rotated if it was packed that way, with
+		// its edge texels repeated out through the gutter and any block
+		// padding, so neither bleeds into the image's edges at any level.
+		void compose_image(uint16_t image, uint8_t* out, size_t stride) const
+		{
+			const pixel_span_t& span = pixel_spans[image];
+			const uint8_t* source = pixels.data(span);
+
+			atlas_rect_t packed = packed_rect(image);
+			atlas_rect_t reserved = reserved_rect(image);
+
+			const size_t bpp = GLK_ATLAS_DESIRED_BPP;
+
+			int32_t left = packed.x - reserved.x;
+			int32_t top = packed.y - reserved.y;
+
+			for (int32_t y = 0; y < packed.h; ++y) {
+				uint8_t* row = out + (top + y) * stride;
+				uint8_t* texels = row + left * bpp;
+
+				if (!image_rotated(image)) {
+					memcpy(texels, source + y * span.stride, packed.w * bpp);
+				} else {
+					// Layer texel (u, v) holds (v, h - 1 - u), as in fill()
+					for (int32_t x = 0; x < packed.w; ++x) {
+						memcpy(texels + x * bpp, source + (dims_y[image] - 1 - x)
+							* span.stride + y * bpp, bpp);
+					}
+				}
+
+				for (int32_t x = 0; x < left; ++x)
+					memcpy(row + x * bpp, texels, bpp);
+
+				for (int32_t x = left + packed.w; x < reserved.w; ++x)
+					memcpy(row + x * bpp, texels + (packed.w - 1) * bpp, bpp);
+			}
+
+			for (int32_t y = 0; y < top; ++y)
+				memcpy(out + y * stride, out + top * stride, reserved.w * bpp);
+
+			for (int32_t y = top + packed.h; y < reserved.h; ++y)
+				memcpy(out + y * stride, out + (top + packed.h - 1) * stride, reserved.w * bpp);
+		}
+
+		// Composes image's reserved_rect, reduces it through the levels
+		// it keeps to itself (see set_mipmap_levels) and uploads each of
+		// them, encoded if the layer's compressed. Reserved rects start
+		// and end on a texel, or a block, of every one of those levels,
+		// so nothing of a neighbouring image is touched. Layers which
+		// can't be updated in place (ETC1 on ES2) get the blocks patched
+		// into their copy and are uploaded whole. Levels past those stay as they
+		// were until the atlas is laid out again.
+		void fill_levels(uint16_t image)
+		{
+			uint8_t layer = layers[image];
+			atlas_layer_format_t format = layer_format(layer);
+
+			atlas_rect_t r = reserved_rect(image);
+			size_t levels = glm::min(layer_levels(layer), (size_t) mip_levels);
+
+			std::vector<uint8_t> texels(mip_chain_bytes(r.w, r.h, levels));
+
+			compose_image(image, texels.data(), (size_t) r.w * GLK_ATLAS_DESIRED_BPP);
+			mip_build_chain(texels.data(), r.w, r.h, levels, 1);
+
+			std::vector<uint8_t> blocks;
+			const uint8_t* data = texels.data();
+
+			if (format != atlas_layer_rgba8) {
+				blocks.resize(atlas_layer_chain_bytes(format, r.w, r.h, levels));
+				atlas_encode_levels(format, texels.data(), r.w, r.h, levels, blocks.data(), 1);
+				data = blocks.data();
+			}
+
+			if (!layer_updatable(layer)) {
+				patch_layer_blocks(layer, r, levels, data);
+				return;
+			}
+
+			for (size_t level = 0; level < levels; ++level) {
+				GLint x = (GLint) (r.x >> level);
+				GLint y = (GLint) (r.y >> level);
+				GLsizei w = (GLsizei) (r.w >> level);
+				GLsizei h = (GLsizei) (r.h >> level);
+
+				if (format == atlas_layer_rgba8) {
+					GLK_H( glTexSubImage2D(GL_TEXTURE_2D,
+										   (GLint) level,
+										   x,
+										   y,
+										   w,
+										   h,
+										   GLK_ATLAS_TEX_FORMAT,
+										   GL_UNSIGNED_BYTE,
+										   data) );
+				} else {
+					GLsizei plane = (GLsizei) atlas_layer_plane_bytes(format, w, h);
+
+					GLK_H( glCompressedTexSubImage2D(GL_TEXTURE_2D,
+										(GLint) level,
+										x,
+										y,
+										w,
+										h,
+										layer_gl_format(layer),
+										plane,
+										data) );
+
+					if (alpha_tex_handles[layer]) {
+						bind_alpha(layer);
+
+						GLK_H( glCompressedTexSubImage2D(GL_TEXTURE_2D,
+											(GLint) level,
+											x,
+											y,
+											w,
+											h,
+											layer_gl_format(layer),
+											plane,
+											data + plane) );
+
+						bind(layer);
+					}
+				}
+
+				data += atlas_layer_bytes(format, w, h);
+			}
+		}
+
+		// Copies the blocks of r's first levels levels (as fill_levels
+		// encodes them) into layer's copy, and uploads that.
+		void patch_layer_blocks(uint8_t layer, const atlas_rect_t& r, size_t levels,
+			const uint8_t* blocks)
+		{
+			atlas_layer_format_t format = layer_format(layer);
+			std::vector<uint8_t>& dest = layer_blocks[layer];
+
+			size_t block_bytes = atlas_layer_plane_bytes(format, 4, 4);
+
+			for (size_t level = 0; level < levels; ++level) {
+				size_t layer_w = mip_extent(widths[layer], level);
+				size_t layer_h = mip_extent(heights[layer], level);
+				size_t x = (size_t) r.x >> level, y = (size_t) r.y >> level;
+				size_t w = (size_t) r.w >> level, h = (size_t) r.h >> level;
+
+				uint8_t* level_dest = &dest[atlas_layer_chain_bytes(format,
+					widths[layer], heights[layer], level)];
+
+				size_t layer_row = (layer_w + 3) / 4 * block_bytes;
+				size_t image_row = w / 4 * block_bytes;
+
+				uint64_t layer_plane = atlas_layer_plane_bytes(format, layer_w, layer_h);
+				uint64_t image_plane = atlas_layer_plane_bytes(format, w, h);
+				uint64_t image_bytes = atlas_layer_bytes(format, w, h);
+
+				// Each plane (color, then alpha) is its own grid of blocks
+				for (uint64_t p = 0; p * image_plane < image_bytes; ++p) {
+					for (size_t by = 0; by < h / 4; ++by) {
+						memcpy(&level_dest[p * layer_plane + (y / 4 + by) * layer_row
+							+ x / 4 * block_bytes],
+							&blocks[p * image_plane + by * image_row], image_row);
+					}
+				}
+
+				blocks += image_bytes;
+			}
+
+			upload_layer_levels(layer, dest.data());
+		}
+
+		void fill_atlas_image(size_t image)
+		{
+			if (layer_format(layers[image]) != atlas_layer_rgba8 || mip_levels > 1) {
+				fill_levels((uint16_t) image);
+				return;
+			}
+
+            atlas_rect_t packed = packed_rect(image);
+
+            fill(image, 0, 0, (GLsizei) packed.w, (GLsizei) packed.h);
+		}
+
+		// Returns image's rectangle to its layer's free space and frees its
+		// pixels. The index stays reserved so no other index changes;
+		// the space itself is only reclaimed for good by compaction.
+		// Pixels shared with duplicates are kept until the last of them
+		// is removed too.
+		void remove_image(uint16_t image)
+		{
+			if (image >= num_images || image_removed(image))
+				return;
+
+			if (removed.size() != num_images)
+				removed.resize(num_images, 0);
+
+			removed[image] = 1;
+
+			uint16_t slot = slots[image];
+
+			if (slot != image) {
+				num_duplicates--;
+				duplicate_bytes -= (uint64_t) dims_x[image] * dims_y[image] * GLK_ATLAS_DESIRED_BPP;
+
+				if (image < layers.size()) {
+					layers[image] = 0xFF;
+					refresh_record(image);
+				}
+			}
+
+			// Duplicates still show the pixels, so the slot keeps its place;
+			// only its own record goes empty
+			if (--slot_refs[slot] > 0) {
+				refresh_record(image);
+				return;
+			}
+
+			if (content_map.find(content_hashes[slot]) == slot)
+				content_map.erase(content_hashes[slot]);
+
+			area_accum -= (uint32_t) dims_x[slot] * dims_y[slot];
+
+			pixels.release(pixel_spans[slot]);
+
+			if (slot < spill_offsets.size())
+				spill_offsets[slot] = not_spilled;
+
+			if (slot < layers.size() && layers[slot] != 0xFF) {
+				if (layer_bins.size() == num_layers())
+					layer_bins[layers[slot]].release(reserved_rect(slot));
+
+				layers[slot] = 0xFF;
+				refresh_record(slot);
+			}
+		}
+
+		// Rebuilds layer_bins from the layers and placed images.
+		void build_free_space(void)
+		{
+			layer_bins.assign(num_layers(), maxrects_bin_t());
+
+			for (size_t i = 0; i < layer_bins.size(); ++i)
+				layer_bins[i].reset(widths[i], heights[i]);
+
+			for (uint16_t image = 0; image < layers.size(); ++image) {
+				if (layers[image] == 0xFF || !slot_live(image))
+					continue;
+
+				layer_bins[layers[image]].place(reserved_rect(image));
+			}
+		}
+
+		// The image mapped to key. Throws std::out_of_range for a key
+		// which was never mapped, as the std::map lookup did.
+		uint16_t key_image(size_t key) const
+		{
+			uint16_t image = key_map.find(key);
+
+			if (image == image_map_t::npos)
+				throw std::out_of_range("atlas_t::key_image: key isn't mapped");
+
+			return image;
+		}
+
+		void map_key_to_image(size_t key, uint16_t image)
+		{
+			key_map.insert(key, image);
+		}
+
+		// Indexes filenames by their hash64, so image_named doesn't have
+		// to search them. make_atlas_from_dir and load_atlas_cache call
+		// this; anything else that fills in filenames should too.
+		void build_filename_map(void)
+		{
+			filename_map.clear();
+			filename_map.reserve(filenames.size());
+
+			filenames_mapped = filenames.size();
+
+			for (size_t i = 0; i < filenames.size(); ++i) {
+				uint64_t hash = hash64(filenames[i].data(), filenames[i].size());
+
+				// The first of any repeated name wins, as a search would
+				if (filename_map.find(hash) == image_map_t::npos)
+					filename_map.insert(hash, (uint16_t) i);
+			}
+		}
+
+		// The image loaded from the file name, or no_image_index. Falls
+		// back to a search if filenames changed since build_filename_map.
+		uint16_t image_named(const std::string& name) const
+		{
+			if (filenames_mapped != filenames.size()) {
+				for (size_t i = 0; i < filenames.size(); ++i)
+					if (filenames[i] == name)
+						return (uint16_t) i;
+
+				return no_image_index;
+			}
+
+			uint16_t image = filename_map.find(hash64(name.data(), name.size()));
+
+			// The hash only narrows it down to one candidate
+			if (image == image_map_t::npos || filenames[image] != name)
+				return no_image_index;
+
+			return image;
+		}
+
+		// For atlases which won't change anymore: swaps the key and
+		// filename maps for minimal perfect hashes (see image_map_t),
+		// half the size and a single probe. Mapping another key
+		// afterward just thaws the key map again.
+		void freeze_lookups(void)
+		{
+			key_map.freeze();
+			filename_map.freeze();
+		}
+
+		static void delete_textures(const std::vector<GLuint>& handles)
+		{
+			GLint curr_bound_tex;
+            GLK_H( glGetIntegerv(GL_TEXTURE_BINDING_2D, &curr_bound_tex) );
+
+			// We unbind if any of this atlas's textures are bound
+			// because a glDelete call on a bound item can't be fulfilled
+			// until that item is unbound
+
+			bool bound = false;
+			for (GLuint handle = 0; handle < handles.size()
+				&& !bound && curr_bound_tex; ++handle) {
+				bound = (GLuint)curr_bound_tex == handles[handle];
+			}
+
+			if (bound) {
+                GLK_H( glBindTexture(GL_TEXTURE_2D, 0) );
+			}
+
+			if (!handles.empty())
+			{
+				GLK_H( glDeleteTextures(handles.size(),
+					&handles[0]) );
+			}
+		}
+
+		void free_memory(void)
+		{
+			compaction.reset();
+
+			delete_textures(layer_tex_handles);
+			delete_textures(alpha_tex_handles);
+
+			num_images = 0;
+			area_accum = 0;
+			default_image = no_image_index;
+
+			widths.clear();
+			heights.clear();
+			dims_x.clear();
+			dims_y.clear();
+			coords_x.clear();
+			coords_y.clear();
+			trim_x.clear();
+			trim_y.clear();
+			source_x.clear();
+			source_y.clear();
+			pixels.reset();
+			pixel_spans.clear();
+
+			pixels_dropped = false;
+			spill_file.reset();
+			spill_bytes = 0;
+			spill_offsets.clear();
+			spill_spans.clear();
+			filenames.clear();
+			filename_map.clear();
+			filenames_mapped = 0;
+
+			layers.clear();
+			layer_tex_handles.clear();
+			alpha_tex_handles.clear();
+			layer_bins.clear();
+			removed.clear();
+			rotated.clear();
+			record_storage.clear();
+			records = nullptr;
+			num_records = 0;
+			opaque.clear();
+			layer_formats.clear();
+			layer_blocks.clear();
+			captured_layers.clear();
+
+			slots.clear();
+			slot_refs.clear();
+			content_hashes.clear();
+			content_map.clear();
+			num_duplicates = 0;
+			duplicate_bytes = 0;
+		}
+
+		~atlas_t(void)
+		{
+			free_memory();
+		}
+
+		atlas_t(void)
+            : 	is_downscaled(false),
+				downscale_budget(0),
+				downscale_filter(downscale_box),
+				pack_params {
+					atlas_packer_bsp,
+					false,
+					atlas_root_size_sqrt_area,
+					GLK_ATLAS_DEFAULT_LAYER_ALIGN,
+					false,
+					GLK_ATLAS_DEFAULT_COMPRESSION == atlas_compression_none ? 1 : 4,
+					0
+				},
+                default_image(no_image_index),
+				num_images(0),
+				area_accum(0),
+				trim(false),
+				filenames_mapped(0),
+				records(nullptr),
+				num_records(0),
+				compression(GLK_ATLAS_DEFAULT_COMPRESSION),
+				mip_levels(1),
+				etc1_as_etc2(false),
+				capture_layers(false),
+				dedupe(true),
+				num_duplicates(0),
+				duplicate_bytes(0),
+				compaction(nullptr, destroy_atlas_compaction),
+				residency(atlas_residency_keep),
+				pixels_dropped(false),
+				spill_file(nullptr, fclose),
+				spill_bytes(0)
+		{}
+	};
+
+	GLK_FUNC int32_t max_layer_dims(void)
+	{
+		GLint max_dims;
+		GLK_H( glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_dims) );
+
+		return (int32_t) max_dims;
+	}
+
+	// For atlas_root_size_sqrt_area the root of every layer is a square
+	// sized from the total image area, capped by the largest texture
+	// the implementation supports.
+	GLK_FUNC glm::ivec2 layer_root_dims(const atlas_pack_source_t& source, int32_t max_dims)
+	{
+		uint32_t root_area_accumf =
+			next_power2((uint32_t) glm::sqrt((float) source.area_accum));
+
+		if ((uint32_t) max_dims > root_area_accumf)
+			max_dims = (int32_t) root_area_accumf;
+
+		return glm::ivec2(max_dims, max_dims);
+	}
+
+	// Candidate roots for atlas_root_size_search, smallest area first
+	// (squarer first among equal areas). Sizes which can't hold the
+	// largest image, or the total image area, are left out.
+	GLK_FUNC std::vector<glm::ivec2> layer_root_search_dims(const atlas_pack_source_t& source,
+		const std::vector<uint16_t>& images, int32_t max_dims)
+	{
+		uint64_t area = 0;
+		int32_t min_x = 1, min_y = 1;
+
+		for (uint16_t image: images) {
+			area += (uint64_t) source.width(image) * source.height(image);
+			min_x = glm::max(min_x, (int32_t) source.width(image));
+			min_y = glm::max(min_y, (int32_t) source.height(image));
+		}
+
+		std::vector<glm::ivec2> roots;
+
+		for (int32_t w = next_power2(min_x); w <= max_dims; w <<= 1) {
+			for (int32_t h = next_power2(min_y); h <= max_dims; h <<= 1) {
+				if ((uint64_t) w * h >= area)
+					roots.push_back(glm::ivec2(w, h));
+			}
+		}
+
+		std::sort(roots.begin(), roots.end(), [](const glm::ivec2& a,
+			const glm::ivec2& b) -> bool {
+			uint64_t area_a = (uint64_t) a.x * a.y;
+			uint64_t area_b = (uint64_t) b.x * b.y;
+
+			if (area_a != area_b)
+				return area_a < area_b;
+
+			return glm::abs(a.x - a.y) < glm::abs(b.x - b.y);
+		});
+
+		return roots;
+	}
+
+	// Orderings gen_layer can race against each other; every one
+	// is descending, with ties broken on the other dimension
+	// and finally on the image index so each ordering is deterministic.
+	enum layer_sort_t {
+		layer_sort_width = 0, // widest first, then tallest
+		layer_sort_height,
+		layer_sort_area,
+		layer_sort_max_side,
+		layer_sort_perimeter,
+		layer_sort_count
+	};
+
+	GLK_FUNC std::vector<uint16_t> sort_layer_images(const atlas_pack_source_t& source,
+		std::vector<uint16_t> sorted, layer_sort_t order)
+	{
+		auto key = [&source, order](uint16_t image) -> uint32_t {
+			uint32_t w = source.width(image);
+			uint32_t h = source.height(image);
+
+			switch (order) {
+			case layer_sort_height: return h;
+			case layer_sort_area: return w * h;
+			case layer_sort_max_side: return glm::max(w, h);
+			case layer_sort_perimeter: return w + h;
+			default: return w;
+			}
+		};
+
+		auto tie = [&source, order](uint16_t image) -> uint32_t {
+			return order == layer_sort_width
+				? source.height(image) : source.width(image);
+		};
+
+		std::sort(sorted.begin(), sorted.end(), [&key, &tie](uint16_t a,
+			uint16_t b) -> bool {
+			uint32_t ka = key(a), kb = key(b);
+
+			if (ka != kb)
+				return ka > kb;
+
+			uint32_t ta = tie(a), tb = tie(b);
+
+			if (ta != tb)
+				return ta > tb;
+
+			return a < b;
+		});
+
+		return sorted;
+	}
+
+	struct layer_placement_t {
+		uint16_t image;
+		uint16_t x, y;
+		bool rotated;
+	};
+
+	// Only left child's are capable of storing image indices,
+	// from the perspective of the child's parent.
+
+	// The "lines" (expressed implicitly) will only have
+	// positive normals that face either to the right, or upward.
+	struct bsp_node_t {
+		static const uint32_t no_node = 0xFFFFFFFF;
+
+		bool region;
+		int32_t image;
+
+		glm::ivec2 origin;
+		glm::ivec2 dims;
+
+		uint32_t left_child;
+		uint32_t right_child;
+
+		bsp_node_t(void)
+		:   region(false),
+			image(-1),
+			origin(0, 0), dims(0, 0),
+			left_child(no_node), right_child(no_node)
+		{}
+	};
+
+	// Nodes are addressed by index into one contiguous array which
+	// is cleared at the start of every layer; keeping it alive across
+	// layers means its storage is only ever allocated once.
+	using bsp_node_arena_t = std::vector<bsp_node_t>;
+
+	// Scratch state for packing one candidate layer. Generators write
+	// their placements here rather than into the atlas, so several
+	// candidates can be packed concurrently and only the winner
+	// gets committed.
+	struct layer_candidate_t {
+		bsp_node_arena_t bsp_nodes;
+		maxrects_bin_t bin;
+
+		std::vector<layer_placement_t> placed;
+
+		glm::ivec3 dims; // used extent and image count
+		uint64_t area; // image area placed
+
+		void reset(void)
+		{
+			placed.clear();
+			dims = glm::ivec3(0, 0, 0);
+			area = 0;
+		}
+
+		// w and h are as placed, i.e. already swapped if rotated
+		void add(uint16_t image, int32_t x, int32_t y, int32_t w, int32_t h,
+			bool rotated = false)
+		{
+			placed.push_back(layer_placement_t { image, (uint16_t) x, (uint16_t) y,
+				rotated });
+
+			dims.x = glm::max(dims.x, x + w);
+			dims.y = glm::max(dims.y, y + h);
+			dims.z += 1;
+
+			area += (uint64_t) w * h;
+		}
+
+		// The winner fits the most image area; ties go to
+		// the smaller layer once it's rounded up for allocation.
+		bool better_than(const layer_candidate_t& other, uint16_t align) const
+		{
+			if (area != other.area)
+				return area > other.area;
+
+			return footprint(align) < other.footprint(align);
+		}
+
+		uint64_t footprint(uint16_t align) const
+		{
+			return (uint64_t) layer_extent((uint32_t) dims.x, align)
+				* layer_extent((uint32_t) dims.y, align);
+		}
+	};
+
+	//------------------
+	// gen_layer_bsp
+	//
+	// generates a layer (think of "layer" in this sense as just a texture
+	// representing a portion for a set of a group of images ).
+	// The core algorithm is based on 2D BSP generation.
+	//
+	// it assesses whether or not sorted images for this layer
+	// actually save space and how large this layer actually needs to be.
+	//
+	// the set of images a layer has will be more efficiently placed if the
+	// variation of the image sizes is high; if a layer consists
+	// of images which are of the same dimensions, then there will be a lot of unused
+	// space.
+	//
+	// idea behind BSP algol is from here:
+	// http://gamedev.stackexchange.com/a/34193
+	//------------------
+
+	class gen_layer_bsp
+	{
+		const atlas_pack_source_t& source;
+
+		layer_candidate_t& layer;
+		bsp_node_arena_t& nodes;
+
+		static const uint32_t root = 0;
+
+		uint32_t alloc_node(void)
+		{
+			nodes.push_back(bsp_node_t());
+			return (uint32_t)(nodes.size() - 1);
+		}
+
+		// The first free leaf image_dims fits in, left subtrees first, or
+		// no_node. Every insertion walks the whole tree this way, so the
+		// walk only reads, through a pointer taken once per insertion
+		// rather than through the arena on every visit.
+		static uint32_t find_node(const bsp_node_t* base, uint32_t node,
+			glm::ivec2 image_dims)
+		{
+			const bsp_node_t& n = base[node];
+
+			if (n.region) {
+				uint32_t found = find_node(base, n.left_child, image_dims);
+
+				if (found != bsp_node_t::no_node)
+					return found;
+
+				return find_node(base, n.right_child, image_dims);
+			}
+
+			if (n.image >= 0 || n.dims.x < image_dims.x || n.dims.y < image_dims.y)
+				return bsp_node_t::no_node;
+
+			return node;
+		}
+
+		// Splits node until its left-most leaf is exactly image_dims
+		// and places the image there.
+		void place(uint32_t node, uint16_t image, glm::ivec2 image_dims,
+			bool rotated)
+		{
+			while (nodes[node].dims != image_dims) {
+				const bsp_node_t& n = nodes[node];
+
+				uint16_t dx = n.dims.x - image_dims.x;
+				uint16_t dy = n.dims.y - image_dims.y;
+
+				bsp_node_t left, right;
+
+				// Is the partition line vertical?
+				if (dx > dy) {
+					left.dims.x = image_dims.x;
+					left.dims.y = n.dims.y;
+					left.origin = n.origin;
+
+					right.dims.x = dx;
+					right.dims.y = n.dims.y;
+					right.origin = n.origin;
+
+					right.origin.x += image_dims.x;
+
+				// Nope, it's horizontal
+				} else {
+					left.dims.x = n.dims.x;
+					left.dims.y = image_dims.y;
+					left.origin = n.origin;
+
+					right.dims.x = n.dims.x;
+					right.dims.y = dy;
+					right.origin = n.origin;
+
+					right.origin.y += image_dims.y;
+				}
+
+				// n isn't referenced past this point: pushing
+				// the children may move the arena's storage.
+				uint32_t left_child = alloc_node();
+				uint32_t right_child = alloc_node();
+
+				nodes[left_child] = left;
+				nodes[right_child] = right;
+
+				nodes[node].region = true;
+				nodes[node].left_child = left_child;
+				nodes[node].right_child = right_child;
+
+				// The left child shares one of the image's dimensions
+				// and is no smaller in the other, so at most one more
+				// split makes it an exact fit.
+				node = left_child;
+			}
+
+			bsp_node_t& n = nodes[node];
+			n.image = image;
+
+			layer.add(image, n.origin.x, n.origin.y,
+				image_dims.x, image_dims.y, rotated);
+
+			assert(layer.dims.x <= nodes[root].dims.x);
+			assert(layer.dims.y <= nodes[root].dims.y);
+		}
+
+		bool insert_node(uint16_t image, glm::ivec2 image_dims, bool rotated)
+		{
+			uint32_t node = find_node(nodes.data(), root, image_dims);
+
+			if (node == bsp_node_t::no_node)
+				return false;
+
+			place(node, image, image_dims, rotated);
+
+			return true;
+		}
+
+		// The image's own orientation gets the whole tree to itself
+		// before the rotated one is tried.
+		bool insert(uint16_t image)
+		{
+			glm::ivec2 image_dims(source.width(image), source.height(image));
+
+			if (insert_node(image, image_dims, false))
+				return true;
+
+			if (!source.params.allow_rotation || image_dims.x == image_dims.y)
+				return false;
+
+			return insert_node(image,
+				glm::ivec2(image_dims.y, image_dims.x), true);
+		}
+
+	public:
+
+		const glm::ivec3& dims(void) const
+		{
+			return layer.dims;
+		}
+
+		// sorted is the order images are inserted in; images which
+		// don't fit are skipped and left out of layer.placed.
+		gen_layer_bsp(const atlas_pack_source_t& source_, const std::vector<uint16_t>& sorted,
+			glm::ivec2 root_dims, layer_candidate_t& layer_)
+			:   source(source_),
+				layer(layer_),
+				nodes(layer_.bsp_nodes)
+		{
+			layer.reset();
+
+			// Each insertion splits at most twice, so this
+			// bounds the arena for the whole layer.
+			nodes.clear();
+			nodes.reserve(sorted.size() * 4 + 1);
+
+			alloc_node();
+
+			// Setup some upper bounds for the width/height values
+			nodes[root].dims = root_dims;
+
+			for (uint16_t image: sorted)
+				insert(image);
+		}
+	};
 
-            // NOTE: there is a problem due to how the array is being traversed.
-            // E.g., the buffer's stride isn't actually given, so the only "width"
-            // it can actually go off of is what's provided by dx. This is why starting
-            // after the image will still produce image texels on further iterations.
+	//------------------
+	// gen_layer_maxrects
+	//
+	// same contract as gen_layer_bsp, but places each image
+	// in the free rectangle of a maxrects_bin_t chosen by heuristic.
+	// Images of identical size tile their free space instead of
+	// leaving one unusable sliver per partition.
+	//------------------
 
-            // Best bet is to instead copy.
-            std::vector<uint8_t> copy(dx * dy * GLK_ATLAS_DESIRED_BPP, 0);
+	class gen_layer_maxrects
+	{
+		const atlas_pack_source_t& source;
 
-            for (GLsizei iy = 0; iy < dy; ++iy) {
-                for (GLsizei ix = 0; ix < dx; ++ix) {
-                    uint8_t* p_dest_copy = &copy[(iy * dx + ix) * GLK_ATLAS_DESIRED_BPP];
-                    const uint8_t* p_source = &buffer_table[image][((offset_y + iy) * dims_x[image] + ix + offset_x) * GLK_ATLAS_DESIRED_BPP];
+		layer_candidate_t& layer;
+
+	public:
+
+		const glm::ivec3& dims(void) const
+		{
+			return layer.dims;
+		}
+
+		gen_layer_maxrects(const atlas_pack_source_t& source_, const std::vector<uint16_t>& sorted,
+			glm::ivec2 root_dims, atlas_packer_t heuristic, layer_candidate_t& layer_)
+			:   source(source_),
+				layer(layer_)
+		{
+			maxrects_bin_t& bin = layer.bin;
+
+			layer.reset();
+			bin.reset(root_dims.x, root_dims.y);
+
+			for (uint16_t image: sorted) {
+				int32_t w = source.width(image);
+				int32_t h = source.height(image);
+
+				bool rotated = false;
+
+				int32_t index = bin.find(w, h, heuristic,
+					source.params.allow_rotation ? &rotated : nullptr);
+
+				if (index < 0)
+					continue;
+
+				if (rotated)
+					std::swap(w, h);
+
+				atlas_rect_t used { bin.free_rects[index].x,
+					bin.free_rects[index].y, w, h };
+
+				bin.place(used);
+
+				layer.add(image, used.x, used.y, w, h, rotated);
+			}
+		}
+	};
+
+	GLK_FUNC void pack_layer_candidate(const atlas_pack_source_t& source,
+		const std::vector<uint16_t>& images, glm::ivec2 root_dims,
+		layer_sort_t order, layer_candidate_t& candidate)
+	{
+		std::vector<uint16_t> sorted = sort_layer_images(source, images, order);
+
+		switch (source.params.packer) {
+		case atlas_packer_maxrects_bssf:
+		case atlas_packer_maxrects_baf:
+			gen_layer_maxrects(source, sorted, root_dims, source.params.packer,
+				candidate);
+			break;
+
+		default:
+			gen_layer_bsp(source, sorted, root_dims, candidate);
+			break;
+		}
+	}
+
+	//------------------
+	// layer_race_t
+	//
+	// the candidates each layer is packed into and, with sort racing
+	// enabled, the threads which race them: one candidate per
+	// layer_sort_t, spread over no more threads than there are cores
+	// (the planning thread included). The threads are started once per
+	// plan and handed every layer, and every root size tried for it, in
+	// turn. With one core there's nothing to race on, so no threads are
+	// started and only layer_sort_width is packed.
+	//------------------
+
+	struct layer_race_t {
+		std::vector<layer_candidate_t> candidates;
+
+		std::vector<std::thread> workers;
+
+		std::mutex mutex;
+		std::condition_variable wake; // workers, for a new round or to stop
+		std::condition_variable done; // the planning thread, for a round's end
+
+		// The round being packed; written under mutex before round is bumped
+		const atlas_pack_source_t* source;
+		const std::vector<uint16_t>* images;
+		glm::ivec2 root_dims;
+
+		uint64_t round;
+		size_t busy; // workers yet to finish the round
+		bool stopping;
+
+		std::atomic<size_t> next; // candidate to pack next
+
+		explicit layer_race_t(const atlas_pack_params_t& params)
+			:   source(nullptr),
+				images(nullptr),
+				root_dims(0, 0),
+				round(0),
+				busy(0),
+				stopping(false),
+				next(0)
+		{
+			size_t cores = std::thread::hardware_concurrency();
+
+			candidates.resize(params.sort_race && cores > 1 ? layer_sort_count : 1);
+
+			for (size_t i = 1; i < glm::min(cores, candidates.size()); ++i)
+				workers.emplace_back(&layer_race_t::work, this);
+		}
+
+		~layer_race_t(void)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+
+			wake.notify_all();
+
+			for (std::thread& t: workers)
+				t.join();
+		}
+
+		layer_race_t(const layer_race_t&) = delete;
+		layer_race_t& operator = (const layer_race_t&) = delete;
+
+		// Packs every candidate, on the workers and this thread
+		void pack_round(const atlas_pack_source_t& source_,
+			const std::vector<uint16_t>& images_, glm::ivec2 root_dims_)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				source = &source_;
+				images = &images_;
+				root_dims = root_dims_;
+
+				next = 0;
+				busy = workers.size();
+				round++;
+			}
+
+			wake.notify_all();
+
+			pack_candidates();
+
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this](void) { return busy == 0; });
+		}
+
+		void pack_candidates(void)
+		{
+			for (size_t i = next++; i < candidates.size(); i = next++) {
+				pack_layer_candidate(*source, *images, root_dims,
+					(layer_sort_t) i, candidates[i]);
+			}
+		}
+
+		void work(void)
+		{
+			uint64_t seen = 0;
+
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&](void) { return stopping || round != seen; });
+
+					if (stopping)
+						return;
+
+					seen = round;
+				}
+
+				pack_candidates();
+
+				std::lock_guard<std::mutex> lock(mutex);
+
+				if (--busy == 0)
+					done.notify_one();
+			}
+		}
+	};
+
+	// Packs images into root_dims once per race candidate. Returns the
+	// index of the best.
+	GLK_FUNC size_t race_layer_candidates(const atlas_pack_source_t& source,
+		const std::vector<uint16_t>& images, glm::ivec2 root_dims,
+		layer_race_t& race)
+	{
+		race.pack_round(source, images, root_dims);
+
+		const std::vector<layer_candidate_t>& candidates = race.candidates;
+
+		size_t best = 0;
+
+		for (size_t i = 1; i < candidates.size(); ++i) {
+			if (candidates[i].better_than(candidates[best],
+				source.params.layer_align))
+				best = i;
+		}
+
+		return best;
+	}
+
+	// Packs the next layer out of images without touching the atlas.
+	// Returns the chosen candidate, which stays valid until race is
+	// next used.
+	GLK_FUNC const layer_candidate_t& select_layer(const atlas_pack_source_t& source,
+		const std::vector<uint16_t>& images, atlas_root_size_t root_size,
+		int32_t max_dims, layer_race_t& race)
+	{
+		if (root_size == atlas_root_size_search) {
+			std::vector<glm::ivec2> roots =
+				layer_root_search_dims(source, images, max_dims);
+
+			for (const glm::ivec2& root_dims: roots) {
+				size_t best = race_layer_candidates(source, images, root_dims, race);
+
+				if ((size_t) race.candidates[best].dims.z == images.size())
+					return race.candidates[best];
+			}
+
+			// Nothing holds the whole set, so fill the largest layer we can
+			return race.candidates[race_layer_candidates(source, images,
+				glm::ivec2(max_dims, max_dims), race)];
+		}
+
+		return race.candidates[race_layer_candidates(source, images,
+			layer_root_dims(source, max_dims), race)];
+	}
+
+	//------------------
+	// atlas_plan_t
+	//
+	// the complete outcome of packing a set of images: each layer's size,
+	// each image's layer and origin, and how much of every layer is
+	// covered by images. Making one only needs image dimensions and
+	// settings, never a GL context, so plans can be made on worker
+	// threads or offline; apply_atlas_plan is what uploads one.
+	//------------------
+
+	struct atlas_plan_t {
+		static const uint8_t no_layer = 0xFF;
+
+		// per layer
+		std::vector<uint16_t> widths;
+		std::vector<uint16_t> heights;
+		std::vector<uint64_t> image_areas;
+
+		// per image; images which weren't packed keep no_layer
+		std::vector<uint8_t> layers;
+		std::vector<uint16_t> coords_x;
+		std::vector<uint16_t> coords_y;
+		std::vector<uint8_t> rotated;
+
+		// false if some image couldn't be placed on any layer
+		bool complete;
+
+		atlas_plan_t(void)
+			:   complete(false)
+		{}
+
+		size_t num_layers(void) const { return widths.size(); }
+
+		uint64_t layer_texels(size_t layer) const
+		{
+			return (uint64_t) widths[layer] * heights[layer];
+		}
+
+		uint64_t texels(void) const
+		{
+			uint64_t t = 0;
+
+			for (size_t i = 0; i < num_layers(); ++i)
+				t += layer_texels(i);
+
+			return t;
+		}
+
+		double occupancy(size_t layer) const
+		{
+			return (double) image_areas[layer] / (double) layer_texels(layer);
+		}
+
+		double occupancy(void) const
+		{
+			uint64_t area = 0;
+
+			for (uint64_t a: image_areas)
+				area += a;
+
+			uint64_t t = texels();
+
+			return t ? (double) area / (double) t : 0.0;
+		}
+	};
+
+	// Adds layers to plan until every one of images is placed; returns
+	// false if one won't fit in an empty layer of max_dims x max_dims.
+	GLK_FUNC bool extend_atlas_plan(atlas_plan_t& plan, const atlas_pack_source_t& source,
+		std::vector<uint16_t> images, int32_t max_dims, layer_race_t& race)
+	{
+		while (!images.empty()) {
+			const layer_candidate_t& layer = select_layer(source, images,
+				source.params.root_size, max_dims, race);
+
+			if (!layer.dims.z || plan.num_layers() >= atlas_plan_t::no_layer)
+				return false;
+
+			uint8_t index = (uint8_t) plan.num_layers();
+
+			// Placements are of reserved rects; images start past the gutter
+			uint16_t gutter = source.params.gutter;
+
+			for (const layer_placement_t& p: layer.placed) {
+				plan.layers[p.image] = index;
+				plan.coords_x[p.image] = p.x + gutter;
+				plan.coords_y[p.image] = p.y + gutter;
+				plan.rotated[p.image] = p.rotated;
+			}
+
+			uint16_t w = layer_extent((uint16_t) layer.dims.x,
+				source.params.layer_align, max_dims);
+			uint16_t h = layer_extent((uint16_t) layer.dims.y,
+				source.params.layer_align, max_dims);
+
+			if (!w || !h)
+				return false;
+
+			plan.widths.push_back(w);
+			plan.heights.push_back(h);
+			plan.image_areas.push_back(layer.area);
+
+			images.erase(std::remove_if(images.begin(), images.end(),
+				[&plan](uint16_t image) -> bool {
+				return plan.layers[image] != atlas_plan_t::no_layer;
+			}), images.end());
+		}
+
+		return true;
+	}
+
+	// Packs images (indices into source's dimension arrays, num_images
+	// long) layer by layer until every one is placed or one won't fit
+	// in an empty layer of max_dims x max_dims.
+	GLK_FUNC atlas_plan_t make_atlas_plan(const atlas_pack_source_t& source,
+		uint32_t num_images, std::vector<uint16_t> images, int32_t max_dims)
+	{
+		atlas_plan_t plan;
+
+		plan.layers.assign(num_images, (uint8_t) atlas_plan_t::no_layer);
+		plan.coords_x.assign(num_images, 0);
+		plan.coords_y.assign(num_images, 0);
+		plan.rotated.assign(num_images, 0);
+
+		layer_race_t race(source.params);
+
+		if (source.opaque) {
+			std::vector<uint16_t> opaque;
+
+			images.erase(std::remove_if(images.begin(), images.end(),
+				[&source, &opaque](uint16_t image) -> bool {
+				if (!source.opaque[image])
+					return false;
+
+				opaque.push_back(image);
+				return true;
+			}), images.end());
+
+			plan.complete = extend_atlas_plan(plan, source, images, max_dims, race)
+				&& extend_atlas_plan(plan, source, opaque, max_dims, race);
+		} else {
+			plan.complete = extend_atlas_plan(plan, source, images, max_dims, race);
+		}
+
+		return plan;
+	}
+
+	// Plans every image in the atlas which owns pixels still in use;
+	// duplicates are left out, they take their slot's placement.
+	GLK_FUNC atlas_plan_t make_atlas_plan(const atlas_t& atlas, int32_t max_dims)
+	{
+		return make_atlas_plan(atlas.pack_source(), atlas.num_images,
+			atlas.packed_images(), max_dims);
+	}
+
+	//------------------------------------------------------------------------------------
+	// minor texture utils
+	//------------------------------------------------------------------------------------
+    GLK_FUNC void alloc_blank_texture(size_t width, size_t height,
+									uint32_t clear_val, GLint level)
+	{
+		std::vector<uint32_t> blank(width * height, clear_val);
+        GLK_H( glTexImage2D(GL_TEXTURE_2D,
+							level,
+                            GLK_ATLAS_INTERNAL_TEX_FORMAT,
+							(GLsizei) width,
+							(GLsizei) height,
+							0,
+                            GLK_ATLAS_TEX_FORMAT,
+							GL_UNSIGNED_BYTE,
+							&blank[0]) );
+	}
+
+	// Finds the smallest rectangle holding every pixel with nonzero
+	// alpha. Returns false if there aren't any.
+	GLK_FUNC bool alpha_bounds_rgba(atlas_rect_t& bounds,
+		const uint8_t* image_data, int32_t dim_x, int32_t dim_y)
+	{
+		int32_t min_x = dim_x, max_x = -1;
+		int32_t min_y = dim_y, max_y = -1;
+
+		for (int32_t y = 0; y < dim_y; ++y) {
+			const uint8_t* row = image_data + (size_t) y * dim_x * 4;
+
+			int32_t first = -1, last = -1;
+			int32_t x = 0;
+
+#if defined(__SSE2__)
+			// Four pixels at a time: one mask bit per pixel with alpha
+			const __m128i alpha_mask = _mm_set1_epi32((int) 0xFF000000);
+			const __m128i zero = _mm_setzero_si128();
+
+			for (; x + 4 <= dim_x; x += 4) {
+				__m128i px = _mm_loadu_si128((const __m128i*) (row + x * 4));
+				__m128i clear = _mm_cmpeq_epi32(_mm_and_si128(px, alpha_mask), zero);
+
+				int opaque = ~_mm_movemask_ps(_mm_castsi128_ps(clear)) & 0xF;
+
+				if (opaque) {
+					if (first < 0)
+						first = x + (int32_t) bit_scan_forward((uint32_t) opaque);
+
+					last = x + (int32_t) bit_scan_reverse((uint32_t) opaque);
+				}
+			}
+#endif
+			for (; x < dim_x; ++x) {
+				if (row[x * 4 + 3]) {
+					if (first < 0)
+						first = x;
+
+					last = x;
+				}
+			}
+
+			if (first < 0)
+				continue;
+
+			min_x = glm::min(min_x, first);
+			max_x = glm::max(max_x, last);
+
+			if (min_y > y)
+				min_y = y;
+
+			max_y = y;
+		}
+
+		if (max_y < 0)
+			return false;
+
+		bounds = atlas_rect_t { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+
+		return true;
+	}
+
+	// True if every texel has full alpha
+	GLK_FUNC bool opaque_rgba(const uint8_t* image_data, size_t length)
+	{
+		for (size_t i = 3; i < length; i += GLK_ATLAS_DESIRED_BPP) {
+			if (image_data[i] != 0xFF)
+				return false;
+		}
+
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------
+	// gen
+	//------------------------------------------------------------------------------------
+
+	// Puts an image which isn't on a layer yet into the first layer whose
+	// free space can hold it, opening a new layer only when none can.
+	// Nothing is uploaded.
+	GLK_FUNC bool place_atlas_image(atlas_t& atlas, uint16_t image, int32_t max_dims)
+	{
+		if (atlas.image_duplicate(image)) {
+			uint16_t slot = atlas.slots[image];
+
+			if (slot >= atlas.layers.size() || atlas.layers[slot] == 0xFF)
+				return false;
+
+			atlas.set_layer(image, atlas.layers[slot]);
+			atlas.write_origins(image, atlas.coords_x[slot], atlas.coords_y[slot]);
+			atlas.set_rotated(image, atlas.image_rotated(slot));
+			atlas.refresh_record(image);
+
+			return true;
+		}
+
+		atlas_pack_source_t source = atlas.pack_source();
+
+		int32_t dx = (int32_t) source.width(image);
+		int32_t dy = (int32_t) source.height(image);
+
+		if (dx > max_dims || dy > max_dims)
+			return false;
+
+		atlas_layer_format_t format = atlas.layer_format_for(image);
+
+		if (atlas.layer_bins.size() != atlas.num_layers())
+			atlas.build_free_space();
+
+		atlas_packer_t heuristic = atlas.packer_type() == atlas_packer_maxrects_baf
+			? atlas_packer_maxrects_baf : atlas_packer_maxrects_bssf;
+
+		size_t layer = 0;
+		int32_t index = -1;
+		bool rotated = false;
+
+		for (; layer < atlas.layer_bins.size() && index < 0; ++layer) {
+			// Translucent images can't go on a layer without alpha
+			if (!atlas_layer_has_alpha(atlas.layer_format(layer))
+				&& atlas_layer_has_alpha(format))
+				continue;
+
+			index = atlas.layer_bins[layer].find(dx, dy, heuristic,
+				atlas.allow_rotation() ? &rotated : nullptr);
+		}
+
+		if (index >= 0) {
+			layer--;
+		} else {
+			if (layer >= 0xFF) {
+				glk_logf("FATAL: atlas has run out of layers for image %i",
+					(int) image);
+				exit_on_error();
+				return false;
+			}
+
+			// Size new layers like the largest one so far, so the
+			// next insertions have room to land in as well.
+			int32_t w = dx, h = dy;
+
+			for (size_t i = 0; i < atlas.num_layers(); ++i) {
+				w = glm::max(w, (int32_t) atlas.widths[i]);
+				h = glm::max(h, (int32_t) atlas.heights[i]);
+			}
+
+			w = layer_extent(w, atlas.layer_alignment(), max_dims);
+			h = layer_extent(h, atlas.layer_alignment(), max_dims);
+
+			if (!w || !h) {
+				glk_logf("ERROR: image %i is too large for a %i x %i layer",
+					(int) image, max_dims, max_dims);
+				return false;
+			}
+
+			atlas.push_layer((uint16_t) w, (uint16_t) h, nullptr, format);
+
+			atlas.layer_bins.push_back(maxrects_bin_t());
+			atlas.layer_bins[layer].reset(w, h);
+
+			index = 0;
+		}
+
+		if (rotated)
+			std::swap(dx, dy);
+
+		maxrects_bin_t& bin = atlas.layer_bins[layer];
+
+		atlas_rect_t used { bin.free_rects[index].x, bin.free_rects[index].y,
+			dx, dy };
+
+		bin.place(used);
+
+		atlas.write_origins(image, (uint16_t) (used.x + source.params.gutter),
+			(uint16_t) (used.y + source.params.gutter));
+		atlas.set_layer(image, (uint8_t) layer);
+		atlas.set_rotated(image, rotated);
+		atlas.refresh_record(image);
+
+		return true;
+	}
+
+	// Draws every live image on layer into a cleared RGBA buffer, i.e.
+	// what the layer's texture holds once it's been filled.
+	GLK_FUNC void compose_atlas_layer(const atlas_t& atlas, uint8_t layer,
+		std::vector<uint8_t>& out)
+	{
+		size_t width = atlas.widths[layer];
 
-                    memcpy(&p_dest_copy[0], &p_source[0], sizeof(*p_dest_copy) * GLK_ATLAS_DESIRED_BPP);
-                }
-            }
+		out.assign(width * atlas.heights[layer] * GLK_ATLAS_DESIRED_BPP, 0);
 
-            GLK_H( glTexSubImage2D(GL_TEXTURE_2D,
-                                   0,
-                                   dest_x,
-                                   dest_y,
-                                   dx,
-                                   dy,
-                                   GLK_ATLAS_TEX_FORMAT,
-                                   GL_UNSIGNED_BYTE,
-                                   &copy[0]) );
-        }
+		for (uint16_t image = 0; image < atlas.num_images; ++image) {
+			if (atlas.layers[image] != layer || !atlas.slot_live(image))
+				continue;
 
-		void fill_atlas_image(size_t image)
-		{
-            if (downscaled()) {
-                downscale_image(image);
-            }
+			atlas_rect_t r = atlas.reserved_rect(image);
+
+			atlas.compose_image(image, &out[((size_t) r.y * width + r.x) * GLK_ATLAS_DESIRED_BPP],
+				width * GLK_ATLAS_DESIRED_BPP);
+		}
+	}
 
-            GLsizei dx = (GLsizei) dims_x[image];
-            GLsizei dy = (GLsizei) dims_y[image];
+	// The layer's contents in its own format, every level of it: composed
+	// RGBA, reduced into a mip chain if the atlas is mipmapped, and that
+	// encoded into blocks if the layer's compressed.
+	GLK_FUNC void encode_atlas_layer(const atlas_t& atlas, uint8_t layer,
+		std::vector<uint8_t>& out)
+	{
+		atlas_layer_format_t format = atlas.layer_format(layer);
 
-            fill(image, 0, 0, dx, dy);
+		size_t width = atlas.widths[layer];
+		size_t height = atlas.heights[layer];
+		size_t levels = atlas.layer_levels(layer);
 
-            if (downscaled()) {
-                fill(image, dx, 0, dx, dy * 2);
-              //  fill(image, 0, dy, dx * 2, dy);
-            }
+		if (format == atlas_layer_rgba8 && levels == 1) {
+			compose_atlas_layer(atlas, layer, out);
+			return;
 		}
 
-		uint16_t key_image(size_t key) const
-		{
-			return key_map.at(key);
+		std::vector<uint8_t> texels;
+		compose_atlas_layer(atlas, layer, texels);
+
+		if (levels > 1) {
+			texels.resize(mip_chain_bytes(width, height, levels));
+			mip_build_chain(texels.data(), width, height, levels);
 		}
 
-		void map_key_to_image(size_t key, uint16_t image)
-		{
-			key_map[key] = image;
+		if (format == atlas_layer_rgba8) {
+			out.swap(texels);
+			return;
 		}
 
-		void free_memory(void)
-		{
-			{
-				GLint curr_bound_tex;
-                GLK_H( glGetIntegerv(GL_TEXTURE_BINDING_2D, &curr_bound_tex) );
+		out.resize(atlas_layer_chain_bytes(format, width, height, levels));
 
-				// We unbind if any of this atlas's textures are bound
-				// because a glDelete call on a bound item can't be fulfilled
-				// until that item is unbound
+		atlas_encode_levels(format, texels.data(), width, height, levels, out.data());
+	}
 
-				bool bound = false;
-				for (GLuint handle = 0; handle < layer_tex_handles.size()
-					&& !bound && curr_bound_tex; ++handle) {
-					bound = (GLuint)curr_bound_tex == layer_tex_handles[handle];
-				}
+	// Uploads a plan made for this atlas, replacing whatever layers it had.
+	// Every layer of the plan is created and filled before the old layers
+	// are deleted, so the atlas is never seen half built. Images the plan
+	// doesn't cover because they were pushed after it was made are placed
+	// into the new layers' free space; images removed since are left out.
+	// Duplicates are placed wherever their slot lands. Once everything's
+	// uploaded, the residency policy decides what happens to the pixels.
+	// Returns false, changing nothing, if the pixels aren't there to
+	// upload anymore.
+	GLK_FUNC bool apply_atlas_plan(atlas_t& atlas, const atlas_plan_t& plan)
+	{
+		if (!atlas.restore_pixels()) {
+			glk_logf("ERROR: %s", "the atlas's pixels were dropped after "
+				"upload, so it can't be laid out again");
+			return false;
+		}
 
-				if (bound) {
-                    GLK_H( glBindTexture(GL_TEXTURE_2D, 0) );
-				}
+		std::vector<GLuint> old_handles;
+		old_handles.swap(atlas.layer_tex_handles);
 
-				if (!layer_tex_handles.empty())
-				{
-					GLK_H( glDeleteTextures(layer_tex_handles.size(),
-						&layer_tex_handles[0]) );
-				}
-			}
+		std::vector<GLuint> old_alpha_handles;
+		old_alpha_handles.swap(atlas.alpha_tex_handles);
 
-			num_images = 0;
-			area_accum = 0;
-			default_image = no_image_index;
+		atlas.widths.clear();
+		atlas.heights.clear();
+		atlas.layer_formats.clear();
+		atlas.layer_blocks.clear();
 
-			widths.clear();
-			heights.clear();
-			dims_x.clear();
-			dims_y.clear();
-			coords_x.clear();
-			coords_y.clear();
-			buffer_table.clear();
-			filenames.clear();
+		// A layer only goes without alpha if every image on it is opaque
+		std::vector<uint8_t> formats(plan.num_layers(),
+			(uint8_t) atlas_layer_format(atlas.compression_mode(), true));
 
-			layers.clear();
-			layer_tex_handles.clear();
+		for (uint32_t image = 0; image < plan.layers.size(); ++image) {
+			if (plan.layers[image] != atlas_plan_t::no_layer
+				&& atlas.slot_live(image)
+				&& !atlas.image_opaque(image))
+				formats[plan.layers[image]] =
+					(uint8_t) atlas_layer_format(atlas.compression_mode(), false);
 		}
 
-		~atlas_t(void)
-		{
-			free_memory();
+		for (size_t i = 0; i < plan.num_layers(); ++i) {
+			atlas.push_layer(plan.widths[i], plan.heights[i], nullptr,
+				(atlas_layer_format_t) formats[i]);
 		}
 
-		atlas_t(void)
-            : 	is_downscaled(false),
-                default_image(no_image_index),
-				num_images(0),
-				area_accum(0)
-		{}
-	};
+		atlas.layers.assign(atlas.num_images, 0xFF);
+		atlas.rotated.assign(atlas.num_images, 0);
 
-	//------------------
-	// gen_layer_bsp
-	//
-	// generates a layer (think of "layer" in this sense as just a texture
-	// representing a portion for a set of a group of images ).
-	// The core algorithm is based on 2D BSP generation.
-	//
-	// it assesses whether or not sorted images for this layer
-	// actually save space and how large this layer actually needs to be.
-	//
-	// the set of images a layer has will be more efficiently placed if the
-	// variation of the image sizes is high; if a layer consists
-	// of images which are of the same dimensions, then there will be a lot of unused
-	// space.
-	//
-	// idea behind BSP algol is from here:
-	// http://gamedev.stackexchange.com/a/34193
-	//------------------
+		for (uint32_t image = 0; image < plan.layers.size(); ++image) {
+			if (plan.layers[image] == atlas_plan_t::no_layer
+				|| !atlas.slot_live(image))
+				continue;
 
-	class gen_layer_bsp
-	{
-		struct node_t;
+			atlas.set_layer(image, plan.layers[image]);
+			atlas.write_origins(image, plan.coords_x[image], plan.coords_y[image]);
+			atlas.set_rotated(image, plan.rotated[image]);
+		}
 
-		using node_ptr_t = std::unique_ptr<node_t, void (*)(node_t*)>;
-		using atlas_type_t = atlas_t;
+		atlas.build_free_space();
 
-		atlas_type_t& atlas;
+		if (plan.layers.size() < atlas.num_images) {
+			int32_t max_dims = max_layer_dims();
 
-		// one for a sorted atlas, the other for an unsorted atlas. The atlas
-		// which takes the least amount of space is the winner
-		node_ptr_t root;
-		glm::ivec3 layer_dims;
+			for (uint32_t image = plan.layers.size(); image < atlas.num_images; ++image) {
+				if (atlas.slot_live(image))
+					place_atlas_image(atlas, (uint16_t) image, max_dims);
+			}
+		}
 
-		// Only left child's are capable of storing image indices,
-		// from the perspective of the child's parent.
+		atlas.place_duplicates();
+		atlas.build_records();
 
-		// The "lines" (expressed implicitly) will only have
-		// positive normals that face either to the right, or upward.
-		struct node_t {
-			bool region;
-			int32_t image;
+		atlas.captured_layers.clear();
 
-			glm::ivec2 origin;
-			glm::ivec2 dims;
+		if (atlas.capture_layers)
+			atlas.captured_layers.resize(atlas.num_layers());
 
-			node_t* left_child;
-			node_t* right_child;
+		std::vector<uint8_t> blocks;
 
-			node_t(void)
-			:   region(false),
-				image(-1),
-				origin(0, 0), dims(0, 0),
-				left_child(nullptr), right_child(nullptr)
-			{}
+		for (size_t layer = 0; layer < atlas.num_layers(); ++layer) {
+			atlas.bind(layer);
 
-			static void destroy(node_t* n)
-			{
-				if (n) {
-                    destroy(n->left_child);
-					destroy(n->right_child);
-					delete n;
-				}
+			// Compressed and mipmapped layers are encoded whole, on every
+			// core, and uploaded in one go; so is every layer which is
+			// being captured
+			if (atlas.capture_layers
+				|| atlas.layer_format(layer) != atlas_layer_rgba8
+				|| atlas.layer_levels(layer) > 1) {
+				encode_atlas_layer(atlas, (uint8_t) layer, blocks);
+				atlas.upload_layer_levels(layer, blocks.data());
+
+				if (atlas.capture_layers)
+					atlas.captured_layers[layer].swap(blocks);
+
+				continue;
 			}
-		};
 
-		node_t* insert_node(node_t* node, uint16_t image)
-		{
-			if (node->region) {
-				node_t* n = insert_node(node->left_child, image);
+			for (uint32_t image = 0; image < atlas.num_images; ++image) {
+				if (atlas.layers[image] == layer && atlas.slot_live(image))
+					atlas.fill_atlas_image(image);
+			}
 
-				if (n) {
-					node->left_child = n;
-					return node;
-				}
+			atlas.release();
+		}
 
-				n = insert_node(node->right_child, image);
+		atlas_t::delete_textures(old_handles);
+		atlas_t::delete_textures(old_alpha_handles);
 
-				if (n) {
-					node->right_child = n;
-					return node;
-				}
-			} else {
+		atlas.evict_pixels();
 
-				if (node->image >= 0)
-					return nullptr;
+		return true;
+	}
+
+	// Returns false, with the atlas left unpacked, if its images can't be
+	// brought under the downscale budget or the layers can't be made.
+    GLK_FUNC bool gen_atlas_layers(atlas_t& atlas)
+	{
+		auto pack_start = std::chrono::steady_clock::now();
 
-				glm::ivec2 image_dims(atlas.dims_x[image], atlas.dims_y[image]);
+		// GL has to be queried here: planning may race threads which have
+		// no context
+		int32_t max_dims = max_layer_dims();
 
-				if (node->dims.x < image_dims.x || node->dims.y < image_dims.y)
-					return nullptr;
+		if (!atlas.fit_downscale_budget()) {
+			glk_logf("ERROR: %s", "the atlas's pixels were dropped after "
+				"upload, so they can't be downscaled to fit the budget");
+			return false;
+		}
 
-				if (node->dims.x == image_dims.x
-					&& node->dims.y == image_dims.y) {
+		atlas_plan_t plan = make_atlas_plan(atlas, max_dims);
 
-					node->image = image;
+		auto pack_time = std::chrono::steady_clock::now() - pack_start;
 
-					if ((node->origin.x + image_dims.x) > layer_dims.x)
-						layer_dims.x = node->origin.x + image_dims.x;
+		if (!plan.complete) {
+			glk_logf("FATAL: images are too large for a %i x %i layer",
+				max_dims, max_dims);
+			exit_on_error();
+			return false;
+		}
 
-					if ((node->origin.y + image_dims.y) > layer_dims.y)
-						layer_dims.y = node->origin.y + image_dims.y;
+		if (!apply_atlas_plan(atlas, plan))
+			return false;
 
-					assert(layer_dims.x <= root->dims.x);
-					assert(layer_dims.y <= root->dims.y);
+        glk_logf("Total Images: %lu\nArea Accum: %lu",
+			 atlas.num_images, atlas.area_accum);
 
-					atlas.write_origins(node->image, node->origin.x,
-						node->origin.y);
+		for (uint32_t i = 0; i < plan.num_layers(); ++i) {
+            glk_logf("Layer Size [%i/%i]: %i x %i, Occupancy: %f",
+				i + 1,
+				plan.num_layers(),
+				plan.widths[i],
+				plan.heights[i],
+				plan.occupancy(i));
+		}
 
-					return node;
-				}
+		glk_logf("Packer: %i, Layers: %lu, Occupancy: %f",
+			(int) atlas.packer_type(),
+			plan.num_layers(),
+			plan.occupancy());
 
-				node->region = true;
+		glk_logf("Pack Time: %f ms",
+			std::chrono::duration<double, std::milli>(pack_time).count());
 
-				uint16_t dx = node->dims.x - image_dims.x;
-				uint16_t dy = node->dims.y - image_dims.y;
+		glk_logf("Duplicates: %lu, %llu bytes saved",
+			atlas.num_duplicates,
+			(unsigned long long) atlas.duplicate_bytes);
 
-				node->left_child = new node_t();
-				node->right_child = new node_t();
+		atlas_memory_usage_t usage = atlas.memory_usage();
 
-				// Is the partition line vertical?
-				if (dx > dy) {
-					node->left_child->dims.x = image_dims.x;
-					node->left_child->dims.y = node->dims.y;
-					node->left_child->origin = node->origin;
+		glk_logf("Memory: %llu bytes of CPU pixels (%llu reserved), "
+			"%llu spilled, %llu bytes of layers",
+			(unsigned long long) usage.cpu_pixel_bytes,
+			(unsigned long long) usage.cpu_reserved_bytes,
+			(unsigned long long) usage.spilled_bytes,
+			(unsigned long long) usage.gpu_bytes);
 
-					node->right_child->dims.x = dx;
-					node->right_child->dims.y = node->dims.y;
-					node->right_child->origin = node->origin;
+#ifdef GLK_IO
+		if (atlas.root_size_mode() == atlas_root_size_search) {
+			glk_logf("Root Size Search: %llu bytes of layers",
+				(unsigned long long) plan.texels() * GLK_ATLAS_DESIRED_BPP);
+		}
+#endif
 
-					node->right_child->origin.x += image_dims.x;
+		return true;
+	}
 
-				// Nope, it's horizontal
-				} else {
-					node->left_child->dims.x = node->dims.x;
-					node->left_child->dims.y = image_dims.y;
-					node->left_child->origin = node->origin;
+	// How push_atlas_image resamples an image once it's been converted and
+	// post processed; see atlas_resize. A width or height of 0 keeps the
+	// image's own size.
+	struct atlas_resize_t {
+		int width;
+		int height;
+		resample_filter_t filter;
+		unsigned threads; // for resample_rgba, 0 meaning one per hardware thread
+	};
 
-					node->right_child->dims.x = node->dims.x;
-					node->right_child->dims.y = dy;
-					node->right_child->origin = node->origin;
+	GLK_FUNC atlas_resize_t atlas_resize(int width, int height,
+		resample_filter_t filter = resample_lanczos3, unsigned threads = 1)
+	{
+		return atlas_resize_t { width, height, filter, threads };
+	}
 
-					node->right_child->origin.y += image_dims.y;
-				}
+	// Given a resize with a width and height, the image is resampled to
+	// that size, and from then on that's the image's size, as if it had
+	// been pushed that way.
+    GLK_FUNC void push_atlas_image(atlas_t& atlas,
+		uint8_t* buffer, int dx, int dy, int bpp, uint32_t post_process_flags = 0, bool flip = true,
+		const atlas_resize_t& resize = atlas_resize(0, 0))
+	{
+		if (bpp != 3 && bpp != GLK_ATLAS_DESIRED_BPP) {
+            glk_logf("ERROR: received image of would-be index %i" \
+			"that does not contain a supported bytes per pixel count."\
+			" Dimensions: %i x %i. BPP received: %i",
+			(int) atlas.num_images, dx, dy, bpp);
+            exit_on_error();
+			return;
+		}
 
-				// The only way we're able to make it here
-				// is if node's dimensions are >= the image's dimensions.
-				// If they're exactly equal, then node would have already been
-				// set and this call won't happen.
-				// Otherwise, the left child's values are set to values
-				// which have already been examined for size, or are
-				// set to one of the image's dimension values.
+		bool resizing = resize.width > 0 && resize.height > 0
+			&& (resize.width != dx || resize.height != dy);
 
-				node->left_child = insert_node(node->left_child, image);
+		// Converted straight into the arena; if it turns out to be a
+		// duplicate or gets trimmed, the allocation is handed back. An
+		// image being resized goes through scratch first, and only its
+		// resized pixels go in the arena.
+		uint32_t length = dx * dy * GLK_ATLAS_DESIRED_BPP;
 
-				assert(node->left_child);
+		std::vector<uint8_t> scratch;
+		pixel_span_t span { 0, 0, 0, 0 };
 
-				return node;
-			}
+		uint8_t* image_data;
 
-			return nullptr;
+		if (resizing) {
+			scratch.resize(length);
+			image_data = scratch.data();
+		} else {
+			span = atlas.pixels.alloc(length, dx * GLK_ATLAS_DESIRED_BPP);
+			image_data = atlas.pixels.data(span);
 		}
 
-		bool insert(uint16_t image)
-		{
-			node_t* res = insert_node(root.get(), image);
-
-			return !!res;
+		if (bpp == 3) {
+			convert_rgb_to_rgba(image_data, dx * GLK_ATLAS_DESIRED_BPP,
+				buffer, dx * 3, dx, dy);
+        } else {
+            memcpy(image_data, buffer, length);
 		}
 
-	public:
+		post_process_rgba(image_data, length, post_process_flags);
 
-		const glm::ivec3& dims(void) const
-		{
-			return layer_dims;
-		}
+		if (resizing) {
+			span = atlas.pixels.alloc(resize.width * resize.height * GLK_ATLAS_DESIRED_BPP,
+				resize.width * GLK_ATLAS_DESIRED_BPP);
+			image_data = atlas.pixels.data(span);
 
-		gen_layer_bsp(atlas_type_t& atlas_, image_fill_map_t& image_check)
-			:   atlas(atlas_),
-				root(new node_t(), node_t::destroy)
-		{
-			// Setup some upper bounds for the width/height values
-			{
-				GLint max_dims;
-                GLK_H( glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_dims) );
+			resample_rgba(scratch.data(), dx, dy, dx * GLK_ATLAS_DESIRED_BPP,
+				image_data, resize.width, resize.height, span.stride, resize.filter,
+				resize.threads);
 
-				uint32_t root_area_accumf =
-					next_power2((uint32_t) glm::sqrt((float) atlas.area_accum));
+			dx = resize.width;
+			dy = resize.height;
+		}
 
-				if ((uint32_t) max_dims > root_area_accumf)
-					max_dims = (GLint) root_area_accumf;
+		if ( flip ) {
+			flip_rows_rgba(image_data, dx, dy);
+		}
 
-				root->dims = glm::ivec2(max_dims, max_dims);
-			}
+		int source_dx = dx, source_dy = dy;
 
-			std::vector<uint16_t> sorted(image_check.size(), 0);
+		atlas_rect_t keep { 0, 0, dx, dy };
 
-			uint16_t i = 0;
+		// An image with no alpha at all keeps a single texel, so it
+		// still has somewhere to point
+		if (atlas.trim && !alpha_bounds_rgba(keep, image_data, dx, dy))
+			keep = atlas_rect_t { 0, 0, 1, 1 };
 
-			for (auto image: image_check)
-				sorted[i++] = image.first;
+		// Halving below pairs texels from even offsets, with the sizes
+		// rounding up. Widening the kept rect out to even edges (or the
+		// image's own) makes its halves line up with the halved image's,
+		// so keep.x / 2 + dx / 2 (rounded up) never passes source_dx / 2.
+		if (atlas.is_downscaled) {
+			int32_t keep_end_x = std::min((keep.x + keep.w + 1) & ~1, dx);
+			int32_t keep_end_y = std::min((keep.y + keep.h + 1) & ~1, dy);
 
-			std::sort(sorted.begin(), sorted.end(), [this](uint16_t a,
-				uint16_t b) -> bool {
-				if (atlas.dims_x[a] == atlas.dims_x[b]) {
-					return atlas.dims_y[a] > atlas.dims_y[b];
-				}
-				return atlas.dims_x[a] > atlas.dims_x[b];
-			});
+			keep.x &= ~1;
+			keep.y &= ~1;
+			keep.w = keep_end_x - keep.x;
+			keep.h = keep_end_y - keep.y;
+		}
 
-			for (uint16_t image: sorted) {
-				if (insert(image)) {
-					image_check[image] = 1;
-					layer_dims[2] += 1;
-				}
+		if (keep.w != dx || keep.h != dy) {
+			// Rows only ever move toward the front, so this can
+			// happen in place
+			for (int32_t y = 0; y < keep.h; ++y) {
+				memmove(&image_data[y * keep.w * GLK_ATLAS_DESIRED_BPP],
+					&image_data[((keep.y + y) * dx + keep.x) * GLK_ATLAS_DESIRED_BPP],
+					keep.w * GLK_ATLAS_DESIRED_BPP);
 			}
+
+			atlas.pixels.truncate(span, keep.w * keep.h * GLK_ATLAS_DESIRED_BPP);
+			span.stride = keep.w * GLK_ATLAS_DESIRED_BPP;
+
+			dx = keep.w;
+			dy = keep.h;
 		}
-	};
 
-	//------------------------------------------------------------------------------------
-	// minor texture utils
-	//------------------------------------------------------------------------------------
-    GLK_FUNC void alloc_blank_texture(size_t width, size_t height,
-									uint32_t clear_val)
-	{
-		std::vector<uint32_t> blank(width * height, clear_val);
-        GLK_H( glTexImage2D(GL_TEXTURE_2D,
-							0,
-                            GLK_ATLAS_INTERNAL_TEX_FORMAT,
-							(GLsizei) width,
-							(GLsizei) height,
-							0,
-                            GLK_ATLAS_TEX_FORMAT,
-							GL_UNSIGNED_BYTE,
-							&blank[0]) );
-	}
+		if (atlas.is_downscaled) {
+			int half_dx = (int) downscale_extent(dx, 2);
+			int half_dy = (int) downscale_extent(dy, 2);
 
+			downscale_rgba(image_data, dx, dy, span.stride, image_data, half_dx, half_dy,
+				half_dx * GLK_ATLAS_DESIRED_BPP, atlas.downscale_filter);
 
-    GLK_FUNC void convert_rgb_to_rgba(uint8_t* dest,
-		const uint8_t* src, size_t dim_x, size_t dim_y)
-	{
-		for (size_t y = 0; y < dim_y; ++y) {
-			for (size_t x = 0; x < dim_x; ++x) {
-				size_t i = y * dim_x + x;
-				dest[i * 4 + 0] = src[i * 3 + 0];
-				dest[i * 4 + 1] = src[i * 3 + 1];
-				dest[i * 4 + 2] = src[i * 3 + 2];
-				dest[i * 4 + 3] = 255;
-			}
-		}
-	}
+			atlas.pixels.truncate(span, half_dx * half_dy * GLK_ATLAS_DESIRED_BPP);
+			span.stride = half_dx * GLK_ATLAS_DESIRED_BPP;
 
-	static const float inverse255 = 1.0f / 255.0f;
-	static const float gammaDecode = 2.2f;
-	static const float gammaEncode = 1.0f / gammaDecode;
+			keep.x /= 2;
+			keep.y /= 2;
 
-	// Trivial, but learned from https://www.opengl.org/discussion_boards/showthread.php/147624-Quake3-Overbright-Lightmap
-    GLK_FUNC void brighten_rgb(uint8_t* rgb)
-	{
-		uint16_t r = ((uint16_t)rgb[0]) << 2;
-		uint16_t g = ((uint16_t)rgb[1]) << 2;
-		uint16_t b = ((uint16_t)rgb[2]) << 2;
-		
-		float maxf = (float)glm::max(r, glm::max(g, b));
+			source_dx = (int) downscale_extent(source_dx, 2);
+			source_dy = (int) downscale_extent(source_dy, 2);
 
-		if (maxf > 255.0f)
-		{
-			float lower = 255.0f / (float) maxf;
-			r = (uint16_t)((float)r * lower);
-			g = (uint16_t)((float)g * lower);
-			b = (uint16_t)((float)b * lower);
+			dx = half_dx;
+			dy = half_dy;
 		}
 
-		rgb[0] = (uint8_t)r;
-		rgb[1] = (uint8_t)g;
-		rgb[2] = (uint8_t)b;
-	}
+		atlas.source_x.push_back(source_dx);
+		atlas.source_y.push_back(source_dy);
 
-	#define GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN 0x1
-	#define GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA 0x2
+		atlas.trim_x.push_back(keep.x);
+		atlas.trim_y.push_back(keep.y);
 
-    GLK_FUNC void post_process_rgba(uint8_t* image_data, size_t length, uint32_t flags)
-	{
-		if (!flags) {
-			return;
-		}
+		atlas.dims_x.push_back(dx);
+		atlas.dims_y.push_back(dy);
 
-		for (size_t i = 0; i < length; i += 4) {
-			// assume SRGB, so linearize here
-			float r = glm::pow(((float)image_data[i + 0]) * inverse255, gammaDecode);
-			float g = glm::pow(((float)image_data[i + 1]) * inverse255, gammaDecode);
-			float b = glm::pow(((float)image_data[i + 2]) * inverse255, gammaDecode);
-			float a = glm::pow(((float)image_data[i + 3]) * inverse255, gammaDecode);
+		uint16_t image = (uint16_t) atlas.num_images;
+		uint16_t slot = image;
 
-			if (!!(flags & GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN)) {
-				uint8_t tmp[3] = {
-					(uint8_t)(r * 255.0f),
-					(uint8_t)(g * 255.0f),
-					(uint8_t)(b * 255.0f)
-				};
+		uint64_t hash = 0;
 
-				brighten_rgb(&tmp[0]);
+		if (atlas.dedupe) {
+			// The dimensions go into the seed so a 2 x 8 image can't match
+			// a 4 x 4 one with the same bytes
+			hash = hash64(image_data, span.length,
+				((uint64_t) dx << 16) | (uint64_t) dy);
 
-				r = ((float)tmp[0]) * inverse255;
-				g = ((float)tmp[1]) * inverse255;
-				b = ((float)tmp[2]) * inverse255;
-			}
+			uint16_t match = atlas.content_map.find(hash);
 
-			if (!!(flags & GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA)) {
-				r *= a;
-				g *= a;
-				b *= a;
+			if (match == image_map_t::npos) {
+				atlas.content_map.insert(hash, image);
+			} else {
+				// A hash match is only a hint
+				if (atlas.dims_x[match] == dx && atlas.dims_y[match] == dy
+					&& atlas.same_pixels(match, image_data, span.length))
+					slot = match;
 			}
+		}
+
+		atlas.opaque.push_back(opaque_rgba(image_data, span.length));
+
+		atlas.slots.push_back(slot);
+		atlas.slot_refs.push_back(0);
+		atlas.slot_refs[slot]++;
+		atlas.content_hashes.push_back(hash);
 
-			image_data[i + 0] = (uint8_t)(glm::pow(r, gammaEncode) * 255.0f);
-			image_data[i + 1] = (uint8_t)(glm::pow(g, gammaEncode) * 255.0f);
-			image_data[i + 2] = (uint8_t)(glm::pow(b, gammaEncode) * 255.0f);
+		if (slot == image) {
+			atlas.area_accum += dx * dy;
+		} else {
+			atlas.num_duplicates++;
+			atlas.duplicate_bytes += span.length;
+			atlas.pixels.truncate(span, 0);
 		}
-	}
 
-    GLK_FUNC uint32_t pack_rgba(const uint8_t *rgba)
-	{
-		return (((uint32_t)rgba[0]) << 0)
-		| (((uint32_t)rgba[1]) << 8)
-		| (((uint32_t)rgba[2]) << 16)
-		| (((uint32_t)rgba[3]) << 24);
+		atlas.pixel_spans.push_back(span);
+
+		atlas.num_images++;
 	}
 
-    GLK_FUNC void unpack_rgba(uint8_t* dest, uint32_t src)
+	// Adds an image to an atlas which has already been through
+	// gen_atlas_layers, without repacking anything (see place_atlas_image).
+	// Only the image's own rectangle is uploaded, and nothing at all for a
+	// duplicate of an image already in the atlas. Returns the new image's
+	// index, or no_image_index if it couldn't be added. Resizing works as
+	// it does for push_atlas_image.
+	GLK_FUNC uint16_t insert_atlas_image(atlas_t& atlas,
+		uint8_t* buffer, int dx, int dy, int bpp, uint32_t post_process_flags = 0, bool flip = true,
+		const atlas_resize_t& resize = atlas_resize(0, 0))
 	{
-		dest[0] = (src >> 0) & 0xFF;
-		dest[1] = (src >> 8) & 0xFF;
-		dest[2] = (src >> 16) & 0xFF;
-		dest[3] = (src >> 24) & 0xFF;
-	}
+		int32_t max_dims = max_layer_dims();
 
-    GLK_FUNC uint8_t average_pix_channel4(
-        size_t index,
-        const uint8_t* x1,
-        const uint8_t* x2,
-        const uint8_t* y1,
-        const uint8_t* y2
-    )
-    {
-        size_t value = size_t(x1[index]) + size_t(x2[index]) + size_t(y1[index]) + size_t(y2[index]);
-        value >>= 2;
-        value &= 0xFF;
+		int final_dx = resize.width > 0 && resize.height > 0 ? resize.width : dx;
+		int final_dy = resize.width > 0 && resize.height > 0 ? resize.height : dy;
 
-        return (uint8_t)value;
-    }
+		if (final_dx > max_dims || final_dy > max_dims
+			|| atlas.num_images >= atlas_t::no_image_index) {
+			glk_logf("ERROR: can't insert %i x %i image into atlas of %lu images",
+				final_dx, final_dy, atlas.num_images);
+			return atlas_t::no_image_index;
+		}
 
-    GLK_FUNC void flip_rows_rgba(uint8_t* image_data,
-		size_t dim_x, size_t dim_y)
-	{
-		size_t half_dy = dim_y >> 1;
-		for (size_t y = 0; y < half_dy; ++y) {
-			for (size_t x = 0; x < dim_x; ++x) {
-				size_t top_x = (y * dim_x + x) * 4;
-				size_t bot_x = ((dim_y - y - 1) * dim_x + x) * 4;
-				uint32_t top = pack_rgba(&image_data[top_x]);
+		uint32_t image = atlas.num_images;
 
-				unpack_rgba(&image_data[top_x],
-							pack_rgba(&image_data[bot_x]));
+		push_atlas_image(atlas, buffer, dx, dy, bpp, post_process_flags, flip, resize);
 
-				unpack_rgba(&image_data[bot_x], top);
-			}
+		if (atlas.num_images == image)
+			return atlas_t::no_image_index;
+
+		// Taken back out, so the next layout doesn't pack an image the
+		// caller was told wasn't added; its index stays reserved
+		if (!place_atlas_image(atlas, (uint16_t) image, max_dims)) {
+			glk_logf("ERROR: couldn't place inserted image %i", (int) image);
+			atlas.remove_image((uint16_t) image);
+			return atlas_t::no_image_index;
 		}
+
+		if (atlas.image_duplicate(image))
+			return (uint16_t) image;
+
+		atlas.bind(atlas.layer(image));
+		atlas.fill_atlas_image(image);
+		atlas.release();
+
+		atlas.evict_pixels();
+
+		return (uint16_t) image;
 	}
 
-	//------------------------------------------------------------------------------------
-	// gen
-	//------------------------------------------------------------------------------------
+	//------------------
+	// atlas_compaction_t
+	//
+	// repacks the live images of an atlas into as few layers as the
+	// atlas's settings allow, so the layers shrink back down after
+	// images have been removed. Packing runs on a worker thread which
+	// only sees a snapshot of dimensions and settings, never the atlas;
+	// finish_atlas_compaction uploads the result and swaps it in on
+	// the thread which owns the GL context.
+	//------------------
 
-    GLK_FUNC void gen_atlas_layers(atlas_t& atlas)
-	{
-		// Basic idea is to keep track of each image
-		// and the layer it belongs to; every image
-		// which has yet to be assigned to a layer
-		// remains in this map after a given iteration.
-		// As soon as an image is inserted, its corresponding
-		// flags is set to 1 and we remove it from this list.
-		image_fill_map_t global_unfill;
-		for (uint16_t i = 0; i < atlas.num_images; ++i) {
-			global_unfill[i] = 0;
+	struct atlas_compaction_t {
+		std::thread worker;
+		std::atomic<bool> ready;
+
+		// snapshot, taken by begin_atlas_compaction
+		uint32_t num_images;
+		std::vector<uint16_t> dims_x, dims_y;
+		std::vector<uint8_t> opaque;
+		std::vector<uint16_t> images;
+		atlas_pack_source_t source;
+		int32_t max_dims;
+
+		atlas_plan_t plan; // written by the worker
+
+		atlas_compaction_t(void)
+			:   ready(false),
+				num_images(0),
+				max_dims(0)
+		{}
+
+		void run(void)
+		{
+			plan = make_atlas_plan(source, num_images, images, max_dims);
+
+			ready.store(true, std::memory_order_release);
 		}
+	};
 
-		uint8_t layer = 0;
+	GLK_FUNC void destroy_atlas_compaction(atlas_compaction_t* c)
+	{
+		if (c) {
+			if (c->worker.joinable())
+				c->worker.join();
 
-		while (!global_unfill.empty()) {
-			image_fill_map_t local_fill;
+			delete c;
+		}
+	}
 
-			local_fill.insert(global_unfill.begin(),
-							  global_unfill.end());
+	// Starts repacking the atlas's live images in the background. Returns
+	// false if a compaction is already in flight, there's nothing to pack
+	// or the pixels it'd need to upload were dropped (atlas_residency_drop).
+	GLK_FUNC bool begin_atlas_compaction(atlas_t& atlas)
+	{
+		if (atlas.compaction || atlas.pixels_dropped)
+			return false;
 
-			// gen_layer_bsp allocates a fair amount of memory
-			// internally, so it's best to just wrap it in an
-			// inner block since we have plenty of processing to do
-			// afterward
-			uint16_t w, h;
-			{
-				gen_layer_bsp placed(atlas, local_fill);
+		atlas_t::compaction_ptr_t job(new atlas_compaction_t(),
+			destroy_atlas_compaction);
 
-				const glm::ivec3& dims = placed.dims();
+		job->num_images = atlas.num_images;
+		job->dims_x = atlas.dims_x;
+		job->dims_y = atlas.dims_y;
+		job->opaque = atlas.opaque;
 
-				w = next_power2(dims[0]);
-				h = next_power2(dims[1]);
-			}
+		job->images = atlas.packed_images();
 
-			atlas.push_layer(w, h);
+		if (job->images.empty())
+			return false;
 
-			atlas.bind(layer);
+		job->source = atlas.pack_source();
+		job->source.dims_x = job->dims_x.data();
+		job->source.dims_y = job->dims_y.data();
 
-			for (auto& image: local_fill) {
-				if (image.second) {
-					atlas.set_layer(image.first, layer);
-					atlas.fill_atlas_image(image.first);
-					global_unfill.erase(image.first);
-				}
-			}
+		if (job->source.opaque)
+			job->source.opaque = job->opaque.data();
 
-			atlas.release();
-            layer++;
-		}
+		// GL has to be queried here: the worker has no context
+		job->max_dims = max_layer_dims();
 
-        glk_logf("Total Images: %lu\nArea Accum: %lu",
-			 atlas.num_images, atlas.area_accum);
+		job->worker = std::thread(&atlas_compaction_t::run, job.get());
 
-		for (uint32_t i = 0; i < atlas.widths.size(); ++i) {
-            glk_logf("Layer Size [%i/%i]: %i x %i",
-				i + 1,
-				atlas.widths.size(),
-				atlas.widths[i],
-				atlas.heights[i]);
-		}
+		atlas.compaction = std::move(job);
+
+		return true;
 	}
 
-    GLK_FUNC void push_atlas_image(atlas_t& atlas,
-		uint8_t* buffer, int dx, int dy, int bpp, uint32_t post_process_flags = 0, bool flip = true)
+	// Swaps the plan from begin_atlas_compaction in, if it's done; with
+	// wait set, blocks until it is (see apply_atlas_plan). Returns true if
+	// a new layout was swapped in.
+	GLK_FUNC bool finish_atlas_compaction(atlas_t& atlas, bool wait = false)
 	{
-        std::vector<uint8_t> image_data(dx * dy * GLK_ATLAS_DESIRED_BPP, 0);
+		if (!atlas.compaction)
+			return false;
 
-		if (bpp == 3) {
-			convert_rgb_to_rgba(&image_data[0], buffer, dx, dy);
-        } else if (bpp == GLK_ATLAS_DESIRED_BPP) {
-            memcpy(&image_data[0], buffer, dx * dy * GLK_ATLAS_DESIRED_BPP);
-		} else {
-            glk_logf("ERROR: received image of would-be index %i" \
-			"that does not contain a supported bytes per pixel count."\
-			" Dimensions: %i x %i. BPP received: %i",
-			(int) atlas.num_images, dx, dy, bpp);
-            exit_on_error();
-			return;
-		}
+		atlas_compaction_t& job = *atlas.compaction;
 
-		post_process_rgba(&image_data[0], image_data.size(), post_process_flags);
+		if (!wait && !job.ready.load(std::memory_order_acquire))
+			return false;
 
-		atlas.area_accum += dx * dy;
+		job.worker.join();
 
-		atlas.dims_x.push_back(dx);
-		atlas.dims_y.push_back(dy);
+		if (!job.plan.complete) {
+			glk_logf("ERROR: compaction of %lu images failed; keeping the "
+				"current layers", job.images.size());
+			atlas.compaction.reset();
+			return false;
+		}
 
-		if ( flip ) {
-			flip_rows_rgba(&image_data[0], dx, dy);
+		size_t old_layers = atlas.num_layers();
+
+		if (!apply_atlas_plan(atlas, job.plan)) {
+			atlas.compaction.reset();
+			return false;
 		}
 
-		atlas.buffer_table.push_back(std::move(image_data));
-		atlas.num_images++;
+		atlas.compact_pixels();
+
+		glk_logf("Compaction: %lu layers -> %lu layers",
+			old_layers, atlas.num_layers());
+
+		atlas.compaction.reset();
+
+		return true;
 	}
 
-    GLK_FUNC void make_atlas_from_dir(
+	// Returns what gen_atlas_layers does.
+    GLK_FUNC bool make_atlas_from_dir(
 		atlas_t& atlas,
 		std::string dirpath)
 	{
@@ -928,7 +4126,7 @@ namespace glk {
 		if (!dir) {
             glk_logf("Could not open %s", dirpath.c_str());
             exit_on_error();
-			return;
+			return false;
 		}
 
         assert(GLK_ATLAS_DESIRED_BPP == 4
@@ -964,7 +4162,9 @@ namespace glk {
 
 		closedir(dir);
 
-		gen_atlas_layers(atlas);
+		atlas.build_filename_map();
+
+		return gen_atlas_layers(atlas);
 	}
 
 } // namespace glk
@@ -4,13 +4,14 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.cpp \
+    pixel.cpp \
     stb_image.c
 
-QMAKE_CXXFLAGS += -std=c++14 -stdlib=libc++
+QMAKE_CXXFLAGS += -std=c++14 -stdlib=libc++ -pthread
 
 INCLUDEPATH += /usr/local/include
 
-LIBS += -L/usr/local/lib -lglfw3 -lGLEW -F/System/Library/Frameworks -framework OpenGL
+LIBS += -pthread -L/usr/local/lib -lglfw3 -lGLEW -F/System/Library/Frameworks -framework OpenGL
 
 HEADERS += \
     stb_image.h \
@@ -0,0 +1,533 @@
+#ifndef __GLK_ATLAS_CACHE_H__
+#define __GLK_ATLAS_CACHE_H__
+
+#include "atlas.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//------------------------------------------------------------------------------------
+// .glka atlas cache
+//
+// A built atlas baked to disk: a header, one record per layer and per
+// image, the atlas's filenames, and then every layer's texels (RGBA or
+// compressed blocks), each starting on a page boundary. Loading maps the
+// file and hands each layer straight to glTexImage2D (or its compressed
+// counterpart), so nothing is decoded, packed or copied on the CPU.
+//
+// Each file carries a signature of whatever it was built from (see
+// atlas_source_signature); a load with a different one is refused,
+// which is how stale caches get rebuilt. Everything's stored in the
+// writer's byte order, and a file from the other one is refused too.
+//
+// Compressed layers are stored as the blocks they're uploaded as, and
+// mipmapped layers with every level, so a warm load never runs the
+// encoder or the mip builder. (ETC1 layers do get copied, since
+// that copy is the only way to insert into them later.)
+//------------------------------------------------------------------------------------
+
+#define GLK_ATLAS_CACHE_VERSION 3
+
+namespace glk {
+
+	struct glka_header_t {
+		char magic[4]; // "GLKA"
+		uint32_t byte_order; // 0x01020304 as written
+		uint32_t version;
+		uint32_t page_size;
+
+		uint64_t signature;
+		uint64_t file_length;
+
+		uint32_t num_layers;
+		uint32_t num_images;
+		uint32_t num_filenames;
+		uint32_t names_length; // NUL separated, right after the image records
+	};
+
+	struct glka_layer_t {
+		uint16_t width;
+		uint16_t height;
+		uint16_t format; // atlas_layer_format_t
+		uint16_t levels; // stored one after the other, level 0 first
+		uint64_t offset; // of the pixels, page aligned
+	};
+
+	enum {
+		glka_image_rotated = 1 << 0,
+		glka_image_removed = 1 << 1,
+		glka_image_opaque = 1 << 2
+	};
+
+	struct glka_image_t {
+		uint64_t filename_hash; // 0 if the atlas has no filename for it
+		uint64_t content_hash;
+
+		uint16_t x, y;
+		uint16_t w, h;
+		uint16_t trim_x, trim_y;
+		uint16_t source_w, source_h;
+
+		uint16_t slot;
+		uint8_t layer; // 0xFF unless placed; a removed slot with duplicates stays placed
+		uint8_t flags;
+		uint32_t reserved;
+	};
+
+	GLK_FUNC uint64_t glka_align(uint64_t offset, uint64_t page_size)
+	{
+		return (offset + page_size - 1) / page_size * page_size;
+	}
+
+	// Identifies what an atlas built from dirpath with atlas's settings
+	// would come out as on this device: every file's name, size and
+	// modification time, or with hash_contents set its bytes instead of
+	// the time, plus GL_MAX_TEXTURE_SIZE. Stable across directory
+	// listing order.
+	GLK_FUNC uint64_t atlas_source_signature(const atlas_t& atlas,
+		std::string dirpath, bool hash_contents = false)
+	{
+		if (dirpath[dirpath.size() - 1] != GLK_PATH_SEP)
+			dirpath.append(1, GLK_PATH_SEP);
+
+		std::vector<std::string> names;
+
+		DIR* dir = opendir(dirpath.c_str());
+
+		if (dir) {
+			struct dirent* ent = NULL;
+
+			while (!!(ent = readdir(dir)))
+				names.push_back(ent->d_name);
+
+			closedir(dir);
+		}
+
+		std::sort(names.begin(), names.end());
+
+		const atlas_pack_params_t& params = atlas.pack_params;
+
+		uint64_t settings[] = {
+			GLK_ATLAS_CACHE_VERSION,
+			GLK_ATLAS_DESIRED_BPP,
+			(uint64_t) params.packer,
+			(uint64_t) params.sort_race,
+			(uint64_t) params.root_size,
+			(uint64_t) params.layer_align,
+			(uint64_t) params.allow_rotation,
+			(uint64_t) params.block_align,
+			(uint64_t) atlas.compression_mode(),
+			(uint64_t) atlas.mipmap_levels(),
+			(uint64_t) atlas.trim_transparent(),
+			(uint64_t) atlas.dedupe_images(),
+			(uint64_t) atlas.downscaled(),
+			atlas.downscale_budget_bytes(),
+			(uint64_t) atlas.downscale_filter_mode(),
+			// The device caps layer sizes, and alignment rounds up to
+			// the cap, so the same settings pack differently elsewhere
+			(uint64_t) max_layer_dims()
+		};
+
+		uint64_t signature = hash64(settings, sizeof(settings));
+
+		for (const std::string& name: names) {
+			std::string filepath(dirpath + name);
+
+			struct stat info;
+
+			if (stat(filepath.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+				continue;
+
+			uint64_t record[3] = {
+				hash64(name.data(), name.size()),
+				(uint64_t) info.st_size,
+				(uint64_t) info.st_mtime
+			};
+
+			if (hash_contents) {
+				record[2] = 0;
+
+				int fd = open(filepath.c_str(), O_RDONLY);
+
+				if (fd >= 0 && info.st_size > 0) {
+					void* bytes = mmap(NULL, (size_t) info.st_size, PROT_READ,
+						MAP_PRIVATE, fd, 0);
+
+					if (bytes != MAP_FAILED) {
+						record[2] = hash64(bytes, (size_t) info.st_size);
+						munmap(bytes, (size_t) info.st_size);
+					}
+				}
+
+				if (fd >= 0)
+					close(fd);
+			}
+
+			signature = hash64(record, sizeof(record), signature);
+		}
+
+		return signature;
+	}
+
+	// Writes a built atlas to path. Layers captured as they were uploaded
+	// (see atlas_t::capture_layers) are written as they are; otherwise
+	// each layer is composed and encoded again, with spilled pixels read
+	// back in to do it, and an atlas whose pixels were dropped can't be
+	// saved.
+	GLK_FUNC bool save_atlas_cache(atlas_t& atlas, const std::string& path,
+		uint64_t signature)
+	{
+		bool captured = atlas.num_layers()
+			&& atlas.captured_layers.size() == atlas.num_layers();
+
+		if (!atlas.num_layers() || (!captured && !atlas.restore_pixels())) {
+			glk_logf("ERROR: nothing to save to %s; the atlas needs to be built "
+				"and still have its pixels", path.c_str());
+			return false;
+		}
+
+		uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+
+		std::string names;
+
+		for (const std::string& name: atlas.filenames) {
+			names.append(name);
+			names.append(1, '\0');
+		}
+
+		glka_header_t header;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "GLKA", 4);
+
+		header.byte_order = 0x01020304;
+		header.version = GLK_ATLAS_CACHE_VERSION;
+		header.page_size = (uint32_t) page_size;
+		header.signature = signature;
+		header.num_layers = (uint32_t) atlas.num_layers();
+		header.num_images = atlas.num_images;
+		header.num_filenames = (uint32_t) atlas.filenames.size();
+		header.names_length = (uint32_t) names.size();
+
+		std::vector<glka_layer_t> layers(atlas.num_layers());
+
+		uint64_t offset = glka_align(sizeof(header)
+			+ sizeof(glka_layer_t) * layers.size()
+			+ sizeof(glka_image_t) * atlas.num_images
+			+ names.size(), page_size);
+
+		for (size_t i = 0; i < layers.size(); ++i) {
+			layers[i].width = atlas.widths[i];
+			layers[i].height = atlas.heights[i];
+			layers[i].format = (uint16_t) atlas.layer_format(i);
+			layers[i].levels = (uint16_t) atlas.layer_levels(i);
+			layers[i].offset = offset;
+
+			offset = glka_align(offset + atlas_layer_chain_bytes(atlas.layer_format(i),
+				atlas.widths[i], atlas.heights[i], layers[i].levels), page_size);
+		}
+
+		header.file_length = offset;
+
+		std::vector<glka_image_t> images(atlas.num_images);
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			glka_image_t& r = images[i];
+
+			memset(&r, 0, sizeof(r));
+
+			if (i < atlas.filenames.size()) {
+				r.filename_hash = hash64(atlas.filenames[i].data(),
+					atlas.filenames[i].size());
+			}
+
+			r.content_hash = atlas.content_hashes[i];
+			r.w = atlas.dims_x[i];
+			r.h = atlas.dims_y[i];
+			r.trim_x = atlas.trim_x[i];
+			r.trim_y = atlas.trim_y[i];
+			r.source_w = atlas.source_x[i];
+			r.source_h = atlas.source_y[i];
+			r.slot = atlas.slots[i];
+			r.layer = 0xFF;
+
+			if (atlas.image_opaque(i))
+				r.flags |= glka_image_opaque;
+
+			if (atlas.image_removed(i))
+				r.flags |= glka_image_removed;
+
+			// A removed image keeps its place while duplicates still
+			// show its pixels
+			if (i < atlas.layers.size() && atlas.layers[i] != 0xFF) {
+				r.x = atlas.coords_x[i];
+				r.y = atlas.coords_y[i];
+				r.layer = atlas.layers[i];
+
+				if (atlas.image_rotated(i))
+					r.flags |= glka_image_rotated;
+			}
+		}
+
+		FILE* file = fopen(path.c_str(), "wb");
+
+		if (!file) {
+			glk_logf("ERROR: couldn't open %s for writing", path.c_str());
+			return false;
+		}
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fwrite(layers.data(), sizeof(glka_layer_t), layers.size(), file) == layers.size()
+			&& fwrite(images.data(), sizeof(glka_image_t), images.size(), file) == images.size()
+			&& fwrite(names.data(), 1, names.size(), file) == names.size();
+
+		std::vector<uint8_t> encoded;
+
+		for (size_t i = 0; i < layers.size() && ok; ++i) {
+			const std::vector<uint8_t>* pixels = &encoded;
+
+			if (captured)
+				pixels = &atlas.captured_layers[i];
+			else
+				encode_atlas_layer(atlas, (uint8_t) i, encoded);
+
+			ok = fseeko(file, (off_t) layers[i].offset, SEEK_SET) == 0
+				&& fwrite(pixels->data(), 1, pixels->size(), file) == pixels->size();
+		}
+
+		// Pad out the last page, so the loader can map whole pages; a
+		// layer which already ends on one mustn't lose its last byte
+		ok = ok && (ftello(file) == (off_t) header.file_length
+			|| (fseeko(file, (off_t) header.file_length - 1, SEEK_SET) == 0
+				&& fputc(0, file) != EOF));
+
+		ok = (fclose(file) == 0) && ok;
+
+		if (!ok) {
+			glk_logf("ERROR: couldn't write %s", path.c_str());
+			remove(path.c_str());
+		}
+
+		if (!captured)
+			atlas.evict_pixels();
+
+		return ok;
+	}
+
+	// Replaces atlas with the one baked into path, if path's there, is
+	// intact and carries signature. The loaded atlas has no CPU copy of
+	// its pixels, so it behaves as if they'd been dropped after upload:
+	// images can be inserted and removed, but it can't be repacked.
+	GLK_FUNC bool load_atlas_cache(atlas_t& atlas, const std::string& path,
+		uint64_t signature)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+
+		if (fd < 0)
+			return false;
+
+		struct stat info;
+
+		if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(glka_header_t)) {
+			close(fd);
+			return false;
+		}
+
+		size_t length = (size_t) info.st_size;
+
+		void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		close(fd);
+
+		if (mapping == MAP_FAILED)
+			return false;
+
+		const uint8_t* base = (const uint8_t*) mapping;
+
+		glka_header_t header;
+		memcpy(&header, base, sizeof(header));
+
+		uint64_t tables_length = sizeof(header)
+			+ sizeof(glka_layer_t) * (uint64_t) header.num_layers
+			+ sizeof(glka_image_t) * (uint64_t) header.num_images
+			+ header.names_length;
+
+		bool valid = memcmp(header.magic, "GLKA", 4) == 0
+			&& header.byte_order == 0x01020304
+			&& header.version == GLK_ATLAS_CACHE_VERSION
+			&& header.signature == signature
+			&& header.file_length == length
+			&& header.page_size != 0
+			&& (header.page_size & (header.page_size - 1)) == 0
+			&& header.num_layers > 0 && header.num_layers < 0xFF
+			&& header.num_images < atlas_t::no_image_index
+			&& header.num_filenames <= header.num_images
+			&& tables_length <= length;
+
+		const glka_layer_t* layers = (const glka_layer_t*) (base + sizeof(header));
+		const glka_image_t* images = (const glka_image_t*) (layers + (valid ? header.num_layers : 0));
+		const char* names = (const char*) (images + (valid ? header.num_images : 0));
+
+		for (uint32_t i = 0; i < header.num_layers && valid; ++i) {
+			valid = layers[i].width && layers[i].height
+				&& layers[i].format <= atlas_layer_etc2_rgba
+				&& layers[i].levels == atlas_layer_levels(atlas.mipmap_levels(),
+					layers[i].width, layers[i].height)
+				&& layers[i].offset % header.page_size == 0
+				&& layers[i].offset + atlas_layer_chain_bytes(
+					(atlas_layer_format_t) layers[i].format,
+					layers[i].width, layers[i].height, layers[i].levels) <= length;
+		}
+
+		for (uint32_t i = 0; i < header.num_images && valid; ++i) {
+			const glka_image_t& r = images[i];
+
+			valid = r.slot < header.num_images
+				&& (r.layer == 0xFF || (r.layer < header.num_layers
+					&& (uint32_t) r.x + ((r.flags & glka_image_rotated) ? r.h : r.w)
+						<= layers[r.layer].width
+					&& (uint32_t) r.y + ((r.flags & glka_image_rotated) ? r.w : r.h)
+						<= layers[r.layer].height));
+		}
+
+		// Slots are one step deep: a duplicate shows an image which is
+		// its own slot, and which is placed wherever the duplicate is.
+		// Anything else would have same_pixels or remove_image follow
+		// a chain, or a cycle.
+		for (uint32_t i = 0; i < header.num_images && valid; ++i) {
+			const glka_image_t& r = images[i];
+
+			valid = images[r.slot].slot == r.slot
+				&& (r.layer == 0xFF || images[r.slot].layer != 0xFF);
+		}
+
+		// Exactly num_filenames NUL terminated names, filling names_length
+		if (valid) {
+			const char* name = names;
+			const char* names_end = names + header.names_length;
+
+			for (uint32_t i = 0; i < header.num_filenames && valid; ++i) {
+				const char* end = (const char*) memchr(name, '\0', (size_t) (names_end - name));
+
+				if (end)
+					name = end + 1;
+				else
+					valid = false;
+			}
+
+			valid = valid && name == names_end;
+		}
+
+		if (!valid) {
+			glk_logf("Cache %s is stale or damaged; ignoring it", path.c_str());
+			munmap(mapping, length);
+			return false;
+		}
+
+		madvise(mapping, length, MADV_SEQUENTIAL);
+
+		atlas.free_memory();
+
+		atlas.num_images = header.num_images;
+		atlas.pixels_dropped = true;
+
+		atlas.slot_refs.assign(header.num_images, 0);
+		atlas.removed.assign(header.num_images, 0);
+		atlas.rotated.assign(header.num_images, 0);
+		atlas.layers.assign(header.num_images, 0xFF);
+		atlas.pixel_spans.assign(header.num_images, pixel_span_t { 0, 0, 0, 0 });
+
+		for (uint16_t i = 0; i < header.num_images; ++i) {
+			const glka_image_t& r = images[i];
+
+			atlas.dims_x.push_back(r.w);
+			atlas.dims_y.push_back(r.h);
+			atlas.coords_x.push_back(r.x);
+			atlas.coords_y.push_back(r.y);
+			atlas.trim_x.push_back(r.trim_x);
+			atlas.trim_y.push_back(r.trim_y);
+			atlas.source_x.push_back(r.source_w);
+			atlas.source_y.push_back(r.source_h);
+			atlas.slots.push_back(r.slot);
+			atlas.content_hashes.push_back(r.content_hash);
+
+			atlas.layers[i] = r.layer;
+			atlas.rotated[i] = (r.flags & glka_image_rotated) ? 1 : 0;
+			atlas.opaque.push_back((r.flags & glka_image_opaque) ? 1 : 0);
+
+			if (r.flags & glka_image_removed) {
+				atlas.removed[i] = 1;
+				continue;
+			}
+
+			atlas.slot_refs[r.slot]++;
+
+			if (r.slot != i) {
+				atlas.num_duplicates++;
+				atlas.duplicate_bytes += (uint64_t) r.w * r.h * GLK_ATLAS_DESIRED_BPP;
+			}
+		}
+
+		for (uint16_t i = 0; i < header.num_images; ++i) {
+			if (atlas.slot_live(i)) {
+				atlas.area_accum += (uint32_t) atlas.dims_x[i] * atlas.dims_y[i];
+
+				if (atlas.dedupe_images())
+					atlas.content_map.insert(atlas.content_hashes[i], i);
+			}
+		}
+
+		for (const char* name = names; atlas.filenames.size() < header.num_filenames;
+			name += strlen(name) + 1)
+			atlas.filenames.push_back(std::string(name));
+
+		atlas.build_filename_map();
+
+		for (uint32_t i = 0; i < header.num_layers; ++i)
+			atlas.push_layer(layers[i].width, layers[i].height, base + layers[i].offset,
+				(atlas_layer_format_t) layers[i].format);
+
+		atlas.build_records();
+
+		munmap(mapping, length);
+
+		glk_logf("Loaded %lu images in %lu layers from %s",
+			atlas.num_images, atlas.num_layers(), path.c_str());
+
+		return true;
+	}
+
+	// make_atlas_from_dir, through a cache at cache_path: loaded from it
+	// if it matches dirpath's current contents, otherwise built and then
+	// saved to it. The build captures its layers as they're uploaded, so
+	// the cache is written from those whatever the residency policy. An
+	// atlas which failed to build isn't saved, and false is returned; one
+	// which built but couldn't be saved is logged, and still returns true.
+	GLK_FUNC bool make_atlas_from_dir_cached(atlas_t& atlas, const std::string& dirpath,
+		const std::string& cache_path, bool hash_contents = false)
+	{
+		uint64_t signature = atlas_source_signature(atlas, dirpath, hash_contents);
+
+		if (load_atlas_cache(atlas, cache_path, signature))
+			return true;
+
+		atlas.capture_layers = true;
+
+		bool built = make_atlas_from_dir(atlas, dirpath);
+
+		if (built && !save_atlas_cache(atlas, cache_path, signature)) {
+			glk_logf("Warning: %s was built but couldn't be cached to %s; "
+				"it'll be built again next time", dirpath.c_str(), cache_path.c_str());
+		}
+
+		atlas.capture_layers = false;
+		std::vector<std::vector<uint8_t>>().swap(atlas.captured_layers);
+
+		return built;
+	}
+
+} // namespace glk
+
+#endif // __GLK_ATLAS_CACHE_H__
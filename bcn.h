@@ -0,0 +1,664 @@
+#ifndef __GLK_BCN_H__
+#define __GLK_BCN_H__
+
+#include "main_def.h"
+#include "parallel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+//------------------------------------------------------------------------------------
+// BC1 / BC3 (DXT1 / DXT5) block compression
+//
+// Encoders and reference decoders for 4 x 4 blocks of RGBA8 texels,
+// plus whole images split across threads. Nothing here touches GL, so
+// the codec can be checked on the CPU alone: decode what was encoded
+// and compare.
+//
+// Colors are fit along the block's principal axis, then refined by
+// least squares; indices always go to the nearest palette entry, which
+// is where the SIMD goes. Both palettes are computed with the same
+// integer arithmetic the reference decoders use.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	enum bcn_format_t {
+		bcn_bc1 = 0, // opaque RGB, 8 bytes per block
+		bcn_bc3 // RGBA, 16 bytes per block
+	};
+
+	GLK_FUNC size_t bcn_block_bytes(bcn_format_t format)
+	{
+		return format == bcn_bc1 ? 8 : 16;
+	}
+
+	GLK_FUNC size_t bcn_encoded_size(bcn_format_t format, size_t width, size_t height)
+	{
+		return ((width + 3) / 4) * ((height + 3) / 4) * bcn_block_bytes(format);
+	}
+
+	GLK_FUNC uint16_t bcn_pack565(int r, int g, int b)
+	{
+		r = std::min(std::max(r, 0), 255);
+		g = std::min(std::max(g, 0), 255);
+		b = std::min(std::max(b, 0), 255);
+
+		return (uint16_t) ((((r * 31 + 127) / 255) << 11)
+			| (((g * 63 + 127) / 255) << 5)
+			| ((b * 31 + 127) / 255));
+	}
+
+	GLK_FUNC void bcn_unpack565(uint16_t c, int* rgb)
+	{
+		int r = (c >> 11) & 31;
+		int g = (c >> 5) & 63;
+		int b = c & 31;
+
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	}
+
+	// Four color mode when c0 > c1 (or always, for BC3's color half);
+	// otherwise three colors and transparent black, which the encoders
+	// never produce.
+	GLK_FUNC void bc1_palette(uint16_t c0, uint16_t c1, int palette[4][3],
+		bool four_colors = false)
+	{
+		bcn_unpack565(c0, palette[0]);
+		bcn_unpack565(c1, palette[1]);
+
+		for (int i = 0; i < 3; ++i) {
+			if (c0 > c1 || four_colors) {
+				palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+				palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+			} else {
+				palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+				palette[3][i] = 0;
+			}
+		}
+	}
+
+	// Eight values when a0 > a1; otherwise six, plus 0 and 255.
+	GLK_FUNC void bc3_alpha_palette(uint8_t a0, uint8_t a1, int palette[8])
+	{
+		palette[0] = a0;
+		palette[1] = a1;
+
+		if (a0 > a1) {
+			for (int i = 2; i < 8; ++i)
+				palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+		} else {
+			for (int i = 2; i < 6; ++i)
+				palette[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+	}
+
+	//------------------
+	// reference decoders
+	//
+	// out receives 16 RGBA texels, row by row.
+	//------------------
+
+	GLK_FUNC void bc1_decode_color(const uint8_t* block, uint8_t* out, bool bc3)
+	{
+		uint16_t c0 = (uint16_t) (block[0] | (block[1] << 8));
+		uint16_t c1 = (uint16_t) (block[2] | (block[3] << 8));
+
+		int palette[4][3];
+		bc1_palette(c0, c1, palette, bc3);
+
+		uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16)
+			| ((uint32_t) block[7] << 24);
+
+		for (int t = 0; t < 16; ++t) {
+			uint32_t index = (indices >> (2 * t)) & 3;
+
+			out[t * 4 + 0] = (uint8_t) palette[index][0];
+			out[t * 4 + 1] = (uint8_t) palette[index][1];
+			out[t * 4 + 2] = (uint8_t) palette[index][2];
+			out[t * 4 + 3] = (!bc3 && c0 <= c1 && index == 3) ? 0 : 255;
+		}
+	}
+
+	GLK_FUNC void bc1_decode_block(const uint8_t* block, uint8_t* out)
+	{
+		bc1_decode_color(block, out, false);
+	}
+
+	GLK_FUNC void bc3_decode_block(const uint8_t* block, uint8_t* out)
+	{
+		bc1_decode_color(block + 8, out, true);
+
+		int palette[8];
+		bc3_alpha_palette(block[0], block[1], palette);
+
+		uint64_t indices = 0;
+
+		for (int i = 0; i < 6; ++i)
+			indices |= (uint64_t) block[2 + i] << (8 * i);
+
+		for (int t = 0; t < 16; ++t)
+			out[t * 4 + 3] = (uint8_t) palette[(indices >> (3 * t)) & 7];
+	}
+
+	//------------------
+	// encoders
+	//------------------
+
+	// Spreads the low 8 bits of m out to every other bit, so a mask of
+	// texels can be or'd into a row of 2 bit indices.
+	GLK_FUNC uint32_t bcn_spread_bits(uint32_t m)
+	{
+		m = (m | (m << 4)) & 0x0F0F;
+		m = (m | (m << 2)) & 0x3333;
+		m = (m | (m << 1)) & 0x5555;
+
+		return m;
+	}
+
+	// Nearest palette entry for each of 16 texels (planar r, g, b);
+	// returns the packed 2 bit indices and adds the squared error up
+	// in *error. Ties go to the lower index on every path.
+	GLK_FUNC uint32_t bc1_fit_indices(const float* r, const float* g, const float* b,
+		const int palette[4][3], float* error)
+	{
+		uint32_t indices = 0;
+		float total = 0.0f;
+
+#if defined(__AVX__)
+		for (int t = 0; t < 16; t += 8) {
+			__m256 R = _mm256_loadu_ps(r + t);
+			__m256 G = _mm256_loadu_ps(g + t);
+			__m256 B = _mm256_loadu_ps(b + t);
+
+			__m256 d[4];
+
+			for (int k = 0; k < 4; ++k) {
+				__m256 dr = _mm256_sub_ps(R, _mm256_set1_ps((float) palette[k][0]));
+				__m256 dg = _mm256_sub_ps(G, _mm256_set1_ps((float) palette[k][1]));
+				__m256 db = _mm256_sub_ps(B, _mm256_set1_ps((float) palette[k][2]));
+
+				d[k] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr),
+					_mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+			}
+
+			__m256 best = _mm256_min_ps(_mm256_min_ps(d[0], d[1]),
+				_mm256_min_ps(d[2], d[3]));
+
+			uint32_t taken = 0;
+
+			for (uint32_t k = 0; k < 4; ++k) {
+				uint32_t m = (uint32_t) _mm256_movemask_ps(
+					_mm256_cmp_ps(d[k], best, _CMP_EQ_OQ)) & ~taken;
+
+				taken |= m;
+				indices |= (bcn_spread_bits(m) * k) << (2 * t);
+			}
+
+			__m128 sum = _mm_add_ps(_mm256_castps256_ps128(best),
+				_mm256_extractf128_ps(best, 1));
+
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+			total += _mm_cvtss_f32(sum);
+		}
+#elif defined(__SSE2__)
+		for (int t = 0; t < 16; t += 4) {
+			__m128 R = _mm_loadu_ps(r + t);
+			__m128 G = _mm_loadu_ps(g + t);
+			__m128 B = _mm_loadu_ps(b + t);
+
+			__m128 best = _mm_set1_ps(FLT_MAX);
+			__m128i best_index = _mm_setzero_si128();
+
+			for (int k = 0; k < 4; ++k) {
+				__m128 dr = _mm_sub_ps(R, _mm_set1_ps((float) palette[k][0]));
+				__m128 dg = _mm_sub_ps(G, _mm_set1_ps((float) palette[k][1]));
+				__m128 db = _mm_sub_ps(B, _mm_set1_ps((float) palette[k][2]));
+
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr),
+					_mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+				__m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+
+				best = _mm_min_ps(d, best);
+				best_index = _mm_or_si128(_mm_andnot_si128(closer, best_index),
+					_mm_and_si128(closer, _mm_set1_epi32(k)));
+			}
+
+			// Each index's two bits, moved into place with movemask
+			uint32_t lo = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+				_mm_slli_epi32(best_index, 31)));
+
+			uint32_t hi = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+				_mm_slli_epi32(best_index, 30)));
+
+			indices |= (bcn_spread_bits(lo) | (bcn_spread_bits(hi) << 1)) << (2 * t);
+
+			__m128 sum = _mm_add_ps(best, _mm_movehl_ps(best, best));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+			total += _mm_cvtss_f32(sum);
+		}
+#else
+		for (int t = 0; t < 16; ++t) {
+			float best = FLT_MAX;
+			uint32_t best_index = 0;
+
+			for (int k = 0; k < 4; ++k) {
+				float dr = r[t] - palette[k][0];
+				float dg = g[t] - palette[k][1];
+				float db = b[t] - palette[k][2];
+				float d = dr * dr + dg * dg + db * db;
+
+				if (d < best) {
+					best = d;
+					best_index = k;
+				}
+			}
+
+			indices |= best_index << (2 * t);
+			total += best;
+		}
+#endif
+		*error += total;
+
+		return indices;
+	}
+
+	// Puts c0 > c1 so the block decodes in four color mode, for a
+	// palette fit with hi and lo in either order.
+	GLK_FUNC void bc1_write_color(uint8_t* out, uint16_t hi, uint16_t lo, uint32_t indices)
+	{
+		if (hi < lo) {
+			std::swap(hi, lo);
+			indices ^= 0x55555555; // 0 <-> 1, 2 <-> 3
+		}
+
+		if (hi == lo)
+			indices = 0;
+
+		out[0] = (uint8_t) hi;
+		out[1] = (uint8_t) (hi >> 8);
+		out[2] = (uint8_t) lo;
+		out[3] = (uint8_t) (lo >> 8);
+		out[4] = (uint8_t) indices;
+		out[5] = (uint8_t) (indices >> 8);
+		out[6] = (uint8_t) (indices >> 16);
+		out[7] = (uint8_t) (indices >> 24);
+	}
+
+	// Scores endpoints a and b the way they'll be decoded (in whichever
+	// order gives four colors); indices come back for a first.
+	GLK_FUNC uint32_t bc1_try_endpoints(const float* r, const float* g, const float* b,
+		uint16_t a, uint16_t c, float* error)
+	{
+		int palette[4][3];
+
+		if (a == c) {
+			bc1_palette(a, c, palette);
+
+			// A single color: index 0 everywhere
+			palette[1][0] = palette[2][0] = palette[3][0] = palette[0][0];
+			palette[1][1] = palette[2][1] = palette[3][1] = palette[0][1];
+			palette[1][2] = palette[2][2] = palette[3][2] = palette[0][2];
+		} else if (a > c) {
+			bc1_palette(a, c, palette);
+		} else {
+			// Same palette, indices mapped back for a first
+			int swapped[4][3];
+			bc1_palette(c, a, swapped);
+
+			for (int i = 0; i < 3; ++i) {
+				palette[0][i] = swapped[1][i];
+				palette[1][i] = swapped[0][i];
+				palette[2][i] = swapped[3][i];
+				palette[3][i] = swapped[2][i];
+			}
+		}
+
+		*error = 0.0f;
+
+		return bc1_fit_indices(r, g, b, palette, error);
+	}
+
+	GLK_FUNC void bc1_encode_color(const uint8_t* texels, uint8_t* out)
+	{
+		float r[16], g[16], b[16];
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+
+		int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+
+		for (int t = 0; t < 16; ++t) {
+			r[t] = texels[t * 4 + 0];
+			g[t] = texels[t * 4 + 1];
+			b[t] = texels[t * 4 + 2];
+
+			mean[0] += r[t];
+			mean[1] += g[t];
+			mean[2] += b[t];
+
+			for (int i = 0; i < 3; ++i) {
+				lo[i] = std::min(lo[i], (int) texels[t * 4 + i]);
+				hi[i] = std::max(hi[i], (int) texels[t * 4 + i]);
+			}
+		}
+
+		if (lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2]) {
+			uint16_t c = bcn_pack565(lo[0], lo[1], lo[2]);
+			bc1_write_color(out, c, c, 0);
+			return;
+		}
+
+		for (int i = 0; i < 3; ++i)
+			mean[i] /= 16.0f;
+
+		// Principal axis of the block, by power iteration on the
+		// covariance, starting from the bounding box's diagonal
+		float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+		for (int t = 0; t < 16; ++t) {
+			float dr = r[t] - mean[0], dg = g[t] - mean[1], db = b[t] - mean[2];
+
+			cov[0] += dr * dr;
+			cov[1] += dr * dg;
+			cov[2] += dr * db;
+			cov[3] += dg * dg;
+			cov[4] += dg * db;
+			cov[5] += db * db;
+		}
+
+		float axis[3] = {
+			(float) (hi[0] - lo[0]),
+			(float) (hi[1] - lo[1]),
+			(float) (hi[2] - lo[2])
+		};
+
+		for (int iter = 0; iter < 4; ++iter) {
+			float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+			float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+			float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+
+			float m = std::max(std::max(fabsf(x), fabsf(y)), fabsf(z));
+
+			if (m < 1e-6f)
+				break;
+
+			axis[0] = x / m;
+			axis[1] = y / m;
+			axis[2] = z / m;
+		}
+
+		int min_t = 0, max_t = 0;
+		float min_p = FLT_MAX, max_p = -FLT_MAX;
+
+		for (int t = 0; t < 16; ++t) {
+			float p = r[t] * axis[0] + g[t] * axis[1] + b[t] * axis[2];
+
+			if (p < min_p) {
+				min_p = p;
+				min_t = t;
+			}
+
+			if (p > max_p) {
+				max_p = p;
+				max_t = t;
+			}
+		}
+
+		uint16_t best_a = bcn_pack565((int) r[max_t], (int) g[max_t], (int) b[max_t]);
+		uint16_t best_b = bcn_pack565((int) r[min_t], (int) g[min_t], (int) b[min_t]);
+
+		float best_error;
+		uint32_t best_indices = bc1_try_endpoints(r, g, b, best_a, best_b, &best_error);
+
+		// Least squares endpoints for the current indices, kept if
+		// they decode closer
+		static const float weight_a[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+		for (int iter = 0; iter < 2; ++iter) {
+			float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+			float ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+
+			for (int t = 0; t < 16; ++t) {
+				float wa = weight_a[(best_indices >> (2 * t)) & 3];
+				float wb = 1.0f - wa;
+
+				aa += wa * wa;
+				ab += wa * wb;
+				bb += wb * wb;
+
+				ax[0] += wa * r[t];
+				ax[1] += wa * g[t];
+				ax[2] += wa * b[t];
+
+				bx[0] += wb * r[t];
+				bx[1] += wb * g[t];
+				bx[2] += wb * b[t];
+			}
+
+			float det = aa * bb - ab * ab;
+
+			if (fabsf(det) < 1e-6f)
+				break;
+
+			int ea[3], eb[3];
+
+			for (int i = 0; i < 3; ++i) {
+				ea[i] = (int) ((ax[i] * bb - bx[i] * ab) / det + 0.5f);
+				eb[i] = (int) ((bx[i] * aa - ax[i] * ab) / det + 0.5f);
+			}
+
+			uint16_t a = bcn_pack565(ea[0], ea[1], ea[2]);
+			uint16_t c = bcn_pack565(eb[0], eb[1], eb[2]);
+
+			if (a == best_a && c == best_b)
+				break;
+
+			float error;
+			uint32_t indices = bc1_try_endpoints(r, g, b, a, c, &error);
+
+			if (error >= best_error)
+				break;
+
+			best_a = a;
+			best_b = c;
+			best_error = error;
+			best_indices = indices;
+		}
+
+		bc1_write_color(out, best_a, best_b, best_indices);
+	}
+
+	GLK_FUNC uint64_t bc3_fit_alpha(const uint8_t* texels, uint8_t a0, uint8_t a1,
+		int* error)
+	{
+		int palette[8];
+		bc3_alpha_palette(a0, a1, palette);
+
+		uint64_t indices = 0;
+		*error = 0;
+
+		for (int t = 0; t < 16; ++t) {
+			int a = texels[t * 4 + 3];
+			int best = INT32_MAX, best_index = 0;
+
+			for (int k = 0; k < 8; ++k) {
+				int d = (a - palette[k]) * (a - palette[k]);
+
+				if (d < best) {
+					best = d;
+					best_index = k;
+				}
+			}
+
+			indices |= (uint64_t) best_index << (3 * t);
+			*error += best;
+		}
+
+		return indices;
+	}
+
+	GLK_FUNC void bc3_encode_alpha(const uint8_t* texels, uint8_t* out)
+	{
+		int lo = 255, hi = 0;
+		int inner_lo = 255, inner_hi = 0; // ignoring 0 and 255
+
+		for (int t = 0; t < 16; ++t) {
+			int a = texels[t * 4 + 3];
+
+			lo = std::min(lo, a);
+			hi = std::max(hi, a);
+
+			if (a != 0 && a != 255) {
+				inner_lo = std::min(inner_lo, a);
+				inner_hi = std::max(inner_hi, a);
+			}
+		}
+
+		uint8_t a0 = (uint8_t) hi, a1 = (uint8_t) lo;
+		int error = 0;
+		uint64_t indices = 0;
+
+		if (hi != lo) {
+			indices = bc3_fit_alpha(texels, a0, a1, &error);
+
+			// Six values plus exact 0 and 255 can win on blocks
+			// with hard edges
+			if (error && (lo == 0 || hi == 255)) {
+				uint8_t b0 = (uint8_t) (inner_lo <= inner_hi ? inner_lo : lo);
+				uint8_t b1 = (uint8_t) (inner_lo <= inner_hi ? inner_hi : lo);
+
+				int six_error;
+				uint64_t six = bc3_fit_alpha(texels, b0, b1, &six_error);
+
+				if (six_error < error) {
+					a0 = b0;
+					a1 = b1;
+					indices = six;
+				}
+			}
+		}
+
+		out[0] = a0;
+		out[1] = a1;
+
+		for (int i = 0; i < 6; ++i)
+			out[2 + i] = (uint8_t) (indices >> (8 * i));
+	}
+
+	GLK_FUNC void bc1_encode_block(const uint8_t* texels, uint8_t* out)
+	{
+		bc1_encode_color(texels, out);
+	}
+
+	GLK_FUNC void bc3_encode_block(const uint8_t* texels, uint8_t* out)
+	{
+		bc3_encode_alpha(texels, out);
+		bc1_encode_color(texels, out + 8);
+	}
+
+	//------------------
+	// images
+	//------------------
+
+	// Copies the 4 x 4 block at (bx, by) out of an image, repeating the
+	// last row and column where the image doesn't fill it.
+	GLK_FUNC void bcn_gather_block(const uint8_t* rgba, size_t width, size_t height,
+		size_t stride, size_t bx, size_t by, uint8_t* texels)
+	{
+		for (size_t y = 0; y < 4; ++y) {
+			size_t sy = std::min(by * 4 + y, height - 1);
+
+			for (size_t x = 0; x < 4; ++x) {
+				size_t sx = std::min(bx * 4 + x, width - 1);
+
+				memcpy(texels + (y * 4 + x) * 4, rgba + sy * stride + sx * 4, 4);
+			}
+		}
+	}
+
+	GLK_FUNC void bcn_encode_rows(const uint8_t* rgba, size_t width, size_t height,
+		size_t stride, bcn_format_t format, uint8_t* out, size_t first_row, size_t end_row)
+	{
+		size_t blocks_x = (width + 3) / 4;
+		size_t block_bytes = bcn_block_bytes(format);
+
+		uint8_t texels[64];
+
+		for (size_t by = first_row; by < end_row; ++by) {
+			for (size_t bx = 0; bx < blocks_x; ++bx) {
+				bcn_gather_block(rgba, width, height, stride, bx, by, texels);
+
+				uint8_t* block = out + (by * blocks_x + bx) * block_bytes;
+
+				if (format == bcn_bc1)
+					bc1_encode_block(texels, block);
+				else
+					bc3_encode_block(texels, block);
+			}
+		}
+	}
+
+	// Encodes width x height RGBA texels (stride bytes per row) into
+	// out, which must hold bcn_encoded_size bytes. Rows of blocks are
+	// split across threads; 0 means one per hardware thread.
+	GLK_FUNC void bcn_encode_image(const uint8_t* rgba, size_t width, size_t height,
+		size_t stride, bcn_format_t format, uint8_t* out, unsigned threads = 0)
+	{
+		parallel_rows((height + 3) / 4, threads,
+			[=](size_t first, size_t end) {
+			bcn_encode_rows(rgba, width, height, stride, format, out, first, end);
+		});
+	}
+
+	GLK_FUNC void bcn_decode_image(const uint8_t* blocks, size_t width, size_t height,
+		bcn_format_t format, uint8_t* rgba)
+	{
+		size_t blocks_x = (width + 3) / 4;
+		size_t block_bytes = bcn_block_bytes(format);
+
+		uint8_t texels[64];
+
+		for (size_t by = 0; by < (height + 3) / 4; ++by) {
+			for (size_t bx = 0; bx < blocks_x; ++bx) {
+				const uint8_t* block = blocks + (by * blocks_x + bx) * block_bytes;
+
+				if (format == bcn_bc1)
+					bc1_decode_block(block, texels);
+				else
+					bc3_decode_block(block, texels);
+
+				for (size_t y = 0; y < 4 && by * 4 + y < height; ++y) {
+					for (size_t x = 0; x < 4 && bx * 4 + x < width; ++x) {
+						memcpy(rgba + ((by * 4 + y) * width + bx * 4 + x) * 4,
+							texels + (y * 4 + x) * 4, 4);
+					}
+				}
+			}
+		}
+	}
+
+} // namespace glk
+
+#endif // __GLK_BCN_H__
@@ -0,0 +1,40 @@
+#ifndef __GLK_BITS_H__
+#define __GLK_BITS_H__
+
+#include "main_def.h"
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace glk {
+
+    // Index of the lowest set bit; x must not be 0
+    GLK_FUNC uint32_t bit_scan_forward(uint32_t x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return (uint32_t) index;
+#else
+        return (uint32_t) __builtin_ctz(x);
+#endif
+    }
+
+    // Index of the highest set bit; x must not be 0
+    GLK_FUNC uint32_t bit_scan_reverse(uint32_t x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, x);
+        return (uint32_t) index;
+#else
+        return 31 - (uint32_t) __builtin_clz(x);
+#endif
+    }
+
+} // namespace glk
+
+#endif // __GLK_BITS_H__
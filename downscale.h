@@ -0,0 +1,358 @@
+#ifndef __GLK_DOWNSCALE_H__
+#define __GLK_DOWNSCALE_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------------
+// RGBA8 downscaling
+//
+// Box (area average) and bilinear reduction to any smaller size. Halving
+// and quartering with the box filter have kernels of their own; every
+// other size goes through a separable pass with precomputed weights:
+// each destination row is filtered down from its source rows into a
+// scratch row, then across. Filtering happens on the stored values, as
+// GL's own linear filtering does.
+//
+// src and dst may be the same buffer (with dst's stride no larger than
+// src's) as long as it's done on one thread: destination rows are only
+// written once the source rows they come from have been read, and no
+// later row reads from before them.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	enum downscale_filter_t {
+		downscale_box = 0,
+		downscale_bilinear
+	};
+
+	// extent divided by factor, rounding up: an odd last row or column
+	// still gets a texel of its own
+	GLK_FUNC size_t downscale_extent(size_t extent, size_t factor)
+	{
+		return (extent + factor - 1) / factor;
+	}
+
+	// Destination rows [first_row, end_row) of a box filter over factor x
+	// factor texels, for factor 2 or 4. Source rows and columns past the
+	// edge repeat the last one.
+	template <size_t factor>
+	void downscale_box_rows(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_stride,
+		size_t first_row, size_t end_row)
+	{
+		size_t dst_width = downscale_extent(width, factor);
+
+		size_t shift = factor == 4 ? 4 : 2;
+		uint32_t round = 1u << (shift - 1);
+
+		for (size_t y = first_row; y < end_row; ++y) {
+			const uint8_t* rows[4];
+
+			for (size_t k = 0; k < factor; ++k)
+				rows[k] = src + std::min(y * factor + k, height - 1) * src_stride;
+
+			uint8_t* out = dst + y * dst_stride;
+
+			size_t x = 0;
+
+#if defined(__SSE2__)
+			// Four destination texels at a time from 4 * factor source
+			// texels a row: rows are summed as 16 bit, then each texel's
+			// columns are folded together
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i bias = _mm_set1_epi16((short) round);
+
+			size_t simd_width = (width / (factor * 4)) * 4;
+
+			for (; x < simd_width; x += 4) {
+				__m128i folded[2];
+
+				for (size_t half = 0; half < 2; ++half) {
+					// Per 16 bit lane: a column sum of one source texel
+					// channel, two texels to a vector
+					__m128i sums[4];
+
+					for (size_t v = 0; v < factor / 2; ++v) {
+						sums[v * 2] = zero;
+						sums[v * 2 + 1] = zero;
+
+						for (size_t k = 0; k < factor; ++k) {
+							__m128i px = _mm_loadu_si128((const __m128i*)
+								(rows[k] + ((x + half * 2) * factor + v * 4) * 4));
+
+							sums[v * 2] = _mm_add_epi16(sums[v * 2],
+								_mm_unpacklo_epi8(px, zero));
+							sums[v * 2 + 1] = _mm_add_epi16(sums[v * 2 + 1],
+								_mm_unpackhi_epi8(px, zero));
+						}
+					}
+
+					// Two destination texels, one per 64 bit half; at 4 x 4
+					// the second load holds the other half of each
+					__m128i a = sums[0], b = sums[1];
+
+					if (factor == 4) {
+						a = _mm_add_epi16(sums[0], sums[1]);
+						b = _mm_add_epi16(sums[2], sums[3]);
+					}
+
+					__m128i total = _mm_add_epi16(_mm_unpacklo_epi64(a, b),
+						_mm_unpackhi_epi64(a, b));
+
+					folded[half] = _mm_srli_epi16(_mm_add_epi16(total, bias), (int) shift);
+				}
+
+				_mm_storeu_si128((__m128i*) (out + x * 4),
+					_mm_packus_epi16(folded[0], folded[1]));
+			}
+#endif
+			for (; x < dst_width; ++x) {
+				for (size_t c = 0; c < 4; ++c) {
+					uint32_t sum = 0;
+
+					for (size_t k = 0; k < factor; ++k) {
+						for (size_t i = 0; i < factor; ++i)
+							sum += rows[k][std::min(x * factor + i, width - 1) * 4 + c];
+					}
+
+					out[x * 4 + c] = (uint8_t) ((sum + round) >> shift);
+				}
+			}
+		}
+	}
+
+	// Which source texels a destination texel is filtered from along
+	// one axis, and how much each counts (out of 1 << 14). Taps come in
+	// pairs, the last one padded out with a weight of 0, and each pair's
+	// weights are packed into one value, first tap in the low half, so
+	// they can go straight into a madd.
+	struct downscale_taps_t {
+		std::vector<uint32_t> first; // per destination texel
+		std::vector<uint32_t> pairs;
+		std::vector<uint32_t> offset; // into weights
+		std::vector<uint32_t> weights;
+
+		static const int32_t one = 1 << 14;
+
+		void push(uint32_t a, const int32_t* w, uint32_t count)
+		{
+			first.push_back(a);
+			pairs.push_back((count + 1) / 2);
+			offset.push_back((uint32_t) weights.size());
+
+			for (uint32_t k = 0; k < count; k += 2) {
+				uint32_t w1 = k + 1 < count ? (uint32_t) w[k + 1] : 0;
+				weights.push_back((uint32_t) w[k] | (w1 << 16));
+			}
+		}
+
+		downscale_taps_t(size_t src, size_t dst, downscale_filter_t filter)
+		{
+			double scale = (double) src / (double) dst;
+
+			std::vector<int32_t> w;
+
+			for (size_t i = 0; i < dst; ++i) {
+				w.clear();
+
+				if (filter == downscale_bilinear) {
+					// Sample at the destination texel's center
+					double u = std::max((i + 0.5) * scale - 0.5, 0.0);
+					double lo = floor(u);
+
+					if (lo + 1.0 >= (double) src || u == lo) {
+						w.push_back((int32_t) one);
+					} else {
+						int32_t w1 = (int32_t) ((u - lo) * one + 0.5);
+
+						w.push_back(one - w1);
+						w.push_back(w1);
+					}
+
+					push((uint32_t) lo, w.data(), (uint32_t) w.size());
+					continue;
+				}
+
+				// Area average: every source texel the destination texel
+				// covers, weighed by how much of it is covered
+				double lo = i * scale;
+				double hi = std::min((i + 1) * scale, (double) src);
+
+				size_t a = (size_t) lo;
+				size_t b = std::min((size_t) ceil(hi), src);
+
+				int32_t left = one;
+
+				for (size_t k = a; k < b; ++k) {
+					double cover = std::min(hi, (double) k + 1) - std::max(lo, (double) k);
+					int32_t wk = k + 1 == b ? left : (int32_t) (cover / (hi - lo) * one + 0.5);
+
+					wk = std::min(wk, left);
+					left -= wk;
+
+					w.push_back(wk);
+				}
+
+				push((uint32_t) a, w.data(), (uint32_t) w.size());
+			}
+		}
+	};
+
+	// Destination rows [first_row, end_row), each filtered vertically into
+	// a row of 16 bit values scaled by 1 << 7, then horizontally
+	GLK_FUNC void downscale_separable_rows(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_width, size_t dst_stride,
+		const downscale_taps_t& across, const downscale_taps_t& down,
+		size_t first_row, size_t end_row)
+	{
+		// Past the last texel is a pair's worth of zeros, for a padded
+		// tap to read
+		std::vector<int16_t> row(width * 4 + 8);
+
+		for (size_t y = first_row; y < end_row; ++y) {
+			const uint32_t first = down.first[y];
+			const uint32_t pairs = down.pairs[y];
+			const uint32_t* wy = &down.weights[down.offset[y]];
+
+			// A padded tap reads the row above it again
+			const uint8_t* rows[2 * 64];
+			uint32_t num_rows = std::min(pairs, 64u) * 2;
+
+			for (uint32_t k = 0; k < num_rows; ++k)
+				rows[k] = src + std::min((size_t) first + k, height - 1) * src_stride;
+
+			size_t i = 0;
+
+#if defined(__SSE2__)
+			// Eight channels at a time; rows go in pairs through madd,
+			// each lane a source channel next to the one below it
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i bias = _mm_set1_epi32(1 << 6);
+
+			for (; pairs <= 64 && i + 8 <= width * 4; i += 8) {
+				__m128i lo = zero, hi = zero;
+
+				for (uint32_t k = 0; k < pairs; ++k) {
+					__m128i a = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((const __m128i*) (rows[k * 2] + i)), zero);
+					__m128i b = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((const __m128i*) (rows[k * 2 + 1] + i)), zero);
+					__m128i w = _mm_set1_epi32((int) wy[k]);
+
+					lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+					hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+				}
+
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), 7);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), 7);
+
+				_mm_storeu_si128((__m128i*) &row[i], _mm_packs_epi32(lo, hi));
+			}
+#endif
+			for (; i < width * 4; ++i) {
+				int32_t sum = 0;
+
+				for (uint32_t k = 0; k < pairs * 2; ++k) {
+					size_t r = std::min((size_t) first + k, height - 1);
+					sum += src[r * src_stride + i] * (int16_t) (wy[k / 2] >> (k % 2 * 16));
+				}
+
+				row[i] = (int16_t) ((sum + (1 << 6)) >> 7);
+			}
+
+			uint8_t* out = dst + y * dst_stride;
+
+			for (size_t x = 0; x < dst_width; ++x) {
+				const int16_t* texels = &row[across.first[x] * 4];
+				const uint32_t* wx = &across.weights[across.offset[x]];
+				const uint32_t cx = across.pairs[x];
+
+#if defined(__SSE2__)
+				// Each pair of source texels is one load, which is
+				// interleaved with itself to put each channel next to
+				// the same channel of the next texel
+				__m128i sum = _mm_set1_epi32(1 << 20);
+
+				for (uint32_t k = 0; k < cx; ++k) {
+					__m128i ab = _mm_loadu_si128((const __m128i*) (texels + k * 8));
+
+					sum = _mm_add_epi32(sum, _mm_madd_epi16(
+						_mm_unpacklo_epi16(ab, _mm_srli_si128(ab, 8)),
+						_mm_set1_epi32((int) wx[k])));
+				}
+
+				sum = _mm_srai_epi32(sum, 21);
+				sum = _mm_packs_epi32(sum, sum);
+
+				uint32_t texel = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+
+				memcpy(out + x * 4, &texel, 4);
+#else
+				for (size_t c = 0; c < 4; ++c) {
+					int32_t sum = 1 << 20;
+
+					for (uint32_t k = 0; k < cx * 2; ++k)
+						sum += texels[k * 4 + c] * (int16_t) (wx[k / 2] >> (k % 2 * 16));
+
+					out[x * 4 + c] = (uint8_t) std::min(std::max(sum >> 21, 0), 255);
+				}
+#endif
+			}
+		}
+	}
+
+	// Scales width x height texels at src (src_stride bytes per row)
+	// down to dst_width x dst_height at dst. Halving or quartering with
+	// the box filter, rounding up as downscale_extent does, takes the
+	// fast path. Rows are split across threads, 0 meaning one per
+	// hardware thread; in place takes 1.
+	GLK_FUNC void downscale_rgba(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_width, size_t dst_height,
+		size_t dst_stride, downscale_filter_t filter = downscale_box, unsigned threads = 1)
+	{
+		if (filter == downscale_box) {
+			for (size_t factor = 2; factor <= 4; factor += 2) {
+				if (dst_width == downscale_extent(width, factor)
+					&& dst_height == downscale_extent(height, factor)) {
+					parallel_rows(dst_height, threads,
+						[=](size_t first, size_t end) {
+						if (factor == 2)
+							downscale_box_rows<2>(src, width, height, src_stride,
+								dst, dst_stride, first, end);
+						else
+							downscale_box_rows<4>(src, width, height, src_stride,
+								dst, dst_stride, first, end);
+					});
+					return;
+				}
+			}
+		}
+
+		downscale_taps_t across(width, dst_width, filter);
+		downscale_taps_t down(height, dst_height, filter);
+
+		parallel_rows(dst_height, threads,
+			[&](size_t first, size_t end) {
+			downscale_separable_rows(src, width, height, src_stride, dst, dst_width,
+				dst_stride, across, down, first, end);
+		});
+	}
+
+} // namespace glk
+
+#endif // __GLK_DOWNSCALE_H__
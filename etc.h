@@ -0,0 +1,619 @@
+#ifndef __GLK_ETC_H__
+#define __GLK_ETC_H__
+
+#include "bcn.h"
+
+//------------------------------------------------------------------------------------
+// ETC1 / ETC2 block compression
+//
+// Encoders and reference decoders for the formats ES devices have:
+//
+// - ETC1 (OES_compressed_ETC1_RGB8_texture), 8 bytes per 4 x 4 block
+//   of RGB. ES2 has nothing with alpha, so translucent textures carry
+//   their alpha as a second ETC1 texture - etc_etc1_alpha encodes the
+//   alpha channel as grey for that - and shaders read it from there.
+//
+// - ETC2 RGBA8 (ES3's GL_COMPRESSED_RGBA8_ETC2_EAC), 16 bytes per block:
+//   an EAC alpha block followed by an ETC2 color block.
+//
+// Color blocks only ever use ETC1's individual and differential modes,
+// which ETC2 decodes the same way (the differential mode never
+// overflows, which is what ETC2 reads as its T, H and planar modes), so
+// an ETC1 block is also a valid GL_COMPRESSED_RGB8_ETC2 one. The decoders
+// here cover exactly what the encoders write.
+//
+// Each half block gets the average color of its texels, quantized, and
+// whichever intensity table fits best; the table search is vectorized
+// the same way as BC1's index search (SSE2, or AVX when built with it).
+//
+// That is the whole search: the base colors are never moved off the
+// means, so a half block whose texels spread unevenly around its mean
+// keeps that error. Over textures/ that comes to about 34 dB RGB PSNR
+// (tests/etc_test.cpp). Encoders which also search the base colors,
+// or use ETC2's T, H and planar modes, do better at many times the
+// cost; where quality matters more than build time, compress offline.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	enum etc_format_t {
+		etc_etc1 = 0, // RGB, 8 bytes per block
+		etc_etc1_alpha, // an image's alpha channel as ETC1 grey, 8 bytes per block
+		etc_etc2_rgba // EAC alpha and color, 16 bytes per block
+	};
+
+	GLK_FUNC size_t etc_block_bytes(etc_format_t format)
+	{
+		return format == etc_etc2_rgba ? 16 : 8;
+	}
+
+	GLK_FUNC size_t etc_encoded_size(etc_format_t format, size_t width, size_t height)
+	{
+		return ((width + 3) / 4) * ((height + 3) / 4) * etc_block_bytes(format);
+	}
+
+	// Intensity modifiers by table: pixel indices 0 and 1 add the first
+	// and second, 2 and 3 subtract them.
+	static const int etc1_modifiers[8][2] = {
+		{ 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 },
+		{ 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+	};
+
+	static const int eac_modifiers[16][8] = {
+		{ -3, -6, -9, -15, 2, 5, 8, 14 },
+		{ -3, -7, -10, -13, 2, 6, 9, 12 },
+		{ -2, -5, -8, -13, 1, 4, 7, 12 },
+		{ -2, -4, -6, -13, 1, 3, 5, 12 },
+		{ -3, -6, -8, -12, 2, 5, 7, 11 },
+		{ -3, -7, -9, -11, 2, 6, 8, 10 },
+		{ -4, -7, -8, -11, 3, 6, 7, 10 },
+		{ -3, -5, -8, -11, 2, 4, 7, 10 },
+		{ -2, -6, -8, -10, 1, 5, 7, 9 },
+		{ -2, -5, -8, -10, 1, 4, 7, 9 },
+		{ -2, -4, -8, -10, 1, 3, 7, 9 },
+		{ -2, -5, -7, -10, 1, 4, 6, 9 },
+		{ -3, -4, -7, -10, 2, 3, 6, 9 },
+		{ -1, -2, -3, -10, 0, 1, 2, 9 },
+		{ -4, -6, -8, -9, 3, 5, 7, 8 },
+		{ -3, -5, -7, -9, 2, 4, 6, 8 }
+	};
+
+	GLK_FUNC int etc_clamp255(int v)
+	{
+		return std::min(std::max(v, 0), 255);
+	}
+
+	GLK_FUNC int etc_modifier(int table, int index)
+	{
+		int m = etc1_modifiers[table][index & 1];
+		return (index & 2) ? -m : m;
+	}
+
+	// The four colors a half block with base color rgb and table can
+	// show, in pixel index order.
+	GLK_FUNC void etc1_palette(const int* rgb, int table, int palette[4][3])
+	{
+		for (int k = 0; k < 4; ++k) {
+			for (int c = 0; c < 3; ++c)
+				palette[k][c] = etc_clamp255(rgb[c] + etc_modifier(table, k));
+		}
+	}
+
+	// Texel i of the block, in the column major order pixel indices
+	// are stored in
+	GLK_FUNC int etc_texel_x(int i) { return i >> 2; }
+	GLK_FUNC int etc_texel_y(int i) { return i & 3; }
+
+	GLK_FUNC bool etc_in_second_half(int i, bool flip)
+	{
+		return flip ? etc_texel_y(i) >= 2 : etc_texel_x(i) >= 2;
+	}
+
+	GLK_FUNC uint64_t etc_read64(const uint8_t* block)
+	{
+		uint64_t v = 0;
+
+		for (int i = 0; i < 8; ++i)
+			v = (v << 8) | block[i];
+
+		return v;
+	}
+
+	GLK_FUNC void etc_write64(uint8_t* block, uint64_t v)
+	{
+		for (int i = 7; i >= 0; --i) {
+			block[i] = (uint8_t) v;
+			v >>= 8;
+		}
+	}
+
+	//------------------
+	// reference decoders
+	//
+	// out receives 16 RGBA texels, row by row.
+	//------------------
+
+	GLK_FUNC void etc1_decode_block(const uint8_t* block, uint8_t* out)
+	{
+		uint64_t bits = etc_read64(block);
+
+		bool diff = (bits >> 33) & 1;
+		bool flip = (bits >> 32) & 1;
+
+		int base[2][3];
+
+		for (int c = 0; c < 3; ++c) {
+			int shift = 59 - c * 8;
+
+			if (diff) {
+				int c1 = (bits >> shift) & 31;
+				int d = (bits >> (shift - 3)) & 7;
+				int c2 = c1 + (d >= 4 ? d - 8 : d);
+
+				base[0][c] = (c1 << 3) | (c1 >> 2);
+				base[1][c] = (c2 << 3) | (c2 >> 2);
+			} else {
+				int c1 = (bits >> (shift + 1)) & 15;
+				int c2 = (bits >> (shift - 3)) & 15;
+
+				base[0][c] = (c1 << 4) | c1;
+				base[1][c] = (c2 << 4) | c2;
+			}
+		}
+
+		int tables[2] = { (int) ((bits >> 37) & 7), (int) ((bits >> 34) & 7) };
+
+		for (int i = 0; i < 16; ++i) {
+			int half = etc_in_second_half(i, flip) ? 1 : 0;
+			int index = (int) (((bits >> (16 + i)) & 1) << 1 | ((bits >> i) & 1));
+
+			uint8_t* texel = out + (etc_texel_y(i) * 4 + etc_texel_x(i)) * 4;
+
+			for (int c = 0; c < 3; ++c)
+				texel[c] = (uint8_t) etc_clamp255(base[half][c]
+					+ etc_modifier(tables[half], index));
+
+			texel[3] = 255;
+		}
+	}
+
+	// Writes the alpha of 16 texels (row by row) into out's alpha
+	GLK_FUNC void eac_decode_alpha(const uint8_t* block, uint8_t* out)
+	{
+		uint64_t bits = etc_read64(block);
+
+		int base = block[0];
+		int multiplier = block[1] >> 4;
+		int table = block[1] & 15;
+
+		for (int i = 0; i < 16; ++i) {
+			int index = (int) ((bits >> (45 - 3 * i)) & 7);
+
+			out[(etc_texel_y(i) * 4 + etc_texel_x(i)) * 4 + 3] = (uint8_t) etc_clamp255(
+				base + eac_modifiers[table][index] * multiplier);
+		}
+	}
+
+	GLK_FUNC void etc2_rgba_decode_block(const uint8_t* block, uint8_t* out)
+	{
+		etc1_decode_block(block + 8, out);
+		eac_decode_alpha(block, out);
+	}
+
+	//------------------
+	// encoders
+	//------------------
+
+	struct etc1_half_t {
+		int rgb[3]; // expanded base color
+		int table;
+		uint32_t indices; // 2 bits per texel of the half, in order
+		float error;
+	};
+
+	// Best table for a half block of 8 texels (planar r, g, b) around
+	// base color rgb. The texels stay in registers across all eight
+	// tables, and indices are only packed for a table that wins.
+	GLK_FUNC etc1_half_t etc1_fit_half(const float* r, const float* g, const float* b,
+		const int* rgb)
+	{
+		etc1_half_t best;
+
+		best.rgb[0] = rgb[0];
+		best.rgb[1] = rgb[1];
+		best.rgb[2] = rgb[2];
+		best.table = 0;
+		best.indices = 0;
+		best.error = FLT_MAX;
+
+#if defined(__AVX__)
+		__m256 R = _mm256_loadu_ps(r);
+		__m256 G = _mm256_loadu_ps(g);
+		__m256 B = _mm256_loadu_ps(b);
+#elif defined(__SSE2__)
+		__m128 R[2] = { _mm_loadu_ps(r), _mm_loadu_ps(r + 4) };
+		__m128 G[2] = { _mm_loadu_ps(g), _mm_loadu_ps(g + 4) };
+		__m128 B[2] = { _mm_loadu_ps(b), _mm_loadu_ps(b + 4) };
+#endif
+
+		for (int table = 0; table < 8 && best.error > 0.0f; ++table) {
+			int palette[4][3];
+			etc1_palette(rgb, table, palette);
+
+			float error = 0.0f;
+			uint32_t indices = 0;
+
+#if defined(__AVX__)
+			__m256 d[4];
+
+			for (int k = 0; k < 4; ++k) {
+				__m256 dr = _mm256_sub_ps(R, _mm256_set1_ps((float) palette[k][0]));
+				__m256 dg = _mm256_sub_ps(G, _mm256_set1_ps((float) palette[k][1]));
+				__m256 db = _mm256_sub_ps(B, _mm256_set1_ps((float) palette[k][2]));
+
+				d[k] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr),
+					_mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+			}
+
+			__m256 least = _mm256_min_ps(_mm256_min_ps(d[0], d[1]),
+				_mm256_min_ps(d[2], d[3]));
+
+			__m128 sum = _mm_add_ps(_mm256_castps256_ps128(least),
+				_mm256_extractf128_ps(least, 1));
+
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+			error = _mm_cvtss_f32(sum);
+
+			if (error >= best.error)
+				continue;
+
+			uint32_t taken = 0;
+
+			for (uint32_t k = 0; k < 4; ++k) {
+				uint32_t m = (uint32_t) _mm256_movemask_ps(
+					_mm256_cmp_ps(d[k], least, _CMP_EQ_OQ)) & ~taken;
+
+				taken |= m;
+				indices |= bcn_spread_bits(m) * k;
+			}
+#elif defined(__SSE2__)
+			__m128 least[2];
+			__m128i least_index[2];
+
+			for (int h = 0; h < 2; ++h) {
+				least[h] = _mm_set1_ps(FLT_MAX);
+				least_index[h] = _mm_setzero_si128();
+
+				for (int k = 0; k < 4; ++k) {
+					__m128 dr = _mm_sub_ps(R[h], _mm_set1_ps((float) palette[k][0]));
+					__m128 dg = _mm_sub_ps(G[h], _mm_set1_ps((float) palette[k][1]));
+					__m128 db = _mm_sub_ps(B[h], _mm_set1_ps((float) palette[k][2]));
+
+					__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr),
+						_mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+					__m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, least[h]));
+
+					least[h] = _mm_min_ps(dist, least[h]);
+					least_index[h] = _mm_or_si128(_mm_andnot_si128(closer, least_index[h]),
+						_mm_and_si128(closer, _mm_set1_epi32(k)));
+				}
+			}
+
+			__m128 sum = _mm_add_ps(least[0], least[1]);
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+			error = _mm_cvtss_f32(sum);
+
+			if (error >= best.error)
+				continue;
+
+			for (int h = 0; h < 2; ++h) {
+				uint32_t lo = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+					_mm_slli_epi32(least_index[h], 31)));
+
+				uint32_t hi = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(
+					_mm_slli_epi32(least_index[h], 30)));
+
+				indices |= (bcn_spread_bits(lo) | (bcn_spread_bits(hi) << 1)) << (8 * h);
+			}
+#else
+			for (int t = 0; t < 8; ++t) {
+				float least = FLT_MAX;
+				uint32_t least_index = 0;
+
+				for (int k = 0; k < 4; ++k) {
+					float dr = r[t] - palette[k][0];
+					float dg = g[t] - palette[k][1];
+					float db = b[t] - palette[k][2];
+					float dist = dr * dr + dg * dg + db * db;
+
+					if (dist < least) {
+						least = dist;
+						least_index = k;
+					}
+				}
+
+				indices |= least_index << (2 * t);
+				error += least;
+			}
+
+			if (error >= best.error)
+				continue;
+#endif
+			best.table = table;
+			best.indices = indices;
+			best.error = error;
+		}
+
+		return best;
+	}
+
+	// Fits one split of the block (flip) in both modes and writes the
+	// better one to *bits; returns its error.
+	GLK_FUNC float etc1_encode_split(const uint8_t* texels, bool flip, uint64_t* bits)
+	{
+		float r[2][8], g[2][8], b[2][8];
+		float mean[2][3] = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+
+		int count[2] = { 0, 0 };
+		int order[16]; // position of each texel within its half
+
+		for (int i = 0; i < 16; ++i) {
+			int half = etc_in_second_half(i, flip) ? 1 : 0;
+			const uint8_t* texel = texels + (etc_texel_y(i) * 4 + etc_texel_x(i)) * 4;
+
+			int n = count[half]++;
+			order[i] = n;
+
+			r[half][n] = texel[0];
+			g[half][n] = texel[1];
+			b[half][n] = texel[2];
+
+			mean[half][0] += texel[0];
+			mean[half][1] += texel[1];
+			mean[half][2] += texel[2];
+		}
+
+		// individual: 4 bits a channel for each half
+		int q4[2][3], e4[2][3];
+
+		// differential: 5 bits, and the second half as a 3 bit delta
+		int q5[2][3], e5[2][3];
+		bool differential = true;
+
+		for (int h = 0; h < 2; ++h) {
+			for (int c = 0; c < 3; ++c) {
+				float m = mean[h][c] / 8.0f;
+
+				q4[h][c] = std::min((int) (m * 15.0f / 255.0f + 0.5f), 15);
+				e4[h][c] = (q4[h][c] << 4) | q4[h][c];
+
+				q5[h][c] = std::min((int) (m * 31.0f / 255.0f + 0.5f), 31);
+			}
+		}
+
+		for (int c = 0; c < 3; ++c) {
+			int d = q5[1][c] - q5[0][c];
+
+			if (d < -4 || d > 3)
+				differential = false;
+
+			for (int h = 0; h < 2; ++h)
+				e5[h][c] = (q5[h][c] << 3) | (q5[h][c] >> 2);
+		}
+
+		// The differential mode's bases are closer to the means whenever
+		// it can represent them, so that's the only one tried then
+		const int (*bases)[3] = differential ? e5 : e4;
+
+		etc1_half_t halves[2] = {
+			etc1_fit_half(r[0], g[0], b[0], bases[0]),
+			etc1_fit_half(r[1], g[1], b[1], bases[1])
+		};
+
+		float error = halves[0].error + halves[1].error;
+		bool use_diff = differential;
+
+		uint64_t v = 0;
+
+		for (int c = 0; c < 3; ++c) {
+			int shift = 59 - c * 8;
+
+			if (use_diff) {
+				v |= (uint64_t) q5[0][c] << shift;
+				v |= (uint64_t) ((q5[1][c] - q5[0][c]) & 7) << (shift - 3);
+			} else {
+				v |= (uint64_t) q4[0][c] << (shift + 1);
+				v |= (uint64_t) q4[1][c] << (shift - 3);
+			}
+		}
+
+		v |= (uint64_t) halves[0].table << 37;
+		v |= (uint64_t) halves[1].table << 34;
+		v |= (uint64_t) (use_diff ? 1 : 0) << 33;
+		v |= (uint64_t) (flip ? 1 : 0) << 32;
+
+		for (int i = 0; i < 16; ++i) {
+			int half = etc_in_second_half(i, flip) ? 1 : 0;
+			uint32_t index = (halves[half].indices >> (2 * order[i])) & 3;
+
+			v |= (uint64_t) (index >> 1) << (16 + i);
+			v |= (uint64_t) (index & 1) << i;
+		}
+
+		*bits = v;
+
+		return error;
+	}
+
+	GLK_FUNC void etc1_encode_block(const uint8_t* texels, uint8_t* out)
+	{
+		uint64_t side_by_side, stacked;
+
+		float error = etc1_encode_split(texels, false, &side_by_side);
+
+		if (error > 0.0f && etc1_encode_split(texels, true, &stacked) < error)
+			side_by_side = stacked;
+
+		etc_write64(out, side_by_side);
+	}
+
+	// ETC1 of the texels' alpha as grey
+	GLK_FUNC void etc1_encode_alpha_block(const uint8_t* texels, uint8_t* out)
+	{
+		uint8_t grey[64];
+
+		for (int t = 0; t < 16; ++t) {
+			uint8_t a = texels[t * 4 + 3];
+
+			grey[t * 4 + 0] = a;
+			grey[t * 4 + 1] = a;
+			grey[t * 4 + 2] = a;
+			grey[t * 4 + 3] = 255;
+		}
+
+		etc1_encode_block(grey, out);
+	}
+
+	// Alpha as EAC: for every table, the multiplier which spans the
+	// block's alpha range and the base which centers it, then each
+	// texel's nearest value.
+	GLK_FUNC void eac_encode_alpha(const uint8_t* texels, uint8_t* out)
+	{
+		int alpha[16];
+		int lo = 255, hi = 0;
+
+		for (int i = 0; i < 16; ++i) {
+			alpha[i] = texels[(etc_texel_y(i) * 4 + etc_texel_x(i)) * 4 + 3];
+
+			lo = std::min(lo, alpha[i]);
+			hi = std::max(hi, alpha[i]);
+		}
+
+		int best_error = INT32_MAX;
+		uint64_t best = 0;
+
+		for (int table = 0; table < 16 && best_error; ++table) {
+			const int* mods = eac_modifiers[table];
+			int span = mods[7] - mods[3];
+
+			int guess = std::max((hi - lo + span / 2) / span, 1);
+
+			for (int multiplier = std::max(guess - 1, 1);
+				multiplier <= std::min(guess + 1, 15) && best_error; ++multiplier) {
+				int base = etc_clamp255((lo + hi) / 2
+					- (mods[3] + mods[7]) * multiplier / 2);
+
+				int values[8];
+
+				for (int k = 0; k < 8; ++k)
+					values[k] = etc_clamp255(base + mods[k] * multiplier);
+
+				int error = 0;
+				uint64_t v = ((uint64_t) base << 56) | ((uint64_t) multiplier << 52)
+					| ((uint64_t) table << 48);
+
+				for (int i = 0; i < 16 && error < best_error; ++i) {
+					int best_k = 0, best_d = INT32_MAX;
+
+					for (int k = 0; k < 8; ++k) {
+						int d = (alpha[i] - values[k]) * (alpha[i] - values[k]);
+
+						if (d < best_d) {
+							best_d = d;
+							best_k = k;
+						}
+					}
+
+					error += best_d;
+					v |= (uint64_t) best_k << (45 - 3 * i);
+				}
+
+				if (error < best_error) {
+					best_error = error;
+					best = v;
+				}
+			}
+		}
+
+		etc_write64(out, best);
+	}
+
+	GLK_FUNC void etc2_rgba_encode_block(const uint8_t* texels, uint8_t* out)
+	{
+		eac_encode_alpha(texels, out);
+		etc1_encode_block(texels, out + 8);
+	}
+
+	//------------------
+	// images
+	//------------------
+
+	GLK_FUNC void etc_encode_rows(const uint8_t* rgba, size_t width, size_t height,
+		size_t stride, etc_format_t format, uint8_t* out, size_t first_row, size_t end_row)
+	{
+		size_t blocks_x = (width + 3) / 4;
+		size_t block_bytes = etc_block_bytes(format);
+
+		uint8_t texels[64];
+
+		for (size_t by = first_row; by < end_row; ++by) {
+			for (size_t bx = 0; bx < blocks_x; ++bx) {
+				bcn_gather_block(rgba, width, height, stride, bx, by, texels);
+
+				uint8_t* block = out + (by * blocks_x + bx) * block_bytes;
+
+				switch (format) {
+				case etc_etc1_alpha: etc1_encode_alpha_block(texels, block); break;
+				case etc_etc2_rgba: etc2_rgba_encode_block(texels, block); break;
+				default: etc1_encode_block(texels, block); break;
+				}
+			}
+		}
+	}
+
+	// Same contract as bcn_encode_image
+	GLK_FUNC void etc_encode_image(const uint8_t* rgba, size_t width, size_t height,
+		size_t stride, etc_format_t format, uint8_t* out, unsigned threads = 0)
+	{
+		parallel_rows((height + 3) / 4, threads,
+			[=](size_t first, size_t end) {
+			etc_encode_rows(rgba, width, height, stride, format, out, first, end);
+		});
+	}
+
+	// etc_etc1_alpha decodes to grey, as a shader would sample it
+	GLK_FUNC void etc_decode_image(const uint8_t* blocks, size_t width, size_t height,
+		etc_format_t format, uint8_t* rgba)
+	{
+		size_t blocks_x = (width + 3) / 4;
+		size_t block_bytes = etc_block_bytes(format);
+
+		uint8_t texels[64];
+
+		for (size_t by = 0; by < (height + 3) / 4; ++by) {
+			for (size_t bx = 0; bx < blocks_x; ++bx) {
+				const uint8_t* block = blocks + (by * blocks_x + bx) * block_bytes;
+
+				if (format == etc_etc2_rgba)
+					etc2_rgba_decode_block(block, texels);
+				else
+					etc1_decode_block(block, texels);
+
+				for (size_t y = 0; y < 4 && by * 4 + y < height; ++y) {
+					for (size_t x = 0; x < 4 && bx * 4 + x < width; ++x) {
+						memcpy(rgba + ((by * 4 + y) * width + bx * 4 + x) * 4,
+							texels + (y * 4 + x) * 4, 4);
+					}
+				}
+			}
+		}
+	}
+
+} // namespace glk
+
+#endif // __GLK_ETC_H__
@@ -0,0 +1,118 @@
+#ifndef __GLK_HASH_H__
+#define __GLK_HASH_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace glk {
+
+    static const uint64_t hash64_prime1 = 11400714785074694791ULL;
+    static const uint64_t hash64_prime2 = 14029467366897019727ULL;
+    static const uint64_t hash64_prime3 = 1609587929392839161ULL;
+    static const uint64_t hash64_prime4 = 9650029242287828579ULL;
+    static const uint64_t hash64_prime5 = 2870177450012600261ULL;
+
+    GLK_FUNC uint64_t hash64_rotl(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    GLK_FUNC uint64_t hash64_read(const uint8_t* p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    GLK_FUNC uint64_t hash64_round(uint64_t acc, uint64_t input)
+    {
+        acc += input * hash64_prime2;
+        acc = hash64_rotl(acc, 31);
+        return acc * hash64_prime1;
+    }
+
+    GLK_FUNC uint64_t hash64_merge(uint64_t acc, uint64_t lane)
+    {
+        acc ^= hash64_round(0, lane);
+        return acc * hash64_prime1 + hash64_prime4;
+    }
+
+    //------------------
+    // hash64
+    //
+    // xxHash64 (https://github.com/Cyan4973/xxHash), for content hashing
+    // image data. The bulk loop runs four independent accumulators over
+    // 32 byte stripes, so there's no dependency between lanes and the
+    // compiler is free to keep them in vector registers; in practice it's
+    // bound by memory bandwidth. Reads are little endian.
+    //------------------
+
+    GLK_FUNC uint64_t hash64(const void* data, size_t length, uint64_t seed = 0)
+    {
+        const uint8_t* p = (const uint8_t*) data;
+        const uint8_t* end = p + length;
+
+        uint64_t h;
+
+        if (length >= 32) {
+            uint64_t v[4] = {
+                seed + hash64_prime1 + hash64_prime2,
+                seed + hash64_prime2,
+                seed,
+                seed - hash64_prime1
+            };
+
+            const uint8_t* limit = end - 32;
+
+            do {
+                for (int lane = 0; lane < 4; ++lane)
+                    v[lane] = hash64_round(v[lane], hash64_read(p + lane * 8));
+
+                p += 32;
+            } while (p <= limit);
+
+            h = hash64_rotl(v[0], 1) + hash64_rotl(v[1], 7)
+                + hash64_rotl(v[2], 12) + hash64_rotl(v[3], 18);
+
+            for (int lane = 0; lane < 4; ++lane)
+                h = hash64_merge(h, v[lane]);
+        } else {
+            h = seed + hash64_prime5;
+        }
+
+        h += (uint64_t) length;
+
+        for (; p + 8 <= end; p += 8) {
+            h ^= hash64_round(0, hash64_read(p));
+            h = hash64_rotl(h, 27) * hash64_prime1 + hash64_prime4;
+        }
+
+        if (p + 4 <= end) {
+            uint32_t k;
+            memcpy(&k, p, sizeof(k));
+
+            h ^= (uint64_t) k * hash64_prime1;
+            h = hash64_rotl(h, 23) * hash64_prime2 + hash64_prime3;
+            p += 4;
+        }
+
+        for (; p < end; ++p) {
+            h ^= (uint64_t) (*p) * hash64_prime5;
+            h = hash64_rotl(h, 11) * hash64_prime1;
+        }
+
+        h ^= h >> 33;
+        h *= hash64_prime2;
+        h ^= h >> 29;
+        h *= hash64_prime3;
+        h ^= h >> 32;
+
+        return h;
+    }
+
+} // namespace glk
+
+#endif // __GLK_HASH_H__
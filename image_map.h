@@ -0,0 +1,498 @@
+#ifndef __GLK_IMAGE_MAP_H__
+#define __GLK_IMAGE_MAP_H__
+
+#include "main_def.h"
+#include "bits.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------------
+// image_map_t
+//
+// A flat hash table from 64 bit keys to image indices, for the lookups
+// an atlas does at runtime: by key, by filename hash and by content hash.
+//
+// Slots come in groups of 16, each slot with a control byte holding
+// 7 bits of its key's hash, or empty / deleted. A probe loads a whole
+// group's control bytes and compares all 16 against the hash at once
+// (SSE2, or a byte loop without it), so only slots whose 7 bits match
+// ever have their key read - about one in 128 misses. Keys, values
+// and control bytes are separate arrays, so the bytes probed stay
+// dense in cache.
+//
+// An atlas which won't change anymore can freeze() its maps: the
+// table is swapped for a minimal perfect hash of the keys it holds
+// (PTHash style - keys are split into buckets and each bucket gets a
+// pilot value which scatters its keys into free positions). Every
+// lookup is then one pilot read and one key compare, in n keys' worth
+// of storage with no empty slots. Changing a frozen map thaws it back
+// into a table first.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	// Spreads a key over all 64 bits; keys are often small integers.
+	// The final mix of xxHash64.
+	GLK_FUNC uint64_t image_map_mix(uint64_t k)
+	{
+		k ^= k >> 33;
+		k *= 14029467366897019727ULL;
+		k ^= k >> 29;
+		k *= 1609587929392839161ULL;
+		k ^= k >> 32;
+		return k;
+	}
+
+	// x * n / 2^32: maps 32 random bits onto [0, n) without a divide
+	GLK_FUNC uint32_t image_map_range(uint32_t x, uint32_t n)
+	{
+		return (uint32_t) (((uint64_t) x * n) >> 32);
+	}
+
+	// Where a key hashing to h lands under pilot hash p, out of n. The
+	// multiply matters: XOR alone keeps two keys' difference the same
+	// under every pilot, so keys whose top bits agree could never be
+	// pulled apart.
+	GLK_FUNC uint32_t image_map_position(uint64_t h, uint64_t p, uint32_t n)
+	{
+		return image_map_range((uint32_t) (((h ^ p) * 0x9E3779B97F4A7C15ULL) >> 32), n);
+	}
+
+	struct image_map_t {
+		static const uint16_t npos = 0xFFFF;
+
+		static const uint8_t ctrl_empty = 0x80;
+		static const uint8_t ctrl_deleted = 0xFE;
+
+		static const size_t group_size = 16;
+
+		// table: capacity is a power of two, and a multiple of group_size
+		std::vector<uint8_t> ctrl;
+		std::vector<uint64_t> keys;
+		std::vector<uint16_t> values;
+
+		size_t count;
+		size_t tombstones;
+
+		// frozen: a key's bucket picks a pilot, and key and pilot
+		// together pick its position in keys / values
+		bool is_frozen;
+		uint64_t seed;
+		std::vector<uint32_t> pilots;
+
+		image_map_t(void)
+			:   count(0),
+				tombstones(0),
+				is_frozen(false),
+				seed(0)
+		{}
+
+		size_t size(void) const { return count; }
+
+		bool empty(void) const { return count == 0; }
+
+		bool frozen(void) const { return is_frozen; }
+
+		void clear(void)
+		{
+			ctrl.clear();
+			keys.clear();
+			values.clear();
+			pilots.clear();
+			count = 0;
+			tombstones = 0;
+			is_frozen = false;
+		}
+
+		// Bits i set for each control byte i of the group at c equal to tag
+		static uint32_t match(const uint8_t* c, uint8_t tag)
+		{
+#if defined(__SSE2__)
+			__m128i group = _mm_loadu_si128((const __m128i*) c);
+
+			return (uint32_t) _mm_movemask_epi8(
+				_mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+#else
+			uint32_t bits = 0;
+
+			for (size_t i = 0; i < group_size; ++i)
+				bits |= (uint32_t) (c[i] == tag) << i;
+
+			return bits;
+#endif
+		}
+
+		// Bits set for each empty or deleted slot: the only control
+		// bytes with their top bit set
+		static uint32_t match_free(const uint8_t* c)
+		{
+#if defined(__SSE2__)
+			return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) c));
+#else
+			uint32_t bits = 0;
+
+			for (size_t i = 0; i < group_size; ++i)
+				bits |= (uint32_t) (c[i] >> 7) << i;
+
+			return bits;
+#endif
+		}
+
+		// Index of key's slot in the table, or SIZE_MAX
+		size_t find_slot(uint64_t key) const
+		{
+			if (ctrl.empty())
+				return SIZE_MAX;
+
+			uint64_t h = image_map_mix(key);
+			uint8_t tag = (uint8_t) (h & 0x7F);
+
+			size_t mask = ctrl.size() / group_size - 1;
+			size_t group = (size_t) (h >> 7) & mask;
+
+			// Triangular steps visit every group of a power of two table
+			for (size_t step = 1; ; ++step) {
+				const uint8_t* c = &ctrl[group * group_size];
+
+				for (uint32_t bits = match(c, tag); bits; bits &= bits - 1) {
+					size_t slot = group * group_size + bit_scan_forward(bits);
+
+					if (keys[slot] == key)
+						return slot;
+				}
+
+				if (match(c, ctrl_empty))
+					return SIZE_MAX;
+
+				group = (group + step) & mask;
+			}
+		}
+
+		size_t frozen_position(uint64_t key) const
+		{
+			uint64_t h = image_map_mix(key ^ seed);
+
+			uint32_t bucket = image_map_range((uint32_t) (h >> 32), (uint32_t) pilots.size());
+			uint64_t pilot = image_map_mix(pilots[bucket] + seed);
+
+			return image_map_position(h, pilot, (uint32_t) keys.size());
+		}
+
+		// The image key maps to, or npos
+		uint16_t find(uint64_t key) const
+		{
+			if (is_frozen) {
+				if (keys.empty())
+					return npos;
+
+				size_t position = frozen_position(key);
+
+				return keys[position] == key ? values[position] : (uint16_t) npos;
+			}
+
+			size_t slot = find_slot(key);
+
+			return slot == SIZE_MAX ? (uint16_t) npos : values[slot];
+		}
+
+		// Lays the table out for capacity slots, reinserting what it held
+		void rehash(size_t capacity)
+		{
+			std::vector<uint8_t> old_ctrl;
+			std::vector<uint64_t> old_keys;
+			std::vector<uint16_t> old_values;
+
+			old_ctrl.swap(ctrl);
+			old_keys.swap(keys);
+			old_values.swap(values);
+
+			ctrl.assign(capacity, (uint8_t) ctrl_empty);
+			keys.assign(capacity, 0);
+			values.assign(capacity, (uint16_t) npos);
+
+			tombstones = 0;
+
+			for (size_t i = 0; i < old_ctrl.size(); ++i) {
+				if (!(old_ctrl[i] & 0x80))
+					place(old_keys[i], old_values[i]);
+			}
+		}
+
+		// Puts a key known not to be in the table into its first free slot
+		void place(uint64_t key, uint16_t value)
+		{
+			uint64_t h = image_map_mix(key);
+
+			size_t mask = ctrl.size() / group_size - 1;
+			size_t group = (size_t) (h >> 7) & mask;
+
+			for (size_t step = 1; ; ++step) {
+				uint32_t bits = match_free(&ctrl[group * group_size]);
+
+				if (bits) {
+					size_t slot = group * group_size + bit_scan_forward(bits);
+
+					if (ctrl[slot] == ctrl_deleted)
+						tombstones--;
+
+					ctrl[slot] = (uint8_t) (h & 0x7F);
+					keys[slot] = key;
+					values[slot] = value;
+					return;
+				}
+
+				group = (group + step) & mask;
+			}
+		}
+
+		// Room for n keys without growing
+		void reserve(size_t n)
+		{
+			thaw();
+
+			size_t capacity = std::max(ctrl.size(), (size_t) group_size);
+
+			while (capacity * 7 / 8 < n)
+				capacity *= 2;
+
+			if (capacity != ctrl.size())
+				rehash(capacity);
+		}
+
+		// Maps key to image, replacing whatever it mapped to before
+		void insert(uint64_t key, uint16_t image)
+		{
+			thaw();
+
+			size_t slot = find_slot(key);
+
+			if (slot != SIZE_MAX) {
+				values[slot] = image;
+				return;
+			}
+
+			// At 7/8 full, double; if it's mostly tombstones filling it,
+			// clearing them out makes enough room
+			if (count + tombstones + 1 > ctrl.size() * 7 / 8) {
+				if (!ctrl.empty() && count + 1 <= ctrl.size() * 7 / 16)
+					rehash(ctrl.size());
+				else
+					rehash(std::max(ctrl.size() * 2, (size_t) group_size));
+			}
+
+			place(key, image);
+			count++;
+		}
+
+		// True if key was there
+		bool erase(uint64_t key)
+		{
+			thaw();
+
+			size_t slot = find_slot(key);
+
+			if (slot == SIZE_MAX)
+				return false;
+
+			ctrl[slot] = ctrl_deleted;
+			count--;
+			tombstones++;
+
+			return true;
+		}
+
+		// Calls f(key, image) for every entry, in no particular order
+		template <class func_t>
+		void for_each(func_t f) const
+		{
+			if (is_frozen) {
+				for (size_t i = 0; i < keys.size(); ++i)
+					f(keys[i], values[i]);
+
+				return;
+			}
+
+			for (size_t i = 0; i < ctrl.size(); ++i) {
+				if (!(ctrl[i] & 0x80))
+					f(keys[i], values[i]);
+			}
+		}
+
+		// Swaps the table for a minimal perfect hash of its keys. Buckets
+		// average 4 keys; they're placed largest first, each trying
+		// pilots until all of its keys land on free positions, and the
+		// whole thing starts over with a new seed if one runs out.
+		void freeze(void)
+		{
+			if (is_frozen)
+				return;
+
+			std::vector<uint64_t> entries;
+			std::vector<uint16_t> images;
+
+			entries.reserve(count);
+			images.reserve(count);
+
+			for_each([&](uint64_t key, uint16_t image) {
+				entries.push_back(key);
+				images.push_back(image);
+			});
+
+			size_t n = entries.size();
+			size_t num_buckets = std::max(n / 4, (size_t) 1);
+
+			std::vector<uint8_t> taken;
+			std::vector<uint32_t> order;
+			std::vector<uint32_t> bucket_start;
+			std::vector<uint32_t> bucket_keys;
+			std::vector<uint32_t> positions;
+
+			for (uint64_t attempt = 1; ; ++attempt) {
+				seed = image_map_mix(attempt * 0x9E3779B97F4A7C15ULL);
+
+				// Counting sort of key indices by bucket
+				bucket_start.assign(num_buckets + 1, 0);
+				bucket_keys.resize(n);
+
+				std::vector<uint32_t> key_bucket(n);
+
+				for (size_t i = 0; i < n; ++i) {
+					uint64_t h = image_map_mix(entries[i] ^ seed);
+
+					key_bucket[i] = image_map_range((uint32_t) (h >> 32),
+						(uint32_t) num_buckets);
+					bucket_start[key_bucket[i] + 1]++;
+				}
+
+				for (size_t b = 0; b < num_buckets; ++b)
+					bucket_start[b + 1] += bucket_start[b];
+
+				{
+					std::vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+
+					for (size_t i = 0; i < n; ++i)
+						bucket_keys[fill[key_bucket[i]]++] = (uint32_t) i;
+				}
+
+				order.resize(num_buckets);
+
+				for (size_t b = 0; b < num_buckets; ++b)
+					order[b] = (uint32_t) b;
+
+				std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+					return bucket_start[a + 1] - bucket_start[a]
+						> bucket_start[b + 1] - bucket_start[b];
+				});
+
+				taken.assign(n, 0);
+				pilots.assign(num_buckets, 0);
+				positions.assign(n, 0);
+
+				bool placed = true;
+
+				for (size_t o = 0; o < num_buckets && placed; ++o) {
+					uint32_t b = order[o];
+					uint32_t first = bucket_start[b], end = bucket_start[b + 1];
+
+					if (first == end)
+						continue;
+
+					placed = false;
+
+					// With no spare positions, the last buckets take around
+					// n tries each
+					for (uint32_t pilot = 0; pilot < (1u << 24) && !placed; ++pilot) {
+						uint64_t p = image_map_mix(pilot + seed);
+						uint32_t k = first;
+
+						for (; k < end; ++k) {
+							uint64_t h = image_map_mix(entries[bucket_keys[k]] ^ seed);
+							uint32_t position = image_map_position(h, p, (uint32_t) n);
+
+							if (taken[position])
+								break;
+
+							// Two keys of one bucket can land together too
+							taken[position] = 1;
+							positions[k] = position;
+						}
+
+						if (k == end) {
+							pilots[b] = pilot;
+							placed = true;
+						} else {
+							for (uint32_t j = first; j < k; ++j)
+								taken[positions[j]] = 0;
+						}
+					}
+				}
+
+				if (!placed)
+					continue;
+
+				ctrl.clear();
+				ctrl.shrink_to_fit();
+
+				keys.assign(n, 0);
+				values.assign(n, (uint16_t) npos);
+
+				for (uint32_t k = 0; k < n; ++k) {
+					keys[positions[k]] = entries[bucket_keys[k]];
+					values[positions[k]] = images[bucket_keys[k]];
+				}
+
+				keys.shrink_to_fit();
+				values.shrink_to_fit();
+
+				tombstones = 0;
+				is_frozen = true;
+
+				return;
+			}
+		}
+
+		// Back to a table, so the map can change again
+		void thaw(void)
+		{
+			if (!is_frozen)
+				return;
+
+			std::vector<uint64_t> entries;
+			std::vector<uint16_t> images;
+
+			entries.swap(keys);
+			images.swap(values);
+
+			pilots.clear();
+			is_frozen = false;
+			count = 0;
+
+			reserve(entries.size());
+
+			for (size_t i = 0; i < entries.size(); ++i) {
+				place(entries[i], images[i]);
+				count++;
+			}
+		}
+
+		// Bytes held, for comparing layouts
+		size_t bytes(void) const
+		{
+			return ctrl.capacity() + keys.capacity() * sizeof(uint64_t)
+				+ values.capacity() * sizeof(uint16_t)
+				+ pilots.capacity() * sizeof(uint32_t);
+		}
+	};
+
+} // namespace glk
+
+#endif // __GLK_IMAGE_MAP_H__
@@ -35,8 +35,12 @@ int main(int argc, const char * argv[])
 
 	std::string texpath("." GLK_PATH_SEP_STR "textures" GLK_PATH_SEP_STR "base_wall");
 
-    glk::make_atlas_from_dir(atlasses[0], texpath);
-    glk::make_atlas_from_dir(atlasses[1], texpath);
+    if (!glk::make_atlas_from_dir(atlasses[0], texpath)
+        || !glk::make_atlas_from_dir(atlasses[1], texpath)) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 1;
+    }
 
     GLuint program = glk::link_program(glk::GLSL_VERTEX_SHADER, glk::GLSL_FRAGMENT_SHADER);
 
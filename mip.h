@@ -0,0 +1,230 @@
+#ifndef __GLK_MIP_H__
+#define __GLK_MIP_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "parallel.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------------
+// mip chains for RGBA8
+//
+// Each level is the one above it reduced 2 x 2, averaged in linear light:
+// color is decoded from sRGB, weighted by alpha (so transparent texels
+// don't darken the edges of what's around them) and encoded again.
+// Alpha itself is linear already and is averaged as is.
+//
+// A chain is its levels back to back, level 0 first, each tightly packed
+// (mip_extent(width, level) * 4 bytes per row). A level with an odd
+// extent drops its last row or column, as GL sizes levels.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	GLK_FUNC size_t mip_extent(size_t extent, size_t level)
+	{
+		return std::max(extent >> level, (size_t) 1);
+	}
+
+	// Levels in a chain running from width x height down to 1 x 1
+	GLK_FUNC size_t mip_count(size_t width, size_t height)
+	{
+		size_t levels = 1;
+
+		while ((std::max(width, height) >> levels) > 0)
+			levels++;
+
+		return levels;
+	}
+
+	// The first levels levels of a chain, in bytes; also where level
+	// levels starts within one
+	GLK_FUNC size_t mip_chain_bytes(size_t width, size_t height, size_t levels)
+	{
+		size_t bytes = 0;
+
+		for (size_t level = 0; level < levels; ++level)
+			bytes += mip_extent(width, level) * mip_extent(height, level) * 4;
+
+		return bytes;
+	}
+
+	// decode maps an sRGB byte to linear light. Encoding is exact without
+	// searching: thresholds[i] is where the encoding rounds up past i, and
+	// since they're never closer together than 1 / 4096, a value can only
+	// be one past encode[] for its 4096th.
+	struct mip_srgb_tables_t {
+		float decode[256];
+		float thresholds[256];
+		uint8_t encode[4097];
+
+		static double to_linear(double s)
+		{
+			return s <= 0.04045 ? s / 12.92 : pow((s + 0.055) / 1.055, 2.4);
+		}
+
+		mip_srgb_tables_t(void)
+		{
+			for (int i = 0; i < 256; ++i) {
+				decode[i] = (float) to_linear(i / 255.0);
+				thresholds[i] = i < 255 ? (float) to_linear((i + 0.5) / 255.0) : 2.0f;
+			}
+
+			int i = 0;
+
+			for (int bin = 0; bin <= 4096; ++bin) {
+				while (thresholds[i] <= bin / 4096.0f)
+					i++;
+
+				encode[bin] = (uint8_t) i;
+			}
+		}
+
+		// v is clamped to [0, 1]
+		uint8_t to_srgb(float v) const
+		{
+			v = std::min(std::max(v, 0.0f), 1.0f);
+
+			int i = encode[(int) (v * 4096.0f)];
+
+			return (uint8_t) (i + (v >= thresholds[i]));
+		}
+	};
+
+	GLK_FUNC const mip_srgb_tables_t& mip_srgb_tables(void)
+	{
+		static const mip_srgb_tables_t tables;
+		return tables;
+	}
+
+	// Rows [first_row, end_row) of the level below src
+	GLK_FUNC void mip_reduce_rows(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_stride, size_t first_row, size_t end_row)
+	{
+		const mip_srgb_tables_t& t = mip_srgb_tables();
+
+		size_t dst_width = mip_extent(width, 1);
+
+		for (size_t y = first_row; y < end_row; ++y) {
+			const uint8_t* row0 = src + std::min(y * 2, height - 1) * src_stride;
+			const uint8_t* row1 = src + std::min(y * 2 + 1, height - 1) * src_stride;
+
+			uint8_t* out = dst + y * dst_stride;
+
+			for (size_t x = 0; x < dst_width; ++x) {
+				size_t x0 = std::min(x * 2, width - 1) * 4;
+				size_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+
+				const uint8_t* p[4] = { row0 + x0, row0 + x1, row1 + x0, row1 + x1 };
+
+#if defined(__SSE2__)
+				const __m128 alpha_lane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+				__m128 weighted = _mm_setzero_ps();
+				__m128 plain = _mm_setzero_ps();
+
+				for (int i = 0; i < 4; ++i) {
+					__m128 c = _mm_set_ps(p[i][3] * (1.0f / 255.0f),
+						t.decode[p[i][2]], t.decode[p[i][1]], t.decode[p[i][0]]);
+
+					// (a, a, a, 1): alpha itself isn't weighted
+					__m128 a = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3));
+					__m128 w = _mm_or_ps(_mm_andnot_ps(alpha_lane, a),
+						_mm_and_ps(alpha_lane, _mm_set1_ps(1.0f)));
+
+					weighted = _mm_add_ps(weighted, _mm_mul_ps(c, w));
+					plain = _mm_add_ps(plain, c);
+				}
+
+				// Where every texel is transparent there's nothing to weight
+				// by, so those get the plain average
+				__m128 coverage = _mm_shuffle_ps(weighted, weighted, _MM_SHUFFLE(3, 3, 3, 3));
+				__m128 covered = _mm_cmpgt_ps(coverage, _mm_setzero_ps());
+
+				__m128 quarter = _mm_set1_ps(0.25f);
+				__m128 color = _mm_or_ps(
+					_mm_and_ps(covered, _mm_div_ps(weighted, coverage)),
+					_mm_andnot_ps(covered, _mm_mul_ps(plain, quarter)));
+
+				color = _mm_or_ps(_mm_andnot_ps(alpha_lane, color),
+					_mm_and_ps(alpha_lane, _mm_mul_ps(coverage, quarter)));
+
+				float c[4];
+				_mm_storeu_ps(c, color);
+#else
+				float weighted[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				float plain[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+				for (int i = 0; i < 4; ++i) {
+					float a = p[i][3] * (1.0f / 255.0f);
+
+					for (int k = 0; k < 3; ++k) {
+						weighted[k] += t.decode[p[i][k]] * a;
+						plain[k] += t.decode[p[i][k]];
+					}
+
+					weighted[3] += a;
+				}
+
+				float c[4];
+
+				for (int k = 0; k < 3; ++k)
+					c[k] = weighted[3] > 0.0f ? weighted[k] / weighted[3] : plain[k] * 0.25f;
+
+				c[3] = weighted[3] * 0.25f;
+#endif
+				out[x * 4 + 0] = t.to_srgb(c[0]);
+				out[x * 4 + 1] = t.to_srgb(c[1]);
+				out[x * 4 + 2] = t.to_srgb(c[2]);
+				out[x * 4 + 3] = (uint8_t) (std::min(c[3], 1.0f) * 255.0f + 0.5f);
+			}
+		}
+	}
+
+	// Writes the level below width x height texels at src (stride bytes
+	// per row), mip_extent(width, 1) x mip_extent(height, 1), to dst. Rows
+	// are split across threads; 0 means one per hardware thread.
+	GLK_FUNC void mip_reduce_rgba(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_stride, unsigned threads = 0)
+	{
+		// The tables are built before any thread needs them
+		mip_srgb_tables();
+
+		parallel_rows(mip_extent(height, 1), threads,
+			[=](size_t first, size_t end) {
+			mip_reduce_rows(src, width, height, src_stride, dst, dst_stride, first, end);
+		});
+	}
+
+	// Fills in levels 1 through levels - 1 of a chain whose level 0 is
+	// already at chain
+	GLK_FUNC void mip_build_chain(uint8_t* chain, size_t width, size_t height,
+		size_t levels, unsigned threads = 0)
+	{
+		uint8_t* level = chain;
+
+		for (size_t i = 1; i < levels; ++i) {
+			size_t w = mip_extent(width, i - 1);
+			size_t h = mip_extent(height, i - 1);
+
+			uint8_t* next = level + w * h * 4;
+
+			mip_reduce_rgba(level, w, h, w * 4, next, mip_extent(width, i) * 4, threads);
+
+			level = next;
+		}
+	}
+
+} // namespace glk
+
+#endif // __GLK_MIP_H__
@@ -0,0 +1,46 @@
+#ifndef __GLK_PARALLEL_H__
+#define __GLK_PARALLEL_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace glk {
+
+    // Calls do_rows(first, end) over rows, split evenly across
+    // threads; 0 means one per hardware thread. The calling thread
+    // takes the first share, so 1 runs everything in place.
+    GLK_FUNC void parallel_rows(size_t rows, unsigned threads,
+        const std::function<void(size_t, size_t)>& do_rows)
+    {
+        if (!threads)
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = (unsigned) std::min((size_t) threads, rows);
+
+        if (threads <= 1) {
+            do_rows(0, rows);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+
+        size_t per_thread = (rows + threads - 1) / threads;
+
+        for (size_t first = per_thread; first < rows; first += per_thread)
+            workers.emplace_back(do_rows, first, std::min(first + per_thread, rows));
+
+        do_rows(0, std::min(per_thread, rows));
+
+        for (std::thread& t: workers)
+            t.join();
+    }
+
+} // namespace glk
+
+#endif // __GLK_PARALLEL_H__
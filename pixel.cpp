@@ -0,0 +1,12 @@
+#include "pixel.h"
+
+namespace glk {
+
+	// The one copy of the kernel choice; see pixel_kernels_state
+	pixel_kernels_t& pixel_kernels_state(void)
+	{
+		static pixel_kernels_t kernels = pixel_kernels_for(pixel_best_isa());
+		return kernels;
+	}
+
+} // namespace glk
@@ -0,0 +1,679 @@
+#ifndef __GLK_PIXEL_H__
+#define __GLK_PIXEL_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GLK_PIXEL_X86 1
+#else
+#define GLK_PIXEL_X86 0
+#endif
+
+#if GLK_PIXEL_X86
+#include <immintrin.h>
+
+// MSVC takes any intrinsic anywhere; GCC and clang want the functions
+// using them marked with what they need
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define GLK_PIXEL_TARGET(isa)
+#else
+#define GLK_PIXEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+//------------------------------------------------------------------------------------
+// RGBA8 pixel kernels
+//
+// The per texel work every loaded image goes through: RGB expansion,
+// gamma post processing and flipping. Each has a scalar version and,
+// where it pays, SSE2, SSSE3 or AVX2 ones, and which of those run
+// is decided once, from what the CPU running us has, rather than from
+// what the build was told to assume. One binary still gets AVX2 where
+// there is some.
+//
+// pixel_force_isa() swaps in another instruction set's kernels, so
+// every path can be checked against the scalar ones on one machine. It
+// isn't synchronized with the kernels being called, so call it before
+// loading anything.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	// In increasing order of what's needed
+	enum pixel_isa_t {
+		pixel_isa_scalar = 0,
+		pixel_isa_sse2,
+		pixel_isa_ssse3,
+		pixel_isa_avx2
+	};
+
+	GLK_FUNC const char* pixel_isa_name(pixel_isa_t isa)
+	{
+		switch (isa) {
+		case pixel_isa_sse2: return "sse2";
+		case pixel_isa_ssse3: return "ssse3";
+		case pixel_isa_avx2: return "avx2";
+		default: return "scalar";
+		}
+	}
+
+	// The best instruction set this CPU and OS can run. AVX2 needs the
+	// OS to save the upper halves of the registers as well.
+	GLK_FUNC pixel_isa_t pixel_detect_isa(void)
+	{
+#if GLK_PIXEL_X86 && defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+
+		__cpuid(info, 0);
+		int max_leaf = info[0];
+
+		__cpuid(info, 1);
+
+		bool sse2 = !!(info[3] & (1 << 26));
+		bool ssse3 = !!(info[2] & (1 << 9));
+		bool avx = !!(info[2] & (1 << 27)) && !!(info[2] & (1 << 28))
+			&& (_xgetbv(0) & 0x6) == 0x6;
+
+		bool avx2 = false;
+
+		if (avx && max_leaf >= 7) {
+			__cpuidex(info, 7, 0);
+			avx2 = !!(info[1] & (1 << 5));
+		}
+
+		if (avx2 && ssse3) return pixel_isa_avx2;
+		if (ssse3 && sse2) return pixel_isa_ssse3;
+		if (sse2) return pixel_isa_sse2;
+
+		return pixel_isa_scalar;
+#elif GLK_PIXEL_X86
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2")) return pixel_isa_avx2;
+		if (__builtin_cpu_supports("ssse3")) return pixel_isa_ssse3;
+		if (__builtin_cpu_supports("sse2")) return pixel_isa_sse2;
+
+		return pixel_isa_scalar;
+#else
+		return pixel_isa_scalar;
+#endif
+	}
+
+	//------------------------------------------------------------------------------------
+	// scalar kernels, and the helpers they share
+	//------------------------------------------------------------------------------------
+
+	GLK_FUNC uint32_t pack_rgba(const uint8_t *rgba)
+	{
+		return (((uint32_t)rgba[0]) << 0)
+		| (((uint32_t)rgba[1]) << 8)
+		| (((uint32_t)rgba[2]) << 16)
+		| (((uint32_t)rgba[3]) << 24);
+	}
+
+	GLK_FUNC void unpack_rgba(uint8_t* dest, uint32_t src)
+	{
+		dest[0] = (src >> 0) & 0xFF;
+		dest[1] = (src >> 8) & 0xFF;
+		dest[2] = (src >> 16) & 0xFF;
+		dest[3] = (src >> 24) & 0xFF;
+	}
+
+	GLK_FUNC void convert_rgb_to_rgba_scalar(uint8_t* dest, size_t dest_stride,
+		const uint8_t* src, size_t src_stride, size_t dim_x, size_t dim_y)
+	{
+		for (size_t y = 0; y < dim_y; ++y) {
+			uint8_t* d = dest + y * dest_stride;
+			const uint8_t* s = src + y * src_stride;
+
+			for (size_t x = 0; x < dim_x; ++x) {
+				d[x * 4 + 0] = s[x * 3 + 0];
+				d[x * 4 + 1] = s[x * 3 + 1];
+				d[x * 4 + 2] = s[x * 3 + 2];
+				d[x * 4 + 3] = 255;
+			}
+		}
+	}
+
+	// Swaps the texels of two rows from texel x on
+	GLK_FUNC void swap_rows_rgba_tail(uint8_t* top, uint8_t* bot,
+		size_t x, size_t dim_x)
+	{
+		for (; x < dim_x; ++x) {
+			uint32_t t = pack_rgba(&top[x * 4]);
+
+			unpack_rgba(&top[x * 4], pack_rgba(&bot[x * 4]));
+			unpack_rgba(&bot[x * 4], t);
+		}
+	}
+
+	GLK_FUNC void flip_rows_rgba_scalar(uint8_t* image_data, size_t stride,
+		size_t dim_x, size_t dim_y)
+	{
+		size_t half_dy = dim_y >> 1;
+		for (size_t y = 0; y < half_dy; ++y) {
+			swap_rows_rgba_tail(image_data + y * stride,
+				image_data + (dim_y - y - 1) * stride, 0, dim_x);
+		}
+	}
+
+	static const float inverse255 = 1.0f / 255.0f;
+	static const float gammaDecode = 2.2f;
+	static const float gammaEncode = 1.0f / gammaDecode;
+
+	// Trivial, but learned from https://www.opengl.org/discussion_boards/showthread.php/147624-Quake3-Overbright-Lightmap
+	GLK_FUNC void brighten_rgb(uint8_t* rgb)
+	{
+		uint16_t r = ((uint16_t)rgb[0]) << 2;
+		uint16_t g = ((uint16_t)rgb[1]) << 2;
+		uint16_t b = ((uint16_t)rgb[2]) << 2;
+
+		float maxf = (float)glm::max(r, glm::max(g, b));
+
+		if (maxf > 255.0f)
+		{
+			float lower = 255.0f / (float) maxf;
+			r = (uint16_t)((float)r * lower);
+			g = (uint16_t)((float)g * lower);
+			b = (uint16_t)((float)b * lower);
+		}
+
+		rgb[0] = (uint8_t)r;
+		rgb[1] = (uint8_t)g;
+		rgb[2] = (uint8_t)b;
+	}
+
+	#define GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN 0x1
+	#define GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA 0x2
+
+	// Each table has this many bytes past its end, so a 32 bit gather
+	// can start at its last entry
+	#define GLK_PIXEL_TABLE_PAD 3
+
+	// post_process_rgba's arithmetic only ever sees a texel's own bytes,
+	// so all of it is worked out ahead of time, with the same float
+	// expressions it's always used: the results match to the bit.
+	// Encoding is looked up by what's encoded rather than by linear
+	// value; a table over [0, 1] can't be exact, since gamma 2.2 puts the
+	// first several encoded values within its first 1/4096.
+	struct post_process_tables_t {
+		// a channel as brighten_rgb gets it
+		uint8_t brighten_in[256 + GLK_PIXEL_TABLE_PAD];
+
+		// Indexed by the largest of the three brighten_rgb gets, then by
+		// a channel of them: that channel brightened, and that encoded
+		std::vector<uint8_t> brightened;
+		std::vector<uint8_t> brightened_encoded;
+
+		// Indexed by alpha, then by a channel, brightened or not
+		std::vector<uint8_t> premul;
+		std::vector<uint8_t> premul_brightened;
+
+		post_process_tables_t(void)
+			:   brightened(256 * 256 + GLK_PIXEL_TABLE_PAD),
+				brightened_encoded(256 * 256 + GLK_PIXEL_TABLE_PAD),
+				premul(256 * 256 + GLK_PIXEL_TABLE_PAD),
+				premul_brightened(256 * 256 + GLK_PIXEL_TABLE_PAD)
+		{
+			float decoded[256];
+			uint8_t encoded[256];
+
+			memset(brighten_in, 0, sizeof(brighten_in));
+
+			for (int i = 0; i < 256; ++i) {
+				decoded[i] = glm::pow(((float)i) * inverse255, gammaDecode);
+				encoded[i] = (uint8_t)(glm::pow(((float)i) * inverse255, gammaEncode) * 255.0f);
+
+				brighten_in[i] = (uint8_t)(decoded[i] * 255.0f);
+			}
+
+			for (int m = 0; m < 256; ++m) {
+				float maxf = (float)(m << 2);
+
+				for (int c = 0; c <= m; ++c) {
+					uint16_t shifted = (uint16_t)(c << 2);
+
+					if (maxf > 255.0f)
+						shifted = (uint16_t)((float)shifted * (255.0f / maxf));
+
+					brightened[m * 256 + c] = (uint8_t)shifted;
+					brightened_encoded[m * 256 + c] = encoded[(uint8_t)shifted];
+				}
+			}
+
+			for (int a = 0; a < 256; ++a) {
+				for (int c = 0; c < 256; ++c) {
+					premul[a * 256 + c] = (uint8_t)(glm::pow(decoded[c] * decoded[a],
+						gammaEncode) * 255.0f);
+					premul_brightened[a * 256 + c] = (uint8_t)(glm::pow(
+						((float)c) * inverse255 * decoded[a], gammaEncode) * 255.0f);
+				}
+			}
+		}
+	};
+
+	GLK_FUNC const post_process_tables_t& post_process_tables(void)
+	{
+		static const post_process_tables_t tables;
+		return tables;
+	}
+
+	// Decodes RGB from gamma 2.2, brightens it (see brighten_rgb) and/or
+	// premultiplies it by alpha (itself decoded), and encodes it again.
+	// Alpha is left as it is. Flags with neither bit set still decode
+	// and encode, which is premultiplying by an alpha of 255.
+	GLK_FUNC void post_process_rgba_scalar(uint8_t* image_data, size_t length, uint32_t flags)
+	{
+		if (!flags) {
+			return;
+		}
+
+		const post_process_tables_t& t = post_process_tables();
+
+		// The tables are kept in locals, since byte stores could
+		// otherwise alias them
+		const uint8_t* brighten_in = t.brighten_in;
+		const uint8_t* brightened = t.brightened.data();
+		const uint8_t* brightened_encoded = t.brightened_encoded.data();
+		const uint8_t* premul = t.premul.data();
+		const uint8_t* premul_brightened = t.premul_brightened.data();
+
+		bool brighten = !!(flags & GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN);
+		bool premul_alpha = !!(flags & GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA);
+
+		for (size_t i = 0; i < length; i += 4) {
+			uint32_t r = image_data[i + 0];
+			uint32_t g = image_data[i + 1];
+			uint32_t b = image_data[i + 2];
+			uint32_t a = image_data[i + 3];
+
+			if (!brighten) {
+				const uint8_t* p = &premul[(premul_alpha ? a : 255) * 256];
+
+				r = p[r];
+				g = p[g];
+				b = p[b];
+			} else {
+				r = brighten_in[r];
+				g = brighten_in[g];
+				b = brighten_in[b];
+
+				uint32_t m = glm::max(r, glm::max(g, b)) * 256;
+
+				if (!premul_alpha) {
+					r = brightened_encoded[m + r];
+					g = brightened_encoded[m + g];
+					b = brightened_encoded[m + b];
+				} else {
+					const uint8_t* p = &premul_brightened[a * 256];
+
+					r = p[brightened[m + r]];
+					g = p[brightened[m + g]];
+					b = p[brightened[m + b]];
+				}
+			}
+
+			image_data[i + 0] = (uint8_t) r;
+			image_data[i + 1] = (uint8_t) g;
+			image_data[i + 2] = (uint8_t) b;
+		}
+	}
+
+	//------------------------------------------------------------------------------------
+	// x86 kernels
+	//------------------------------------------------------------------------------------
+
+#if GLK_PIXEL_X86
+	GLK_PIXEL_TARGET("sse2")
+	GLK_FUNC void flip_rows_rgba_sse2(uint8_t* image_data, size_t stride,
+		size_t dim_x, size_t dim_y)
+	{
+		size_t half_dy = dim_y >> 1;
+		for (size_t y = 0; y < half_dy; ++y) {
+			uint8_t* top = image_data + y * stride;
+			uint8_t* bot = image_data + (dim_y - y - 1) * stride;
+
+			size_t x = 0;
+			for (; x + 4 <= dim_x; x += 4) {
+				__m128i t = _mm_loadu_si128((const __m128i*) &top[x * 4]);
+				__m128i b = _mm_loadu_si128((const __m128i*) &bot[x * 4]);
+
+				_mm_storeu_si128((__m128i*) &top[x * 4], b);
+				_mm_storeu_si128((__m128i*) &bot[x * 4], t);
+			}
+
+			swap_rows_rgba_tail(top, bot, x, dim_x);
+		}
+	}
+
+	GLK_PIXEL_TARGET("avx2")
+	GLK_FUNC void flip_rows_rgba_avx2(uint8_t* image_data, size_t stride,
+		size_t dim_x, size_t dim_y)
+	{
+		size_t half_dy = dim_y >> 1;
+		for (size_t y = 0; y < half_dy; ++y) {
+			uint8_t* top = image_data + y * stride;
+			uint8_t* bot = image_data + (dim_y - y - 1) * stride;
+
+			size_t x = 0;
+			for (; x + 8 <= dim_x; x += 8) {
+				__m256i t = _mm256_loadu_si256((const __m256i*) &top[x * 4]);
+				__m256i b = _mm256_loadu_si256((const __m256i*) &bot[x * 4]);
+
+				_mm256_storeu_si256((__m256i*) &top[x * 4], b);
+				_mm256_storeu_si256((__m256i*) &bot[x * 4], t);
+			}
+
+			swap_rows_rgba_tail(top, bot, x, dim_x);
+		}
+	}
+
+	// A row's texels from x on, once there are fewer than sixteen left:
+	// four at a time while a 16 byte load stays within the row, then one
+	// at a time
+	GLK_PIXEL_TARGET("ssse3")
+	GLK_FUNC void convert_rgb_to_rgba_ssse3_tail(uint8_t* d, const uint8_t* s,
+		size_t x, size_t dim_x)
+	{
+		const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+			6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+
+		for (; x + 6 <= dim_x; x += 4) {
+			__m128i t = _mm_loadu_si128((const __m128i*) &s[x * 3]);
+
+			_mm_storeu_si128((__m128i*) &d[x * 4],
+				_mm_or_si128(_mm_shuffle_epi8(t, expand), alpha));
+		}
+
+		convert_rgb_to_rgba_scalar(d + x * 4, 0, s + x * 3, 0, dim_x - x, 1);
+	}
+
+	// Sixteen texels at a time. Each 12 bytes of RGB are spread out to
+	// 16 bytes of RGBA by one shuffle, and alpha is ORed in. The loads
+	// cover the 48 bytes of those texels and nothing past them, so a
+	// row's last texels need no padding after them.
+	GLK_PIXEL_TARGET("ssse3")
+	GLK_FUNC void convert_rgb_to_rgba_ssse3(uint8_t* dest, size_t dest_stride,
+		const uint8_t* src, size_t src_stride, size_t dim_x, size_t dim_y)
+	{
+		const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+			6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+
+		for (size_t y = 0; y < dim_y; ++y) {
+			uint8_t* d = dest + y * dest_stride;
+			const uint8_t* s = src + y * src_stride;
+
+			size_t x = 0;
+			for (; x + 16 <= dim_x; x += 16) {
+				__m128i s0 = _mm_loadu_si128((const __m128i*) &s[x * 3]);
+				__m128i s1 = _mm_loadu_si128((const __m128i*) &s[x * 3 + 16]);
+				__m128i s2 = _mm_loadu_si128((const __m128i*) &s[x * 3 + 32]);
+
+				// Texels 4n to 4n + 3 start each of these
+				__m128i t1 = _mm_alignr_epi8(s1, s0, 12);
+				__m128i t2 = _mm_alignr_epi8(s2, s1, 8);
+				__m128i t3 = _mm_srli_si128(s2, 4);
+
+				_mm_storeu_si128((__m128i*) &d[x * 4],
+					_mm_or_si128(_mm_shuffle_epi8(s0, expand), alpha));
+				_mm_storeu_si128((__m128i*) &d[x * 4 + 16],
+					_mm_or_si128(_mm_shuffle_epi8(t1, expand), alpha));
+				_mm_storeu_si128((__m128i*) &d[x * 4 + 32],
+					_mm_or_si128(_mm_shuffle_epi8(t2, expand), alpha));
+				_mm_storeu_si128((__m128i*) &d[x * 4 + 48],
+					_mm_or_si128(_mm_shuffle_epi8(t3, expand), alpha));
+			}
+
+			convert_rgb_to_rgba_ssse3_tail(d, s, x, dim_x);
+		}
+	}
+
+	// As the SSSE3 version, eight texels to a register. The shuffle
+	// can't cross 128 bit lanes, so each lane first gets the 12 bytes it
+	// expands moved to its bottom; the two loads again end at the 48th
+	// byte.
+	GLK_PIXEL_TARGET("avx2")
+	GLK_FUNC void convert_rgb_to_rgba_avx2(uint8_t* dest, size_t dest_stride,
+		const uint8_t* src, size_t src_stride, size_t dim_x, size_t dim_y)
+	{
+		const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+			6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1,
+			6, 7, 8, -1, 9, 10, 11, -1);
+		const __m256i alpha = _mm256_set1_epi32((int) 0xFF000000);
+
+		// Bytes 0 to 23 of the first load, and 8 to 31 of the second
+		const __m256i lanes_lo = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+		const __m256i lanes_hi = _mm256_setr_epi32(2, 3, 4, 0, 5, 6, 7, 0);
+
+		for (size_t y = 0; y < dim_y; ++y) {
+			uint8_t* d = dest + y * dest_stride;
+			const uint8_t* s = src + y * src_stride;
+
+			size_t x = 0;
+			for (; x + 16 <= dim_x; x += 16) {
+				__m256i s0 = _mm256_loadu_si256((const __m256i*) &s[x * 3]);
+				__m256i s1 = _mm256_loadu_si256((const __m256i*) &s[x * 3 + 16]);
+
+				__m256i t0 = _mm256_permutevar8x32_epi32(s0, lanes_lo);
+				__m256i t1 = _mm256_permutevar8x32_epi32(s1, lanes_hi);
+
+				_mm256_storeu_si256((__m256i*) &d[x * 4],
+					_mm256_or_si256(_mm256_shuffle_epi8(t0, expand), alpha));
+				_mm256_storeu_si256((__m256i*) &d[x * 4 + 32],
+					_mm256_or_si256(_mm256_shuffle_epi8(t1, expand), alpha));
+			}
+
+			convert_rgb_to_rgba_ssse3_tail(d, s, x, dim_x);
+		}
+	}
+
+	// Eight texels at a time, each lookup a 32 bit gather at the byte it
+	// wants; the tables are padded for the three bytes past it. x86 is
+	// little endian, so red is a texel's low byte.
+	GLK_PIXEL_TARGET("avx2")
+	GLK_FUNC void post_process_rgba_avx2(uint8_t* image_data, size_t length, uint32_t flags)
+	{
+		if (!flags) {
+			return;
+		}
+
+		const post_process_tables_t& t = post_process_tables();
+
+		const int* brighten_in = (const int*) t.brighten_in;
+		const int* brightened = (const int*) t.brightened.data();
+		const int* brightened_encoded = (const int*) t.brightened_encoded.data();
+		const int* premul = (const int*) t.premul.data();
+		const int* premul_brightened = (const int*) t.premul_brightened.data();
+
+		bool brighten = !!(flags & GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN);
+		bool premul_alpha = !!(flags & GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA);
+
+		const __m256i low = _mm256_set1_epi32(0xFF);
+		const __m256i alpha_mask = _mm256_set1_epi32((int) 0xFF000000);
+		const __m256i opaque = _mm256_set1_epi32(255 << 8);
+
+		size_t i = 0;
+		for (; i + 32 <= length; i += 32) {
+			__m256i texels = _mm256_loadu_si256((const __m256i*) &image_data[i]);
+
+			__m256i r = _mm256_and_si256(texels, low);
+			__m256i g = _mm256_and_si256(_mm256_srli_epi32(texels, 8), low);
+			__m256i b = _mm256_and_si256(_mm256_srli_epi32(texels, 16), low);
+			__m256i a = _mm256_slli_epi32(_mm256_srli_epi32(texels, 24), 8);
+
+			#define GLK_PIXEL_GATHER(table, index) \
+				_mm256_and_si256(_mm256_i32gather_epi32((table), (index), 1), low)
+
+			if (!brighten) {
+				__m256i row = premul_alpha ? a : opaque;
+
+				r = GLK_PIXEL_GATHER(premul, _mm256_add_epi32(row, r));
+				g = GLK_PIXEL_GATHER(premul, _mm256_add_epi32(row, g));
+				b = GLK_PIXEL_GATHER(premul, _mm256_add_epi32(row, b));
+			} else {
+				r = GLK_PIXEL_GATHER(brighten_in, r);
+				g = GLK_PIXEL_GATHER(brighten_in, g);
+				b = GLK_PIXEL_GATHER(brighten_in, b);
+
+				__m256i m = _mm256_slli_epi32(
+					_mm256_max_epi32(r, _mm256_max_epi32(g, b)), 8);
+
+				if (!premul_alpha) {
+					r = GLK_PIXEL_GATHER(brightened_encoded, _mm256_add_epi32(m, r));
+					g = GLK_PIXEL_GATHER(brightened_encoded, _mm256_add_epi32(m, g));
+					b = GLK_PIXEL_GATHER(brightened_encoded, _mm256_add_epi32(m, b));
+				} else {
+					r = GLK_PIXEL_GATHER(brightened, _mm256_add_epi32(m, r));
+					g = GLK_PIXEL_GATHER(brightened, _mm256_add_epi32(m, g));
+					b = GLK_PIXEL_GATHER(brightened, _mm256_add_epi32(m, b));
+
+					r = GLK_PIXEL_GATHER(premul_brightened, _mm256_add_epi32(a, r));
+					g = GLK_PIXEL_GATHER(premul_brightened, _mm256_add_epi32(a, g));
+					b = GLK_PIXEL_GATHER(premul_brightened, _mm256_add_epi32(a, b));
+				}
+			}
+
+			#undef GLK_PIXEL_GATHER
+
+			texels = _mm256_or_si256(
+				_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+				_mm256_or_si256(_mm256_slli_epi32(b, 16),
+					_mm256_and_si256(texels, alpha_mask)));
+
+			_mm256_storeu_si256((__m256i*) &image_data[i], texels);
+		}
+
+		post_process_rgba_scalar(image_data + i, length - i, flags);
+	}
+#endif // GLK_PIXEL_X86
+
+	//------------------------------------------------------------------------------------
+	// dispatch
+	//------------------------------------------------------------------------------------
+
+	// Strides are in bytes. RGB expansion may write into a buffer with
+	// other things in it: only dim_x texels of each destination row are
+	// touched.
+	struct pixel_kernels_t {
+		pixel_isa_t isa;
+
+		void (*convert_rgb_to_rgba)(uint8_t* dest, size_t dest_stride,
+			const uint8_t* src, size_t src_stride, size_t dim_x, size_t dim_y);
+
+		void (*flip_rows_rgba)(uint8_t* image_data, size_t stride,
+			size_t dim_x, size_t dim_y);
+
+		void (*post_process_rgba)(uint8_t* image_data, size_t length, uint32_t flags);
+	};
+
+	// Kernels an instruction set doesn't have a version of come from the
+	// next one down
+	GLK_FUNC pixel_kernels_t pixel_kernels_for(pixel_isa_t isa)
+	{
+		pixel_kernels_t k;
+
+		k.isa = isa;
+		k.convert_rgb_to_rgba = convert_rgb_to_rgba_scalar;
+		k.flip_rows_rgba = flip_rows_rgba_scalar;
+		k.post_process_rgba = post_process_rgba_scalar;
+
+		switch (isa) {
+#if GLK_PIXEL_X86
+		case pixel_isa_avx2:
+			k.convert_rgb_to_rgba = convert_rgb_to_rgba_avx2;
+			k.flip_rows_rgba = flip_rows_rgba_avx2;
+			k.post_process_rgba = post_process_rgba_avx2;
+			break;
+
+		case pixel_isa_ssse3:
+			k.convert_rgb_to_rgba = convert_rgb_to_rgba_ssse3;
+			k.flip_rows_rgba = flip_rows_rgba_sse2;
+			break;
+
+		case pixel_isa_sse2:
+			k.flip_rows_rgba = flip_rows_rgba_sse2;
+			break;
+#endif
+
+		default:
+			k.isa = pixel_isa_scalar;
+			break;
+		}
+
+		return k;
+	}
+
+	GLK_FUNC pixel_isa_t pixel_best_isa(void)
+	{
+		static const pixel_isa_t isa = pixel_detect_isa();
+		return isa;
+	}
+
+	GLK_FUNC bool pixel_isa_supported(pixel_isa_t isa)
+	{
+		return isa <= pixel_best_isa();
+	}
+
+	// The kernels in use, shared by every translation unit so that
+	// pixel_force_isa reaches all of them. Defined in pixel.cpp.
+	pixel_kernels_t& pixel_kernels_state(void);
+
+	GLK_FUNC const pixel_kernels_t& pixel_kernels(void)
+	{
+		return pixel_kernels_state();
+	}
+
+	// Runs isa's kernels from here on. Returns false, and changes
+	// nothing, if this CPU can't run them.
+	GLK_FUNC bool pixel_force_isa(pixel_isa_t isa)
+	{
+		if (!pixel_isa_supported(isa))
+			return false;
+
+		pixel_kernels_state() = pixel_kernels_for(isa);
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------
+	// entry points
+	//------------------------------------------------------------------------------------
+
+	GLK_FUNC void convert_rgb_to_rgba(uint8_t* dest, size_t dest_stride,
+		const uint8_t* src, size_t src_stride, size_t dim_x, size_t dim_y)
+	{
+		pixel_kernels().convert_rgb_to_rgba(dest, dest_stride, src, src_stride,
+			dim_x, dim_y);
+	}
+
+	GLK_FUNC void convert_rgb_to_rgba(uint8_t* dest,
+		const uint8_t* src, size_t dim_x, size_t dim_y)
+	{
+		convert_rgb_to_rgba(dest, dim_x * 4, src, dim_x * 3, dim_x, dim_y);
+	}
+
+	GLK_FUNC void flip_rows_rgba(uint8_t* image_data,
+		size_t dim_x, size_t dim_y)
+	{
+		pixel_kernels().flip_rows_rgba(image_data, dim_x * 4, dim_x, dim_y);
+	}
+
+	GLK_FUNC void post_process_rgba(uint8_t* image_data, size_t length, uint32_t flags)
+	{
+		pixel_kernels().post_process_rgba(image_data, length, flags);
+	}
+}
+
+#endif // __GLK_PIXEL_H__
@@ -0,0 +1,349 @@
+#ifndef __GLK_RESAMPLE_H__
+#define __GLK_RESAMPLE_H__
+
+#include "main_def.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//------------------------------------------------------------------------------------
+// RGBA8 resampling
+//
+// Windowed sinc resizing to any size, up or down, for when a box filter
+// (see downscale.h) is too soft or too blocky. It's separable: each
+// destination row is filtered down the columns of the source into a row
+// of 16 bit values scaled by 1 << 6, which is extended by its edge texels
+// on both sides and then filtered across. Each destination texel along
+// an axis has its own phase, and with it its own weights, worked out
+// once per call; every texel of an axis has the same number of taps, the
+// ones which fall outside the source repeating its edge.
+//
+// The filters ring a little past sharp edges, as any sharp filter does;
+// that's clamped at 0 and 255.
+//------------------------------------------------------------------------------------
+
+namespace glk {
+
+	enum resample_filter_t {
+		resample_lanczos3 = 0, // sinc windowed by sinc, 3 lobes
+		resample_kaiser // sinc windowed by a Kaiser window (beta 6), 4 lobes
+	};
+
+	GLK_FUNC double resample_radius(resample_filter_t filter)
+	{
+		return filter == resample_kaiser ? 4.0 : 3.0;
+	}
+
+	GLK_FUNC double resample_sinc(double x)
+	{
+		if (fabs(x) < 1e-9)
+			return 1.0;
+
+		x *= 3.14159265358979323846;
+		return sin(x) / x;
+	}
+
+	// Zeroth order modified Bessel function of the first kind, for the
+	// Kaiser window
+	GLK_FUNC double resample_bessel_i0(double x)
+	{
+		double sum = 1.0, term = 1.0;
+
+		for (int k = 1; k < 32; ++k) {
+			term *= (x / (2.0 * k)) * (x / (2.0 * k));
+			sum += term;
+		}
+
+		return sum;
+	}
+
+	GLK_FUNC double resample_kernel(resample_filter_t filter, double x)
+	{
+		double radius = resample_radius(filter);
+
+		if (fabs(x) >= radius)
+			return 0.0;
+
+		if (filter == resample_kaiser) {
+			const double beta = 6.0;
+			double t = x / radius;
+
+			return resample_sinc(x) * resample_bessel_i0(beta * sqrt(1.0 - t * t))
+				/ resample_bessel_i0(beta);
+		}
+
+		return resample_sinc(x) * resample_sinc(x / radius);
+	}
+
+	// The weights along one axis. Destination texel i reads source
+	// texels first[i] to first[i] + taps - 1, any of which may be past
+	// the edge; its weights (out of 1 << 14) are weights[i * taps / 2]
+	// onward, two to a value, the first of each pair in the low half.
+	struct resample_weights_t {
+		size_t taps; // even
+		std::vector<int32_t> first;
+		std::vector<uint32_t> weights;
+
+		static const int32_t one = 1 << 14;
+
+		resample_weights_t(size_t src, size_t dst, resample_filter_t filter)
+		{
+			double scale = (double) src / (double) dst;
+
+			// Shrinking stretches the filter over more source texels, so
+			// it cuts off at the destination's frequency, not the source's
+			double stretch = std::max(scale, 1.0);
+			double support = resample_radius(filter) * stretch;
+
+			taps = ((size_t) ceil(support * 2.0) + 2) & ~(size_t) 1;
+
+			std::vector<double> f(taps);
+			std::vector<int32_t> w(taps);
+
+			for (size_t i = 0; i < dst; ++i) {
+				double center = (i + 0.5) * scale - 0.5;
+				int32_t a = (int32_t) floor(center - support) + 1;
+
+				double total = 0.0;
+
+				for (size_t k = 0; k < taps; ++k) {
+					f[k] = resample_kernel(filter, (a + (double) k - center) / stretch);
+					total += f[k];
+				}
+
+				// Rounding error goes to the largest tap
+				int32_t sum = 0;
+				size_t largest = 0;
+
+				for (size_t k = 0; k < taps; ++k) {
+					w[k] = (int32_t) floor(f[k] / total * one + 0.5);
+					sum += w[k];
+
+					if (w[k] > w[largest])
+						largest = k;
+				}
+
+				w[largest] += one - sum;
+
+				first.push_back(a);
+
+				for (size_t k = 0; k < taps; k += 2)
+					weights.push_back((uint32_t) (w[k] & 0xFFFF) | ((uint32_t) w[k + 1] << 16));
+			}
+		}
+	};
+
+	GLK_FUNC int16_t resample_clamp16(int32_t v)
+	{
+		return (int16_t) std::min(std::max(v, -32768), 32767);
+	}
+
+	// Destination rows [first_row, end_row)
+	GLK_FUNC void resample_rows(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_width, size_t dst_stride,
+		const resample_weights_t& across, const resample_weights_t& down,
+		size_t first_row, size_t end_row)
+	{
+		// Texels past either edge of the row, for taps which reach there
+		const size_t pad = across.taps + 1;
+
+		std::vector<int16_t> row((width + pad * 2) * 4);
+		int16_t* texels = &row[pad * 4];
+
+		std::vector<const uint8_t*> rows(down.taps);
+
+		const size_t channels = width * 4;
+		const size_t pairs_y = down.taps / 2;
+		const size_t pairs_x = across.taps / 2;
+
+		for (size_t y = first_row; y < end_row; ++y) {
+			const int32_t first = down.first[y];
+			const uint32_t* wy = &down.weights[y * pairs_y];
+
+			for (size_t k = 0; k < down.taps; ++k) {
+				int32_t r = std::min(std::max(first + (int32_t) k, 0), (int32_t) height - 1);
+				rows[k] = src + (size_t) r * src_stride;
+			}
+
+			size_t i = 0;
+
+			// Down the columns: rows go in pairs through madd, each lane
+			// a source channel next to the one below it
+#if defined(__AVX2__)
+			for (; i + 16 <= channels; i += 16) {
+				__m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+
+				for (size_t k = 0; k < pairs_y; ++k) {
+					__m256i a = _mm256_cvtepu8_epi16(
+						_mm_loadu_si128((const __m128i*) (rows[k * 2] + i)));
+					__m256i b = _mm256_cvtepu8_epi16(
+						_mm_loadu_si128((const __m128i*) (rows[k * 2 + 1] + i)));
+					__m256i w = _mm256_set1_epi32((int) wy[k]);
+
+					lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+					hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+				}
+
+				__m256i bias = _mm256_set1_epi32(1 << 7);
+
+				lo = _mm256_srai_epi32(_mm256_add_epi32(lo, bias), 8);
+				hi = _mm256_srai_epi32(_mm256_add_epi32(hi, bias), 8);
+
+				// Unpacking and packing both work within each 128 bit
+				// half, so the channels come out in order
+				_mm256_storeu_si256((__m256i*) &texels[i], _mm256_packs_epi32(lo, hi));
+			}
+#endif
+#if defined(__SSE2__)
+			for (; i + 8 <= channels; i += 8) {
+				const __m128i zero = _mm_setzero_si128();
+				__m128i lo = zero, hi = zero;
+
+				for (size_t k = 0; k < pairs_y; ++k) {
+					__m128i a = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((const __m128i*) (rows[k * 2] + i)), zero);
+					__m128i b = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((const __m128i*) (rows[k * 2 + 1] + i)), zero);
+					__m128i w = _mm_set1_epi32((int) wy[k]);
+
+					lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+					hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+				}
+
+				__m128i bias = _mm_set1_epi32(1 << 7);
+
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), 8);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), 8);
+
+				_mm_storeu_si128((__m128i*) &texels[i], _mm_packs_epi32(lo, hi));
+			}
+#endif
+			for (; i < channels; ++i) {
+				int32_t sum = 0;
+
+				for (size_t k = 0; k < down.taps; ++k)
+					sum += rows[k][i] * (int16_t) (wy[k / 2] >> (k % 2 * 16));
+
+				texels[i] = resample_clamp16((sum + (1 << 7)) >> 8);
+			}
+
+			for (size_t k = 0; k < pad; ++k) {
+				memcpy(&row[k * 4], texels, 4 * sizeof(int16_t));
+				memcpy(&texels[(width + k) * 4], &texels[(width - 1) * 4], 4 * sizeof(int16_t));
+			}
+
+			// Across: each pair of source texels is one load, which is
+			// interleaved with itself to put each channel next to the
+			// same channel of the next texel
+			uint8_t* out = dst + y * dst_stride;
+
+			size_t x = 0;
+
+#if defined(__AVX2__)
+			// Two destination texels, one per 128 bit half
+			for (; x + 2 <= dst_width; x += 2) {
+				const int16_t* t0 = texels + across.first[x] * 4;
+				const int16_t* t1 = texels + across.first[x + 1] * 4;
+				const uint32_t* w0 = &across.weights[x * pairs_x];
+				const uint32_t* w1 = w0 + pairs_x;
+
+				__m256i sum = _mm256_set1_epi32(1 << 19);
+
+				for (size_t k = 0; k < pairs_x; ++k) {
+					__m256i ab = _mm256_inserti128_si256(_mm256_castsi128_si256(
+						_mm_loadu_si128((const __m128i*) (t0 + k * 8))),
+						_mm_loadu_si128((const __m128i*) (t1 + k * 8)), 1);
+
+					__m256i w = _mm256_setr_epi32((int) w0[k], (int) w0[k], (int) w0[k], (int) w0[k],
+						(int) w1[k], (int) w1[k], (int) w1[k], (int) w1[k]);
+
+					sum = _mm256_add_epi32(sum, _mm256_madd_epi16(
+						_mm256_unpacklo_epi16(ab, _mm256_srli_si256(ab, 8)), w));
+				}
+
+				sum = _mm256_srai_epi32(sum, 20);
+				sum = _mm256_packs_epi32(sum, sum);
+				sum = _mm256_packus_epi16(sum, sum);
+
+				uint32_t texel0 = (uint32_t) _mm_cvtsi128_si32(_mm256_castsi256_si128(sum));
+				uint32_t texel1 = (uint32_t) _mm_cvtsi128_si32(_mm256_extracti128_si256(sum, 1));
+
+				memcpy(out + x * 4, &texel0, 4);
+				memcpy(out + x * 4 + 4, &texel1, 4);
+			}
+#endif
+#if defined(__SSE2__)
+			for (; x < dst_width; ++x) {
+				const int16_t* t = texels + across.first[x] * 4;
+				const uint32_t* wx = &across.weights[x * pairs_x];
+
+				__m128i sum = _mm_set1_epi32(1 << 19);
+
+				for (size_t k = 0; k < pairs_x; ++k) {
+					__m128i ab = _mm_loadu_si128((const __m128i*) (t + k * 8));
+
+					sum = _mm_add_epi32(sum, _mm_madd_epi16(
+						_mm_unpacklo_epi16(ab, _mm_srli_si128(ab, 8)),
+						_mm_set1_epi32((int) wx[k])));
+				}
+
+				sum = _mm_srai_epi32(sum, 20);
+				sum = _mm_packs_epi32(sum, sum);
+
+				uint32_t texel = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+
+				memcpy(out + x * 4, &texel, 4);
+			}
+#endif
+			for (; x < dst_width; ++x) {
+				const int16_t* t = texels + across.first[x] * 4;
+				const uint32_t* wx = &across.weights[x * pairs_x];
+
+				for (size_t c = 0; c < 4; ++c) {
+					int32_t sum = 1 << 19;
+
+					for (size_t k = 0; k < across.taps; ++k)
+						sum += t[k * 4 + c] * (int16_t) (wx[k / 2] >> (k % 2 * 16));
+
+					out[x * 4 + c] = (uint8_t) std::min(std::max(sum >> 20, 0), 255);
+				}
+			}
+		}
+	}
+
+	// Resizes width x height texels at src (src_stride bytes per row) to
+	// dst_width x dst_height at dst, which mustn't overlap src. Rows are
+	// split into bands across threads, 0 meaning one per hardware thread;
+	// by default it all runs on the calling thread.
+	GLK_FUNC void resample_rgba(const uint8_t* src, size_t width, size_t height,
+		size_t src_stride, uint8_t* dst, size_t dst_width, size_t dst_height,
+		size_t dst_stride, resample_filter_t filter = resample_lanczos3, unsigned threads = 1)
+	{
+		resample_weights_t across(width, dst_width, filter);
+		resample_weights_t down(height, dst_height, filter);
+
+		parallel_rows(dst_height, threads,
+			[&](size_t first, size_t end) {
+			resample_rows(src, width, height, src_stride, dst, dst_width, dst_stride,
+				across, down, first, end);
+		});
+	}
+
+} // namespace glk
+
+#endif // __GLK_RESAMPLE_H__
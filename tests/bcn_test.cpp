@@ -0,0 +1,220 @@
+//------------------------------------------------------------------------------------
+// BC1 / BC3: the reference decoders against blocks worked out by hand from the
+// format descriptions, then encode + decode round trips of random and flat
+// blocks and of the textures/ corpus, with the PSNR each format reaches.
+//------------------------------------------------------------------------------------
+
+#include "test_common.h"
+
+#include "../bcn.h"
+
+#include <math.h>
+
+static bool rgba_is(const uint8_t* t, int r, int g, int b, int a)
+{
+	return t[0] == r && t[1] == g && t[2] == b && t[3] == a;
+}
+
+static void check_decoders(void)
+{
+	uint8_t out[64];
+
+	// Four colors: red over blue (0xF800 > 0x001F), texels 0 to 3 taking
+	// indices 0 to 3, the rest 0
+	{
+		const uint8_t block[8] = { 0x00, 0xF8, 0x1F, 0x00, 0xE4, 0x00, 0x00, 0x00 };
+
+		glk::bc1_decode_block(block, out);
+
+		TEST_CHECK(rgba_is(&out[0], 255, 0, 0, 255));
+		TEST_CHECK(rgba_is(&out[4], 0, 0, 255, 255));
+		TEST_CHECK(rgba_is(&out[8], 170, 0, 85, 255));
+		TEST_CHECK(rgba_is(&out[12], 85, 0, 170, 255));
+		TEST_CHECK(rgba_is(&out[60], 255, 0, 0, 255));
+	}
+
+	// Three colors and transparent black: the same endpoints swapped
+	{
+		const uint8_t block[8] = { 0x1F, 0x00, 0x00, 0xF8, 0xE4, 0x00, 0x00, 0x00 };
+
+		glk::bc1_decode_block(block, out);
+
+		TEST_CHECK(rgba_is(&out[0], 0, 0, 255, 255));
+		TEST_CHECK(rgba_is(&out[4], 255, 0, 0, 255));
+		TEST_CHECK(rgba_is(&out[8], 127, 0, 127, 255));
+		TEST_CHECK(rgba_is(&out[12], 0, 0, 0, 0));
+	}
+
+	// BC3: eight alphas between 200 and 60, texels 0, 1 and 2 taking
+	// indices 0, 2 and 7. The color half always has four colors.
+	{
+		uint8_t block[16] = { 200, 60 };
+		uint64_t indices = (uint64_t) 2 << 3 | (uint64_t) 7 << 6;
+
+		for (int i = 0; i < 6; ++i)
+			block[2 + i] = (uint8_t) (indices >> (8 * i));
+
+		const uint8_t color[8] = { 0x1F, 0x00, 0x00, 0xF8, 0xC0, 0x00, 0x00, 0x00 };
+		memcpy(block + 8, color, 8);
+
+		glk::bc3_decode_block(block, out);
+
+		TEST_CHECK(out[3] == 200);
+		TEST_CHECK(out[7] == 180);
+		TEST_CHECK(out[11] == 80);
+		TEST_CHECK(rgba_is(&out[12], 170, 0, 85, 200));
+	}
+
+	// Six alphas between 60 and 200, plus 0 (index 6) and 255 (index 7)
+	{
+		uint8_t block[16] = { 60, 200 };
+		uint64_t indices = (uint64_t) 6 | (uint64_t) 7 << 3 | (uint64_t) 2 << 6;
+
+		for (int i = 0; i < 6; ++i)
+			block[2 + i] = (uint8_t) (indices >> (8 * i));
+
+		glk::bc3_decode_block(block, out);
+
+		TEST_CHECK(out[3] == 0);
+		TEST_CHECK(out[7] == 255);
+		TEST_CHECK(out[11] == 88);
+		TEST_CHECK(out[15] == 60);
+	}
+}
+
+static void check_blocks(void)
+{
+	std::mt19937 rng(13);
+
+	uint8_t texels[64], block[16], out[64];
+	int misordered = 0, bc1_transparent = 0;
+
+	// Random blocks, and ones with only a few levels per channel
+	for (int trial = 0; trial < 10000; ++trial) {
+		for (int i = 0; i < 64; ++i)
+			texels[i] = trial % 3 ? (uint8_t) (rng() % 16 * 17) : (uint8_t) rng();
+
+		// The encoders only write four color blocks
+		glk::bc1_encode_block(texels, block);
+		glk::bc1_decode_block(block, out);
+
+		misordered += (block[0] | block[1] << 8) <= (block[2] | block[3] << 8)
+			&& (block[4] | block[5] | block[6] | block[7]) != 0;
+
+		for (int t = 0; t < 16; ++t)
+			bc1_transparent += out[t * 4 + 3] != 255;
+
+		glk::bc3_encode_block(texels, block);
+
+		misordered += (block[8] | block[9] << 8) < (block[10] | block[11] << 8);
+	}
+
+	printf("random blocks: %d misordered endpoints, %d transparent BC1 texels\n",
+		misordered, bc1_transparent);
+
+	TEST_CHECK(misordered == 0);
+	TEST_CHECK(bc1_transparent == 0);
+
+	int rgb_error = 0, alpha_error = 0;
+
+	for (int c = 0; c < 256; c += 5) {
+		for (int t = 0; t < 16; ++t) {
+			texels[t * 4] = (uint8_t) c;
+			texels[t * 4 + 1] = (uint8_t) (255 - c);
+			texels[t * 4 + 2] = (uint8_t) (c / 2);
+			texels[t * 4 + 3] = (uint8_t) c;
+		}
+
+		glk::bc3_encode_block(texels, block);
+		glk::bc3_decode_block(block, out);
+
+		for (int i = 0; i < 64; ++i) {
+			int error = abs(out[i] - texels[i]);
+
+			if (i % 4 == 3)
+				alpha_error = std::max(alpha_error, error);
+			else
+				rgb_error = std::max(rgb_error, error);
+		}
+	}
+
+	printf("flat blocks: worst RGB error %d, alpha %d\n", rgb_error, alpha_error);
+
+	// A flat color falls between two 565 values, and the palette's thirds
+	// get within a couple of steps of it; either alpha endpoint hits it
+	TEST_CHECK(rgb_error <= 4);
+	TEST_CHECK(alpha_error == 0);
+}
+
+static double psnr(double squared_error, double samples)
+{
+	return 10.0 * log10(255.0 * 255.0 * samples / std::max(squared_error, 1e-9));
+}
+
+static void check_corpus(const std::string& root)
+{
+	const glk::bcn_format_t formats[] = { glk::bcn_bc1, glk::bcn_bc3 };
+	const char* names[] = { "BC1", "BC3" };
+
+	double rgb_error[2] = {}, alpha_error = 0.0, ms[2] = {};
+	double rgb_samples = 0.0, alpha_samples = 0.0;
+
+	size_t images = test_for_each_texture(root, 4, [&](const std::string&,
+		uint8_t* rgba, int width, int height, int) {
+		std::vector<uint8_t> decoded((size_t) width * height * 4);
+
+		for (int f = 0; f < 2; ++f) {
+			std::vector<uint8_t> blocks(glk::bcn_encoded_size(formats[f], width, height));
+
+			double t0 = test_now_ms();
+			glk::bcn_encode_image(rgba, width, height, (size_t) width * 4, formats[f],
+				blocks.data(), 1);
+			ms[f] += test_now_ms() - t0;
+
+			glk::bcn_decode_image(blocks.data(), width, height, formats[f], decoded.data());
+
+			for (size_t i = 0; i < (size_t) width * height; ++i) {
+				for (int c = 0; c < 3; ++c) {
+					double d = (double) rgba[i * 4 + c] - decoded[i * 4 + c];
+					rgb_error[f] += d * d;
+				}
+
+				if (formats[f] == glk::bcn_bc3) {
+					double d = (double) rgba[i * 4 + 3] - decoded[i * 4 + 3];
+					alpha_error += d * d;
+				}
+			}
+		}
+
+		rgb_samples += (double) width * height * 3;
+		alpha_samples += (double) width * height;
+	});
+
+	printf("%zu images from %s\n", images, root.c_str());
+	TEST_CHECK(images > 0);
+
+	for (int f = 0; f < 2; ++f) {
+		printf("  %-4s  RGB %.2f dB", names[f], psnr(rgb_error[f], rgb_samples));
+
+		if (formats[f] == glk::bcn_bc3)
+			printf("  alpha %.2f dB", psnr(alpha_error, alpha_samples));
+
+		printf("  %.0f ms\n", ms[f]);
+	}
+
+	// Floors a little under what the encoders reach on textures/
+	if (images) {
+		TEST_CHECK(psnr(rgb_error[0], rgb_samples) > 33.0);
+		TEST_CHECK(psnr(rgb_error[1], rgb_samples) > 33.0);
+		TEST_CHECK(psnr(alpha_error, alpha_samples) > 47.0);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	check_decoders();
+	check_blocks();
+	check_corpus(test_textures_root(argc, argv));
+
+	return test_result("bcn_test");
+}
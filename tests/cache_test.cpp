@@ -0,0 +1,247 @@
+//------------------------------------------------------------------------------------
+// The .glka cache: a cold build through make_atlas_from_dir_cached has to
+// leave a cache which loads back into the same layout. Then copies of it
+// with damaged headers, layer records and slot links, and cut short, have
+// to be refused by load_atlas_cache and rebuilt from the directory. Last,
+// a BC compressed build which drops its pixels after upload still has to
+// be cached, with the blocks the same as encoding the layers afresh.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include "../atlas_cache.h"
+
+using namespace glk;
+
+static std::vector<uint8_t> read_file(const std::string& path)
+{
+	std::vector<uint8_t> bytes;
+	FILE* file = fopen(path.c_str(), "rb");
+
+	if (!file)
+		return bytes;
+
+	fseek(file, 0, SEEK_END);
+	bytes.resize((size_t) ftell(file));
+	fseek(file, 0, SEEK_SET);
+
+	if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size())
+		bytes.clear();
+
+	fclose(file);
+
+	return bytes;
+}
+
+static bool write_file(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+
+	if (!file)
+		return false;
+
+	bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+
+	return (fclose(file) == 0) && ok;
+}
+
+// The directory below root with the most files, so the atlas has a few
+// layers' worth of images without taking long to build
+static std::string test_dir(const std::string& root)
+{
+	std::string best;
+	size_t most = 0;
+
+	for (const std::string& dir: test_list_dir(root)) {
+		size_t files = test_list_dir(root + "/" + dir).size();
+
+		if (files > most) {
+			most = files;
+			best = root + "/" + dir;
+		}
+	}
+
+	return best;
+}
+
+static bool same_layout(const atlas_t& a, const atlas_t& b)
+{
+	if (a.num_images != b.num_images || a.num_layers() != b.num_layers())
+		return false;
+
+	for (size_t i = 0; i < a.num_layers(); ++i)
+		if (a.widths[i] != b.widths[i] || a.heights[i] != b.heights[i])
+			return false;
+
+	for (uint16_t i = 0; i < a.num_images; ++i)
+		if (a.layers[i] != b.layers[i] || a.coords_x[i] != b.coords_x[i]
+			|| a.coords_y[i] != b.coords_y[i] || a.slots[i] != b.slots[i]
+			|| a.image_rotated(i) != b.image_rotated(i))
+			return false;
+
+	return a.filenames == b.filenames;
+}
+
+// The file's tables, which the damage below is done to
+struct cache_view_t {
+	glka_header_t* header;
+	glka_layer_t* layers;
+	glka_image_t* images;
+
+	explicit cache_view_t(std::vector<uint8_t>& bytes)
+		:   header((glka_header_t*) bytes.data()),
+			layers((glka_layer_t*) (bytes.data() + sizeof(glka_header_t))),
+			images((glka_image_t*) (layers + header->num_layers))
+	{}
+};
+
+typedef void (*damage_fn_t)(std::vector<uint8_t>& bytes);
+
+struct damage_t {
+	const char* name;
+	damage_fn_t fn;
+};
+
+static const damage_t g_damage[] = {
+	{ "zero page size", [](std::vector<uint8_t>& b) {
+		cache_view_t(b).header->page_size = 0; } },
+	{ "page size not a power of two", [](std::vector<uint8_t>& b) {
+		cache_view_t(b).header->page_size = 3000; } },
+	{ "layer off its page", [](std::vector<uint8_t>& b) {
+		cache_view_t(b).layers[0].offset += 16; } },
+	{ "layer past the end", [](std::vector<uint8_t>& b) {
+		cache_view_t v(b);
+		v.layers[v.header->num_layers - 1].offset = v.header->file_length; } },
+	{ "slot out of range", [](std::vector<uint8_t>& b) {
+		cache_view_t v(b);
+		v.images[0].slot = (uint16_t) v.header->num_images; } },
+	{ "slot chain", [](std::vector<uint8_t>& b) {
+		cache_view_t v(b);
+		v.images[0].slot = 1;
+		v.images[1].slot = 2; } },
+	{ "slot cycle", [](std::vector<uint8_t>& b) {
+		cache_view_t v(b);
+		v.images[0].slot = 1;
+		v.images[1].slot = 0; } },
+	{ "duplicate of an unplaced slot", [](std::vector<uint8_t>& b) {
+		cache_view_t v(b);
+		v.images[0].slot = 0;
+		v.images[0].layer = 0xFF;
+		v.images[1].slot = 0; } },
+	{ "cut short", [](std::vector<uint8_t>& b) {
+		b.resize(b.size() - 1); } }
+};
+
+static void check_dropped_build(const std::string& dir, const std::string& cache_path)
+{
+	remove(cache_path.c_str());
+
+	atlas_t dropped;
+	dropped.set_compression(atlas_compression_bcn);
+	dropped.set_residency_policy(atlas_residency_drop);
+
+	uint64_t signature = atlas_source_signature(dropped, dir);
+
+	TEST_CHECK(make_atlas_from_dir_cached(dropped, dir, cache_path));
+	TEST_CHECK(dropped.pixels_dropped);
+	TEST_CHECK(dropped.captured_layers.empty());
+
+	atlas_t loaded;
+	bool cached = load_atlas_cache(loaded, cache_path, signature);
+
+	TEST_CHECK(cached);
+	TEST_CHECK(same_layout(dropped, loaded));
+
+	// The same atlas, kept in memory, encoded layer by layer
+	atlas_t kept;
+	kept.set_compression(atlas_compression_bcn);
+
+	TEST_CHECK(make_atlas_from_dir(kept, dir));
+	TEST_CHECK(same_layout(dropped, kept));
+
+	std::vector<uint8_t> bytes = read_file(cache_path);
+	std::vector<uint8_t> blocks;
+	int differ = 0;
+
+	if (cached && same_layout(dropped, kept)) {
+		cache_view_t v(bytes);
+
+		for (uint8_t layer = 0; layer < kept.num_layers(); ++layer) {
+			encode_atlas_layer(kept, layer, blocks);
+
+			differ += v.layers[layer].offset + blocks.size() > bytes.size()
+				|| memcmp(bytes.data() + v.layers[layer].offset, blocks.data(),
+					blocks.size()) != 0;
+		}
+	}
+
+	printf("BC, pixels dropped: %s, %d of %zu layers differ from a fresh encode\n",
+		cached ? "cached" : "NOT cached", differ, kept.num_layers());
+
+	TEST_CHECK(differ == 0);
+
+	remove(cache_path.c_str());
+}
+
+int main(int argc, char** argv)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	std::string dir = test_dir(test_textures_root(argc, argv));
+	const std::string cache_path = "cache_test.glka";
+	const std::string damaged_path = "cache_test_damaged.glka";
+
+	remove(cache_path.c_str());
+
+	atlas_t built;
+
+	uint64_t signature = atlas_source_signature(built, dir);
+
+	TEST_CHECK(make_atlas_from_dir_cached(built, dir, cache_path));
+	printf("%s: %u images in %zu layers\n", dir.c_str(), (unsigned) built.num_images,
+		built.num_layers());
+
+	atlas_t loaded;
+
+	TEST_CHECK(load_atlas_cache(loaded, cache_path, signature));
+	TEST_CHECK(same_layout(built, loaded));
+
+	std::vector<uint8_t> bytes = read_file(cache_path);
+	TEST_CHECK(bytes.size() > sizeof(glka_header_t));
+
+	if (built.num_images < 3 || bytes.size() <= sizeof(glka_header_t)) {
+		remove(cache_path.c_str());
+		return test_result("cache_test");
+	}
+
+	for (const damage_t& damage: g_damage) {
+		std::vector<uint8_t> damaged = bytes;
+		damage.fn(damaged);
+
+		TEST_CHECK(write_file(damaged_path, damaged));
+
+		atlas_t atlas;
+		bool refused = !load_atlas_cache(atlas, damaged_path, signature);
+
+		// Refused, then built from the directory and cached over again
+		atlas_t rebuilt;
+		bool built_again = make_atlas_from_dir_cached(rebuilt, dir, damaged_path);
+		bool cached_again = load_atlas_cache(atlas, damaged_path, signature);
+
+		printf("  %-30s %s, %s\n", damage.name, refused ? "refused" : "LOADED",
+			built_again && cached_again ? "rebuilt" : "not rebuilt");
+
+		TEST_CHECK(refused);
+		TEST_CHECK(built_again && cached_again);
+		TEST_CHECK(same_layout(built, rebuilt));
+	}
+
+	remove(damaged_path.c_str());
+
+	check_dropped_build(dir, cache_path);
+
+	return test_result("cache_test");
+}
@@ -0,0 +1,199 @@
+//------------------------------------------------------------------------------------
+// Background compaction: an atlas of random images (a few of them
+// duplicates, rotation allowed) loses half its images, and is compacted
+// while this thread keeps querying UVs. Until the new layout is swapped in,
+// every query has to answer as before. While the worker packs, one more
+// image is removed and one inserted. Afterwards every live image has to read
+// back through its UVs as the pixels it was pushed with; removed images have
+// to be gone, the inserted one placed; and the layers have to have shrunk.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+using namespace glk;
+
+static std::vector<uint8_t> random_image(std::mt19937& rng, int width, int height)
+{
+	std::vector<uint8_t> texels((size_t) width * height * 4);
+
+	for (uint8_t& t: texels)
+		t = (uint8_t) rng();
+
+	for (size_t i = 3; i < texels.size(); i += 4)
+		texels[i] = 255;
+
+	return texels;
+}
+
+struct uv_snapshot_t {
+	std::vector<uint8_t> layers;
+	std::vector<float> u0, v0, u1, v1;
+
+	explicit uv_snapshot_t(size_t count)
+		:   layers(count), u0(count), v0(count), u1(count), v1(count)
+	{}
+
+	atlas_uv_batch_t batch(void)
+	{
+		return atlas_uv_batch_t { layers.data(), u0.data(), v0.data(), u1.data(), v1.data() };
+	}
+
+	bool operator==(const uv_snapshot_t& o) const
+	{
+		return layers == o.layers && u0 == o.u0 && v0 == o.v0 && u1 == o.u1 && v1 == o.v1;
+	}
+};
+
+static uint64_t layer_texels(const atlas_t& atlas)
+{
+	uint64_t texels = 0;
+
+	for (size_t i = 0; i < atlas.num_layers(); ++i)
+		texels += (uint64_t) atlas.widths[i] * atlas.heights[i];
+
+	return texels;
+}
+
+static uv_snapshot_t query_all(const atlas_t& atlas)
+{
+	std::vector<uint16_t> ids(atlas.num_images);
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		ids[i] = i;
+
+	uv_snapshot_t uvs(ids.size());
+	atlas.query_uvs(ids.data(), ids.size(), uvs.batch());
+
+	return uvs;
+}
+
+// Live images which don't read back through their UVs as pushed; removed
+// ones which still have a layer count too
+static int check_pixels(const atlas_t& atlas, const std::vector<std::vector<uint8_t>>& pushed)
+{
+	uv_snapshot_t uvs = query_all(atlas);
+
+	std::vector<std::vector<uint8_t>> composed(atlas.num_layers());
+
+	for (size_t layer = 0; layer < atlas.num_layers(); ++layer)
+		compose_atlas_layer(atlas, (uint8_t) layer, composed[layer]);
+
+	std::vector<uint8_t> shown;
+	int wrong = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		if (atlas.image_removed(i)) {
+			wrong += uvs.layers[i] != 0xFF;
+			continue;
+		}
+
+		uint8_t layer = uvs.layers[i];
+
+		if (layer >= atlas.num_layers()) {
+			wrong++;
+			continue;
+		}
+
+		test_sample_image(composed[layer], atlas.widths[layer], atlas.heights[layer],
+			uvs.u0[i], uvs.v0[i], uvs.u1[i], uvs.v1[i], atlas.record(i).rotated != 0,
+			atlas.dims_x[i], atlas.dims_y[i], shown);
+
+		wrong += shown != pushed[i];
+	}
+
+	return wrong;
+}
+
+int main(int, char**)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	std::mt19937 rng(23);
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_packer_type(atlas_packer_maxrects_bssf);
+	atlas.set_allow_rotation(true);
+
+	std::vector<std::vector<uint8_t>> pushed;
+
+	for (int i = 0; i < 400; ++i) {
+		int width, height;
+
+		// Every tenth image repeats an earlier one
+		if (i % 10 == 9) {
+			size_t original = rng() % pushed.size();
+
+			width = atlas.dims_x[original];
+			height = atlas.dims_y[original];
+			pushed.push_back(pushed[original]);
+		} else {
+			width = 4 + (int) (rng() % 160);
+			height = 4 + (int) (rng() % 160);
+			pushed.push_back(random_image(rng, width, height));
+		}
+
+		push_atlas_image(atlas, pushed.back().data(), width, height, 4, 0, false);
+	}
+
+	TEST_CHECK(atlas.num_duplicates > 0);
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+	TEST_CHECK(check_pixels(atlas, pushed) == 0);
+
+	uint64_t texels_before = layer_texels(atlas);
+
+	for (uint16_t i = 0; i < atlas.num_images; i += 2)
+		atlas.remove_image(i);
+
+	uv_snapshot_t before = query_all(atlas);
+
+	TEST_CHECK(begin_atlas_compaction(atlas));
+	TEST_CHECK(!begin_atlas_compaction(atlas)); // one at a time
+
+	// While the worker packs: one more removal, one insert
+	uint16_t late_removed = 1;
+	atlas.remove_image(late_removed);
+	before = query_all(atlas);
+
+	std::vector<uint8_t> late = random_image(rng, 40, 24);
+	uint16_t inserted = insert_atlas_image(atlas, late.data(), 40, 24, 4, 0, false);
+
+	TEST_CHECK(inserted != atlas_t::no_image_index);
+	pushed.push_back(late);
+
+	before = query_all(atlas);
+
+	int polls = 0, changed = 0;
+
+	while (!finish_atlas_compaction(atlas)) {
+		changed += !(query_all(atlas) == before);
+		polls++;
+
+		if (polls > 2000000)
+			break;
+	}
+
+	printf("%llu layer texels -> %llu, %d polls while packing, %d saw the layout change\n",
+		(unsigned long long) texels_before, (unsigned long long) layer_texels(atlas),
+		polls, changed);
+
+	TEST_CHECK(changed == 0);
+	TEST_CHECK(layer_texels(atlas) < texels_before);
+	TEST_CHECK(!atlas.compaction);
+
+	int wrong = check_pixels(atlas, pushed);
+
+	printf("%d images don't read back as pushed\n", wrong);
+
+	TEST_CHECK(wrong == 0);
+	TEST_CHECK(atlas.record(late_removed).layer == 0xFF);
+	TEST_CHECK(inserted != atlas_t::no_image_index && atlas.record(inserted).layer != 0xFF);
+
+	atlas.free_memory();
+
+	return test_result("compaction_test");
+}
@@ -0,0 +1,266 @@
+//------------------------------------------------------------------------------------
+// downscale_rgba against scalar references: an exact integer box for halving
+// and quartering, and area / bilinear sampling in doubles for every other
+// size. Then what push_atlas_image keeps of a trimmed image in a downscaled
+// atlas, and the filters' throughput on the textures/ corpus.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <math.h>
+
+using glk::downscale_extent;
+
+// factor x factor box, edges repeating the last row and column, rounded
+static void reference_box(const uint8_t* src, size_t width, size_t height,
+	uint8_t* dst, size_t factor)
+{
+	size_t dst_width = downscale_extent(width, factor);
+	size_t dst_height = downscale_extent(height, factor);
+
+	for (size_t y = 0; y < dst_height; ++y) {
+		for (size_t x = 0; x < dst_width; ++x) {
+			for (int c = 0; c < 4; ++c) {
+				uint32_t sum = 0;
+
+				for (size_t j = 0; j < factor; ++j) {
+					for (size_t i = 0; i < factor; ++i) {
+						size_t sx = std::min(x * factor + i, width - 1);
+						size_t sy = std::min(y * factor + j, height - 1);
+
+						sum += src[(sy * width + sx) * 4 + c];
+					}
+				}
+
+				dst[(y * dst_width + x) * 4 + c] =
+					(uint8_t) ((sum + factor * factor / 2) / (factor * factor));
+			}
+		}
+	}
+}
+
+// Channel c of destination texel (x, y): the area it covers, or a
+// bilinear sample at its center
+static double reference_texel(const uint8_t* src, size_t width, size_t height,
+	size_t dst_width, size_t dst_height, size_t x, size_t y, int c, bool bilinear)
+{
+	double scale_x = (double) width / dst_width;
+	double scale_y = (double) height / dst_height;
+
+	auto at = [&](size_t i, size_t j) { return (double) src[(j * width + i) * 4 + c]; };
+
+	if (bilinear) {
+		double u = std::max((x + 0.5) * scale_x - 0.5, 0.0);
+		double v = std::max((y + 0.5) * scale_y - 0.5, 0.0);
+
+		size_t x0 = (size_t) u, y0 = (size_t) v;
+		size_t x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+		double fu = u - x0, fv = v - y0;
+
+		return (at(x0, y0) * (1 - fu) + at(x1, y0) * fu) * (1 - fv)
+			+ (at(x0, y1) * (1 - fu) + at(x1, y1) * fu) * fv;
+	}
+
+	double lo_x = x * scale_x, hi_x = (x + 1) * scale_x;
+	double lo_y = y * scale_y, hi_y = (y + 1) * scale_y;
+	double sum = 0.0;
+
+	for (size_t j = (size_t) lo_y; j < std::min((size_t) ceil(hi_y), height); ++j) {
+		double cover_y = std::min(hi_y, j + 1.0) - std::max(lo_y, (double) j);
+
+		for (size_t i = (size_t) lo_x; i < std::min((size_t) ceil(hi_x), width); ++i) {
+			double cover_x = std::min(hi_x, i + 1.0) - std::max(lo_x, (double) i);
+			sum += at(i, j) * cover_x * cover_y;
+		}
+	}
+
+	return sum / (scale_x * scale_y);
+}
+
+static void check_filters(void)
+{
+	std::mt19937 rng(7);
+
+	int box_mismatches = 0, in_place_mismatches = 0;
+	long box_error = 0, bilinear_error = 0;
+
+	for (int it = 0; it < 200; ++it) {
+		size_t width = 1 + rng() % 200, height = 1 + rng() % 200;
+		std::vector<uint8_t> src(width * height * 4);
+
+		for (uint8_t& b: src)
+			b = (uint8_t) rng();
+
+		for (size_t factor = 2; factor <= 4; factor += 2) {
+			size_t dst_width = downscale_extent(width, factor);
+			size_t dst_height = downscale_extent(height, factor);
+
+			std::vector<uint8_t> out(dst_width * dst_height * 4), ref(out.size());
+
+			glk::downscale_rgba(src.data(), width, height, width * 4,
+				out.data(), dst_width, dst_height, dst_width * 4);
+			reference_box(src.data(), width, height, ref.data(), factor);
+
+			box_mismatches += out != ref;
+
+			std::vector<uint8_t> in_place = src;
+			glk::downscale_rgba(in_place.data(), width, height, width * 4,
+				in_place.data(), dst_width, dst_height, dst_width * 4);
+
+			in_place_mismatches += memcmp(in_place.data(), out.data(), out.size()) != 0;
+		}
+
+		size_t dst_width = std::max<size_t>(1, width * (1 + rng() % 99) / 100);
+		size_t dst_height = std::max<size_t>(1, height * (1 + rng() % 99) / 100);
+
+		for (int bilinear = 0; bilinear < 2; ++bilinear) {
+			glk::downscale_filter_t filter = bilinear ? glk::downscale_bilinear : glk::downscale_box;
+			std::vector<uint8_t> out(dst_width * dst_height * 4), threaded(out.size());
+
+			glk::downscale_rgba(src.data(), width, height, width * 4,
+				out.data(), dst_width, dst_height, dst_width * 4, filter);
+			glk::downscale_rgba(src.data(), width, height, width * 4,
+				threaded.data(), dst_width, dst_height, dst_width * 4, filter, 0);
+
+			in_place_mismatches += threaded != out;
+
+			// Halving and quartering with the box take the exact path above
+			bool exact = false;
+
+			for (size_t factor = 2; factor <= 4; factor += 2)
+				exact |= dst_width == downscale_extent(width, factor)
+					&& dst_height == downscale_extent(height, factor);
+
+			if (!bilinear && exact)
+				continue;
+
+			long& error = bilinear ? bilinear_error : box_error;
+
+			for (size_t y = 0; y < dst_height; ++y) {
+				for (size_t x = 0; x < dst_width; ++x) {
+					for (int c = 0; c < 4; ++c) {
+						long expected = lround(reference_texel(src.data(), width, height,
+							dst_width, dst_height, x, y, c, bilinear != 0));
+
+						error = std::max(error, labs(expected - out[(y * dst_width + x) * 4 + c]));
+					}
+				}
+			}
+		}
+	}
+
+	printf("2x / 4x box mismatches %d, in place / threaded mismatches %d\n",
+		box_mismatches, in_place_mismatches);
+	printf("worst error: box %ld, bilinear %ld\n", box_error, bilinear_error);
+
+	TEST_CHECK(box_mismatches == 0);
+	TEST_CHECK(in_place_mismatches == 0);
+	TEST_CHECK(box_error <= 1);
+	TEST_CHECK(bilinear_error <= 1);
+}
+
+// A downscaled, trimming atlas halves what it keeps of each image. Those
+// texels and their offset have to be the ones halving the whole image
+// gives, whatever the parity of the kept rect's edges.
+static void check_trimmed_halving(void)
+{
+	std::mt19937 rng(11);
+
+	glk::atlas_t atlas;
+	atlas.set_downscaled(true);
+	atlas.set_trim_transparent(true);
+
+	int mismatches = 0, out_of_bounds = 0;
+
+	for (uint16_t image = 0; image < 64; ++image) {
+		int width = 2 + rng() % 60, height = 2 + rng() % 60;
+		int x0 = rng() % width, y0 = rng() % height;
+		int x1 = x0 + 1 + rng() % (width - x0), y1 = y0 + 1 + rng() % (height - y0);
+
+		std::vector<uint8_t> texels((size_t) width * height * 4);
+
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				uint8_t* t = &texels[((size_t) y * width + x) * 4];
+
+				t[0] = (uint8_t) rng();
+				t[1] = (uint8_t) rng();
+				t[2] = (uint8_t) rng();
+				t[3] = x >= x0 && x < x1 && y >= y0 && y < y1 ? (uint8_t) (1 + rng() % 255) : 0;
+			}
+		}
+
+		std::vector<uint8_t> halved(downscale_extent(width, 2) * downscale_extent(height, 2) * 4);
+		reference_box(texels.data(), width, height, halved.data(), 2);
+
+		glk::push_atlas_image(atlas, texels.data(), width, height, 4, 0, false);
+
+		int half_width = (int) downscale_extent(width, 2);
+		int trim_x = atlas.trim_x[image], trim_y = atlas.trim_y[image];
+		int dims_x = atlas.dims_x[image], dims_y = atlas.dims_y[image];
+
+		out_of_bounds += atlas.source_x[image] != half_width
+			|| atlas.source_y[image] != (int) downscale_extent(height, 2)
+			|| trim_x + dims_x > atlas.source_x[image]
+			|| trim_y + dims_y > atlas.source_y[image];
+
+		const uint8_t* kept = atlas.image_pixels(image);
+		size_t stride = atlas.pixel_spans[image].stride;
+
+		for (int y = 0; y < dims_y && trim_y + y < atlas.source_y[image]; ++y) {
+			mismatches += memcmp(kept + y * stride,
+				&halved[((size_t) (trim_y + y) * half_width + trim_x) * 4],
+				(size_t) std::min(dims_x, half_width - trim_x) * 4) != 0;
+		}
+	}
+
+	printf("trimmed halving: %d rows differ, %d rects out of bounds\n",
+		mismatches, out_of_bounds);
+
+	TEST_CHECK(mismatches == 0);
+	TEST_CHECK(out_of_bounds == 0);
+
+	atlas.free_memory();
+}
+
+static void bench_corpus(const std::string& root)
+{
+	double mp = 0.0, ms[4] = {};
+	const char* names[] = { "box 2x", "box 4x", "box 3x", "bilinear 0.7x" };
+
+	size_t images = test_for_each_texture(root, 4, [&](const std::string&,
+		uint8_t* rgba, int width, int height, int) {
+		size_t dst_widths[] = { downscale_extent(width, 2), downscale_extent(width, 4),
+			downscale_extent(width, 3), std::max<size_t>(1, width * 7 / 10) };
+		size_t dst_heights[] = { downscale_extent(height, 2), downscale_extent(height, 4),
+			downscale_extent(height, 3), std::max<size_t>(1, height * 7 / 10) };
+
+		std::vector<uint8_t> out((size_t) width * height * 4);
+
+		for (int k = 0; k < 4; ++k) {
+			double t0 = test_now_ms();
+			glk::downscale_rgba(rgba, width, height, (size_t) width * 4, out.data(),
+				dst_widths[k], dst_heights[k], dst_widths[k] * 4,
+				k == 3 ? glk::downscale_bilinear : glk::downscale_box);
+			ms[k] += test_now_ms() - t0;
+
+			g_test_sink += out[0];
+		}
+
+		mp += (double) width * height / 1e6;
+	});
+
+	printf("%zu images from %s, megatexels of source per second:\n", images, root.c_str());
+
+	for (int k = 0; k < 4; ++k)
+		printf("  %-14s %.0f\n", names[k], ms[k] > 0.0 ? mp / (ms[k] / 1000.0) : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+	check_filters();
+	check_trimmed_halving();
+	bench_corpus(test_textures_root(argc, argv));
+
+	return test_result("downscale_test");
+}
@@ -0,0 +1,215 @@
+//------------------------------------------------------------------------------------
+// ETC1 / ETC2 / EAC: the reference decoders against blocks worked out by hand
+// from the format descriptions, then encode + decode round trips of flat colors
+// and of the textures/ corpus, with the PSNR each format reaches.
+//------------------------------------------------------------------------------------
+
+#include "test_common.h"
+
+#include "../etc.h"
+
+#include <math.h>
+
+static void put_bits(uint8_t* block, uint64_t bits)
+{
+	for (int i = 0; i < 8; ++i)
+		block[i] = (uint8_t) (bits >> (56 - 8 * i));
+}
+
+// Texel (x, y) of a decoded 4 x 4 block
+static const uint8_t* texel(const uint8_t* rgba, int x, int y)
+{
+	return rgba + (y * 4 + x) * 4;
+}
+
+static bool rgb_is(const uint8_t* t, int r, int g, int b)
+{
+	return t[0] == r && t[1] == g && t[2] == b;
+}
+
+static void check_decoders(void)
+{
+	uint8_t block[16], out[64];
+
+	// Individual mode, halves side by side: bases (8, 4, 2) and (1, 2, 3)
+	// as 4 bits, tables 0 (2, 8) and 7 (47, 183). Pixel indices count
+	// down columns; index 1 adds the larger modifier, 2 subtracts the
+	// smaller and 3 the larger.
+	{
+		uint64_t bits = (uint64_t) 8 << 60 | (uint64_t) 1 << 56
+			| (uint64_t) 4 << 52 | (uint64_t) 2 << 48
+			| (uint64_t) 2 << 44 | (uint64_t) 3 << 40
+			| (uint64_t) 0 << 37 | (uint64_t) 7 << 34;
+
+		bits |= (uint64_t) 1 << 0; // (0, 0): index 1
+		bits |= (uint64_t) 1 << (16 + 5); // (1, 1): index 2
+		bits |= (uint64_t) 1 << (16 + 15) | (uint64_t) 1 << 15; // (3, 3): index 3
+
+		put_bits(block, bits);
+		glk::etc1_decode_block(block, out);
+
+		TEST_CHECK(rgb_is(texel(out, 0, 0), 136 + 8, 68 + 8, 34 + 8));
+		TEST_CHECK(rgb_is(texel(out, 1, 1), 136 - 2, 68 - 2, 34 - 2));
+		TEST_CHECK(rgb_is(texel(out, 2, 0), 17 + 47, 34 + 47, 51 + 47));
+		TEST_CHECK(rgb_is(texel(out, 3, 3), 0, 0, 0));
+		TEST_CHECK(texel(out, 0, 0)[3] == 255);
+	}
+
+	// Differential mode, halves stacked: base (16, 8, 31) as 5 bits,
+	// deltas (-1, +3, 0), tables 1 (5, 17) and 2 (9, 29), every index 0
+	{
+		uint64_t bits = (uint64_t) 16 << 59 | (uint64_t) 7 << 56
+			| (uint64_t) 8 << 51 | (uint64_t) 3 << 48
+			| (uint64_t) 31 << 43 | (uint64_t) 0 << 40
+			| (uint64_t) 1 << 37 | (uint64_t) 2 << 34
+			| (uint64_t) 1 << 33 | (uint64_t) 1 << 32;
+
+		put_bits(block, bits);
+		glk::etc1_decode_block(block, out);
+
+		for (int y = 0; y < 4; ++y) {
+			for (int x = 0; x < 4; ++x) {
+				if (y < 2)
+					TEST_CHECK(rgb_is(texel(out, x, y), 132 + 5, 66 + 5, 255));
+				else
+					TEST_CHECK(rgb_is(texel(out, x, y), 123 + 9, 90 + 9, 255));
+			}
+		}
+	}
+
+	// EAC alpha: base 128, multiplier 2, table 13 (-1, -2, -3, -10, 0, 1,
+	// 2, 9). Indices run down columns from the top bits: every texel 7
+	// (+9) but the first, 3 (-10).
+	{
+		uint64_t bits = (uint64_t) 128 << 56 | (uint64_t) 2 << 52 | (uint64_t) 13 << 48;
+
+		for (int i = 0; i < 16; ++i)
+			bits |= (uint64_t) (i ? 7 : 3) << (45 - 3 * i);
+
+		put_bits(block, bits);
+		memset(block + 8, 0, 8);
+		glk::etc2_rgba_decode_block(block, out);
+
+		TEST_CHECK(texel(out, 0, 0)[3] == 128 - 20);
+		TEST_CHECK(texel(out, 0, 1)[3] == 128 + 18);
+		TEST_CHECK(texel(out, 3, 3)[3] == 128 + 18);
+	}
+}
+
+static void check_flat_colors(void)
+{
+	uint8_t texels[64], block[16], out[64];
+	int rgb_error = 0, alpha_error = 0;
+
+	for (int c = 0; c < 256; c += 3) {
+		for (int i = 0; i < 16; ++i) {
+			texels[i * 4] = (uint8_t) c;
+			texels[i * 4 + 1] = (uint8_t) (255 - c);
+			texels[i * 4 + 2] = (uint8_t) (c / 2);
+			texels[i * 4 + 3] = (uint8_t) c;
+		}
+
+		glk::etc2_rgba_encode_block(texels, block);
+		glk::etc2_rgba_decode_block(block, out);
+
+		for (int i = 0; i < 64; ++i) {
+			int error = abs(out[i] - texels[i]);
+
+			if (i % 4 == 3)
+				alpha_error = std::max(alpha_error, error);
+			else
+				rgb_error = std::max(rgb_error, error);
+		}
+	}
+
+	printf("flat blocks: worst RGB error %d, alpha %d\n", rgb_error, alpha_error);
+
+	// A flat color is a 5 bit base plus one modifier shared by all three
+	// channels, so it can't always land exactly; EAC can hit any alpha
+	TEST_CHECK(rgb_error <= 8);
+	TEST_CHECK(alpha_error == 0);
+}
+
+static double psnr(double squared_error, double samples)
+{
+	return 10.0 * log10(255.0 * 255.0 * samples / std::max(squared_error, 1e-9));
+}
+
+static void check_corpus(const std::string& root)
+{
+	const glk::etc_format_t formats[] = { glk::etc_etc1, glk::etc_etc2_rgba, glk::etc_etc1_alpha };
+	const char* names[] = { "ETC1", "ETC2 RGBA", "ETC1 alpha" };
+
+	double rgb_error[3] = {}, alpha_error[3] = {}, ms[3] = {};
+	double rgb_samples = 0.0, alpha_samples = 0.0;
+
+	size_t images = test_for_each_texture(root, 4, [&](const std::string&,
+		uint8_t* rgba, int width, int height, int) {
+		std::vector<uint8_t> decoded((size_t) width * height * 4);
+
+		for (int f = 0; f < 3; ++f) {
+			std::vector<uint8_t> blocks(glk::etc_encoded_size(formats[f], width, height));
+
+			double t0 = test_now_ms();
+			glk::etc_encode_image(rgba, width, height, (size_t) width * 4, formats[f],
+				blocks.data(), 1);
+			ms[f] += test_now_ms() - t0;
+
+			glk::etc_decode_image(blocks.data(), width, height, formats[f], decoded.data());
+
+			for (size_t i = 0; i < (size_t) width * height; ++i) {
+				if (formats[f] == glk::etc_etc1_alpha) {
+					// The alpha channel comes back as grey
+					double d = (double) rgba[i * 4 + 3] - decoded[i * 4];
+					alpha_error[f] += d * d;
+					continue;
+				}
+
+				for (int c = 0; c < 3; ++c) {
+					double d = (double) rgba[i * 4 + c] - decoded[i * 4 + c];
+					rgb_error[f] += d * d;
+				}
+
+				if (formats[f] == glk::etc_etc2_rgba) {
+					double d = (double) rgba[i * 4 + 3] - decoded[i * 4 + 3];
+					alpha_error[f] += d * d;
+				}
+			}
+		}
+
+		rgb_samples += (double) width * height * 3;
+		alpha_samples += (double) width * height;
+	});
+
+	printf("%zu images from %s\n", images, root.c_str());
+	TEST_CHECK(images > 0);
+
+	for (int f = 0; f < 3; ++f) {
+		printf("  %-10s", names[f]);
+
+		if (formats[f] != glk::etc_etc1_alpha)
+			printf("  RGB %.2f dB", psnr(rgb_error[f], rgb_samples));
+
+		if (formats[f] != glk::etc_etc1)
+			printf("  alpha %.2f dB", psnr(alpha_error[f], alpha_samples));
+
+		printf("  %.0f ms\n", ms[f]);
+	}
+
+	// Floors a little under what the encoders reach on textures/
+	if (images) {
+		TEST_CHECK(psnr(rgb_error[0], rgb_samples) > 32.0);
+		TEST_CHECK(psnr(rgb_error[1], rgb_samples) > 32.0);
+		TEST_CHECK(psnr(alpha_error[1], alpha_samples) > 40.0);
+		TEST_CHECK(psnr(alpha_error[2], alpha_samples) > 32.0);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	check_decoders();
+	check_flat_colors();
+	check_corpus(test_textures_root(argc, argv));
+
+	return test_result("etc_test");
+}
@@ -0,0 +1,137 @@
+//------------------------------------------------------------------------------------
+// insert_atlas_image into a built atlas: an image which fits has to land in
+// free space with its own pixels showing there, and one which can't be
+// placed has to come back out again - no_image_index returned, and nothing
+// of it left for the next gen_atlas_layers to pack. The one that can't be
+// placed here is a duplicate of an image pushed since the last layout, so
+// its slot isn't on a layer yet.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+using namespace glk;
+
+static std::vector<uint8_t> random_image(std::mt19937& rng, int width, int height)
+{
+	std::vector<uint8_t> texels((size_t) width * height * 4);
+
+	for (uint8_t& t: texels)
+		t = (uint8_t) rng();
+
+	for (size_t i = 3; i < texels.size(); i += 4)
+		texels[i] = 255;
+
+	return texels;
+}
+
+// What compose_atlas_layer drew over image's packed rectangle matches its
+// pixels. Images here aren't flipped, rotated or trimmed.
+static bool shows_pixels(const atlas_t& atlas, uint16_t image, const std::vector<uint8_t>& texels)
+{
+	uint16_t slot = atlas.slots[image];
+
+	if (atlas.layers[image] == 0xFF || atlas.layers[image] != atlas.layers[slot])
+		return false;
+
+	std::vector<uint8_t> layer;
+	compose_atlas_layer(atlas, atlas.layers[image], layer);
+
+	atlas_rect_t r = atlas.packed_rect(image);
+	size_t row_bytes = (size_t) r.w * 4;
+
+	for (int32_t y = 0; y < r.h; ++y) {
+		const uint8_t* shown = &layer[((size_t) (r.y + y) * atlas.widths[atlas.layers[image]]
+			+ r.x) * 4];
+
+		if (memcmp(shown, &texels[y * row_bytes], row_bytes) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static uint32_t live_area(const atlas_t& atlas)
+{
+	uint32_t area = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		if (atlas.slot_live(i))
+			area += (uint32_t) atlas.dims_x[i] * atlas.dims_y[i];
+
+	return area;
+}
+
+int main(int, char**)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	std::mt19937 rng(17);
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_packer_type(atlas_packer_maxrects_bssf);
+
+	for (int i = 0; i < 40; ++i) {
+		int width = 8 + (int) (rng() % 120), height = 8 + (int) (rng() % 120);
+		std::vector<uint8_t> texels = random_image(rng, width, height);
+
+		push_atlas_image(atlas, texels.data(), width, height, 4, 0, false);
+	}
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+
+	// One which fits
+	std::vector<uint8_t> fits = random_image(rng, 50, 30);
+	uint16_t inserted = insert_atlas_image(atlas, fits.data(), 50, 30, 4, 0, false);
+
+	TEST_CHECK(inserted != atlas_t::no_image_index);
+	TEST_CHECK(inserted != atlas_t::no_image_index && shows_pixels(atlas, inserted, fits));
+
+	// One which doesn't: its slot was pushed after the layout
+	std::vector<uint8_t> pending = random_image(rng, 24, 36);
+	push_atlas_image(atlas, pending.data(), 24, 36, 4, 0, false);
+
+	uint16_t pending_image = (uint16_t) (atlas.num_images - 1);
+
+	uint32_t duplicates = atlas.num_duplicates;
+	uint64_t duplicate_bytes = atlas.duplicate_bytes;
+	uint32_t area = atlas.area_accum;
+
+	uint16_t rejected = insert_atlas_image(atlas, pending.data(), 24, 36, 4, 0, false);
+	uint16_t rejected_index = (uint16_t) (atlas.num_images - 1);
+
+	printf("insert of a duplicate of an unplaced image: %s\n",
+		rejected == atlas_t::no_image_index ? "refused" : "ADDED");
+
+	TEST_CHECK(rejected == atlas_t::no_image_index);
+	TEST_CHECK(atlas.image_removed(rejected_index));
+	TEST_CHECK(atlas.num_duplicates == duplicates);
+	TEST_CHECK(atlas.duplicate_bytes == duplicate_bytes);
+	TEST_CHECK(atlas.area_accum == area);
+	TEST_CHECK(atlas.slot_refs[pending_image] == 1);
+
+	std::vector<uint16_t> packed = atlas.packed_images();
+	TEST_CHECK(std::find(packed.begin(), packed.end(), rejected_index) == packed.end());
+
+	// The next layout packs the pushed image, and leaves the rejected one out
+	TEST_CHECK(gen_atlas_layers(atlas));
+
+	TEST_CHECK(shows_pixels(atlas, pending_image, pending));
+	TEST_CHECK(shows_pixels(atlas, inserted, fits));
+	TEST_CHECK(atlas.layers[rejected_index] == 0xFF);
+	TEST_CHECK(atlas.record(rejected_index).layer == 0xFF);
+	TEST_CHECK(atlas.area_accum == live_area(atlas));
+
+	// An insert of the same pixels now lands on the pushed image's slot
+	uint16_t duplicate = insert_atlas_image(atlas, pending.data(), 24, 36, 4, 0, false);
+
+	TEST_CHECK(duplicate != atlas_t::no_image_index && atlas.slots[duplicate] == pending_image);
+	TEST_CHECK(duplicate != atlas_t::no_image_index && shows_pixels(atlas, duplicate, pending));
+
+	atlas.free_memory();
+
+	return test_result("insert_test");
+}
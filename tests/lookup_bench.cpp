@@ -0,0 +1,237 @@
+//------------------------------------------------------------------------------------
+// image_map_t against std::unordered_map, then the atlas lookups built on it:
+// key_image and image_named.
+//
+// Checks every find, insert and erase of random operation sequences against
+// std::unordered_map, before and after freeze(), then times hits, misses,
+// small sequential keys and filename lookups at 1130 (the textures/ corpus)
+// and 65000 images.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <stdexcept>
+#include <unordered_map>
+
+static void check_image_map(void)
+{
+	std::mt19937_64 rng(1);
+
+	for (int round = 0; round < 40; ++round) {
+		glk::image_map_t map;
+		std::unordered_map<uint64_t, uint16_t> ref;
+
+		// Dense rounds draw keys from a small range, so erases hit
+		size_t count = round < 20 ? (size_t) round * 7 : (size_t) (rng() % 65535);
+		bool dense = (round & 1) != 0;
+
+		for (size_t op = 0; op < count * 3; ++op) {
+			uint64_t key = dense ? rng() % (count * 2 + 1) : rng();
+			int what = (int) (rng() % 10);
+
+			if (what < 6) {
+				if (ref.size() < 65535) {
+					uint16_t value = (uint16_t) (rng() % 65535);
+					map.insert(key, value);
+					ref[key] = value;
+				}
+			} else if (what < 9) {
+				TEST_CHECK(map.erase(key) == (ref.erase(key) == 1));
+			} else {
+				auto it = ref.find(key);
+				TEST_CHECK(map.find(key) == (it == ref.end() ? glk::image_map_t::npos : it->second));
+			}
+
+			if (op == count && round % 3 == 0)
+				map.freeze();
+		}
+
+		TEST_CHECK(map.size() == ref.size());
+
+		map.freeze();
+		TEST_CHECK(map.frozen());
+
+		for (const auto& kv: ref)
+			TEST_CHECK(map.find(kv.first) == kv.second);
+
+		for (int i = 0; i < 1000; ++i) {
+			uint64_t key = rng();
+
+			if (!ref.count(key))
+				TEST_CHECK(map.find(key) == glk::image_map_t::npos);
+		}
+
+		// Inserting thaws it
+		map.insert(12345, 7);
+		ref[12345] = 7;
+		TEST_CHECK(!map.frozen());
+
+		for (const auto& kv: ref)
+			TEST_CHECK(map.find(kv.first) == kv.second);
+	}
+}
+
+static void check_atlas_lookups(glk::atlas_t& atlas)
+{
+	for (size_t i = 0; i < atlas.filenames.size(); ++i)
+		TEST_CHECK(atlas.image_named(atlas.filenames[i]) == i);
+
+	TEST_CHECK(atlas.image_named("no such file.png") == glk::atlas_t::no_image_index);
+
+	for (uint32_t k = 0; k < atlas.num_images; ++k)
+		atlas.map_key_to_image((size_t) k * 977 + 5, (uint16_t) k);
+
+	for (uint32_t k = 0; k < atlas.num_images; ++k)
+		TEST_CHECK(atlas.key_image((size_t) k * 977 + 5) == k);
+
+	bool threw = false;
+
+	try {
+		atlas.key_image(3);
+	} catch (const std::out_of_range&) {
+		threw = true;
+	}
+
+	TEST_CHECK(threw);
+
+	atlas.freeze_lookups();
+
+	for (size_t i = 0; i < atlas.filenames.size(); ++i)
+		TEST_CHECK(atlas.image_named(atlas.filenames[i]) == i);
+
+	for (uint32_t k = 0; k < atlas.num_images; ++k)
+		TEST_CHECK(atlas.key_image((size_t) k * 977 + 5) == k);
+
+	// A repeated name still answers from the map, with its first image
+	glk::atlas_t repeated;
+	repeated.filenames = { "a.png", "b.png", "a.png" };
+	repeated.build_filename_map();
+
+	TEST_CHECK(repeated.image_named("a.png") == 0);
+	TEST_CHECK(repeated.image_named("b.png") == 1);
+
+	// A name added after the map was built is found by the search
+	repeated.filenames.push_back("c.png");
+	TEST_CHECK(repeated.image_named("c.png") == 3);
+}
+
+static void bench_image_map(size_t count)
+{
+	std::mt19937_64 rng(7);
+
+	std::vector<uint64_t> keys(count), misses(count);
+	std::vector<std::string> names(count);
+
+	for (size_t i = 0; i < count; ++i) {
+		keys[i] = rng();
+		misses[i] = rng();
+
+		char name[64];
+		snprintf(name, sizeof(name), "sprite_%05zu_%llx.png", i,
+			(unsigned long long) (rng() % 100000));
+		names[i] = name;
+	}
+
+	// Random ids, a power of two of them
+	std::vector<uint32_t> order(1 << 20);
+
+	for (uint32_t& o: order)
+		o = (uint32_t) (rng() % count);
+
+	size_t mask = order.size() - 1;
+	size_t reps = order.size() * 4;
+
+	std::unordered_map<uint64_t, uint16_t> unordered;
+	glk::image_map_t flat, frozen;
+
+	for (size_t i = 0; i < count; ++i) {
+		unordered[keys[i]] = (uint16_t) i;
+		flat.insert(keys[i], (uint16_t) i);
+	}
+
+	frozen = flat;
+	frozen.freeze();
+
+	printf("%zu images: %zu bytes flat, %zu frozen\n", count, flat.bytes(), frozen.bytes());
+
+	auto time = [&](auto fn, size_t n) {
+		return test_best_ns([&]() {
+			uint64_t acc = 0;
+
+			for (size_t i = 0; i < n; ++i)
+				acc += fn(i);
+
+			g_test_sink += acc;
+		}, n);
+	};
+
+	printf("  hit ns:        unordered %5.1f  flat %5.1f  frozen %5.1f\n",
+		time([&](size_t i) { return (uint64_t) unordered.find(keys[order[i & mask]])->second; }, reps),
+		time([&](size_t i) { return (uint64_t) flat.find(keys[order[i & mask]]); }, reps),
+		time([&](size_t i) { return (uint64_t) frozen.find(keys[order[i & mask]]); }, reps));
+
+	printf("  miss ns:       unordered %5.1f  flat %5.1f  frozen %5.1f\n",
+		time([&](size_t i) { return (uint64_t) unordered.count(misses[order[i & mask]]); }, reps),
+		time([&](size_t i) { return (uint64_t) flat.find(misses[order[i & mask]]); }, reps),
+		time([&](size_t i) { return (uint64_t) frozen.find(misses[order[i & mask]]); }, reps));
+
+	// Small sequential keys, key_map's usual case
+	std::unordered_map<uint64_t, uint16_t> seq_unordered;
+	glk::image_map_t seq_flat, seq_frozen;
+
+	for (size_t i = 0; i < count; ++i) {
+		seq_unordered[i] = (uint16_t) i;
+		seq_flat.insert(i, (uint16_t) i);
+	}
+
+	seq_frozen = seq_flat;
+	seq_frozen.freeze();
+
+	printf("  seq key ns:    unordered %5.1f  flat %5.1f  frozen %5.1f\n",
+		time([&](size_t i) { return (uint64_t) seq_unordered.find(order[i & mask])->second; }, reps),
+		time([&](size_t i) { return (uint64_t) seq_flat.find(order[i & mask]); }, reps),
+		time([&](size_t i) { return (uint64_t) seq_frozen.find(order[i & mask]); }, reps));
+
+	// Filenames: a search against the hash and one compare
+	glk::image_map_t by_name;
+
+	for (size_t i = 0; i < count; ++i)
+		by_name.insert(glk::hash64(names[i].data(), names[i].size()), (uint16_t) i);
+
+	size_t search_reps = count > 10000 ? 20000 : 200000;
+
+	printf("  name ns:       search %8.1f  hashed %5.1f\n",
+		time([&](size_t i) {
+			const std::string& name = names[order[i & mask]];
+
+			for (size_t j = 0; j < count; ++j)
+				if (names[j] == name)
+					return (uint64_t) j;
+
+			return (uint64_t) 0;
+		}, search_reps),
+		time([&](size_t i) {
+			const std::string& name = names[order[i & mask]];
+			uint16_t j = by_name.find(glk::hash64(name.data(), name.size()));
+
+			return (uint64_t) (names[j] == name ? j : 0);
+		}, reps));
+}
+
+int main(int argc, char** argv)
+{
+	check_image_map();
+
+	glk::atlas_t atlas;
+	size_t pushed = test_push_textures(atlas, test_textures_root(argc, argv));
+
+	printf("%zu images pushed\n", pushed);
+	TEST_CHECK(pushed > 0);
+
+	check_atlas_lookups(atlas);
+
+	bench_image_map(1130);
+	bench_image_map(65000);
+
+	return test_result("lookup_bench");
+}
@@ -0,0 +1,193 @@
+//------------------------------------------------------------------------------------
+// gen_layer_bsp's node arena against the tree it replaced, which allocated
+// every node on its own and freed them recursively. Both pack the same layers
+// of the textures/ corpus's image sizes; their placements have to match, and
+// each pass over all the layers is timed.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+// The BSP as it was: a node per allocation, the tree freed from the root
+struct heap_node_t {
+	bool region;
+	int32_t image;
+
+	glm::ivec2 origin;
+	glm::ivec2 dims;
+
+	heap_node_t* left_child;
+	heap_node_t* right_child;
+
+	heap_node_t(void)
+	:   region(false),
+		image(-1),
+		origin(0, 0), dims(0, 0),
+		left_child(nullptr), right_child(nullptr)
+	{}
+
+	~heap_node_t(void)
+	{
+		delete left_child;
+		delete right_child;
+	}
+};
+
+static bool heap_insert(heap_node_t* node, uint16_t image, glm::ivec2 image_dims,
+	std::vector<glk::layer_placement_t>& placed)
+{
+	if (node->region) {
+		if (heap_insert(node->left_child, image, image_dims, placed))
+			return true;
+
+		return heap_insert(node->right_child, image, image_dims, placed);
+	}
+
+	if (node->image >= 0 || node->dims.x < image_dims.x || node->dims.y < image_dims.y)
+		return false;
+
+	if (node->dims == image_dims) {
+		node->image = image;
+		placed.push_back(glk::layer_placement_t { image,
+			(uint16_t) node->origin.x, (uint16_t) node->origin.y, false });
+
+		return true;
+	}
+
+	int32_t dx = node->dims.x - image_dims.x;
+	int32_t dy = node->dims.y - image_dims.y;
+
+	node->region = true;
+	node->left_child = new heap_node_t();
+	node->right_child = new heap_node_t();
+
+	heap_node_t* left = node->left_child;
+	heap_node_t* right = node->right_child;
+
+	left->origin = right->origin = node->origin;
+
+	if (dx > dy) {
+		left->dims = glm::ivec2(image_dims.x, node->dims.y);
+		right->dims = glm::ivec2(dx, node->dims.y);
+		right->origin.x += image_dims.x;
+	} else {
+		left->dims = glm::ivec2(node->dims.x, image_dims.y);
+		right->dims = glm::ivec2(node->dims.x, dy);
+		right->origin.y += image_dims.y;
+	}
+
+	return heap_insert(left, image, image_dims, placed);
+}
+
+static void heap_pack(const glk::atlas_pack_source_t& source,
+	const std::vector<uint16_t>& sorted, glm::ivec2 root_dims,
+	std::vector<glk::layer_placement_t>& placed)
+{
+	placed.clear();
+
+	heap_node_t* root = new heap_node_t();
+	root->dims = root_dims;
+
+	for (uint16_t image: sorted)
+		heap_insert(root, image, glm::ivec2(source.width(image), source.height(image)), placed);
+
+	delete root;
+}
+
+static bool same_placements(const std::vector<glk::layer_placement_t>& a,
+	const std::vector<glk::layer_placement_t>& b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	for (size_t i = 0; i < a.size(); ++i)
+		if (a[i].image != b[i].image || a[i].x != b[i].x || a[i].y != b[i].y)
+			return false;
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	glk::atlas_t atlas;
+
+	atlas.num_images = (uint32_t) test_corpus_dims(test_textures_root(argc, argv),
+		atlas.dims_x, atlas.dims_y);
+
+	for (uint32_t i = 0; i < atlas.num_images; ++i)
+		atlas.area_accum += (uint32_t) atlas.dims_x[i] * atlas.dims_y[i];
+
+	printf("%u image sizes\n", (unsigned) atlas.num_images);
+	TEST_CHECK(atlas.num_images > 0);
+
+	const glk::atlas_pack_source_t source = atlas.pack_source();
+
+	for (int32_t max_dims: { 2048, 4096, 16384 }) {
+		glm::ivec2 root_dims = glk::layer_root_dims(source, max_dims);
+
+		// Split the images into layers the way gen_atlas_layers would
+		std::vector<std::vector<uint16_t>> layers;
+		std::vector<uint16_t> left;
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i)
+			left.push_back(i);
+
+		glk::layer_candidate_t candidate;
+		size_t nodes = 0;
+
+		while (!left.empty()) {
+			std::vector<uint16_t> sorted = glk::sort_layer_images(source, left,
+				glk::layer_sort_width);
+
+			glk::gen_layer_bsp(source, sorted, root_dims, candidate);
+
+			if (candidate.placed.empty())
+				break;
+
+			layers.push_back(sorted);
+			nodes += candidate.bsp_nodes.size();
+
+			std::vector<uint8_t> placed(atlas.num_images, 0);
+
+			for (const glk::layer_placement_t& p: candidate.placed)
+				placed[p.image] = 1;
+
+			left.erase(std::remove_if(left.begin(), left.end(),
+				[&placed](uint16_t image) { return placed[image] != 0; }), left.end());
+		}
+
+		TEST_CHECK(left.empty());
+
+		int mismatches = 0;
+		std::vector<glk::layer_placement_t> heap_placed;
+
+		for (const std::vector<uint16_t>& sorted: layers) {
+			glk::gen_layer_bsp(source, sorted, root_dims, candidate);
+			heap_pack(source, sorted, root_dims, heap_placed);
+
+			mismatches += !same_placements(candidate.placed, heap_placed);
+		}
+
+		TEST_CHECK(mismatches == 0);
+
+		double heap_ns = test_best_ns([&]() {
+			for (const std::vector<uint16_t>& sorted: layers)
+				heap_pack(source, sorted, root_dims, heap_placed);
+
+			g_test_sink += heap_placed.size();
+		}, 1, 30);
+
+		double arena_ns = test_best_ns([&]() {
+			for (const std::vector<uint16_t>& sorted: layers)
+				glk::gen_layer_bsp(source, sorted, root_dims, candidate);
+
+			g_test_sink += candidate.placed.size();
+		}, 1, 30);
+
+		printf("  %5d root: %zu layers, %zu nodes, %d differ; "
+			"heap %.3f ms, arena %.3f ms (%.1fx)\n",
+			root_dims.x, layers.size(), nodes, mismatches,
+			heap_ns / 1e6, arena_ns / 1e6, heap_ns / arena_ns);
+	}
+
+	return test_result("pack_bench");
+}
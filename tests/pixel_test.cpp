@@ -0,0 +1,171 @@
+//------------------------------------------------------------------------------------
+// The pixel kernels of every instruction set this CPU runs against the
+// scalar ones: RGB expansion into strided destinations and row flips. Then
+// RGB expansion's cycles per pixel (TSC cycles on x86) for each, against the
+// plain loop it replaced.
+//------------------------------------------------------------------------------------
+
+#include "test_common.h"
+
+#include "../pixel.h"
+
+#include <string.h>
+
+#if GLK_PIXEL_X86 && !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
+using namespace glk;
+
+static const pixel_isa_t g_isas[] = {
+	pixel_isa_scalar, pixel_isa_sse2, pixel_isa_ssse3, pixel_isa_avx2
+};
+
+// convert_rgb_to_rgba before the kernels
+static void baseline_convert(uint8_t* dest, const uint8_t* src, size_t dim_x, size_t dim_y)
+{
+	for (size_t y = 0; y < dim_y; ++y) {
+		for (size_t x = 0; x < dim_x; ++x) {
+			size_t i = y * dim_x + x;
+
+			dest[i * 4 + 0] = src[i * 3 + 0];
+			dest[i * 4 + 1] = src[i * 3 + 1];
+			dest[i * 4 + 2] = src[i * 3 + 2];
+			dest[i * 4 + 3] = 255;
+		}
+	}
+}
+
+static uint64_t test_ticks(void)
+{
+#if GLK_PIXEL_X86
+	return __rdtsc();
+#else
+	return (uint64_t) (test_now_ms() * 1e6);
+#endif
+}
+
+static void check_kernels(void)
+{
+	std::mt19937 rng(5);
+
+	for (pixel_isa_t isa: g_isas) {
+		if (!pixel_isa_supported(isa))
+			continue;
+
+		pixel_kernels_t k = pixel_kernels_for(isa);
+		int convert_mismatches = 0, flip_mismatches = 0;
+
+		for (int it = 0; it < 3000; ++it) {
+			size_t width = 1 + rng() % 100, height = 1 + rng() % 8;
+			size_t src_stride = width * 3 + rng() % 7;
+			size_t dest_stride = width * 4 + 4 * (rng() % 4);
+
+			// Sized to end at the last texel, so reading past it would
+			// show up under a sanitizer
+			std::vector<uint8_t> src(src_stride * (height - 1) + width * 3);
+
+			for (uint8_t& b: src)
+				b = (uint8_t) rng();
+
+			// The bytes between rows have to come through untouched
+			std::vector<uint8_t> expected(dest_stride * height);
+
+			for (uint8_t& b: expected)
+				b = (uint8_t) rng();
+
+			std::vector<uint8_t> out = expected;
+
+			for (size_t y = 0; y < height; ++y) {
+				for (size_t x = 0; x < width; ++x) {
+					memcpy(&expected[y * dest_stride + x * 4], &src[y * src_stride + x * 3], 3);
+					expected[y * dest_stride + x * 4 + 3] = 255;
+				}
+			}
+
+			k.convert_rgb_to_rgba(out.data(), dest_stride, src.data(), src_stride,
+				width, height);
+
+			convert_mismatches += out != expected;
+
+			std::vector<uint8_t> flipped = out;
+
+			for (size_t y = 0; y < height; ++y)
+				memcpy(&expected[y * dest_stride], &out[(height - 1 - y) * dest_stride],
+					width * 4);
+
+			k.flip_rows_rgba(flipped.data(), dest_stride, width, height);
+
+			flip_mismatches += flipped != expected;
+		}
+
+		printf("%-6s: %d expansions and %d flips differ of 3000\n",
+			pixel_isa_name(isa), convert_mismatches, flip_mismatches);
+
+		TEST_CHECK(convert_mismatches == 0);
+		TEST_CHECK(flip_mismatches == 0);
+	}
+}
+
+// Fewest ticks per pixel over runs calls of fn
+template <class fn_t>
+static double best_per_pixel(fn_t fn, size_t pixels, int runs)
+{
+	uint64_t best = ~(uint64_t) 0;
+
+	for (int run = 0; run < runs; ++run) {
+		uint64_t t0 = test_ticks();
+		fn();
+		best = std::min(best, test_ticks() - t0);
+	}
+
+	return (double) best / (double) pixels;
+}
+
+static void bench_convert(void)
+{
+	std::mt19937 rng(7);
+
+	printf("RGB expansion, %s per pixel:\n", GLK_PIXEL_X86 ? "TSC cycles" : "nanoseconds");
+
+	const size_t sizes[][2] = { { 64, 64 }, { 256, 256 }, { 1024, 1024 }, { 15, 256 }, { 100, 256 } };
+
+	for (const size_t* size: sizes) {
+		size_t width = size[0], height = size[1], pixels = width * height;
+
+		std::vector<uint8_t> src(pixels * 3), dest(pixels * 4);
+
+		for (uint8_t& b: src)
+			b = (uint8_t) rng();
+
+		int runs = (int) (16 * 1024 * 1024 / pixels) + 1;
+
+		printf("  %4zu x %-4zu  baseline %.2f", width, height, best_per_pixel([&] {
+			baseline_convert(dest.data(), src.data(), width, height);
+		}, pixels, runs));
+
+		for (pixel_isa_t isa: g_isas) {
+			pixel_kernels_t k = pixel_kernels_for(isa);
+
+			// SSE2 has no expansion of its own
+			if (isa == pixel_isa_sse2 || !pixel_isa_supported(isa))
+				continue;
+
+			printf("  %s %.2f", pixel_isa_name(isa), best_per_pixel([&] {
+				k.convert_rgb_to_rgba(dest.data(), width * 4, src.data(), width * 3,
+					width, height);
+			}, pixels, runs));
+		}
+
+		g_test_sink += dest[0];
+		printf("\n");
+	}
+}
+
+int main(int, char**)
+{
+	check_kernels();
+	bench_convert();
+
+	return test_result("pixel_test");
+}
@@ -0,0 +1,203 @@
+//------------------------------------------------------------------------------------
+// make_atlas_plan with no GL context: the textures/ corpus's image sizes are
+// planned with every packer and root size mode, with and without rotation,
+// gutters, opaque layers and sort racing. Each plan has to place every image
+// inside its layer, with no two overlapping, and cover the image area it
+// reports. A plan made on a worker thread has to match one made here, and
+// each is timed.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <thread>
+
+using namespace glk;
+
+struct plan_config_t {
+	const char* name;
+	atlas_pack_params_t params;
+	bool opaque;
+};
+
+static atlas_pack_params_t plan_params(atlas_packer_t packer, atlas_root_size_t root_size,
+	bool allow_rotation, uint16_t block_align = 1, uint16_t gutter = 0, bool sort_race = false)
+{
+	return atlas_pack_params_t { packer, sort_race, root_size, GLK_ATLAS_DEFAULT_LAYER_ALIGN,
+		allow_rotation, block_align, gutter };
+}
+
+// The rects an image reserves: its origin less the gutter, at its size
+// as placed
+struct plan_rect_t {
+	int32_t x, y, w, h;
+};
+
+static plan_rect_t plan_rect(const atlas_plan_t& plan, const atlas_pack_source_t& source,
+	uint16_t image)
+{
+	int32_t w = (int32_t) source.width(image), h = (int32_t) source.height(image);
+
+	if (plan.rotated[image])
+		std::swap(w, h);
+
+	return plan_rect_t { plan.coords_x[image] - source.params.gutter,
+		plan.coords_y[image] - source.params.gutter, w, h };
+}
+
+// Returns the number of problems found, printing the first few
+static int check_plan(const atlas_plan_t& plan, const atlas_pack_source_t& source,
+	uint32_t num_images, int32_t max_dims)
+{
+	int problems = 0;
+
+	auto problem = [&problems](const char* what, uint32_t image) {
+		if (problems++ < 5)
+			printf("    %s: image %u\n", what, (unsigned) image);
+	};
+
+	if (!plan.complete)
+		problem("incomplete", 0);
+
+	std::vector<std::vector<uint16_t>> by_layer(plan.num_layers());
+	std::vector<uint64_t> areas(plan.num_layers(), 0);
+
+	for (uint32_t i = 0; i < num_images; ++i) {
+		if (plan.layers[i] >= plan.num_layers()) {
+			problem("not placed", i);
+			continue;
+		}
+
+		uint8_t layer = plan.layers[i];
+		plan_rect_t r = plan_rect(plan, source, (uint16_t) i);
+
+		if (r.x < 0 || r.y < 0 || r.x + r.w > plan.widths[layer]
+			|| r.y + r.h > plan.heights[layer])
+			problem("outside its layer", i);
+
+		if (plan.rotated[i] && !source.params.allow_rotation)
+			problem("rotated without rotation", i);
+
+		by_layer[layer].push_back((uint16_t) i);
+		areas[layer] += (uint64_t) r.w * r.h;
+	}
+
+	for (size_t layer = 0; layer < plan.num_layers(); ++layer) {
+		const std::vector<uint16_t>& images = by_layer[layer];
+
+		if (plan.widths[layer] > max_dims || plan.heights[layer] > max_dims)
+			problem("layer too large", (uint32_t) layer);
+
+		if (areas[layer] != plan.image_areas[layer])
+			problem("layer area differs", (uint32_t) layer);
+
+		// Opaque images get layers of their own
+		if (source.opaque)
+			for (uint16_t image: images)
+				if (source.opaque[image] != source.opaque[images[0]])
+					problem("opaque and translucent share a layer", image);
+
+		for (size_t a = 0; a < images.size(); ++a) {
+			plan_rect_t ra = plan_rect(plan, source, images[a]);
+
+			for (size_t b = a + 1; b < images.size(); ++b) {
+				plan_rect_t rb = plan_rect(plan, source, images[b]);
+
+				if (ra.x < rb.x + rb.w && rb.x < ra.x + ra.w
+					&& ra.y < rb.y + rb.h && rb.y < ra.y + ra.h)
+					problem("overlaps another image", images[a]);
+			}
+		}
+	}
+
+	return problems;
+}
+
+static bool same_plan(const atlas_plan_t& a, const atlas_plan_t& b)
+{
+	return a.complete == b.complete
+		&& a.widths == b.widths && a.heights == b.heights
+		&& a.image_areas == b.image_areas && a.layers == b.layers
+		&& a.coords_x == b.coords_x && a.coords_y == b.coords_y
+		&& a.rotated == b.rotated;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<uint16_t> dims_x, dims_y;
+
+	uint32_t num_images = (uint32_t) test_corpus_dims(test_textures_root(argc, argv),
+		dims_x, dims_y);
+
+	printf("%u image sizes, no GL context\n", (unsigned) num_images);
+	TEST_CHECK(num_images > 0);
+
+	uint64_t area_accum = 0;
+
+	for (uint32_t i = 0; i < num_images; ++i)
+		area_accum += (uint64_t) dims_x[i] * dims_y[i];
+
+	// About a third of the images opaque, as a compressed atlas would see
+	std::mt19937 rng(11);
+	std::vector<uint8_t> opaque(num_images);
+
+	for (uint8_t& o: opaque)
+		o = rng() % 3 == 0;
+
+	std::vector<uint16_t> images(num_images);
+
+	for (uint32_t i = 0; i < num_images; ++i)
+		images[i] = (uint16_t) i;
+
+	const plan_config_t configs[] = {
+		{ "bsp", plan_params(atlas_packer_bsp, atlas_root_size_sqrt_area, false), false },
+		{ "bsp rotated", plan_params(atlas_packer_bsp, atlas_root_size_sqrt_area, true), false },
+		{ "bsp search", plan_params(atlas_packer_bsp, atlas_root_size_search, false), false },
+		{ "bssf", plan_params(atlas_packer_maxrects_bssf, atlas_root_size_sqrt_area, false), false },
+		{ "bssf rotated", plan_params(atlas_packer_maxrects_bssf, atlas_root_size_sqrt_area, true), false },
+		{ "bssf search", plan_params(atlas_packer_maxrects_bssf, atlas_root_size_search, true), false },
+		{ "baf", plan_params(atlas_packer_maxrects_baf, atlas_root_size_sqrt_area, false), false },
+		{ "baf rotated", plan_params(atlas_packer_maxrects_baf, atlas_root_size_sqrt_area, true), false },
+		{ "bsp blocks", plan_params(atlas_packer_bsp, atlas_root_size_sqrt_area, false, 4, 2), true },
+		{ "bssf blocks", plan_params(atlas_packer_maxrects_bssf, atlas_root_size_sqrt_area, true, 4, 2), true },
+		{ "bsp raced", plan_params(atlas_packer_bsp, atlas_root_size_sqrt_area, false, 1, 0, true), false },
+		{ "bssf raced", plan_params(atlas_packer_maxrects_bssf, atlas_root_size_sqrt_area, true, 1, 0, true), true },
+		{ "search raced", plan_params(atlas_packer_bsp, atlas_root_size_search, false, 1, 0, true), false }
+	};
+
+	for (int32_t max_dims: { 2048, 4096 }) {
+		printf("max %d:\n", max_dims);
+
+		for (const plan_config_t& config: configs) {
+			const atlas_pack_source_t source = {
+				dims_x.data(), dims_y.data(), area_accum, config.params,
+				config.opaque ? opaque.data() : nullptr };
+
+			atlas_plan_t plan = make_atlas_plan(source, num_images, images, max_dims);
+
+			int problems = check_plan(plan, source, num_images, max_dims);
+
+			// The same plan off this thread
+			atlas_plan_t worker_plan;
+			std::thread worker([&]() {
+				worker_plan = make_atlas_plan(source, num_images, images, max_dims);
+			});
+			worker.join();
+
+			bool same = same_plan(plan, worker_plan);
+
+			double ms = test_best_ns([&]() {
+				atlas_plan_t timed = make_atlas_plan(source, num_images, images, max_dims);
+				g_test_sink += timed.num_layers();
+			}, 1, 10) / 1e6;
+
+			printf("  %-12s %2zu layers, %5.1f%% occupied, %8.2f ms%s, %d problems\n",
+				config.name, plan.num_layers(), plan.occupancy() * 100.0, ms,
+				same ? "" : ", differs on a worker", problems);
+
+			TEST_CHECK(problems == 0);
+			TEST_CHECK(same);
+		}
+	}
+
+	return test_result("plan_test");
+}
@@ -0,0 +1,137 @@
+//------------------------------------------------------------------------------------
+// post_process_rgba's tables against the float expressions they were worked
+// out from, on every instruction set this CPU runs, for every combination of
+// flags (unknown bits included), then both versions' throughput.
+//------------------------------------------------------------------------------------
+
+#include "test_common.h"
+
+#include "../pixel.h"
+
+#include <string.h>
+
+using namespace glk;
+
+// post_process_rgba as it was before the tables
+static void reference_post_process(uint8_t* image_data, size_t length, uint32_t flags)
+{
+	if (!flags) {
+		return;
+	}
+
+	for (size_t i = 0; i < length; i += 4) {
+		float r = glm::pow(((float)image_data[i + 0]) * inverse255, gammaDecode);
+		float g = glm::pow(((float)image_data[i + 1]) * inverse255, gammaDecode);
+		float b = glm::pow(((float)image_data[i + 2]) * inverse255, gammaDecode);
+		float a = glm::pow(((float)image_data[i + 3]) * inverse255, gammaDecode);
+
+		if (!!(flags & GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN)) {
+			uint8_t tmp[3] = {
+				(uint8_t)(r * 255.0f),
+				(uint8_t)(g * 255.0f),
+				(uint8_t)(b * 255.0f)
+			};
+
+			brighten_rgb(&tmp[0]);
+
+			r = ((float)tmp[0]) * inverse255;
+			g = ((float)tmp[1]) * inverse255;
+			b = ((float)tmp[2]) * inverse255;
+		}
+
+		if (!!(flags & GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA)) {
+			r *= a;
+			g *= a;
+			b *= a;
+		}
+
+		image_data[i + 0] = (uint8_t)(glm::pow(r, gammaEncode) * 255.0f);
+		image_data[i + 1] = (uint8_t)(glm::pow(g, gammaEncode) * 255.0f);
+		image_data[i + 2] = (uint8_t)(glm::pow(b, gammaEncode) * 255.0f);
+	}
+}
+
+// Every (channel, alpha) pair as grey texels, then random ones; a count
+// which isn't a multiple of eight leaves the vector kernels a tail
+static std::vector<uint8_t> test_texels(void)
+{
+	std::mt19937 rng(3);
+	std::vector<uint8_t> texels;
+
+	for (int i = 0; i < 65536; ++i) {
+		uint8_t t[4] = { (uint8_t) i, (uint8_t) i, (uint8_t) i, (uint8_t) (i >> 8) };
+		texels.insert(texels.end(), t, t + 4);
+	}
+
+	for (int i = 0; i < (1 << 20) + 5; ++i)
+		texels.push_back((uint8_t) rng());
+
+	texels.resize(texels.size() / 4 * 4);
+
+	return texels;
+}
+
+int main(int, char**)
+{
+	const std::vector<uint8_t> texels = test_texels();
+
+	const uint32_t flag_sets[] = {
+		GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN,
+		GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA,
+		GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN | GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA,
+		0x100, // unknown bits only: decoded and encoded again
+		0x100 | GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN,
+		0x100 | GL_ATLAS_POST_PROCESS_RGBA_PREMUL_ALPHA
+	};
+
+	std::vector<std::vector<uint8_t>> expected;
+	double reference_ms = 1e300;
+
+	for (uint32_t flags: flag_sets) {
+		expected.push_back(texels);
+
+		double t0 = test_now_ms();
+		reference_post_process(expected.back().data(), texels.size(), flags);
+		reference_ms = std::min(reference_ms, test_now_ms() - t0);
+	}
+
+	const pixel_isa_t isas[] = { pixel_isa_scalar, pixel_isa_avx2 };
+	const char* names[] = { "scalar", "AVX2" };
+
+	// The first call builds the tables
+	std::vector<uint8_t> warm(texels.begin(), texels.begin() + 64);
+	post_process_rgba(warm.data(), warm.size(), GL_ATLAS_POST_PROCESS_RGBA_BRIGHTEN);
+
+	printf("reference: %.0f MB/s\n", texels.size() / reference_ms / 1000.0);
+
+	for (int k = 0; k < 2; ++k) {
+		if (!pixel_force_isa(isas[k])) {
+			printf("%s: not supported here\n", names[k]);
+			continue;
+		}
+
+		size_t differ = 0;
+		double best_ms = 1e300;
+		std::vector<uint8_t> out;
+
+		for (size_t f = 0; f < sizeof(flag_sets) / sizeof(flag_sets[0]); ++f) {
+			out = texels;
+
+			double t0 = test_now_ms();
+			post_process_rgba(out.data(), out.size(), flag_sets[f]);
+			best_ms = std::min(best_ms, test_now_ms() - t0);
+
+			for (size_t i = 0; i < out.size(); ++i)
+				differ += out[i] != expected[f][i];
+		}
+
+		printf("%s: %zu bytes differ, %.0f MB/s\n", names[k], differ,
+			texels.size() / best_ms / 1000.0);
+
+		TEST_CHECK(differ == 0);
+	}
+
+	pixel_force_isa(pixel_best_isa());
+
+	return test_result("post_process_test");
+}
@@ -0,0 +1,193 @@
+//------------------------------------------------------------------------------------
+// resample_rgba against the same filters evaluated in doubles, up and down
+// and with either filter, then images pushed into an atlas with a resize,
+// and the resampler's throughput on the textures/ corpus.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <math.h>
+
+// Channel c of destination texel (x, y): both axes' kernels, normalised,
+// over the source with its edges repeated
+static double reference_texel(const uint8_t* src, size_t width, size_t height,
+	size_t dst_width, size_t dst_height, size_t x, size_t y, int c,
+	glk::resample_filter_t filter)
+{
+	std::vector<double> weights[2];
+	int32_t first[2], taps[2];
+
+	size_t src_extent[2] = { width, height }, dst_extent[2] = { dst_width, dst_height };
+	size_t at[2] = { x, y };
+
+	for (int axis = 0; axis < 2; ++axis) {
+		double scale = (double) src_extent[axis] / dst_extent[axis];
+		double stretch = std::max(scale, 1.0);
+		double support = glk::resample_radius(filter) * stretch;
+		double center = (at[axis] + 0.5) * scale - 0.5;
+
+		first[axis] = (int32_t) ceil(center - support);
+		taps[axis] = (int32_t) floor(center + support) - first[axis] + 1;
+
+		double total = 0.0;
+
+		for (int32_t k = 0; k < taps[axis]; ++k) {
+			weights[axis].push_back(glk::resample_kernel(filter,
+				(first[axis] + k - center) / stretch));
+			total += weights[axis][k];
+		}
+
+		for (int32_t k = 0; k < taps[axis]; ++k)
+			weights[axis][k] /= total;
+	}
+
+	double sum = 0.0;
+
+	for (int32_t j = 0; j < taps[1]; ++j) {
+		size_t sy = (size_t) std::min(std::max(first[1] + j, 0), (int32_t) height - 1);
+
+		for (int32_t i = 0; i < taps[0]; ++i) {
+			size_t sx = (size_t) std::min(std::max(first[0] + i, 0), (int32_t) width - 1);
+			sum += weights[0][i] * weights[1][j] * src[(sy * width + sx) * 4 + c];
+		}
+	}
+
+	return std::min(std::max(sum, 0.0), 255.0);
+}
+
+static void check_filters(void)
+{
+	std::mt19937 rng(5);
+
+	long worst = 0, mismatches = 0;
+	double total_error = 0.0, samples = 0.0;
+
+	for (int it = 0; it < 60; ++it) {
+		size_t width = 1 + rng() % 80, height = 1 + rng() % 80;
+		size_t dst_width = 1 + rng() % 120, dst_height = 1 + rng() % 120;
+		glk::resample_filter_t filter = it % 2 ? glk::resample_kaiser : glk::resample_lanczos3;
+
+		std::vector<uint8_t> src(width * height * 4);
+
+		for (uint8_t& b: src)
+			b = (uint8_t) rng();
+
+		std::vector<uint8_t> out(dst_width * dst_height * 4), threaded(out.size());
+
+		glk::resample_rgba(src.data(), width, height, width * 4,
+			out.data(), dst_width, dst_height, dst_width * 4, filter);
+		glk::resample_rgba(src.data(), width, height, width * 4,
+			threaded.data(), dst_width, dst_height, dst_width * 4, filter, 0);
+
+		mismatches += threaded != out;
+
+		for (size_t y = 0; y < dst_height; ++y) {
+			for (size_t x = 0; x < dst_width; ++x) {
+				for (int c = 0; c < 4; ++c) {
+					double expected = reference_texel(src.data(), width, height,
+						dst_width, dst_height, x, y, c, filter);
+					double error = fabs(expected - out[(y * dst_width + x) * 4 + c]);
+
+					worst = std::max(worst, lround(error));
+					total_error += error;
+					samples += 1.0;
+				}
+			}
+		}
+	}
+
+	printf("against doubles: worst error %ld, mean %.3f; threaded mismatches %ld\n",
+		worst, total_error / samples, mismatches);
+
+	TEST_CHECK(worst <= 1);
+	TEST_CHECK(mismatches == 0);
+}
+
+// A resized push keeps exactly what resample_rgba makes of the image
+static void check_push(void)
+{
+	std::mt19937 rng(9);
+
+	glk::atlas_t atlas;
+
+	const int sizes[][4] = { { 64, 40, 96, 160 }, { 64, 40, 20, 7 }, { 33, 17, 33, 17 } };
+	int mismatches = 0;
+
+	for (uint16_t image = 0; image < 3; ++image) {
+		int width = sizes[image][0], height = sizes[image][1];
+		int dst_width = sizes[image][2], dst_height = sizes[image][3];
+
+		std::vector<uint8_t> texels((size_t) width * height * 4);
+
+		for (uint8_t& b: texels)
+			b = (uint8_t) rng();
+
+		std::vector<uint8_t> expected((size_t) dst_width * dst_height * 4);
+
+		if (dst_width == width && dst_height == height)
+			expected = texels;
+		else
+			glk::resample_rgba(texels.data(), width, height, (size_t) width * 4,
+				expected.data(), dst_width, dst_height, (size_t) dst_width * 4,
+				glk::resample_kaiser);
+
+		glk::push_atlas_image(atlas, texels.data(), width, height, 4, 0, false,
+			glk::atlas_resize(dst_width, dst_height, glk::resample_kaiser));
+
+		TEST_CHECK(atlas.dims_x[image] == dst_width && atlas.dims_y[image] == dst_height);
+
+		if (atlas.dims_x[image] != dst_width || atlas.dims_y[image] != dst_height)
+			continue;
+
+		const uint8_t* kept = atlas.image_pixels(image);
+		size_t stride = atlas.pixel_spans[image].stride;
+
+		for (int y = 0; y < dst_height; ++y)
+			mismatches += memcmp(kept + y * stride,
+				&expected[(size_t) y * dst_width * 4], (size_t) dst_width * 4) != 0;
+	}
+
+	printf("resized pushes: %d rows differ\n", mismatches);
+	TEST_CHECK(mismatches == 0);
+
+	atlas.free_memory();
+}
+
+static void bench_corpus(const std::string& root)
+{
+	const double scales[] = { 0.5, 0.7, 2.0 };
+	double mp[3] = {}, ms[3] = {};
+
+	size_t images = test_for_each_texture(root, 4, [&](const std::string&,
+		uint8_t* rgba, int width, int height, int) {
+		for (int k = 0; k < 3; ++k) {
+			size_t dst_width = std::max<size_t>(1, (size_t) (width * scales[k]));
+			size_t dst_height = std::max<size_t>(1, (size_t) (height * scales[k]));
+
+			std::vector<uint8_t> out(dst_width * dst_height * 4);
+
+			double t0 = test_now_ms();
+			glk::resample_rgba(rgba, width, height, (size_t) width * 4, out.data(),
+				dst_width, dst_height, dst_width * 4);
+			ms[k] += test_now_ms() - t0;
+
+			mp[k] += (double) dst_width * dst_height / 1e6;
+			g_test_sink += out[0];
+		}
+	});
+
+	printf("%zu images from %s, Lanczos-3 megatexels out per second:\n",
+		images, root.c_str());
+
+	for (int k = 0; k < 3; ++k)
+		printf("  %.1fx  %.0f\n", scales[k], ms[k] > 0.0 ? mp[k] / (ms[k] / 1000.0) : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+	check_filters();
+	check_push();
+	bench_corpus(test_textures_root(argc, argv));
+
+	return test_result("resample_test");
+}
@@ -0,0 +1,279 @@
+//------------------------------------------------------------------------------------
+// What happens to an atlas's pixels after upload. Spilled, every live slot
+// has to compare equal to what was pushed while it's only in the spill
+// file, and come back the same from restore_pixels, even after a second
+// layout has spilled them again. With no spill file to be had, the pixels
+// have to stay in memory. Dropped, they can't be restored, so a downscale
+// budget which needs them, a new layout and a compaction all have to be
+// refused, the layout left as it was.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace glk;
+
+static std::vector<uint8_t> random_image(std::mt19937& rng, int width, int height)
+{
+	std::vector<uint8_t> texels((size_t) width * height * 4);
+
+	for (uint8_t& t: texels)
+		t = (uint8_t) rng();
+
+	for (size_t i = 3; i < texels.size(); i += 4)
+		texels[i] = 255;
+
+	return texels;
+}
+
+// Random images, every eighth a duplicate of an earlier one
+static void push_images(atlas_t& atlas, std::mt19937& rng,
+	std::vector<std::vector<uint8_t>>& pushed)
+{
+	for (int i = 0; i < 120; ++i) {
+		int width, height;
+
+		if (i % 8 == 7) {
+			size_t original = rng() % pushed.size();
+
+			width = atlas.dims_x[original];
+			height = atlas.dims_y[original];
+			pushed.push_back(pushed[original]);
+		} else {
+			width = 4 + (int) (rng() % 90);
+			height = 4 + (int) (rng() % 90);
+			pushed.push_back(random_image(rng, width, height));
+		}
+
+		push_atlas_image(atlas, pushed.back().data(), width, height, 4, 0, false);
+	}
+}
+
+static uint64_t live_bytes(const atlas_t& atlas, const std::vector<std::vector<uint8_t>>& pushed)
+{
+	uint64_t bytes = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		if (atlas.slot_live(i))
+			bytes += pushed[i].size();
+
+	return bytes;
+}
+
+// Live slots whose pixels aren't what was pushed, wherever they're kept
+static int wrong_pixels(const atlas_t& atlas, const std::vector<std::vector<uint8_t>>& pushed)
+{
+	int wrong = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		if (atlas.slot_live(i))
+			wrong += !atlas.same_pixels(i, pushed[i].data(), (uint32_t) pushed[i].size());
+
+	return wrong;
+}
+
+static int resident_slots(const atlas_t& atlas)
+{
+	int resident = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		resident += atlas.slot_live(i) && atlas.pixels_resident(i);
+
+	return resident;
+}
+
+static void check_spill(void)
+{
+	std::mt19937 rng(31);
+	std::vector<std::vector<uint8_t>> pushed;
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_residency_policy(atlas_residency_spill);
+
+	push_images(atlas, rng, pushed);
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+
+	atlas_memory_usage_t usage = atlas.memory_usage();
+	int wrong = wrong_pixels(atlas, pushed);
+
+	printf("spill: %llu bytes spilled, %llu in memory, %d slots resident, %d wrong\n",
+		(unsigned long long) usage.spilled_bytes, (unsigned long long) usage.cpu_pixel_bytes,
+		resident_slots(atlas), wrong);
+
+	TEST_CHECK(resident_slots(atlas) == 0);
+	TEST_CHECK(usage.cpu_pixel_bytes == 0);
+	TEST_CHECK(usage.spilled_bytes == live_bytes(atlas, pushed));
+	TEST_CHECK(wrong == 0);
+
+	// A byte off still has to be told apart through the file
+	std::vector<uint8_t> off = pushed[0];
+	off[off.size() / 2] ^= 1;
+	TEST_CHECK(!atlas.same_pixels(0, off.data(), (uint32_t) off.size()));
+
+	// Laid out again: read back, repacked, spilled over the same file
+	for (uint16_t i = 0; i < atlas.num_images; i += 5)
+		atlas.remove_image(i);
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+	TEST_CHECK(resident_slots(atlas) == 0);
+	TEST_CHECK(atlas.memory_usage().spilled_bytes == live_bytes(atlas, pushed));
+	TEST_CHECK(wrong_pixels(atlas, pushed) == 0);
+
+	TEST_CHECK(atlas.restore_pixels());
+
+	int restored_wrong = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		if (!atlas.slot_live(i))
+			continue;
+
+		restored_wrong += !atlas.pixels_resident(i)
+			|| memcmp(atlas.image_pixels(i), pushed[i].data(), pushed[i].size()) != 0;
+	}
+
+	printf("spill: relaid out and restored, %d slots wrong, %llu bytes left spilled\n",
+		restored_wrong, (unsigned long long) atlas.memory_usage().spilled_bytes);
+
+	TEST_CHECK(restored_wrong == 0);
+	TEST_CHECK(atlas.memory_usage().spilled_bytes == 0);
+
+	// The arena pads each image out to its alignment
+	TEST_CHECK(atlas.memory_usage().cpu_pixel_bytes >= live_bytes(atlas, pushed));
+
+	atlas.free_memory();
+}
+
+// tmpfile() fails once the process is out of descriptors
+static void check_no_spill_file(void)
+{
+	std::mt19937 rng(37);
+	std::vector<std::vector<uint8_t>> pushed;
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_residency_policy(atlas_residency_spill);
+
+	push_images(atlas, rng, pushed);
+
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+
+	// The lowest free descriptor, so none above it can be opened
+	int next_fd = dup(0);
+	close(next_fd);
+
+	rlimit lowered = limit;
+	lowered.rlim_cur = (rlim_t) next_fd;
+	TEST_CHECK(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+
+	bool generated = gen_atlas_layers(atlas);
+
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	int wrong = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		if (!atlas.slot_live(i))
+			continue;
+
+		wrong += !atlas.pixels_resident(i)
+			|| memcmp(atlas.image_pixels(i), pushed[i].data(), pushed[i].size()) != 0;
+	}
+
+	printf("no spill file: %s, %d slots resident, %d wrong\n",
+		atlas.spill_file ? "OPENED" : "none", resident_slots(atlas), wrong);
+
+	TEST_CHECK(generated);
+	TEST_CHECK(!atlas.spill_file);
+	TEST_CHECK(wrong == 0);
+	TEST_CHECK(atlas.memory_usage().spilled_bytes == 0);
+
+	// Still free to be laid out again
+	atlas.remove_image(3);
+	TEST_CHECK(gen_atlas_layers(atlas));
+
+	atlas.free_memory();
+}
+
+static void check_drop(void)
+{
+	std::mt19937 rng(41);
+	std::vector<std::vector<uint8_t>> pushed;
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_residency_policy(atlas_residency_drop);
+
+	push_images(atlas, rng, pushed);
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+	TEST_CHECK(atlas.pixels_dropped);
+	TEST_CHECK(resident_slots(atlas) == 0);
+	TEST_CHECK(atlas.memory_usage().cpu_pixel_bytes == 0);
+	TEST_CHECK(atlas.memory_usage().spilled_bytes == 0);
+
+	// Dropped pixels never compare equal, and can't come back
+	TEST_CHECK(!atlas.same_pixels(0, pushed[0].data(), (uint32_t) pushed[0].size()));
+	TEST_CHECK(!atlas.restore_pixels());
+
+	size_t layers = atlas.num_layers();
+	std::vector<atlas_image_record_t> records;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		records.push_back(atlas.record(i));
+
+	// A budget they already fit in needs nothing of them
+	atlas.set_downscale_budget(live_bytes(atlas, pushed));
+	TEST_CHECK(atlas.fit_downscale_budget());
+
+	// One they'd have to shrink for does
+	atlas.set_downscale_budget(live_bytes(atlas, pushed) / 2);
+	bool fitted = atlas.fit_downscale_budget();
+	bool generated = gen_atlas_layers(atlas);
+
+	atlas.set_downscale_budget(0);
+	bool relaid = gen_atlas_layers(atlas);
+	bool compacting = begin_atlas_compaction(atlas);
+
+	int moved = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		atlas_image_record_t r = atlas.record(i);
+
+		moved += memcmp(&r, &records[i], sizeof(r)) != 0;
+	}
+
+	printf("drop: budget %s, layout %s, compaction %s, %d records moved\n",
+		fitted || generated ? "FITTED" : "refused", relaid ? "REDONE" : "refused",
+		compacting ? "STARTED" : "refused", moved);
+
+	TEST_CHECK(!fitted);
+	TEST_CHECK(!generated);
+	TEST_CHECK(!relaid);
+	TEST_CHECK(!compacting);
+	TEST_CHECK(atlas.num_layers() == layers);
+	TEST_CHECK(moved == 0);
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		TEST_CHECK(atlas.dims_x[i] * atlas.dims_y[i] * 4 == (int) pushed[i].size());
+
+	atlas.free_memory();
+}
+
+int main(int, char**)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	check_spill();
+	check_no_spill_file();
+	check_drop();
+
+	return test_result("residency_test");
+}
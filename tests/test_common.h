@@ -0,0 +1,144 @@
+#ifndef __GLK_TEST_COMMON_H__
+#define __GLK_TEST_COMMON_H__
+
+//------------------------------------------------------------------------------------
+// Shared bits for the programs in tests/: a failure counter, a clock and the
+// textures/ corpus. Each program is its own main and returns non-zero if any
+// check failed; the benchmarks print their timings as well. See README.md for
+// how to build them.
+//------------------------------------------------------------------------------------
+
+#include "../stb_image.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+static int g_test_failures = 0;
+
+#define TEST_CHECK(expr) \
+do { \
+	if (!(expr)) { \
+		printf("FAILED %s@%i: %s\n", __FILE__, __LINE__, #expr); \
+		g_test_failures++; \
+	} \
+} while (0)
+
+static inline double test_now_ms(void)
+{
+	return std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of runs calls of fn, in nanoseconds per item over items items
+template <class fn_t>
+static double test_best_ns(fn_t fn, size_t items, int runs = 3)
+{
+	double best = 1e300;
+
+	for (int run = 0; run < runs; ++run) {
+		double t0 = test_now_ms();
+		fn();
+		double t = (test_now_ms() - t0) * 1e6 / (double) items;
+
+		if (t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+// Keeps a benchmark's result alive without printing it
+static volatile uint64_t g_test_sink = 0;
+
+// The test corpus: argv[1] if given, else textures/ under the working
+// directory
+static inline std::string test_textures_root(int argc, char** argv)
+{
+	return argc > 1 ? std::string(argv[1]) : std::string("textures");
+}
+
+static inline std::vector<std::string> test_list_dir(const std::string& path)
+{
+	std::vector<std::string> names;
+	DIR* dir = opendir(path.c_str());
+
+	if (!dir)
+		return names;
+
+	for (struct dirent* ent = readdir(dir); ent; ent = readdir(dir))
+		if (ent->d_name[0] != '.')
+			names.push_back(ent->d_name);
+
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	return names;
+}
+
+// Calls fn(name, texels, width, height, bpp) for every RGB or RGBA image
+// one directory below root, in name order, with name as "dir/file". The
+// texels are as stored, or with components of them if that's non-zero.
+template <class fn_t>
+static size_t test_for_each_texture(const std::string& root, int components, fn_t fn)
+{
+	size_t count = 0;
+
+	for (const std::string& dir: test_list_dir(root)) {
+		for (const std::string& file: test_list_dir(root + "/" + dir)) {
+			std::string name = dir + "/" + file;
+			int width, height, bpp;
+
+			stbi_uc* texels = stbi_load((root + "/" + name).c_str(),
+				&width, &height, &bpp, components);
+
+			if (!texels)
+				continue;
+
+			if (bpp == 3 || bpp == 4) {
+				fn(name, texels, width, height, components ? components : bpp);
+				count++;
+			}
+
+			stbi_image_free(texels);
+		}
+	}
+
+	return count;
+}
+
+// The sizes of the images test_for_each_texture visits, read from their
+// headers alone
+static inline size_t test_corpus_dims(const std::string& root,
+	std::vector<uint16_t>& dims_x, std::vector<uint16_t>& dims_y)
+{
+	for (const std::string& dir: test_list_dir(root)) {
+		for (const std::string& file: test_list_dir(root + "/" + dir)) {
+			int width, height, bpp;
+
+			if (!stbi_info((root + "/" + dir + "/" + file).c_str(), &width, &height, &bpp))
+				continue;
+
+			if (bpp == 3 || bpp == 4) {
+				dims_x.push_back((uint16_t) width);
+				dims_y.push_back((uint16_t) height);
+			}
+		}
+	}
+
+	return dims_x.size();
+}
+
+static inline int test_result(const char* name)
+{
+	printf("%s: %s\n", name, g_test_failures ? "FAILED" : "ok");
+	return g_test_failures ? 1 : 0;
+}
+
+#endif // __GLK_TEST_COMMON_H__
@@ -0,0 +1,79 @@
+#ifndef __GLK_TEST_GL_H__
+#define __GLK_TEST_GL_H__
+
+//------------------------------------------------------------------------------------
+// For the tests which build atlases: a hidden window to own a GL context, the
+// textures/ corpus pushed into an atlas, and images read back out of layers.
+//------------------------------------------------------------------------------------
+
+#include "test_common.h"
+
+#include "../atlas.h"
+
+#include <string.h>
+
+static GLFWwindow* g_test_window = nullptr;
+
+static inline bool test_gl_context(void)
+{
+	if (!glfwInit())
+		return false;
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	g_test_window = glfwCreateWindow(64, 64, "glk test", nullptr, nullptr);
+
+	if (!g_test_window)
+		return false;
+
+	glfwMakeContextCurrent(g_test_window);
+
+	glewExperimental = true;
+	return glewInit() == GLEW_OK;
+}
+
+// Pushes every image test_for_each_texture finds below root, naming each
+// in filenames. Returns the number pushed.
+static inline size_t test_push_textures(glk::atlas_t& atlas, const std::string& root)
+{
+	size_t pushed = test_for_each_texture(root, 0, [&](const std::string& name,
+		uint8_t* texels, int width, int height, int bpp) {
+		atlas.filenames.push_back(name);
+		glk::push_atlas_image(atlas, texels, width, height, bpp);
+	});
+
+	atlas.build_filename_map();
+
+	return pushed;
+}
+
+// Reads a dim_x x dim_y image back out of a composed layer through the UV
+// rectangle it was given: each texel's center, mapped into the rectangle as
+// atlas_image_info_t describes (turned a quarter for rotated images), picks
+// the layer texel it lands in.
+static inline void test_sample_image(const std::vector<uint8_t>& layer,
+	int layer_w, int layer_h, float u0, float v0, float u1, float v1, bool rotated,
+	int dim_x, int dim_y, std::vector<uint8_t>& out)
+{
+	out.resize((size_t) dim_x * dim_y * 4);
+
+	for (int y = 0; y < dim_y; ++y) {
+		for (int x = 0; x < dim_x; ++x) {
+			float s = (x + 0.5f) / dim_x, t = (y + 0.5f) / dim_y;
+
+			float u = rotated ? u0 + (1.0f - t) * (u1 - u0) : u0 + s * (u1 - u0);
+			float v = rotated ? v0 + s * (v1 - v0) : v0 + t * (v1 - v0);
+
+			int lx = std::min(std::max((int) (u * layer_w), 0), layer_w - 1);
+			int ly = std::min(std::max((int) (v * layer_h), 0), layer_h - 1);
+
+			memcpy(&out[((size_t) y * dim_x + x) * 4],
+				&layer[((size_t) ly * layer_w + lx) * 4], 4);
+		}
+	}
+}
+
+#endif // __GLK_TEST_GL_H__
@@ -0,0 +1,211 @@
+//------------------------------------------------------------------------------------
+// Transparent trimming, read back through the UVs. alpha_bounds_rgba has to
+// find the same rectangle as a texel by texel scan, at every width its vector
+// loop can leave a tail for. Then an atlas of images with transparent
+// borders (some opaque, some with holes, some with no alpha at all) is
+// packed with rotation allowed, and each image sampled out of the composed
+// layer at the UVs query_uvs gives has to match its source pixels at the
+// trim offset; everything trimmed away has to have been transparent.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+using namespace glk;
+
+// The tightest rect around nonzero alpha, texel by texel
+static bool reference_bounds(atlas_rect_t& bounds, const std::vector<uint8_t>& texels,
+	int32_t width, int32_t height)
+{
+	int32_t min_x = width, min_y = height, max_x = -1, max_y = -1;
+
+	for (int32_t y = 0; y < height; ++y) {
+		for (int32_t x = 0; x < width; ++x) {
+			if (!texels[((size_t) y * width + x) * 4 + 3])
+				continue;
+
+			min_x = std::min(min_x, x);
+			min_y = std::min(min_y, y);
+			max_x = std::max(max_x, x);
+			max_y = std::max(max_y, y);
+		}
+	}
+
+	if (max_x < 0)
+		return false;
+
+	bounds = atlas_rect_t { min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+
+	return true;
+}
+
+// Random colors throughout, so trimmed texels aren't all zero; alpha only
+// inside a random rect, with a few holes. Images with no_alpha are
+// transparent through.
+static std::vector<uint8_t> bordered_image(std::mt19937& rng, int32_t width, int32_t height,
+	bool no_alpha)
+{
+	std::vector<uint8_t> texels((size_t) width * height * 4);
+
+	for (uint8_t& t: texels)
+		t = (uint8_t) rng();
+
+	int32_t x0 = (int32_t) (rng() % width), y0 = (int32_t) (rng() % height);
+	int32_t x1 = x0 + (int32_t) (rng() % (width - x0)), y1 = y0 + (int32_t) (rng() % (height - y0));
+
+	for (int32_t y = 0; y < height; ++y) {
+		for (int32_t x = 0; x < width; ++x) {
+			uint8_t& alpha = texels[((size_t) y * width + x) * 4 + 3];
+
+			bool inside = !no_alpha && x >= x0 && x <= x1 && y >= y0 && y <= y1;
+
+			if (!inside || rng() % 7 == 0)
+				alpha = 0;
+			else if (alpha == 0)
+				alpha = 1;
+		}
+	}
+
+	return texels;
+}
+
+static void check_bounds(std::mt19937& rng)
+{
+	int mismatches = 0, cases = 0;
+
+	for (int32_t width = 1; width <= 19; ++width) {
+		for (int32_t height: { 1, 2, 7 }) {
+			for (int i = 0; i < 20; ++i, ++cases) {
+				std::vector<uint8_t> texels = bordered_image(rng, width, height, i == 0);
+
+				atlas_rect_t found { -1, -1, -1, -1 }, expected { -1, -1, -1, -1 };
+
+				bool any = alpha_bounds_rgba(found, texels.data(), width, height);
+				bool expected_any = reference_bounds(expected, texels, width, height);
+
+				mismatches += any != expected_any
+					|| (any && memcmp(&found, &expected, sizeof(found)) != 0);
+			}
+		}
+	}
+
+	printf("alpha_bounds_rgba: %d of %d differ from a texel scan\n", mismatches, cases);
+
+	TEST_CHECK(mismatches == 0);
+}
+
+int main(int, char**)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	std::mt19937 rng(43);
+
+	check_bounds(rng);
+
+	atlas_t atlas;
+	atlas.set_compression(atlas_compression_none);
+	atlas.set_packer_type(atlas_packer_maxrects_bssf);
+	atlas.set_allow_rotation(true);
+	atlas.set_trim_transparent(true);
+
+	std::vector<std::vector<uint8_t>> sources;
+	std::vector<atlas_rect_t> expected;
+	std::vector<uint8_t> any_alpha;
+
+	for (int i = 0; i < 200; ++i) {
+		int32_t width = 1 + (int32_t) (rng() % 120), height = 1 + (int32_t) (rng() % 120);
+
+		// Every twentieth transparent through, every tenth opaque
+		std::vector<uint8_t> texels = bordered_image(rng, width, height, i % 20 == 0);
+
+		if (i % 10 == 5)
+			for (size_t a = 3; a < texels.size(); a += 4)
+				texels[a] = 255;
+
+		// With no alpha at all, a single texel is kept
+		atlas_rect_t keep { 0, 0, 1, 1 };
+
+		any_alpha.push_back(reference_bounds(keep, texels, width, height));
+		sources.push_back(texels);
+		expected.push_back(keep);
+
+		std::vector<uint8_t> pushed = texels;
+		push_atlas_image(atlas, pushed.data(), width, height, 4, 0, false);
+	}
+
+	TEST_CHECK(gen_atlas_layers(atlas));
+
+	std::vector<std::vector<uint8_t>> composed(atlas.num_layers());
+
+	for (size_t layer = 0; layer < atlas.num_layers(); ++layer)
+		compose_atlas_layer(atlas, (uint8_t) layer, composed[layer]);
+
+	std::vector<uint16_t> ids(atlas.num_images);
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		ids[i] = i;
+
+	size_t count = ids.size();
+	std::vector<uint8_t> layers(count);
+	std::vector<float> u0(count), v0(count), u1(count), v1(count);
+
+	atlas.query_uvs(ids.data(), count,
+		atlas_uv_batch_t { layers.data(), u0.data(), v0.data(), u1.data(), v1.data() });
+
+	int wrong_rect = 0, wrong_pixels = 0, opaque_trimmed = 0, rotated = 0, transparent = 0;
+	std::vector<uint8_t> shown;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		const std::vector<uint8_t>& source = sources[i];
+		const atlas_rect_t& keep = expected[i];
+
+		int32_t width = atlas.source_x[i], height = atlas.source_y[i];
+		atlas_image_info_t info = atlas.image_info(i);
+
+		wrong_rect += atlas.trim_x[i] != keep.x || atlas.trim_y[i] != keep.y
+			|| atlas.dims_x[i] != keep.w || atlas.dims_y[i] != keep.h
+			|| info.trim_offset != glm::vec2(keep.x, keep.y)
+			|| (size_t) width * height * 4 != source.size();
+
+		// Nothing with alpha left out of the kept rect
+		for (int32_t y = 0; y < height; ++y)
+			for (int32_t x = 0; x < width; ++x)
+				if (x < keep.x || y < keep.y || x >= keep.x + keep.w || y >= keep.y + keep.h)
+					opaque_trimmed += source[((size_t) y * width + x) * 4 + 3] != 0;
+
+		if (layers[i] >= atlas.num_layers()) {
+			wrong_pixels++;
+			continue;
+		}
+
+		rotated += atlas.record(i).rotated != 0;
+		transparent += !any_alpha[i];
+
+		test_sample_image(composed[layers[i]], atlas.widths[layers[i]], atlas.heights[layers[i]],
+			u0[i], v0[i], u1[i], v1[i], atlas.record(i).rotated != 0, keep.w, keep.h, shown);
+
+		bool same = true;
+
+		for (int32_t y = 0; y < keep.h && same; ++y)
+			same = memcmp(&shown[(size_t) y * keep.w * 4],
+				&source[((size_t) (keep.y + y) * width + keep.x) * 4], (size_t) keep.w * 4) == 0;
+
+		wrong_pixels += !same;
+	}
+
+	printf("%u images, %d rotated, %d transparent: %d kept rects wrong, "
+		"%d texels with alpha trimmed, %d don't sample back as their source\n", (unsigned) atlas.num_images, rotated,
+		transparent, wrong_rect, opaque_trimmed, wrong_pixels);
+
+	TEST_CHECK(rotated > 0);
+	TEST_CHECK(transparent > 0);
+	TEST_CHECK(wrong_rect == 0);
+	TEST_CHECK(opaque_trimmed == 0);
+	TEST_CHECK(wrong_pixels == 0);
+
+	atlas.free_memory();
+
+	return test_result("trim_test");
+}
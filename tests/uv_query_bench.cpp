@@ -0,0 +1,186 @@
+//------------------------------------------------------------------------------------
+// atlas_t::query_uvs against the image_info loop it stands in for: every
+// image of the textures/ corpus packed with rotation, one removed and one
+// inserted, then ids out of range with and without a default image. Then
+// 50000 random and sequential ids through both, and through a plain loop
+// over record(). query_uvs gathers with AVX2 when built with -mavx2.
+//------------------------------------------------------------------------------------
+
+#include "test_gl.h"
+
+#include <math.h>
+
+struct uv_arrays_t {
+	std::vector<uint8_t> layers;
+	std::vector<float> u0, v0, u1, v1;
+
+	explicit uv_arrays_t(size_t count)
+		:   layers(count), u0(count), v0(count), u1(count), v1(count)
+	{}
+
+	glk::atlas_uv_batch_t batch(void)
+	{
+		return glk::atlas_uv_batch_t { layers.data(), u0.data(), v0.data(), u1.data(), v1.data() };
+	}
+};
+
+// image_info's answer for image i, written the way query_uvs writes it
+static void image_info_uvs(const glk::atlas_t& atlas, uint16_t image, uv_arrays_t& out, size_t i)
+{
+	glk::atlas_image_info_t info = atlas.image_info(image);
+
+	float w = info.rotated ? atlas.dim_y(image) : atlas.dim_x(image);
+	float h = info.rotated ? atlas.dim_x(image) : atlas.dim_y(image);
+
+	out.layers[i] = info.layer;
+	out.u0[i] = info.coords.x * info.inverse_layer_dims.x;
+	out.v0[i] = info.coords.y * info.inverse_layer_dims.y;
+	out.u1[i] = (info.coords.x + w) * info.inverse_layer_dims.x;
+	out.v1[i] = (info.coords.y + h) * info.inverse_layer_dims.y;
+}
+
+static bool same_uvs(const uv_arrays_t& a, size_t i, const uv_arrays_t& b, size_t j)
+{
+	return a.layers[i] == b.layers[j]
+		&& fabsf(a.u0[i] - b.u0[j]) < 1e-6f && fabsf(a.v0[i] - b.v0[j]) < 1e-6f
+		&& fabsf(a.u1[i] - b.u1[j]) < 1e-6f && fabsf(a.v1[i] - b.v1[j]) < 1e-6f;
+}
+
+static void check_query(glk::atlas_t& atlas, uint16_t removed, uint16_t inserted)
+{
+	std::vector<uint16_t> ids(atlas.num_images);
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i)
+		ids[i] = i;
+
+	uv_arrays_t batch(ids.size()), expected(ids.size());
+	atlas.query_uvs(ids.data(), ids.size(), batch.batch());
+
+	int mismatches = 0, rotated = 0;
+
+	for (uint16_t i = 0; i < atlas.num_images; ++i) {
+		if (atlas.layers[i] == 0xFF) {
+			mismatches += batch.layers[i] != 0xFF || batch.u0[i] != 0.0f;
+			continue;
+		}
+
+		image_info_uvs(atlas, i, expected, i);
+
+		mismatches += !same_uvs(batch, i, expected, i);
+		rotated += atlas.image_rotated(i);
+	}
+
+	printf("%u images (%d rotated): %d differ from image_info\n",
+		(unsigned) atlas.num_images, rotated, mismatches);
+
+	TEST_CHECK(mismatches == 0);
+	TEST_CHECK(batch.layers[removed] == 0xFF);
+	TEST_CHECK(inserted != glk::atlas_t::no_image_index && batch.layers[inserted] != 0xFF);
+
+	// Out of range ids read as empty, or as the default image
+	uint16_t odd[3] = { (uint16_t) atlas.num_images, 0xFFFF, 3 };
+	uv_arrays_t out(3);
+
+	atlas.query_uvs(odd, 3, out.batch());
+	TEST_CHECK(out.layers[0] == 0xFF && out.layers[1] == 0xFF && out.u1[0] == 0.0f);
+
+	atlas.default_image = 3;
+	atlas.query_uvs(odd, 3, out.batch());
+	TEST_CHECK(same_uvs(out, 0, out, 2) && same_uvs(out, 1, out, 2));
+
+	atlas.default_image = glk::atlas_t::no_image_index;
+}
+
+static void bench_query(const glk::atlas_t& atlas)
+{
+	const size_t count = 50000;
+
+	std::mt19937 rng(3);
+	std::vector<uint16_t> random_ids, sequential_ids;
+
+	// Placed images only, since image_info asserts on the others
+	for (size_t i = 0; random_ids.size() < count; ++i) {
+		uint16_t id = (uint16_t) (rng() % atlas.num_images);
+
+		if (atlas.layers[id] != 0xFF)
+			random_ids.push_back(id);
+
+		if (atlas.layers[i % atlas.num_images] != 0xFF && sequential_ids.size() < count)
+			sequential_ids.push_back((uint16_t) (i % atlas.num_images));
+	}
+
+	while (sequential_ids.size() < count)
+		sequential_ids.push_back(sequential_ids[sequential_ids.size() % 64]);
+
+	uv_arrays_t out(count);
+
+	const std::vector<uint16_t>* orders[] = { &random_ids, &sequential_ids };
+	const char* names[] = { "random", "sequential" };
+
+	for (int k = 0; k < 2; ++k) {
+		const std::vector<uint16_t>& ids = *orders[k];
+
+		double info_ns = test_best_ns([&]() {
+			for (size_t i = 0; i < count; ++i)
+				image_info_uvs(atlas, ids[i], out, i);
+
+			g_test_sink += out.layers[count / 2];
+		}, count, 20);
+
+		double records_ns = test_best_ns([&]() {
+			for (size_t i = 0; i < count; ++i) {
+				const glk::atlas_image_record_t& r = atlas.record(ids[i]);
+
+				out.layers[i] = r.layer;
+				out.u0[i] = r.u0;
+				out.v0[i] = r.v0;
+				out.u1[i] = r.u1;
+				out.v1[i] = r.v1;
+			}
+
+			g_test_sink += out.layers[count / 2];
+		}, count, 20);
+
+		double query_ns = test_best_ns([&]() {
+			atlas.query_uvs(ids.data(), count, out.batch());
+			g_test_sink += out.layers[count / 2];
+		}, count, 20);
+
+		printf("  %-10s ns per id: image_info %5.2f  record loop %5.2f  query_uvs %5.2f (%.1fx)\n",
+			names[k], info_ns, records_ns, query_ns, info_ns / query_ns);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (!test_gl_context()) {
+		printf("no GL context\n");
+		return 1;
+	}
+
+	glk::atlas_t atlas;
+	atlas.set_compression(glk::atlas_compression_none);
+	atlas.set_packer_type(glk::atlas_packer_maxrects_bssf);
+	atlas.set_allow_rotation(true);
+
+	size_t pushed = test_push_textures(atlas, test_textures_root(argc, argv));
+
+	printf("%zu images pushed\n", pushed);
+	TEST_CHECK(pushed > 5);
+
+	if (pushed > 5 && glk::gen_atlas_layers(atlas)) {
+		uint16_t removed = 5;
+		atlas.remove_image(removed);
+
+		std::vector<uint32_t> texels(40 * 30, 0xFF00FF00u);
+		uint16_t inserted = glk::insert_atlas_image(atlas, (uint8_t*) texels.data(),
+			40, 30, 4, 0, false);
+
+		check_query(atlas, removed, inserted);
+		bench_query(atlas);
+	}
+
+	atlas.free_memory();
+
+	return test_result("uv_query_bench");
+}